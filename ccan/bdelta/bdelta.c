@@ -23,11 +23,14 @@
 #include "bdelta.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 typedef struct
 {
@@ -490,7 +493,8 @@ static signed char *climb_triangle(const Triangle *triangle)
  * See the comment above the definition of Triangle.  It concisely documents
  * how a descent down the triangle corresponds to a patch script.
  *
- * The resulting patch, including the patch type byte, is appended to patch_out.
+ * The resulting instructions are appended to patch_out.  If @final is set,
+ * nothing follows them, so a trailing skip is left off.
  *
  * Return values:
  *
@@ -501,6 +505,7 @@ static BDELTAcode descent_to_patch(
 	const signed char *descent,
 	const Triangle *triangle,
 	const char *new_, uint32_t new_size,
+	int final,
 	SB *patch_out)
 {
 	const char *new_end = new_ + new_size;
@@ -513,9 +518,6 @@ static BDELTAcode descent_to_patch(
 	uint32_t pending_length = 0;
 	uint32_t copy_length;
 	
-	if (sb_putc(patch_out, PT_CSI32) != 0)
-		return BDELTA_MEMORY;
-	
 	if (*p > 0) {
 		if (csi32_emit_op(patch_out, OP_COPY, *p, &new_) != BDELTA_OK)
 			return BDELTA_MEMORY;
@@ -563,8 +565,8 @@ static BDELTAcode descent_to_patch(
 	assert(k == triangle->solution_k);
 	assert(p == triangle->solution_ptr);
 	
-	/* Emit the last pending op, unless it's a skip. */
-	if (pending_op != 0 && pending_op != OP_SKIP) {
+	/* Emit the last pending op, unless it's a final skip. */
+	if (pending_op != 0 && !(final && pending_op == OP_SKIP)) {
 		if (csi32_emit_op(patch_out, pending_op, pending_length, &new_) != BDELTA_OK)
 			return BDELTA_MEMORY;
 	}
@@ -609,7 +611,9 @@ static BDELTAcode diff_myers(
 	if (descent == NULL)
 		goto oom1;
 	
-	if (descent_to_patch(descent, &triangle, new_, new_size, patch_out) != BDELTA_OK)
+	if (sb_putc(patch_out, PT_CSI32) != 0)
+		goto oom2;
+	if (descent_to_patch(descent, &triangle, new_, new_size, 1, patch_out) != BDELTA_OK)
 		goto oom2;
 	
 	free(descent);
@@ -623,12 +627,298 @@ oom1:
 	return BDELTA_MEMORY;
 }
 
+/*
+ * The linear diff (BDELTA_LINEAR) works the way rsync and xdelta find
+ * matches: every LINEAR_BLOCK-aligned block of old is indexed by hash, then
+ * a rolling hash is run along new looking for them.  Any run of at least
+ * 2*LINEAR_BLOCK-1 matching bytes contains a whole block, so will be found.
+ *
+ * A csi32 patch can only move forward through old, so a match must start at
+ * or after the end of the previous one; of the blocks with a given hash, we
+ * use the first one which does.  The gaps between matches are often only a
+ * few bytes changed, so short ones are diffed with Myers' algorithm.
+ *
+ * Time is O(N log N) at worst, and memory about old_size / 2.
+ */
+#define LINEAR_BLOCK       16
+#define LINEAR_MULT        0x01000193U
+#define LINEAR_TRIES       32     /* Candidate blocks to compare per lookup. */
+#define LINEAR_GAP_MAX     4096   /* Old + new bytes to diff with Myers... */
+#define LINEAR_GAP_DMAX    64     /* ...giving up after this many edits. */
+#define LINEAR_LONG_MATCH  64     /* Only these may skip > LINEAR_GAP_MAX... */
+#define LINEAR_LOOKAHEAD   32     /* ...if there's no nearer match this soon. */
+#define LINEAR_NONE        UINT32_MAX
+
+/*
+ * Block offsets, sorted by hash slot and then by offset.
+ * The blocks in slot s are pos[start[s]] to pos[start[s+1] - 1].
+ */
+typedef struct
+{
+	uint32_t *start;
+	uint32_t *pos;
+	unsigned int bits;
+} BlockIndex;
+
+static uint32_t block_hash(const unsigned char *p)
+{
+	uint32_t h = 0;
+	unsigned int i;
+	
+	for (i = 0; i < LINEAR_BLOCK; i++)
+		h = h * LINEAR_MULT + p[i];
+	return h;
+}
+
+static uint32_t block_slot(const BlockIndex *index, uint32_t h)
+{
+	return (h * 0x9E3779B1U) >> (32 - index->bits);
+}
+
+static int build_index(const unsigned char *old, uint32_t old_size, BlockIndex *index)
+{
+	uint32_t nblocks = old_size / LINEAR_BLOCK;
+	uint32_t nslots, b;
+	
+	index->bits = 1;
+	while (((uint32_t)1 << index->bits) < nblocks && index->bits < 31)
+		index->bits++;
+	nslots = (uint32_t)1 << index->bits;
+	
+	index->start = calloc(nslots + 1, sizeof(*index->start));
+	index->pos = malloc((nblocks + 1) * sizeof(*index->pos));
+	if (index->start == NULL || index->pos == NULL) {
+		free(index->start);
+		free(index->pos);
+		return -1;
+	}
+	
+	/* Counting sort: count each slot, then place each block in turn. */
+	for (b = 0; b < nblocks; b++)
+		index->start[block_slot(index, block_hash(old + b * LINEAR_BLOCK)) + 1]++;
+	for (b = 0; b < nslots; b++)
+		index->start[b + 1] += index->start[b];
+	for (b = 0; b < nblocks; b++) {
+		uint32_t slot = block_slot(index, block_hash(old + b * LINEAR_BLOCK));
+		index->pos[index->start[slot]++] = b * LINEAR_BLOCK;
+	}
+	/* Each start[] is now the end of its slot, i.e. the next one's start. */
+	memmove(index->start + 1, index->start, nslots * sizeof(*index->start));
+	index->start[0] = 0;
+	return 0;
+}
+
+/* Find the first block at or after @from which matches @block. */
+static uint32_t find_block(
+	const BlockIndex *index, const unsigned char *old, uint32_t from,
+	const unsigned char *block, uint32_t h)
+{
+	uint32_t slot = block_slot(index, h);
+	uint32_t lo = index->start[slot];
+	uint32_t hi = index->start[slot + 1];
+	uint32_t end = hi;
+	unsigned int tries;
+	
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (index->pos[mid] < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	
+	for (tries = 0; lo < end && tries < LINEAR_TRIES; lo++, tries++) {
+		if (memcmp(old + index->pos[lo], block, LINEAR_BLOCK) == 0)
+			return index->pos[lo];
+	}
+	return LINEAR_NONE;
+}
+
+/*
+ * Look for a match within LINEAR_GAP_MAX of @from, for new at one of the
+ * LINEAR_LOOKAHEAD positions from @j.  Returns its length (but stops
+ * counting at @max), or 0 if there isn't one.
+ */
+static uint32_t near_match(
+	const BlockIndex *index,
+	const unsigned char *old, uint32_t old_size, uint32_t from,
+	const unsigned char *new_, uint32_t new_size, uint32_t j,
+	uint32_t max)
+{
+	uint32_t k, p, len;
+	
+	for (k = j; k < j + LINEAR_LOOKAHEAD && k <= new_size - LINEAR_BLOCK; k++) {
+		p = find_block(index, old, from, new_ + k, block_hash(new_ + k));
+		if (p == LINEAR_NONE || p - from > LINEAR_GAP_MAX)
+			continue;
+		for (len = LINEAR_BLOCK; len < max; len++) {
+			if (p + len >= old_size || k + len >= new_size || old[p + len] != new_[k + len])
+				break;
+		}
+		return len;
+	}
+	return 0;
+}
+
+/*
+ * Emit the instructions to turn the gap between two matches in old into
+ * the one in new.  If @final, there are no more matches after this gap.
+ */
+static BDELTAcode emit_gap(
+	const char *old,  uint32_t old_size,
+	const char *new_, uint32_t new_size,
+	int final, const char **np,
+	SB *patch_out)
+{
+	BDELTAcode rc;
+	
+	if (old_size > 0 && new_size > 0 && old_size + new_size <= LINEAR_GAP_MAX) {
+		Triangle triangle;
+		signed char *descent;
+		
+		rc = build_triangle(old, old_size, new_, new_size, LINEAR_GAP_DMAX, &triangle);
+		if (rc == BDELTA_MEMORY)
+			return rc;
+		if (rc == BDELTA_OK) {
+			descent = climb_triangle(&triangle);
+			if (descent == NULL)
+				rc = BDELTA_MEMORY;
+			else
+				rc = descent_to_patch(descent, &triangle, new_, new_size, final, patch_out);
+			free(descent);
+			free(triangle.data);
+			*np += new_size;
+			return rc;
+		}
+	}
+	
+	rc = csi32_emit_op(patch_out, OP_INSERT, new_size, np);
+	if (rc == BDELTA_OK && !final)
+		rc = csi32_emit_op(patch_out, OP_SKIP, old_size, np);
+	return rc;
+}
+
+/*
+ * Generate a patch using the block index described above.
+ *
+ * The patch is appended to @patch_out, which must be initialized before calling.
+ *
+ * Return values:
+ *
+ *  BDELTA_OK:                         Success
+ *  BDELTA_MEMORY:                     Memory allocation failed
+ *  BDELTA_INTERNAL_INPUTS_TOO_LARGE:  Input sizes are too large
+ */
+static BDELTAcode diff_linear(
+	const char *old,  size_t old_size,
+	const char *new_, size_t new_size,
+	SB *patch_out)
+{
+	const unsigned char *o = (const unsigned char *)old;
+	const unsigned char *n = (const unsigned char *)new_;
+	const char *np = new_;
+	BlockIndex index;
+	uint32_t opos = 0;   /* End of the last match in old... */
+	uint32_t nstart = 0; /* ...and in new. */
+	uint32_t j = 0;
+	uint32_t h = 0;
+	uint32_t mult_out = 1;
+	int rehash = 1;
+	unsigned int i;
+	BDELTAcode rc;
+	
+	if (old_size >= UINT32_MAX || new_size >= UINT32_MAX)
+		return BDELTA_INTERNAL_INPUTS_TOO_LARGE;
+	
+	if (build_index(o, old_size, &index) != 0)
+		return BDELTA_MEMORY;
+	if (sb_putc(patch_out, PT_CSI32) != 0) {
+		rc = BDELTA_MEMORY;
+		goto out;
+	}
+	
+	/* The multiplier of the byte leaving the window. */
+	for (i = 1; i < LINEAR_BLOCK; i++)
+		mult_out *= LINEAR_MULT;
+	
+	while (old_size >= LINEAR_BLOCK && new_size - j >= LINEAR_BLOCK) {
+		uint32_t p, start, len;
+		
+		if (rehash)
+			h = block_hash(n + j);
+		rehash = 0;
+		
+		p = find_block(&index, o, opos, n + j, h);
+		if (p == LINEAR_NONE)
+			goto no_match;
+		
+		/* Extend it backwards into the gap, and forwards. */
+		for (start = j; start > nstart && p > opos && o[p - 1] == n[start - 1]; )
+			p--, start--;
+		len = j - start + LINEAR_BLOCK;
+		while (p + len < old_size && start + len < new_size && o[p + len] == n[start + len])
+			len++;
+		
+		/*
+		 * Skipping a long way through old loses any matches in
+		 * between, so only do it for a long match, if there's no
+		 * nearer one just ahead (e.g. after a changed byte).  And if
+		 * what follows it is a longer match in the part we'd skip
+		 * (a block moved earlier), leave it to be inserted instead.
+		 */
+		if (p - opos > LINEAR_GAP_MAX) {
+			if (len < LINEAR_LONG_MATCH
+			    || near_match(&index, o, old_size, opos, n, new_size, j + 1, 1))
+				goto no_match;
+			if (near_match(&index, o, old_size, opos, n, new_size, start + len, len + 1) > len) {
+				j = start + len;
+				rehash = 1;
+				continue;
+			}
+		}
+		
+		rc = emit_gap(old + opos, p - opos, new_ + nstart, start - nstart, 0, &np, patch_out);
+		if (rc == BDELTA_OK)
+			rc = csi32_emit_op(patch_out, OP_COPY, len, &np);
+		if (rc != BDELTA_OK)
+			goto out;
+		opos = p + len;
+		j = nstart = start + len;
+		rehash = 1;
+		continue;
+		
+	no_match:
+		if (new_size - j > LINEAR_BLOCK)
+			h = (h - n[j] * mult_out) * LINEAR_MULT + n[j + LINEAR_BLOCK];
+		j++;
+	}
+	
+	rc = emit_gap(old + opos, old_size - opos, new_ + nstart, new_size - nstart, 1, &np, patch_out);
+	assert(rc != BDELTA_OK || np == new_ + new_size);
+	
+out:
+	free(index.start);
+	free(index.pos);
+	return rc;
+}
+
 BDELTAcode bdelta_diff(
 	const void  *old,       size_t  old_size,
 	const void  *new_,      size_t  new_size,
 	void       **patch_out, size_t *patch_size_out)
+{
+	return bdelta_diff_flags(old, old_size, new_, new_size,
+	                         patch_out, patch_size_out, 0);
+}
+
+BDELTAcode bdelta_diff_flags(
+	const void  *old,       size_t  old_size,
+	const void  *new_,      size_t  new_size,
+	void       **patch_out, size_t *patch_size_out,
+	unsigned int flags)
 {
 	SB patch;
+	BDELTAcode rc;
 	
 	if (sb_init(&patch) != 0)
 		goto out_of_memory;
@@ -636,7 +926,11 @@ BDELTAcode bdelta_diff(
 	if (new_size == 0)
 		goto emit_new_literally;
 	
-	if (diff_myers(old, old_size, new_, new_size, &patch) != BDELTA_OK)
+	if (flags & BDELTA_LINEAR)
+		rc = diff_linear(old, old_size, new_, new_size, &patch);
+	else
+		rc = diff_myers(old, old_size, new_, new_size, &patch);
+	if (rc != BDELTA_OK)
 		goto emit_new_literally;
 	
 	if (sb_size(&patch) > new_size) {
@@ -807,6 +1101,239 @@ discard:
 	return rc;
 }
 
+/*
+ * The streaming patcher is a state machine over the patch bytes, so a patch
+ * can be fed in whatever pieces it arrives in.  Copies are read from old
+ * with pread into a fixed buffer; inserts and literals are passed straight
+ * from the patch to the writer.
+ */
+enum stream_state {
+	STREAM_TYPE,    /* Waiting for the patch type byte. */
+	STREAM_LITERAL, /* PT_LITERAL: everything else is new text. */
+	STREAM_OP,      /* PT_CSI32: waiting for an instruction byte. */
+	STREAM_SIZE,    /* Reading the instruction's size. */
+	STREAM_INSERT,  /* Passing through the text of an insert. */
+};
+
+#define STREAM_BUFSIZE 65536
+
+struct BDELTAstream
+{
+	int old_fd;
+	off_t old_pos, old_size;
+	int (*write)(const void *data, size_t size, void *arg);
+	void *arg;
+	
+	enum stream_state state;
+	int op;
+	unsigned int size_bytes; /* Size bytes still to read. */
+	uint32_t size;           /* Size so far, or insert bytes left. */
+	
+	unsigned char buf[STREAM_BUFSIZE];
+};
+
+BDELTAcode bdelta_stream_new(
+	int old_fd,
+	int (*write)(const void *data, size_t size, void *arg), void *arg,
+	BDELTAstream **stream_out)
+{
+	BDELTAstream *s = malloc(sizeof(*s));
+	
+	*stream_out = s;
+	if (s == NULL)
+		return BDELTA_MEMORY;
+	s->old_fd = old_fd;
+	s->old_pos = s->old_size = 0;
+	s->write = write;
+	s->arg = arg;
+	s->state = STREAM_TYPE;
+	return BDELTA_OK;
+}
+
+/*
+ * Return values:
+ *
+ *  BDELTA_OK:              Success
+ *  BDELTA_PATCH_MISMATCH:  Old file is too small
+ *  BDELTA_IO:              Reading old or writing new failed
+ */
+static BDELTAcode stream_run_op(BDELTAstream *s)
+{
+	uint32_t size = s->size;
+	ssize_t r;
+	
+	/* Like patch_csi32, check copies and skips before doing anything. */
+	if ((s->op == OP_COPY || s->op == OP_SKIP)
+	    && size > s->old_size - s->old_pos)
+		return BDELTA_PATCH_MISMATCH;
+	
+	switch (s->op) {
+		case OP_COPY:
+			while (size > 0) {
+				r = pread(s->old_fd, s->buf,
+				          size < sizeof(s->buf) ? size : sizeof(s->buf),
+				          s->old_pos);
+				if (r < 0)
+					return BDELTA_IO;
+				if (r == 0)  /* Old file shrank under us. */
+					return BDELTA_PATCH_MISMATCH;
+				if (s->write(s->buf, r, s->arg) != 0)
+					return BDELTA_IO;
+				s->old_pos += r;
+				size -= r;
+			}
+			break;
+		
+		case OP_SKIP:
+			s->old_pos += size;
+			break;
+		
+		case OP_INSERT:
+			/* An empty insert is allowed, and has nothing to wait for. */
+			if (size > 0) {
+				s->state = STREAM_INSERT;
+				return BDELTA_OK;
+			}
+			break;
+		
+		default:
+			assert(0);
+	}
+	
+	s->state = STREAM_OP;
+	return BDELTA_OK;
+}
+
+BDELTAcode bdelta_stream_feed(BDELTAstream *s, const void *patch, size_t patch_size)
+{
+	const unsigned char *p = patch;
+	const unsigned char *pe = p + patch_size;
+	BDELTAcode rc;
+	size_t n;
+	
+	while (p < pe) {
+		switch (s->state) {
+			case STREAM_TYPE:
+				if (*p == PT_LITERAL)
+					s->state = STREAM_LITERAL;
+				else if (*p == PT_CSI32) {
+					/* Only now do we need old (and its size). */
+					struct stat st;
+					if (fstat(s->old_fd, &st) != 0)
+						return BDELTA_IO;
+					s->old_size = st.st_size;
+					s->state = STREAM_OP;
+				} else
+					return BDELTA_PATCH_INVALID;
+				p++;
+				break;
+			
+			case STREAM_LITERAL:
+				if (s->write(p, pe - p, s->arg) != 0)
+					return BDELTA_IO;
+				p = pe;
+				break;
+			
+			case STREAM_OP:
+				s->op = *p & 3;
+				s->size_bytes = *p >> 2;
+				p++;
+				if (s->op == 0 || s->size_bytes > 4)
+					return BDELTA_PATCH_INVALID;
+				s->size = s->size_bytes == 0 ? 1 : 0;
+				s->state = STREAM_SIZE;
+				/* fall through: the size may be implicit. */
+			
+			case STREAM_SIZE:
+				while (s->size_bytes > 0 && p < pe) {
+					s->size = s->size << 8 | *p++;
+					s->size_bytes--;
+				}
+				if (s->size_bytes == 0) {
+					rc = stream_run_op(s);
+					if (rc != BDELTA_OK)
+						return rc;
+				}
+				break;
+			
+			case STREAM_INSERT:
+				n = (size_t)(pe - p) < s->size ? (size_t)(pe - p) : s->size;
+				if (s->write(p, n, s->arg) != 0)
+					return BDELTA_IO;
+				p += n;
+				s->size -= n;
+				if (s->size == 0)
+					s->state = STREAM_OP;
+				break;
+		}
+	}
+	return BDELTA_OK;
+}
+
+BDELTAcode bdelta_stream_end(BDELTAstream *s)
+{
+	BDELTAcode rc = BDELTA_OK;
+	
+	if (s == NULL)
+		return BDELTA_OK;
+	/* The patch must not stop partway through an instruction. */
+	if (s->state != STREAM_LITERAL && s->state != STREAM_OP)
+		rc = BDELTA_PATCH_INVALID;
+	free(s);
+	return rc;
+}
+
+static int write_to_fd(const void *data, size_t size, void *arg)
+{
+	const char *p = data;
+	ssize_t w;
+	
+	while (size > 0) {
+		w = write(*(int *)arg, p, size);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += w;
+		size -= w;
+	}
+	return 0;
+}
+
+BDELTAcode bdelta_patch_fd(int old_fd, int patch_fd, int new_fd)
+{
+	BDELTAstream *s;
+	BDELTAcode rc;
+	ssize_t r;
+	
+	rc = bdelta_stream_new(old_fd, write_to_fd, &new_fd, &s);
+	if (rc != BDELTA_OK)
+		return rc;
+	
+	for (;;) {
+		unsigned char patch[4096];
+		
+		r = read(patch_fd, patch, sizeof(patch));
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			rc = BDELTA_IO;
+			break;
+		}
+		if (r == 0)
+			break;
+		rc = bdelta_stream_feed(s, patch, r);
+		if (rc != BDELTA_OK)
+			break;
+	}
+	
+	if (rc == BDELTA_OK)
+		return bdelta_stream_end(s);
+	bdelta_stream_end(s);
+	return rc;
+}
+
 const char *bdelta_strerror(BDELTAcode code)
 {
 	switch (code) {
@@ -818,6 +1345,8 @@ const char *bdelta_strerror(BDELTAcode code)
 			return "Patch is invalid";
 		case BDELTA_PATCH_MISMATCH:
 			return "Patch applied to wrong data";
+		case BDELTA_IO:
+			return "Read or write failed";
 		
 		case BDELTA_INTERNAL_DMAX_EXCEEDED:
 			return "Difference threshold exceeded (internal error)";
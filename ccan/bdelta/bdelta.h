@@ -31,12 +31,23 @@ typedef enum {
 	BDELTA_MEMORY           = 1,  /* Memory allocation failed. */
 	BDELTA_PATCH_INVALID    = 2,  /* Patch is malformed. */
 	BDELTA_PATCH_MISMATCH   = 3,  /* Patch applied to wrong original string. */
+	BDELTA_IO               = 4,  /* Read or write failed (see errno). */
 	
 	/* Internal error codes.  These will never be returned by API functions. */
 	BDELTA_INTERNAL_DMAX_EXCEEDED    = -10,
 	BDELTA_INTERNAL_INPUTS_TOO_LARGE = -11,
 } BDELTAcode;
 
+typedef enum {
+	/*
+	 * Find matches by hashing blocks of the old string, rather than with
+	 * Myers' algorithm.  Time and memory stay near-linear however large
+	 * or different the strings are, but matches shorter than about 32
+	 * bytes may be missed (except near other matches).
+	 */
+	BDELTA_LINEAR           = 1,
+} BDELTAflags;
+
 /*
  * bdelta_diff - Given two byte strings, generate a "patch" (also a byte string)
  * that describes how to transform the old string into the new string.
@@ -67,6 +78,23 @@ BDELTAcode bdelta_diff(
 	void       **patch_out, size_t *patch_size_out
 );
 
+/*
+ * bdelta_diff_flags - Like bdelta_diff, but with a choice of algorithm.
+ *
+ * @flags is 0 or more BDELTAflags or'ed together; 0 is the same as
+ * bdelta_diff.  The patches can be applied by bdelta_patch as usual.
+ *
+ * Example:
+ *	rc = bdelta_diff_flags(old, old_size, new_, new_size,
+ *	                       &patch, &patch_size, BDELTA_LINEAR);
+ */
+BDELTAcode bdelta_diff_flags(
+	const void  *old,       size_t  old_size,
+	const void  *new_,      size_t  new_size,
+	void       **patch_out, size_t *patch_size_out,
+	unsigned int flags
+);
+
 /*
  * bdelta_patch - Apply a patch produced by bdelta_diff to the
  * old string to recover the new string.
@@ -97,6 +125,65 @@ BDELTAcode bdelta_patch(
 	void       **new_out, size_t *new_size_out
 );
 
+/*
+ * bdelta_patch_fd - Apply a patch read from @patch_fd to the old file
+ * @old_fd, writing the new file to @new_fd.
+ *
+ * The old file is read with pread (from offset 0), and the patch and new
+ * file a piece at a time, so memory use is constant however big they are.
+ *
+ * Returns BDELTA_OK on success.  On failure, returns an error code, and
+ * some of the new file may have been written.
+ */
+BDELTAcode bdelta_patch_fd(int old_fd, int patch_fd, int new_fd);
+
+/*
+ * BDELTAstream - A patch being applied as it arrives.
+ *
+ * bdelta_stream_new starts applying a patch to the old file @old_fd (read
+ * with pread, from offset 0).  The new string is handed to @write in
+ * pieces as it's produced; @write returns 0 on success, or -1 (setting
+ * errno) to stop with BDELTA_IO.
+ *
+ * Then bdelta_stream_feed is called with the patch, in pieces of any size
+ * (say, as they come off the network).  Once it's all fed, or feeding it
+ * fails, bdelta_stream_end checks the patch wasn't cut off and frees the
+ * stream.
+ *
+ * The old file's size is taken (with fstat) when the patch starts, and the
+ * file mustn't change while it's applied.  As with bdelta_patch, copying or
+ * skipping past its end gives BDELTA_PATCH_MISMATCH.
+ *
+ * Example:
+ *	static int write_stdout(const void *data, size_t size, void *arg)
+ *	{
+ *		return fwrite(data, 1, size, stdout) == size ? 0 : -1;
+ *	}
+ *	...
+ *	BDELTAstream *s;
+ *	char buf[4096];
+ *	ssize_t len;
+ *
+ *	rc = bdelta_stream_new(old_fd, write_stdout, NULL, &s);
+ *	while (rc == BDELTA_OK && (len = read(sock, buf, sizeof(buf))) > 0)
+ *		rc = bdelta_stream_feed(s, buf, len);
+ *	if (rc == BDELTA_OK)
+ *		rc = bdelta_stream_end(s);
+ *	else
+ *		bdelta_stream_end(s);
+ */
+typedef struct BDELTAstream BDELTAstream;
+
+BDELTAcode bdelta_stream_new(
+	int old_fd,
+	int (*write)(const void *data, size_t size, void *arg), void *arg,
+	BDELTAstream **stream_out
+);
+
+BDELTAcode bdelta_stream_feed(BDELTAstream *s, const void *patch, size_t patch_size);
+
+BDELTAcode bdelta_stream_end(BDELTAstream *s);
+
 /*
  * bdelta_strerror - Return a string describing a bdelta error code.
  */
@@ -0,0 +1,97 @@
+#include "common.h"
+
+/* Diff with BDELTA_LINEAR, check it applies, and return the patch size. */
+static size_t linear_patch_size(const void *old, size_t old_size,
+                                const void *new_, size_t new_size)
+{
+	void *patch, *new2;
+	size_t patch_size, new2_size;
+	BDELTAcode rc;
+	
+	rc = bdelta_diff_flags(old, old_size, new_, new_size,
+	                       &patch, &patch_size, BDELTA_LINEAR);
+	if (rc != BDELTA_OK) {
+		bdelta_perror("bdelta_diff_flags", rc);
+		return (size_t)-1;
+	}
+	
+	rc = bdelta_patch(old, old_size, patch, patch_size, &new2, &new2_size);
+	free(patch);
+	if (rc != BDELTA_OK) {
+		bdelta_perror("bdelta_patch", rc);
+		return (size_t)-1;
+	}
+	if (new2_size != new_size || memcmp(new2, new_, new_size) != 0) {
+		fprintf(stderr, "patch(old, diff(old, new)) != new\n");
+		patch_size = (size_t)-1;
+	}
+	free(new2);
+	return patch_size;
+}
+
+static int test_random(uint32_t old_size, uint32_t diff_size, size_t max_patch)
+{
+	uint8_t *old, *new_;
+	uint32_t new_size;
+	size_t patch_size;
+	
+	if (random_string_pair(old_size, diff_size, NULL,
+	                       &old, &new_, &new_size) != RSTRING_OK) {
+		fprintf(stderr, "Error generating random string pair\n");
+		exit(EXIT_FAILURE);
+	}
+	patch_size = linear_patch_size(old, old_size, new_, new_size);
+	free(new_);
+	free(old);
+	return patch_size <= max_patch;
+}
+
+int main(void)
+{
+	const char *s = "aaabbbcdaabcc, aaabbcdaabeca, aaabbbcdaabcc";
+	uint8_t *old, *new_;
+	size_t i;
+	
+	plan_tests(11);
+	
+	/* Small and degenerate cases still work (they mostly go to Myers). */
+	ok1(linear_patch_size("", 0, "", 0) == 1);
+	ok1(linear_patch_size(s, strlen(s), "", 0) == 1);
+	ok1(linear_patch_size("", 0, s, strlen(s)) == strlen(s) + 1);
+	ok1(linear_patch_size(s, strlen(s), s, strlen(s)) <= 3);
+	ok1(linear_patch_size(s, strlen(s), s + 3, strlen(s) - 6) <= 6);
+	
+	/* Scattered edits in a large string: Myers would give up on these. */
+	ok1(test_random(1000000, 2000, 30000));
+	ok1(test_random(5000000, 10, 1000));
+	
+	/* A big deletion and insertion, far apart. */
+	old = random_string(4000000, NULL);
+	new_ = malloc(4000000);
+	memcpy(new_, old, 1000000);
+	memcpy(new_ + 1000000, old + 2000000, 2000000);
+	random_string_into(new_ + 3000000, 1000000, NULL);
+	ok1(linear_patch_size(old, 4000000, new_, 4000000) < 1000100);
+	
+	/* Low entropy, with a block moved earlier: only one copy can be used. */
+	for (i = 0; i < 4000000; i++)
+		old[i] = "abcd"[rand32() >> 30];
+	memcpy(new_, old + 3000000, 500000);
+	memcpy(new_ + 500000, old, 3500000);
+	ok1(linear_patch_size(old, 4000000, new_, 4000000) < 600000);
+	
+	/* Runs of zeroes, which all hash the same. */
+	memset(old, 0, 4000000);
+	memset(new_, 0, 4000000);
+	for (i = 0; i < 4000000; i += 100000)
+		old[i] = new_[i + 50] = 1;
+	ok1(linear_patch_size(old, 4000000, new_, 4000000) < 2000);
+	
+	/* Completely different: near enough the same as a literal. */
+	random_string_into(new_, 4000000, NULL);
+	ok1(linear_patch_size(old, 4000000, new_, 4000000) == 4000001);
+	
+	free(new_);
+	free(old);
+	return exit_status();
+}
@@ -0,0 +1,182 @@
+#include "common.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+struct output {
+	uint8_t *data;
+	size_t size, alloc;
+};
+
+static int append(const void *data, size_t size, void *arg)
+{
+	struct output *out = arg;
+	
+	if (out->size + size > out->alloc) {
+		out->alloc = (out->size + size) * 2;
+		out->data = realloc(out->data, out->alloc);
+	}
+	memcpy(out->data + out->size, data, size);
+	out->size += size;
+	return 0;
+}
+
+static int fail_write(const void *data, size_t size, void *arg)
+{
+	errno = ENOSPC;
+	return -1;
+}
+
+/* Apply the patch, fed in pieces of @piece bytes, into @out. */
+static BDELTAcode stream_patch(int old_fd, const void *patch, size_t patch_size,
+                               size_t piece, struct output *out)
+{
+	BDELTAstream *s;
+	BDELTAcode rc;
+	size_t i, n;
+	
+	out->data = NULL;
+	out->size = out->alloc = 0;
+	rc = bdelta_stream_new(old_fd, append, out, &s);
+	for (i = 0; rc == BDELTA_OK && i < patch_size; i += n) {
+		n = patch_size - i < piece ? patch_size - i : piece;
+		rc = bdelta_stream_feed(s, (const char *)patch + i, n);
+	}
+	if (rc == BDELTA_OK)
+		return bdelta_stream_end(s);
+	bdelta_stream_end(s);
+	return rc;
+}
+
+static int write_file(const char *name, const void *data, size_t size)
+{
+	int fd = open(name, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	
+	if (fd < 0 || write(fd, data, size) != (ssize_t)size) {
+		perror(name);
+		exit(EXIT_FAILURE);
+	}
+	lseek(fd, 0, SEEK_SET);
+	return fd;
+}
+
+static int test_random(uint32_t old_size, uint32_t diff_size, unsigned int flags)
+{
+	static const size_t pieces[] = { 1, 3, 4096, 100000 };
+	uint8_t *old, *new_;
+	uint32_t new_size;
+	void *patch;
+	size_t patch_size, i;
+	struct output out;
+	int fd, ret = 1;
+	
+	if (random_string_pair(old_size, diff_size, NULL,
+	                       &old, &new_, &new_size) != RSTRING_OK) {
+		fprintf(stderr, "Error generating random string pair\n");
+		exit(EXIT_FAILURE);
+	}
+	if (bdelta_diff_flags(old, old_size, new_, new_size,
+	                      &patch, &patch_size, flags) != BDELTA_OK)
+		return 0;
+	
+	fd = write_file("run-stream.old", old, old_size);
+	for (i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++) {
+		if (stream_patch(fd, patch, patch_size, pieces[i], &out) != BDELTA_OK
+		    || out.size != new_size
+		    || memcmp(out.data, new_, new_size) != 0)
+			ret = 0;
+		free(out.data);
+	}
+	close(fd);
+	
+	free(patch);
+	free(new_);
+	free(old);
+	return ret;
+}
+
+int main(void)
+{
+	uint8_t *old, *new_, *result;
+	void *patch;
+	size_t patch_size, result_size, mem_size;
+	void *mem;
+	struct output out;
+	BDELTAstream *s;
+	int old_fd, patch_fd, new_fd;
+	
+	plan_tests(19);
+	
+	ok1(test_random(100, 10, 0));
+	ok1(test_random(10000, 200, 0));
+	ok1(test_random(1000000, 200, BDELTA_LINEAR));
+	ok1(test_random(1000, 2000, 0));
+	
+	/* The whole thing through file descriptors. */
+	old = random_string(1000000, NULL);
+	new_ = malloc(1000000);
+	memcpy(new_, old + 500000, 500000);
+	memcpy(new_ + 500000, old, 500000);
+	bdelta_diff_flags(old, 1000000, new_, 1000000, &patch, &patch_size, BDELTA_LINEAR);
+	old_fd = write_file("run-stream.old", old, 1000000);
+	patch_fd = write_file("run-stream.patch", patch, patch_size);
+	new_fd = open("run-stream.new", O_RDWR|O_CREAT|O_TRUNC, 0600);
+	ok1(bdelta_patch_fd(old_fd, patch_fd, new_fd) == BDELTA_OK);
+	lseek(new_fd, 0, SEEK_SET);
+	result = malloc(1000001);
+	result_size = read(new_fd, result, 1000001);
+	ok1(result_size == 1000000 && memcmp(result, new_, 1000000) == 0);
+	close(new_fd);
+	close(patch_fd);
+	
+	/* Errors: truncated, or against the wrong old file. */
+	ok1(stream_patch(old_fd, patch, 0, 1, &out) == BDELTA_PATCH_INVALID);
+	ok1(stream_patch(old_fd, patch, patch_size - 1, 1, &out) == BDELTA_PATCH_INVALID);
+	free(out.data);
+	ok1(stream_patch(old_fd, "\x0b\x05", 2, 1, &out) == BDELTA_PATCH_INVALID);
+	ok1(stream_patch(old_fd, "\x0c", 1, 1, &out) == BDELTA_PATCH_INVALID);
+	
+	/* Write errors are passed back. */
+	ok1(bdelta_stream_new(old_fd, fail_write, NULL, &s) == BDELTA_OK);
+	ok1(bdelta_stream_feed(s, patch, patch_size) == BDELTA_IO && errno == ENOSPC);
+	bdelta_stream_end(s);
+	
+	close(old_fd);
+	old_fd = write_file("run-stream.old", old, 600000);
+	ok1(stream_patch(old_fd, patch, patch_size, 4096, &out) == BDELTA_PATCH_MISMATCH);
+	free(out.data);
+	
+	/* Skipping to the end of old is fine; past it isn't, even at the end. */
+	ok1(stream_patch(old_fd, "\x0b\x12\x00\x09\x27\xc0", 6, 1, &out) == BDELTA_OK
+	    && out.size == 0);
+	free(out.data);
+	ok1(bdelta_patch(old, 600000, "\x0b\x12\x00\x09\x27\xc1", 6, &mem, &mem_size)
+	    == BDELTA_PATCH_MISMATCH);
+	ok1(stream_patch(old_fd, "\x0b\x12\x00\x09\x27\xc1", 6, 1, &out)
+	    == BDELTA_PATCH_MISMATCH);
+	free(out.data);
+	
+	/* An empty insert at the end isn't a truncated one. */
+	ok1(stream_patch(old_fd, "\x0b\x07\x00", 3, 1, &out) == BDELTA_OK
+	    && out.size == 0);
+	free(out.data);
+	
+	/* We can't check a patch against an old file we can't stat. */
+	ok1(stream_patch(-1, "\x0b\x05", 2, 1, &out) == BDELTA_IO);
+	free(out.data);
+	
+	/* A literal patch doesn't need old at all. */
+	ok1(stream_patch(-1, "\x0a" "abc", 4, 1, &out) == BDELTA_OK
+	    && out.size == 3 && memcmp(out.data, "abc", 3) == 0);
+	free(out.data);
+	
+	close(old_fd);
+	unlink("run-stream.old");
+	unlink("run-stream.patch");
+	unlink("run-stream.new");
+	free(result);
+	free(patch);
+	free(new_);
+	free(old);
+	return exit_status();
+}
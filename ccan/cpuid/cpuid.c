@@ -38,13 +38,20 @@ enum {
 #ifndef _MSC_VER
 static void ___cpuid(cpuid_t info, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
 {
+#if UINTPTR_MAX == 0xffffffffffffffff
+	/* A 32-bit xchg would zero the top half of rbx. */
+#define ASM_XCHGBX	"xchgq %%rbx, %%rdi\n\t"
+#else
+#define ASM_XCHGBX	"xchgl %%ebx, %%edi\n\t"
+#endif
 	__asm__(
-		"xchg %%ebx, %%edi\n\t" 	/* 32bit PIC: Don't clobber ebx.  */
+		ASM_XCHGBX 	/* 32bit PIC: Don't clobber ebx.  */
 		"cpuid\n\t"
-		"xchg %%ebx, %%edi\n\t"
+		ASM_XCHGBX
 		: "=a"(*eax), "=D"(*ebx), "=c"(*ecx), "=d"(*edx)
 		: "0" (info)
 	);
+#undef ASM_XCHGBX
 }
 #else
 #include <intrin.h>
@@ -77,6 +84,9 @@ static struct {
 
 	{ CF_SSSE3,     	1 << 9,  	false },
 	{ CF_AVX, 		1 << 28, 	false },
+	{ CF_SSE41, 		1 << 19, 	false },
+	{ CF_SSE42, 		1 << 20, 	false },
+	{ CF_PCLMUL, 		1 << 1, 	false },
 
 	/* Extended ones.  */
 	{ CEF_x64, 		1 << 30, 	true },
@@ -111,44 +121,32 @@ bool cpuid_is_supported(void)
 	 */
 
 #if UINTPTR_MAX == 0xffffffffffffffff
-#define ASM_PUSHF 	"pushfq\n\t"
-#define ASM_POPF	"popfq\n\t"
-#define ASM_PUSHEAX 	"pushq %%rax\n\t"
-#define ASM_POPEAX 	"popq %%rax\n\t"
-#define ASM_PUSHECX 	"popq %%rcx\n\t"
-#elif UINTPTR_MAX == 0xffffffff
-#define ASM_PUSHF 	"pushfl\n\t"
-#define ASM_POPF	"popfl\n\t"
-#define ASM_PUSHEAX 	"pushl %%eax\n\t"
-#define ASM_POPEAX 	"popl %%eax\n\t"
-#define ASM_PUSHECX 	"popl %%ecx\n\t"
-#endif
-
+	/* Every 64-bit CPU has it (and pushing here would clobber the
+	 * red zone below the stack pointer). */
+	return true;
+#else
 	int ret = 0;
 	asm volatile(
-		ASM_PUSHF
-		ASM_POPEAX
+		"pushfl\n\t"
+		"popl %%eax\n\t"
 		"movl %%eax, %%ecx\n\t"
 		"xorl $0x200000, %%eax\n\t"
-		ASM_PUSHEAX
-		ASM_POPF
-		ASM_PUSHF
-		ASM_POPEAX
+		"pushl %%eax\n\t"
+		"popfl\n\t"
+		"pushfl\n\t"
+		"popl %%eax\n\t"
 		"xorl %%ecx, %%eax\n\t"
 		"shrl $21, %%eax\n\t"
 		"andl $1, %%eax\n\t"
-		ASM_PUSHECX
-		ASM_POPF
+		"pushl %%ecx\n\t"
+		"popfl\n\t"
 		: "=a" (ret)
+		:
+		: "ecx", "cc"
 	);
 
-#undef ASM_PUSHF
-#undef ASM_POPF
-#undef ASM_PUSHEAX
-#undef ASM_POPEAX
-#undef ASM_PUSHECX
-
 	return !!ret;
+#endif
 }
 
 bool cpuid_test_feature(cpuid_t feature)
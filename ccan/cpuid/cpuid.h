@@ -86,6 +86,9 @@ typedef enum cpuid {
 #define CF_SSSE3 	7
 #define CF_AVX 		8
 #define CF_FMA 		9
+#define CF_SSE41 	18
+#define CF_SSE42 	19
+#define CF_PCLMUL 	20
 
 #define CEF_x64 	10
 #define CEF_FPU 	11
@@ -246,6 +249,9 @@ bool cpuid_test_feature(cpuid_t feature);
 #define cpuid_has_sse2() 	cpuid_has_feature(CF_SSE2, 	false)
 #define cpuid_has_sse3() 	cpuid_has_feature(CF_SSE3, 	false)
 #define cpuid_has_ssse3() 	cpuid_has_feature(CF_SSSE3, 	false)
+#define cpuid_has_sse41() 	cpuid_has_feature(CF_SSE41, 	false)
+#define cpuid_has_sse42() 	cpuid_has_feature(CF_SSE42, 	false)
+#define cpuid_has_pclmul() 	cpuid_has_feature(CF_PCLMUL, 	false)
 #define cpuid_has_avx() 	cpuid_has_feature(CF_AVX, 	false)
 #define cpuid_has_fma() 	cpuid_has_feature(CF_FMA, 	false)
 #define cpuid_has_x64() 	cpuid_has_feature(CEF_x64, 	true)
@@ -27,6 +27,7 @@
 #include <ccan/array_size/array_size.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 /*
  * This is the CRC-32C table
@@ -107,16 +108,52 @@ static const uint32_t crc32c_tab[] = {
  * Steps through buffer one byte at at time, calculates reflected
  * crc using table.
  */
-uint32_t crc32c(uint32_t crc, const void *buf, size_t size)
+static uint32_t crc32c_bytes(uint32_t crc, const uint8_t *p, size_t size)
 {
-	const uint8_t *p = buf;
-
 	while (size--)
 		crc = crc32c_tab[(crc ^ *p++) & 0xFFL] ^ (crc >> 8);
 
 	return crc;
 }
 
+/* crc32c_tab, then each extended by one more zero byte. */
+static uint32_t crc32c_slice[8][256];
+
+static void crc32c_slice_init(void)
+{
+	unsigned int i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc32c_slice[0][i] = crc32c_tab[i];
+		for (k = 1; k < 8; k++) {
+			uint32_t c = crc32c_slice[k-1][i];
+			crc32c_slice[k][i] = crc32c_tab[c & 0xFF] ^ (c >> 8);
+		}
+	}
+}
+
+/* Slice-by-8: eight independent lookups for each 8 bytes. */
+static uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+
+	while (size >= 8) {
+		uint32_t lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16)
+				     | ((uint32_t)p[3] << 24));
+		crc = crc32c_slice[7][lo & 0xFF]
+			^ crc32c_slice[6][(lo >> 8) & 0xFF]
+			^ crc32c_slice[5][(lo >> 16) & 0xFF]
+			^ crc32c_slice[4][lo >> 24]
+			^ crc32c_slice[3][p[4]]
+			^ crc32c_slice[2][p[5]]
+			^ crc32c_slice[1][p[6]]
+			^ crc32c_slice[0][p[7]];
+		p += 8;
+		size -= 8;
+	}
+	return crc32c_bytes(crc, p, size);
+}
+
 const uint32_t *crc32c_table(void)
 {
 	return crc32c_tab;
@@ -168,17 +205,59 @@ static const uint32_t crc32_ieee_tab[] = {
 	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
 };
 
-uint32_t crc32_ieee(uint32_t crc, const void *buf, size_t size)
+/* These work on the raw register: crc32_ieee() does the inversion. */
+static uint32_t crc32_ieee_bytes(uint32_t crc, const uint8_t *p, size_t size)
 {
-	const uint8_t *p;
-
-	p = buf;
-	crc ^= ~0U;
-
 	while (size--)
 		crc = crc32_ieee_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
 
-	return crc ^ ~0U;
+	return crc;
+}
+
+static uint32_t crc32_ieee_slice[16][256];
+
+static void crc32_ieee_slice_init(void)
+{
+	unsigned int i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc32_ieee_slice[0][i] = crc32_ieee_tab[i];
+		for (k = 1; k < 16; k++) {
+			uint32_t c = crc32_ieee_slice[k-1][i];
+			crc32_ieee_slice[k][i] = crc32_ieee_tab[c & 0xFF]
+				^ (c >> 8);
+		}
+	}
+}
+
+/* Slice-by-16: the first four bytes have the crc mixed in. */
+static uint32_t crc32_ieee_sw(uint32_t crc, const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+
+	while (size >= 16) {
+		uint32_t lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16)
+				     | ((uint32_t)p[3] << 24));
+		crc = crc32_ieee_slice[15][lo & 0xFF]
+			^ crc32_ieee_slice[14][(lo >> 8) & 0xFF]
+			^ crc32_ieee_slice[13][(lo >> 16) & 0xFF]
+			^ crc32_ieee_slice[12][lo >> 24]
+			^ crc32_ieee_slice[11][p[4]]
+			^ crc32_ieee_slice[10][p[5]]
+			^ crc32_ieee_slice[9][p[6]]
+			^ crc32_ieee_slice[8][p[7]]
+			^ crc32_ieee_slice[7][p[8]]
+			^ crc32_ieee_slice[6][p[9]]
+			^ crc32_ieee_slice[5][p[10]]
+			^ crc32_ieee_slice[4][p[11]]
+			^ crc32_ieee_slice[3][p[12]]
+			^ crc32_ieee_slice[2][p[13]]
+			^ crc32_ieee_slice[1][p[14]]
+			^ crc32_ieee_slice[0][p[15]];
+		p += 16;
+		size -= 16;
+	}
+	return crc32_ieee_bytes(crc, p, size);
 }
 
 const uint32_t *crc32_ieee_table(void)
@@ -276,10 +355,8 @@ static uint16_t crc64_tab[] = {
     0x9090
 };
 
-uint64_t crc64_iso(uint64_t crc, const void *buf, size_t size)
+static uint64_t crc64_iso_bytes(uint64_t crc, const uint8_t *p, size_t size)
 {
-	const uint8_t *p = buf;
-
 	while (size--) {
 		uint64_t tabval = crc64_tab[(crc ^ *p++) & 0xFFL];
 		tabval <<= 48;
@@ -288,20 +365,430 @@ uint64_t crc64_iso(uint64_t crc, const void *buf, size_t size)
 	return crc;
 }
 
-const uint64_t *crc64_iso_table(void)
+static uint64_t crc64_iso_slice[8][256];
+
+static void crc64_iso_slice_init(void)
+{
+	unsigned int i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc64_iso_slice[0][i] = (uint64_t)crc64_tab[i] << 48;
+		for (k = 1; k < 8; k++) {
+			uint64_t c = crc64_iso_slice[k-1][i];
+			crc64_iso_slice[k][i] = ((uint64_t)crc64_tab[c & 0xFF]
+						 << 48) ^ (c >> 8);
+		}
+	}
+}
+
+/* Slice-by-8: the whole crc is mixed into each 8 bytes. */
+static uint64_t crc64_iso_sw(uint64_t crc, const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+
+	while (size >= 8) {
+		uint64_t x = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16)
+				    | ((uint64_t)p[3] << 24)
+				    | ((uint64_t)p[4] << 32)
+				    | ((uint64_t)p[5] << 40)
+				    | ((uint64_t)p[6] << 48)
+				    | ((uint64_t)p[7] << 56));
+		crc = crc64_iso_slice[7][x & 0xFF]
+			^ crc64_iso_slice[6][(x >> 8) & 0xFF]
+			^ crc64_iso_slice[5][(x >> 16) & 0xFF]
+			^ crc64_iso_slice[4][(x >> 24) & 0xFF]
+			^ crc64_iso_slice[3][(x >> 32) & 0xFF]
+			^ crc64_iso_slice[2][(x >> 40) & 0xFF]
+			^ crc64_iso_slice[1][(x >> 48) & 0xFF]
+			^ crc64_iso_slice[0][x >> 56];
+		p += 8;
+		size -= 8;
+	}
+	return crc64_iso_bytes(crc, p, size);
+}
+
+/* The polynomials, reflected like the tables. */
+#define CRC32C_POLY 0x82F63B78
+#define CRC32_IEEE_POLY 0xEDB88320
+#define CRC64_ISO_POLY 0xD800000000000000ULL
+
+/*
+ * Polynomials here are reflected, like the crc itself: the top bit is
+ * x^0.  These multiply two of them modulo @poly.
+ */
+static uint32_t crc32_multmodp(uint32_t poly, uint32_t a, uint32_t b)
+{
+	uint32_t m = (uint32_t)1 << 31, p = 0;
+
+	while (m) {
+		if (a & m)
+			p ^= b;
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ poly : b >> 1;
+	}
+	return p;
+}
+
+static uint64_t crc64_multmodp(uint64_t poly, uint64_t a, uint64_t b)
+{
+	uint64_t m = (uint64_t)1 << 63, p = 0;
+
+	while (m) {
+		if (a & m)
+			p ^= b;
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ poly : b >> 1;
+	}
+	return p;
+}
+
+/* x^n modulo @poly.  Appending len zero bytes multiplies by x^(8*len). */
+static uint32_t crc32_xnmodp(uint32_t poly, uint64_t n)
+{
+	uint32_t sq = (uint32_t)1 << 30, p = (uint32_t)1 << 31;
+
+	/* sq is x, then x^2, x^4... */
+	for (; n; n >>= 1) {
+		if (n & 1)
+			p = crc32_multmodp(poly, sq, p);
+		sq = crc32_multmodp(poly, sq, sq);
+	}
+	return p;
+}
+
+static uint64_t crc64_xnmodp(uint64_t poly, uint64_t n)
+{
+	uint64_t sq = (uint64_t)1 << 62, p = (uint64_t)1 << 63;
+
+	for (; n; n >>= 1) {
+		if (n & 1)
+			p = crc64_multmodp(poly, sq, p);
+		sq = crc64_multmodp(poly, sq, sq);
+	}
+	return p;
+}
+
+/*
+ * The crc of A then B is the crc of A followed by len(B) zeroes, xored
+ * with the crc of B (from 0).  The inversion in crc32_ieee() cancels out.
+ */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+	return crc32_multmodp(CRC32C_POLY,
+			      crc32_xnmodp(CRC32C_POLY, len2 * 8), crc1) ^ crc2;
+}
+
+uint32_t crc32_ieee_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+	return crc32_multmodp(CRC32_IEEE_POLY,
+			      crc32_xnmodp(CRC32_IEEE_POLY, len2 * 8), crc1)
+		^ crc2;
+}
+
+uint64_t crc64_iso_combine(uint64_t crc1, uint64_t crc2, uint64_t len2)
+{
+	return crc64_multmodp(CRC64_ISO_POLY,
+			      crc64_xnmodp(CRC64_ISO_POLY, len2 * 8), crc1)
+		^ crc2;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <ccan/cpuid/cpuid.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#include <string.h>
+
+/* A table per byte of the crc, to append zeros 4 lookups at a time. */
+static void crc32c_zeros_init(uint32_t zeros[4][256], size_t len)
+{
+	uint32_t op = crc32_xnmodp(CRC32C_POLY, len * 8);
+	unsigned int i, k;
+
+	for (k = 0; k < 4; k++)
+		for (i = 0; i < 256; i++)
+			zeros[k][i] = crc32_multmodp(CRC32C_POLY, op,
+						     (uint32_t)i << (k * 8));
+}
+
+static inline uint32_t crc32c_shift(uint32_t zeros[4][256], uint32_t crc)
+{
+	return zeros[0][crc & 0xFF] ^ zeros[1][(crc >> 8) & 0xFF]
+		^ zeros[2][(crc >> 16) & 0xFF] ^ zeros[3][crc >> 24];
+}
+
+/*
+ * The crc32 instruction takes 3 cycles, but can start one every cycle, so
+ * we run three independent streams and merge them with crc32c_shift().
+ * Long streams amortize the merge; short ones are for what's left.
+ */
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+static uint32_t crc32c_long[4][256], crc32c_short[4][256];
+
+static inline uint64_t crc32c_load(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+__attribute__((target("sse4.2")))
+static uint64_t crc32c_streams(uint64_t crc0, const uint8_t **pp,
+			       size_t *size, size_t stream,
+			       uint32_t zeros[4][256])
 {
-	static uint64_t *fulltab = NULL;
-	unsigned int i;
+	const uint8_t *p = *pp, *end;
+	uint64_t crc1, crc2;
 
-	if (fulltab)
-		return fulltab;
+	while (*size >= stream * 3) {
+		crc1 = crc2 = 0;
+		for (end = p + stream; p < end; p += 8) {
+			crc0 = _mm_crc32_u64(crc0, crc32c_load(p));
+			crc1 = _mm_crc32_u64(crc1, crc32c_load(p + stream));
+			crc2 = _mm_crc32_u64(crc2, crc32c_load(p + stream*2));
+		}
+		crc0 = crc32c_shift(zeros, crc0) ^ crc1;
+		crc0 = crc32c_shift(zeros, crc0) ^ crc2;
+		p += stream * 2;
+		*size -= stream * 3;
+	}
+	*pp = p;
+	return crc0;
+}
 
-	fulltab = malloc(sizeof(uint64_t)*ARRAY_SIZE(crc64_tab));
-	if (!fulltab)
-		return NULL;
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+	uint64_t crc0 = crc;
 
-	for (i = 0; i < ARRAY_SIZE(crc64_tab); i++)
-		fulltab[i] = (uint64_t)crc64_tab[i] << 48;
+	/* Align, so the 8 byte loads don't straddle cache lines. */
+	while (size && ((uintptr_t)p & 7)) {
+		crc0 = _mm_crc32_u8(crc0, *p++);
+		size--;
+	}
+
+	crc0 = crc32c_streams(crc0, &p, &size, CRC32C_LONG, crc32c_long);
+	crc0 = crc32c_streams(crc0, &p, &size, CRC32C_SHORT, crc32c_short);
+
+	for (; size >= 8; p += 8, size -= 8)
+		crc0 = _mm_crc32_u64(crc0, crc32c_load(p));
+	while (size--)
+		crc0 = _mm_crc32_u8(crc0, *p++);
+
+	return crc0;
+}
+
+/*
+ * Carry-less multiply folding, as in Intel's "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction".
+ *
+ * We keep 128 bit chunks of message, and fold each one forward by
+ * multiplying its halves by x^n mod P for the right n: the result is
+ * congruent modulo P, so it has the same crc.  At the end we simply
+ * run the tables over the last 16 bytes we're left with.
+ *
+ * In this bit order, a 64x64 carry-less multiply also multiplies by x,
+ * so each constant is one power lower.  These are computed at startup
+ * from the polynomial rather than copied from the paper.
+ */
+struct crc_fold_keys {
+	/* Fold by 512, 384, 256 and 128 bits: low half, then high half. */
+	uint64_t k[4][2];
+};
+
+static struct crc_fold_keys crc32_ieee_keys, crc64_iso_keys;
+
+static void crc_fold_keys_init(struct crc_fold_keys *keys, int width,
+			       uint64_t poly)
+{
+	unsigned int i, bits;
+
+	for (i = 0; i < 4; i++) {
+		bits = 512 - i * 128;
+		if (width == 32) {
+			keys->k[i][0] = (uint64_t)crc32_xnmodp(poly, bits + 63)
+				<< 32;
+			keys->k[i][1] = (uint64_t)crc32_xnmodp(poly, bits - 1)
+				<< 32;
+		} else {
+			keys->k[i][0] = crc64_xnmodp(poly, bits + 63);
+			keys->k[i][1] = crc64_xnmodp(poly, bits - 1);
+		}
+	}
+}
+
+__attribute__((target("pclmul")))
+static inline __m128i crc_fold(__m128i x, const uint64_t k[2])
+{
+	__m128i key = _mm_set_epi64x(k[1], k[0]);
+
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, key, 0x00),
+			     _mm_clmulepi64_si128(x, key, 0x11));
+}
+
+/*
+ * Fold @size bytes (a multiple of 16, at least 64) down to 16, having
+ * mixed @crc into the start of it.
+ */
+__attribute__((target("pclmul")))
+static void crc_fold_all(const uint8_t *p, size_t size, uint64_t crc,
+			 const struct crc_fold_keys *keys, uint8_t out[16])
+{
+	__m128i x0, x1, x2, x3;
+
+	x0 = _mm_loadu_si128((const __m128i *)p);
+	x1 = _mm_loadu_si128((const __m128i *)(p + 16));
+	x2 = _mm_loadu_si128((const __m128i *)(p + 32));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 48));
+	x0 = _mm_xor_si128(x0, _mm_set_epi64x(0, crc));
+	p += 64;
+	size -= 64;
+
+	/* Four independent streams, to keep the multiplier busy. */
+	while (size >= 64) {
+		x0 = _mm_xor_si128(crc_fold(x0, keys->k[0]),
+				   _mm_loadu_si128((const __m128i *)p));
+		x1 = _mm_xor_si128(crc_fold(x1, keys->k[0]),
+				   _mm_loadu_si128((const __m128i *)(p + 16)));
+		x2 = _mm_xor_si128(crc_fold(x2, keys->k[0]),
+				   _mm_loadu_si128((const __m128i *)(p + 32)));
+		x3 = _mm_xor_si128(crc_fold(x3, keys->k[0]),
+				   _mm_loadu_si128((const __m128i *)(p + 48)));
+		p += 64;
+		size -= 64;
+	}
+
+	x0 = _mm_xor_si128(_mm_xor_si128(crc_fold(x0, keys->k[1]),
+					 crc_fold(x1, keys->k[2])),
+			   _mm_xor_si128(crc_fold(x2, keys->k[3]), x3));
+
+	for (; size; p += 16, size -= 16)
+		x0 = _mm_xor_si128(crc_fold(x0, keys->k[3]),
+				   _mm_loadu_si128((const __m128i *)p));
+
+	_mm_storeu_si128((__m128i *)out, x0);
+}
 
-	return fulltab;
+/* Below this, setting up the fold isn't worth it. */
+#define CRC_FOLD_MIN 128
+
+static uint32_t crc32_ieee_clmul(uint32_t crc, const void *buf, size_t size)
+{
+	uint8_t rest[16];
+	size_t folded = size & ~(size_t)15;
+
+	if (size < CRC_FOLD_MIN)
+		return crc32_ieee_sw(crc, buf, size);
+
+	crc_fold_all(buf, folded, crc, &crc32_ieee_keys, rest);
+	crc = crc32_ieee_sw(0, rest, sizeof(rest));
+	return crc32_ieee_sw(crc, (const uint8_t *)buf + folded,
+			     size - folded);
+}
+
+static uint64_t crc64_iso_clmul(uint64_t crc, const void *buf, size_t size)
+{
+	uint8_t rest[16];
+	size_t folded = size & ~(size_t)15;
+
+	if (size < CRC_FOLD_MIN)
+		return crc64_iso_sw(crc, buf, size);
+
+	crc_fold_all(buf, folded, crc, &crc64_iso_keys, rest);
+	crc = crc64_iso_sw(0, rest, sizeof(rest));
+	return crc64_iso_sw(crc, (const uint8_t *)buf + folded,
+			    size - folded);
+}
+
+static void crc_setup_hw(uint32_t (**crc32c_fn)(uint32_t, const void *,
+						  size_t),
+			 uint32_t (**crc32_ieee_fn)(uint32_t, const void *,
+						    size_t),
+			 uint64_t (**crc64_iso_fn)(uint64_t, const void *,
+						   size_t))
+{
+	if (!cpuid_is_supported())
+		return;
+
+	if (cpuid_has_sse42()) {
+		crc32c_zeros_init(crc32c_long, CRC32C_LONG);
+		crc32c_zeros_init(crc32c_short, CRC32C_SHORT);
+		*crc32c_fn = crc32c_hw;
+	}
+
+	if (cpuid_has_pclmul()) {
+		crc_fold_keys_init(&crc32_ieee_keys, 32, CRC32_IEEE_POLY);
+		crc_fold_keys_init(&crc64_iso_keys, 64, CRC64_ISO_POLY);
+		*crc32_ieee_fn = crc32_ieee_clmul;
+		*crc64_iso_fn = crc64_iso_clmul;
+	}
+}
+#else
+static void crc_setup_hw(uint32_t (**crc32c_fn)(uint32_t, const void *,
+						  size_t),
+			 uint32_t (**crc32_ieee_fn)(uint32_t, const void *,
+						    size_t),
+			 uint64_t (**crc64_iso_fn)(uint64_t, const void *,
+						   size_t))
+{
+}
+#endif
+
+/*
+ * Set up on first use.  pthread_once() means the tables are built
+ * exactly once, and every caller sees them (and these) filled in.
+ */
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc32c_fn)(uint32_t, const void *, size_t);
+static uint32_t (*crc32_ieee_fn)(uint32_t, const void *, size_t);
+static uint64_t (*crc64_iso_fn)(uint64_t, const void *, size_t);
+
+static void crc_setup(void)
+{
+	uint32_t (*c32c)(uint32_t, const void *, size_t) = crc32c_sw;
+	uint32_t (*c32ieee)(uint32_t, const void *, size_t) = crc32_ieee_sw;
+	uint64_t (*c64iso)(uint64_t, const void *, size_t) = crc64_iso_sw;
+
+	/* The hardware versions use these for odd bytes, too. */
+	crc32c_slice_init();
+	crc32_ieee_slice_init();
+	crc64_iso_slice_init();
+	crc_setup_hw(&c32c, &c32ieee, &c64iso);
+
+	crc32c_fn = c32c;
+	crc32_ieee_fn = c32ieee;
+	crc64_iso_fn = c64iso;
+}
+
+/*
+ * Uses the SSE4.2 crc32 instruction if the CPU has it, otherwise
+ * slicing-by-8 tables.  Both give the same answer as crc32c_tab.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t size)
+{
+	pthread_once(&crc_once, crc_setup);
+	return crc32c_fn(crc, buf, size);
+}
+
+/* These two use PCLMULQDQ folding if we can, otherwise sliced tables. */
+uint32_t crc32_ieee(uint32_t crc, const void *buf, size_t size)
+{
+	pthread_once(&crc_once, crc_setup);
+	return crc32_ieee_fn(crc ^ ~0U, buf, size) ^ ~0U;
+}
+
+uint64_t crc64_iso(uint64_t crc, const void *buf, size_t size)
+{
+	pthread_once(&crc_once, crc_setup);
+	return crc64_iso_fn(crc, buf, size);
+}
+
+/* The first slice is crc64_tab widened to 64 bits: no need for another. */
+const uint64_t *crc64_iso_table(void)
+{
+	pthread_once(&crc_once, crc_setup);
+	return crc64_iso_slice[0];
 }
@@ -104,4 +104,46 @@ uint64_t crc64_iso(uint64_t start_crc, const void *buf, size_t size);
  */
 const uint64_t *crc64_iso_table(void);
 
+/**
+ * crc32c_combine - crc of two buffers, from the crcs of each
+ * @crc1: the crc of the first buffer (with any start_crc)
+ * @crc2: the crc of the second buffer, with start_crc 0
+ * @len2: the length of the second buffer
+ *
+ * This returns the crc of the two buffers one after the other, so you can
+ * checksum pieces of a large buffer separately (eg. in different threads)
+ * and put the results together.  It takes time proportional to log(@len2).
+ *
+ * Example:
+ *	// Same as crc32c(0, buf, len), in two halves.
+ *	static uint32_t crc_in_halves(const char *buf, size_t len)
+ *	{
+ *		uint32_t a = crc32c(0, buf, len / 2);
+ *		uint32_t b = crc32c(0, buf + len / 2, len - len / 2);
+ *
+ *		return crc32c_combine(a, b, len - len / 2);
+ *	}
+ */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+/**
+ * crc32_ieee_combine - crc of two buffers, from the crcs of each
+ * @crc1: the crc of the first buffer (with any start_crc)
+ * @crc2: the crc of the second buffer, with start_crc 0
+ * @len2: the length of the second buffer
+ *
+ * See crc32c_combine() for details.
+ */
+uint32_t crc32_ieee_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+/**
+ * crc64_iso_combine - crc of two buffers, from the crcs of each
+ * @crc1: the crc of the first buffer (with any start_crc)
+ * @crc2: the crc of the second buffer, with start_crc 0
+ * @len2: the length of the second buffer
+ *
+ * See crc32c_combine() for details.
+ */
+uint64_t crc64_iso_combine(uint64_t crc1, uint64_t crc2, uint64_t len2);
+
 #endif /* CCAN_CRC_H */
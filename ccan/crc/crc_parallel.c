@@ -0,0 +1,120 @@
+/* Licensed under GPLv2+ - see LICENSE file for details */
+#include <ccan/crc/crc_parallel.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* Below this, starting a thread costs more than it saves. */
+#define CRC_PARALLEL_MIN (1024 * 1024)
+
+typedef uint64_t (*crc_fn)(uint64_t crc, const void *buf, size_t size);
+typedef uint64_t (*crc_combine_fn)(uint64_t crc1, uint64_t crc2,
+				   uint64_t len2);
+
+struct crc_job {
+	pthread_t thread;
+	bool threaded;
+	crc_fn fn;
+	const uint8_t *p;
+	size_t size;
+	uint64_t crc;
+};
+
+static void *crc_job_run(void *arg)
+{
+	struct crc_job *job = arg;
+
+	job->crc = job->fn(job->crc, job->p, job->size);
+	return NULL;
+}
+
+static uint64_t crc_parallel(uint64_t crc, const void *buf, size_t size,
+			     unsigned int threads,
+			     crc_fn fn, crc_combine_fn combine)
+{
+	struct crc_job *jobs;
+	size_t chunk;
+	unsigned int i;
+
+	if (threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? cpus : 1;
+	}
+	if (threads > size / CRC_PARALLEL_MIN)
+		threads = size / CRC_PARALLEL_MIN;
+	if (threads <= 1)
+		return fn(crc, buf, size);
+
+	jobs = calloc(threads, sizeof(*jobs));
+	if (!jobs)
+		return fn(crc, buf, size);
+
+	/* Cache-line sized pieces; the last one gets the remainder. */
+	chunk = (size / threads) & ~(size_t)63;
+	for (i = 0; i < threads; i++) {
+		jobs[i].fn = fn;
+		jobs[i].p = (const uint8_t *)buf + i * chunk;
+		jobs[i].size = (i == threads - 1) ? size - i * chunk : chunk;
+		jobs[i].crc = i ? 0 : crc;
+	}
+
+	/* We do the first piece ourselves. */
+	for (i = 1; i < threads; i++)
+		jobs[i].threaded = (pthread_create(&jobs[i].thread, NULL,
+						   crc_job_run, &jobs[i]) == 0);
+	crc_job_run(&jobs[0]);
+
+	crc = jobs[0].crc;
+	for (i = 1; i < threads; i++) {
+		if (jobs[i].threaded)
+			pthread_join(jobs[i].thread, NULL);
+		else
+			crc_job_run(&jobs[i]);
+		crc = combine(crc, jobs[i].crc, jobs[i].size);
+	}
+	free(jobs);
+	return crc;
+}
+
+/* Everything is a uint64_t inside, so one crc_parallel() does them all. */
+static uint64_t crc32c_64(uint64_t crc, const void *buf, size_t size)
+{
+	return crc32c(crc, buf, size);
+}
+
+static uint64_t crc32c_combine_64(uint64_t crc1, uint64_t crc2, uint64_t len2)
+{
+	return crc32c_combine(crc1, crc2, len2);
+}
+
+static uint64_t crc32_ieee_64(uint64_t crc, const void *buf, size_t size)
+{
+	return crc32_ieee(crc, buf, size);
+}
+
+static uint64_t crc32_ieee_combine_64(uint64_t crc1, uint64_t crc2,
+				      uint64_t len2)
+{
+	return crc32_ieee_combine(crc1, crc2, len2);
+}
+
+uint32_t crc32c_parallel(uint32_t start_crc, const void *buf, size_t size,
+			 unsigned int threads)
+{
+	return crc_parallel(start_crc, buf, size, threads,
+			    crc32c_64, crc32c_combine_64);
+}
+
+uint32_t crc32_ieee_parallel(uint32_t start_crc, const void *buf, size_t size,
+			     unsigned int threads)
+{
+	return crc_parallel(start_crc, buf, size, threads,
+			    crc32_ieee_64, crc32_ieee_combine_64);
+}
+
+uint64_t crc64_iso_parallel(uint64_t start_crc, const void *buf, size_t size,
+			    unsigned int threads)
+{
+	return crc_parallel(start_crc, buf, size, threads,
+			    crc64_iso, crc64_iso_combine);
+}
@@ -0,0 +1,71 @@
+/* Licensed under GPLv2+ - see LICENSE file for details */
+#ifndef CCAN_CRC_PARALLEL_H
+#define CCAN_CRC_PARALLEL_H
+#include <ccan/crc/crc.h>
+
+/**
+ * crc32c_parallel - Castagnoli 32 bit crc of a large buffer, using threads
+ * @start_crc: the initial crc (usually 0)
+ * @buf: pointer to bytes
+ * @size: length of buffer
+ * @threads: maximum number of threads to use, or 0 for one per CPU
+ *
+ * This splits @buf into one piece per thread, and puts their crcs
+ * together with crc32c_combine().  The answer is the same as
+ * crc32c(@start_crc, @buf, @size).
+ *
+ * Each thread gets at least a megabyte, so small buffers are simply done
+ * in the caller's thread.  If threads can't be created, it does the work
+ * itself.
+ *
+ * Example:
+ *	#include <sys/mman.h>
+ *	#include <sys/stat.h>
+ *	#include <fcntl.h>
+ *	#include <unistd.h>
+ *	...
+ *	// Checksum a whole file, using every CPU.
+ *	static bool file_crc(const char *name, uint32_t *crc)
+ *	{
+ *		struct stat st;
+ *		void *p;
+ *		int fd = open(name, O_RDONLY);
+ *
+ *		if (fd < 0 || fstat(fd, &st) != 0)
+ *			return false;
+ *		p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+ *		close(fd);
+ *		if (p == MAP_FAILED)
+ *			return false;
+ *		*crc = crc32c_parallel(0, p, st.st_size, 0);
+ *		munmap(p, st.st_size);
+ *		return true;
+ *	}
+ */
+uint32_t crc32c_parallel(uint32_t start_crc, const void *buf, size_t size,
+			 unsigned int threads);
+
+/**
+ * crc32_ieee_parallel - IEEE 802.3 32 bit crc of a large buffer, using threads
+ * @start_crc: the initial crc (usually 0)
+ * @buf: pointer to bytes
+ * @size: length of buffer
+ * @threads: maximum number of threads to use, or 0 for one per CPU
+ *
+ * See crc32c_parallel() for details.
+ */
+uint32_t crc32_ieee_parallel(uint32_t start_crc, const void *buf, size_t size,
+			     unsigned int threads);
+
+/**
+ * crc64_iso_parallel - ISO 3309 64 bit crc of a large buffer, using threads
+ * @start_crc: the initial crc (usually 0)
+ * @buf: pointer to bytes
+ * @size: length of buffer
+ * @threads: maximum number of threads to use, or 0 for one per CPU
+ *
+ * See crc32c_parallel() for details.
+ */
+uint64_t crc64_iso_parallel(uint64_t start_crc, const void *buf, size_t size,
+			    unsigned int threads);
+#endif /* CCAN_CRC_PARALLEL_H */
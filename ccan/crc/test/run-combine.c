@@ -0,0 +1,43 @@
+#include <ccan/crc/crc.h>
+#include <ccan/tap/tap.h>
+#include <string.h>
+
+#define BUFSIZE 10000
+
+int main(int argc, char *argv[])
+{
+	static uint8_t buf[BUFSIZE];
+	static const size_t splits[] = { 0, 1, 5, 8, 100, 4097, BUFSIZE };
+	unsigned int i;
+
+	plan_tests(3 * 7 + 3);
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i * 17 + (i >> 8);
+
+	for (i = 0; i < 7; i++) {
+		size_t a = splits[i], b = BUFSIZE - splits[i];
+
+		ok1(crc32c_combine(crc32c(0, buf, a), crc32c(0, buf + a, b), b)
+		    == crc32c(0, buf, BUFSIZE));
+		ok1(crc32_ieee_combine(crc32_ieee(0, buf, a),
+				       crc32_ieee(0, buf + a, b), b)
+		    == crc32_ieee(0, buf, BUFSIZE));
+		ok1(crc64_iso_combine(crc64_iso(0, buf, a),
+				      crc64_iso(0, buf + a, b), b)
+		    == crc64_iso(0, buf, BUFSIZE));
+	}
+
+	/* The first crc can start anywhere. */
+	ok1(crc32c_combine(crc32c(0x12345678, buf, 100),
+			   crc32c(0, buf + 100, 900), 900)
+	    == crc32c(0x12345678, buf, 1000));
+	ok1(crc64_iso_combine(crc64_iso(~0ULL, buf, 100),
+			      crc64_iso(0, buf + 100, 900), 900)
+	    == crc64_iso(~0ULL, buf, 1000));
+
+	/* Combining in a huge (zero) middle is just a few multiplies. */
+	ok1(crc32_ieee_combine(crc32_ieee(0, buf, 10), 0, 0) ==
+	    crc32_ieee(0, buf, 10));
+
+	return exit_status();
+}
@@ -0,0 +1,58 @@
+#include <ccan/crc/crc.c>
+#include <ccan/cpuid/cpuid.c>
+#include <ccan/tap/tap.h>
+#include <string.h>
+
+/* Enough for a few rounds of the long three-way streams, plus change. */
+#define BUFSIZE (3 * 8192 * 3 + 3 * 256 * 2 + 100)
+
+static bool same_as_bytes(uint32_t (*fn)(uint32_t, const void *, size_t),
+			  const uint8_t *buf)
+{
+	static const size_t sizes[] = { 0, 1, 7, 8, 9, 63, 255, 256, 767, 768,
+					769, 3 * 256 * 2 + 17, 3 * 8192,
+					3 * 8192 + 3 * 256 + 9,
+					BUFSIZE - 8 };
+	unsigned int i, off;
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		for (off = 0; off < 8; off++) {
+			uint32_t start = i * 0x9E3779B9;
+			if (fn(start, buf + off, sizes[i])
+			    != crc32c_bytes(start, buf + off, sizes[i]))
+				return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	static uint8_t buf[BUFSIZE];
+	unsigned int i;
+
+	plan_tests(6);
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i * 7 + (i >> 8);
+
+	/* The standard check value, with the usual inversion. */
+	ok1((crc32c(~0U, "123456789", 9) ^ ~0U) == 0xE3069283);
+	ok1(crc32c(0, "IHATEMATH", 9) == 0x98a3b8df);
+	ok1(same_as_bytes(crc32c, buf));
+
+	crc_setup();
+	ok1(same_as_bytes(crc32c_sw, buf));
+
+	/* Pieces give the same result as the whole. */
+	ok1(crc32c(crc32c(0, buf, 12345), buf + 12345, sizeof(buf) - 12345)
+	    == crc32c_bytes(0, buf, sizeof(buf)));
+
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (crc32c_fn == crc32c_hw)
+		ok1(same_as_bytes(crc32c_hw, buf));
+	else
+#endif
+		pass("No hardware crc32c");
+
+	return exit_status();
+}
@@ -0,0 +1,66 @@
+#include <ccan/crc/crc.c>
+#include <ccan/cpuid/cpuid.c>
+#include <ccan/tap/tap.h>
+#include <pthread.h>
+#include <string.h>
+
+#define NUM_THREADS 8
+#define BUFSIZE 10000
+
+static uint8_t buf[BUFSIZE];
+static pthread_barrier_t start;
+
+struct result {
+	uint32_t c32c, c32ieee;
+	uint64_t c64iso;
+	const uint64_t *tab64iso;
+};
+
+/* Every thread's first call is at the same time. */
+static void *first_use(void *arg)
+{
+	struct result *r = arg;
+
+	pthread_barrier_wait(&start);
+	r->tab64iso = crc64_iso_table();
+	r->c32c = crc32c(0, buf, sizeof(buf));
+	r->c32ieee = crc32_ieee(0, buf, sizeof(buf));
+	r->c64iso = crc64_iso(0, buf, sizeof(buf));
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t threads[NUM_THREADS];
+	struct result r[NUM_THREADS];
+	bool same = true, tab_ok = true;
+	unsigned int i, j;
+
+	plan_tests(3);
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i * 7 + (i >> 8);
+
+	pthread_barrier_init(&start, NULL, NUM_THREADS);
+	for (i = 0; i < NUM_THREADS; i++)
+		if (pthread_create(&threads[i], NULL, first_use, &r[i]) != 0)
+			break;
+	ok1(i == NUM_THREADS);
+	for (i = 0; i < NUM_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+		if (r[i].c32c != crc32c_bytes(0, buf, sizeof(buf))
+		    || r[i].c32ieee
+		       != (crc32_ieee_bytes(~0U, buf, sizeof(buf)) ^ ~0U)
+		    || r[i].c64iso != crc64_iso_bytes(0, buf, sizeof(buf)))
+			same = false;
+		if (r[i].tab64iso != r[0].tab64iso)
+			tab_ok = false;
+		for (j = 0; j < 256 && r[i].tab64iso; j++)
+			if (r[i].tab64iso[j] != (uint64_t)crc64_tab[j] << 48)
+				tab_ok = false;
+	}
+	ok1(same);
+	ok1(tab_ok && r[0].tab64iso);
+	pthread_barrier_destroy(&start);
+
+	return exit_status();
+}
@@ -0,0 +1,78 @@
+#include <ccan/crc/crc.c>
+#include <ccan/cpuid/cpuid.c>
+#include <ccan/tap/tap.h>
+#include <string.h>
+
+#define BUFSIZE (64 * 100 + 200)
+
+static const size_t sizes[] = { 0, 1, 7, 8, 15, 16, 17, 63, 64, 127, 128,
+				129, 143, 144, 191, 192, 200, 255, 256,
+				1000, 4096, BUFSIZE - 16 };
+
+static bool crc32_same(uint32_t (*fn)(uint32_t, const void *, size_t),
+		       const uint8_t *buf)
+{
+	unsigned int i, off;
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		for (off = 0; off < 16; off++) {
+			uint32_t start = i * 0x9E3779B9;
+			if (fn(start, buf + off, sizes[i])
+			    != crc32_ieee_bytes(start, buf + off, sizes[i]))
+				return false;
+		}
+	}
+	return true;
+}
+
+static bool crc64_same(uint64_t (*fn)(uint64_t, const void *, size_t),
+		       const uint8_t *buf)
+{
+	unsigned int i, off;
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		for (off = 0; off < 16; off++) {
+			uint64_t start = i * 0x9E3779B97F4A7C15ULL;
+			if (fn(start, buf + off, sizes[i])
+			    != crc64_iso_bytes(start, buf + off, sizes[i]))
+				return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	static uint8_t buf[BUFSIZE];
+	unsigned int i;
+
+	plan_tests(8);
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i * 13 + (i >> 8);
+
+	/* The standard check values. */
+	ok1(crc32_ieee(0, "123456789", 9) == 0xCBF43926);
+	ok1((crc64_iso(~0ULL, "123456789", 9) ^ ~0ULL) == 0xB90956C775A41001ULL);
+
+	/* Whatever the dispatcher picked. */
+	ok1(crc32_ieee(0, buf, sizeof(buf))
+	    == (crc32_ieee_bytes(~0U, buf, sizeof(buf)) ^ ~0U));
+	ok1(crc64_iso(0, buf, sizeof(buf))
+	    == crc64_iso_bytes(0, buf, sizeof(buf)));
+
+	ok1(crc32_same(crc32_ieee_sw, buf));
+	ok1(crc64_same(crc64_iso_sw, buf));
+
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (crc32_ieee_fn == crc32_ieee_clmul) {
+		ok1(crc32_same(crc32_ieee_clmul, buf));
+		ok1(crc64_same(crc64_iso_clmul, buf));
+	} else
+#endif
+	{
+		pass("No PCLMULQDQ");
+		pass("No PCLMULQDQ");
+	}
+
+	return exit_status();
+}
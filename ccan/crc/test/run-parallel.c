@@ -0,0 +1,40 @@
+#include <ccan/crc/crc_parallel.h>
+#include <ccan/crc/crc.c>
+#include <ccan/crc/crc_parallel.c>
+#include <ccan/cpuid/cpuid.c>
+#include <ccan/tap/tap.h>
+#include <string.h>
+
+/* Enough for 8 threads, and not a multiple of anything. */
+#define BUFSIZE (9 * CRC_PARALLEL_MIN + 13)
+
+int main(int argc, char *argv[])
+{
+	static const unsigned int threads[] = { 0, 1, 2, 3, 8, 1000 };
+	uint8_t *buf = malloc(BUFSIZE);
+	uint32_t c32c, c32ieee;
+	uint64_t c64;
+	unsigned int i;
+
+	plan_tests(ARRAY_SIZE(threads) * 3 + 3);
+	for (i = 0; i < BUFSIZE; i++)
+		buf[i] = i * 11 + (i >> 12);
+
+	c32c = crc32c(0x1234, buf, BUFSIZE);
+	c32ieee = crc32_ieee(0x1234, buf, BUFSIZE);
+	c64 = crc64_iso(0x1234, buf, BUFSIZE);
+	for (i = 0; i < ARRAY_SIZE(threads); i++) {
+		ok1(crc32c_parallel(0x1234, buf, BUFSIZE, threads[i]) == c32c);
+		ok1(crc32_ieee_parallel(0x1234, buf, BUFSIZE, threads[i])
+		    == c32ieee);
+		ok1(crc64_iso_parallel(0x1234, buf, BUFSIZE, threads[i]) == c64);
+	}
+
+	/* Small ones, and empty ones, just work. */
+	ok1(crc32c_parallel(0, buf, 100, 4) == crc32c(0, buf, 100));
+	ok1(crc64_iso_parallel(7, buf, 0, 4) == 7);
+	ok1(crc32_ieee_parallel(0, "123456789", 9, 0) == 0xCBF43926);
+
+	free(buf);
+	return exit_status();
+}
@@ -0,0 +1,734 @@
+/* Licensed under LGPLv2.1+ - see LICENSE file for details */
+#include <ccan/crcdelta/crcdelta.h>
+#include <ccan/crcsync/crcsync.h>
+#include <ccan/crc/crc.h>
+#include <ccan/bdelta/bdelta.h>
+#include <ccan/endian/endian.h>
+#include <ccan/read_write_all/read_write_all.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+/*
+ * Signature: the header, then a leint64_t crc per block, then the length
+ * of the old file as a leint64_t (we don't know it until the end).
+ *
+ * Delta: DELTA_MAGIC, varint block size, varint old length, then
+ * records, each starting with an enum delta_op byte:
+ *	OP_COPY: varint first block, varint number of blocks.
+ *	OP_LITERAL: varint length, then the bytes.
+ *	OP_PATCH: varint length, varint patch length, then a bdelta patch
+ *		  against the last CRCDELTA_WINDOW bytes of output.
+ *	OP_END: leint64_t crc64_iso of the whole new file.
+ * Varints are little-endian, 7 bits per byte, top bit set if more follow.
+ */
+#define SIG_MAGIC "CRCSIG01"
+#define DELTA_MAGIC "CRCDLT01"
+
+/* Sanity limit: we allocate a block on each side. */
+#define MAX_BLOCK_SIZE (1 << 30)
+
+enum delta_op {
+	OP_END = 0,
+	OP_COPY = 1,
+	OP_LITERAL = 2,
+	OP_PATCH = 3
+};
+
+struct sig_header {
+	char magic[8];
+	leint64_t block_size;
+	leint64_t crcbits;
+};
+
+/* Like read_all(), but stopping early at EOF is fine. */
+static ssize_t read_upto(int fd, void *data, size_t size)
+{
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t r = read(fd, (char *)data + done, size - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -1;
+		if (r == 0)
+			break;
+		done += r;
+	}
+	return done;
+}
+
+static bool pread_all(int fd, void *data, size_t size, uint64_t off)
+{
+	while (size) {
+		ssize_t r = pread(fd, data, size, off);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return false;
+		/* The old file is shorter than when we signed it. */
+		if (r == 0) {
+			errno = EINVAL;
+			return false;
+		}
+		data = (char *)data + r;
+		size -= r;
+		off += r;
+	}
+	return true;
+}
+
+/* We write through this, rather than a write() per record. */
+struct out {
+	int fd;
+	size_t used;
+	uint8_t buf[65536];
+};
+
+static bool out_flush(struct out *out)
+{
+	bool ok = write_all(out->fd, out->buf, out->used);
+	out->used = 0;
+	return ok;
+}
+
+static bool out_write(struct out *out, const void *data, size_t len)
+{
+	if (out->used + len > sizeof(out->buf)) {
+		if (!out_flush(out))
+			return false;
+		if (len > sizeof(out->buf))
+			return write_all(out->fd, data, len);
+	}
+	memcpy(out->buf + out->used, data, len);
+	out->used += len;
+	return true;
+}
+
+static bool out_byte(struct out *out, uint8_t b)
+{
+	return out_write(out, &b, 1);
+}
+
+static size_t varint_len(uint64_t v)
+{
+	size_t len = 1;
+
+	while (v >= 0x80) {
+		v >>= 7;
+		len++;
+	}
+	return len;
+}
+
+static bool out_varint(struct out *out, uint64_t v)
+{
+	uint8_t b[10];
+	size_t len = 0;
+
+	while (v >= 0x80) {
+		b[len++] = (v & 0x7F) | 0x80;
+		v >>= 7;
+	}
+	b[len++] = v;
+	return out_write(out, b, len);
+}
+
+static bool out_le64(struct out *out, uint64_t v)
+{
+	leint64_t le = cpu_to_le64(v);
+	return out_write(out, &le, sizeof(le));
+}
+
+/* And read through this. */
+struct in {
+	int fd;
+	size_t start, end;
+	uint8_t buf[65536];
+};
+
+/* Running out of delta is an invalid delta. */
+static bool in_read(struct in *in, void *data, size_t len)
+{
+	while (len) {
+		size_t n = in->end - in->start;
+		ssize_t r;
+
+		if (n) {
+			if (n > len)
+				n = len;
+			memcpy(data, in->buf + in->start, n);
+			in->start += n;
+			data = (char *)data + n;
+			len -= n;
+			continue;
+		}
+		r = read_upto(in->fd, in->buf, sizeof(in->buf));
+		if (r < 0)
+			return false;
+		if (r == 0) {
+			errno = EINVAL;
+			return false;
+		}
+		in->start = 0;
+		in->end = r;
+	}
+	return true;
+}
+
+static bool in_varint(struct in *in, uint64_t *v)
+{
+	unsigned int shift;
+	uint8_t b;
+
+	*v = 0;
+	for (shift = 0; shift < 64; shift += 7) {
+		if (!in_read(in, &b, 1))
+			return false;
+		*v |= (uint64_t)(b & 0x7F) << shift;
+		if (!(b & 0x80))
+			return true;
+	}
+	errno = EINVAL;
+	return false;
+}
+
+/* The last CRCDELTA_WINDOW bytes of output, which both ends have.  We
+ * keep up to twice that, so we only move it down occasionally. */
+struct window {
+	size_t len;
+	uint8_t buf[CRCDELTA_WINDOW * 2];
+};
+
+static void window_add(struct window *w, const uint8_t *data, size_t len)
+{
+	if (len >= CRCDELTA_WINDOW) {
+		memcpy(w->buf, data + len - CRCDELTA_WINDOW, CRCDELTA_WINDOW);
+		w->len = CRCDELTA_WINDOW;
+		return;
+	}
+	if (w->len + len > sizeof(w->buf)) {
+		size_t keep = CRCDELTA_WINDOW - len;
+		memmove(w->buf, w->buf + w->len - keep, keep);
+		w->len = keep;
+	}
+	memcpy(w->buf + w->len, data, len);
+	w->len += len;
+}
+
+static const uint8_t *window_get(const struct window *w, size_t *len)
+{
+	*len = w->len < CRCDELTA_WINDOW ? w->len : CRCDELTA_WINDOW;
+	return w->buf + w->len - *len;
+}
+
+bool crcdelta_signature(int oldfd, size_t block_size, unsigned int crcbits,
+			int sigfd)
+{
+	struct sig_header hdr;
+	struct out *out;
+	uint8_t *block;
+	uint64_t len = 0;
+	bool ok;
+
+	if (block_size == 0 || block_size > MAX_BLOCK_SIZE
+	    || crcbits == 0 || crcbits > 64) {
+		errno = EINVAL;
+		return false;
+	}
+
+	out = malloc(sizeof(*out));
+	block = malloc(block_size);
+	if (!out || !block) {
+		free(out);
+		free(block);
+		return false;
+	}
+	out->fd = sigfd;
+	out->used = 0;
+
+	memcpy(hdr.magic, SIG_MAGIC, sizeof(hdr.magic));
+	hdr.block_size = cpu_to_le64(block_size);
+	hdr.crcbits = cpu_to_le64(crcbits);
+	ok = out_write(out, &hdr, sizeof(hdr));
+
+	while (ok) {
+		ssize_t n = read_upto(oldfd, block, block_size);
+		uint64_t crc;
+
+		if (n <= 0) {
+			ok = (n == 0);
+			break;
+		}
+		crc_of_blocks(block, n, block_size, crcbits, &crc);
+		ok = out_le64(out, crc);
+		len += n;
+		if ((size_t)n < block_size)
+			break;
+	}
+
+	ok = ok && out_le64(out, len) && out_flush(out);
+	free(block);
+	free(out);
+	return ok;
+}
+
+struct crcdelta_sig *crcdelta_sig_read(int sigfd)
+{
+	struct sig_header hdr;
+	struct crcdelta_sig *sig;
+	size_t num = 0, max = 1024;
+	uint64_t block_size, crcbits, i;
+	leint64_t *raw;
+
+	if (!read_all(sigfd, &hdr, sizeof(hdr)))
+		goto inval;
+	block_size = le64_to_cpu(hdr.block_size);
+	crcbits = le64_to_cpu(hdr.crcbits);
+	if (memcmp(hdr.magic, SIG_MAGIC, sizeof(hdr.magic))
+	    || block_size == 0 || block_size > MAX_BLOCK_SIZE
+	    || crcbits == 0 || crcbits > 64)
+		goto inval;
+
+	/* Read all the rest: the last one is the length. */
+	raw = malloc(max * sizeof(raw[0]));
+	if (!raw)
+		return NULL;
+	for (;;) {
+		ssize_t n;
+
+		if (num == max) {
+			leint64_t *newraw = realloc(raw, max * 2 * sizeof(raw[0]));
+			if (!newraw) {
+				free(raw);
+				return NULL;
+			}
+			raw = newraw;
+			max *= 2;
+		}
+		n = read_upto(sigfd, (char *)(raw + num),
+			      (max - num) * sizeof(raw[0]));
+		if (n < 0) {
+			free(raw);
+			return NULL;
+		}
+		if (n % sizeof(raw[0])) {
+			free(raw);
+			goto inval;
+		}
+		num += n / sizeof(raw[0]);
+		if (num < max)
+			break;
+	}
+
+	sig = malloc(sizeof(*sig));
+	if (!sig || num == 0) {
+		free(raw);
+		free(sig);
+		if (num == 0)
+			goto inval;
+		return NULL;
+	}
+	sig->block_size = block_size;
+	sig->crcbits = crcbits;
+	sig->len = le64_to_cpu(raw[num - 1]);
+	sig->num_crcs = num - 1;
+	if (sig->len / block_size + (sig->len % block_size != 0)
+	    != sig->num_crcs) {
+		free(raw);
+		free(sig);
+		goto inval;
+	}
+
+	/* Convert in place. */
+	sig->crcs = (uint64_t *)raw;
+	for (i = 0; i < sig->num_crcs; i++)
+		sig->crcs[i] = le64_to_cpu(raw[i]);
+	return sig;
+
+inval:
+	errno = EINVAL;
+	return NULL;
+}
+
+void crcdelta_sig_free(struct crcdelta_sig *sig)
+{
+	if (!sig)
+		return;
+	free(sig->crcs);
+	free(sig);
+}
+
+/* Everything the sending side keeps: all bounded by the block size and
+ * CRCDELTA_CHUNK. */
+struct sender {
+	const struct crcdelta_sig *sig;
+	struct crc_context *ctx;
+	struct out out;
+	struct window win;
+
+	/* Bytes crc_read_block() has seen, but not told us about. */
+	uint8_t *pending;
+	size_t pending_len;
+
+	/* Literal bytes not yet sent. */
+	uint8_t lit[CRCDELTA_CHUNK];
+	size_t lit_len;
+
+	/* Run of matched blocks not yet sent. */
+	uint64_t copy_start, copy_count;
+};
+
+static bool send_copy(struct sender *s)
+{
+	bool ok;
+
+	if (!s->copy_count)
+		return true;
+	ok = out_byte(&s->out, OP_COPY)
+		&& out_varint(&s->out, s->copy_start)
+		&& out_varint(&s->out, s->copy_count);
+	s->copy_count = 0;
+	return ok;
+}
+
+/* Send literal bytes as a patch against the window, if that's smaller. */
+static bool send_literal(struct sender *s)
+{
+	const uint8_t *w;
+	size_t wlen, psize;
+	void *patch = NULL;
+	bool ok;
+
+	if (!s->lit_len)
+		return true;
+
+	w = window_get(&s->win, &wlen);
+	if (wlen
+	    && bdelta_diff_flags(w, wlen, s->lit, s->lit_len, &patch, &psize,
+				 BDELTA_LINEAR)
+	       == BDELTA_OK
+	    && varint_len(psize) + psize < s->lit_len) {
+		ok = out_byte(&s->out, OP_PATCH)
+			&& out_varint(&s->out, s->lit_len)
+			&& out_varint(&s->out, psize)
+			&& out_write(&s->out, patch, psize);
+	} else {
+		ok = out_byte(&s->out, OP_LITERAL)
+			&& out_varint(&s->out, s->lit_len)
+			&& out_write(&s->out, s->lit, s->lit_len);
+	}
+	free(patch);
+
+	window_add(&s->win, s->lit, s->lit_len);
+	s->lit_len = 0;
+	return ok;
+}
+
+static bool add_literal(struct sender *s, const uint8_t *data, size_t len)
+{
+	if (!send_copy(s))
+		return false;
+
+	while (len) {
+		size_t n = CRCDELTA_CHUNK - s->lit_len;
+		if (n > len)
+			n = len;
+		memcpy(s->lit + s->lit_len, data, n);
+		s->lit_len += n;
+		data += n;
+		len -= n;
+		if (s->lit_len == CRCDELTA_CHUNK && !send_literal(s))
+			return false;
+	}
+	return true;
+}
+
+static bool add_match(struct sender *s, uint64_t block,
+		      const uint8_t *data, size_t len)
+{
+	if (!send_literal(s))
+		return false;
+
+	window_add(&s->win, data, len);
+	if (s->copy_count && block == s->copy_start + s->copy_count) {
+		s->copy_count++;
+		return true;
+	}
+	if (!send_copy(s))
+		return false;
+	s->copy_start = block;
+	s->copy_count = 1;
+	return true;
+}
+
+/* Act on a result from crc_read_block() or crc_read_flush(). */
+static bool handle_result(struct sender *s, long res)
+{
+	if (res > 0) {
+		if (!add_literal(s, s->pending, res))
+			return false;
+		s->pending_len -= res;
+		memmove(s->pending, s->pending + res, s->pending_len);
+	} else if (res < 0) {
+		uint64_t block = -res - 1;
+		size_t len = s->sig->block_size;
+
+		if (block == s->sig->num_crcs - 1 && s->sig->len % len)
+			len = s->sig->len % len;
+		/* Any literal bytes before it were reported first. */
+		if (s->pending_len != len) {
+			errno = EINVAL;
+			return false;
+		}
+		if (!add_match(s, block, s->pending, len))
+			return false;
+		s->pending_len = 0;
+	}
+	return true;
+}
+
+bool crcdelta_delta(const struct crcdelta_sig *sig, int newfd, int deltafd)
+{
+	struct sender *s;
+	uint8_t *buf;
+	uint64_t crc = 0;
+	long res;
+	bool ok;
+
+	s = malloc(sizeof(*s));
+	buf = malloc(CRCDELTA_CHUNK);
+	if (!s || !buf) {
+		free(s);
+		free(buf);
+		return false;
+	}
+	s->sig = sig;
+	s->ctx = NULL;
+	s->out.fd = deltafd;
+	s->out.used = 0;
+	s->win.len = 0;
+	s->pending = malloc(sig->block_size + CRCDELTA_CHUNK);
+	s->pending_len = 0;
+	s->lit_len = 0;
+	s->copy_count = 0;
+	ok = (s->pending != NULL);
+
+	/* With no old blocks, everything is a literal. */
+	if (ok && sig->num_crcs) {
+		s->ctx = crc_context_new(sig->block_size, sig->crcbits,
+					 sig->crcs, sig->num_crcs,
+					 sig->len % sig->block_size);
+		ok = (s->ctx != NULL);
+	}
+
+	ok = ok && out_write(&s->out, DELTA_MAGIC, strlen(DELTA_MAGIC))
+		&& out_varint(&s->out, sig->block_size)
+		&& out_varint(&s->out, sig->len);
+
+	while (ok) {
+		ssize_t n = read_upto(newfd, buf, CRCDELTA_CHUNK);
+		size_t off;
+
+		if (n <= 0) {
+			ok = (n == 0);
+			break;
+		}
+		crc = crc64_iso(crc, buf, n);
+		if (!s->ctx) {
+			ok = add_literal(s, buf, n);
+			continue;
+		}
+		for (off = 0; ok && off < (size_t)n; ) {
+			size_t used = crc_read_block(s->ctx, &res, buf + off,
+						     n - off);
+			memcpy(s->pending + s->pending_len, buf + off, used);
+			s->pending_len += used;
+			off += used;
+			ok = handle_result(s, res);
+		}
+	}
+
+	if (s->ctx) {
+		while (ok && (res = crc_read_flush(s->ctx)) != 0)
+			ok = handle_result(s, res);
+	}
+
+	ok = ok && send_literal(s) && send_copy(s)
+		&& out_byte(&s->out, OP_END)
+		&& out_le64(&s->out, crc)
+		&& out_flush(&s->out);
+
+	crc_context_free(s->ctx);
+	free(s->pending);
+	free(s);
+	free(buf);
+	return ok;
+}
+
+/* The receiving side. */
+struct receiver {
+	struct in in;
+	struct out out;
+	struct window win;
+	uint64_t crc;
+	uint8_t lit[CRCDELTA_CHUNK];
+	uint8_t patch[CRCDELTA_CHUNK];
+};
+
+static bool emit(struct receiver *r, const uint8_t *data, size_t len)
+{
+	r->crc = crc64_iso(r->crc, data, len);
+	window_add(&r->win, data, len);
+	return out_write(&r->out, data, len);
+}
+
+static bool apply_copy(struct receiver *r, int oldfd, uint8_t *block,
+		       size_t block_size, uint64_t old_len)
+{
+	uint64_t start, count, num_blocks, i;
+
+	num_blocks = old_len / block_size + (old_len % block_size != 0);
+	if (!in_varint(&r->in, &start) || !in_varint(&r->in, &count))
+		return false;
+	if (start >= num_blocks || count > num_blocks - start) {
+		errno = EINVAL;
+		return false;
+	}
+
+	for (i = start; i < start + count; i++) {
+		uint64_t off = i * block_size;
+		size_t len = block_size;
+
+		if (old_len - off < len)
+			len = old_len - off;
+		if (!pread_all(oldfd, block, len, off) || !emit(r, block, len))
+			return false;
+	}
+	return true;
+}
+
+static bool apply_literal(struct receiver *r)
+{
+	uint64_t len;
+
+	if (!in_varint(&r->in, &len))
+		return false;
+	if (len > CRCDELTA_CHUNK) {
+		errno = EINVAL;
+		return false;
+	}
+	return in_read(&r->in, r->lit, len) && emit(r, r->lit, len);
+}
+
+static bool apply_patch(struct receiver *r)
+{
+	uint64_t len, psize;
+	const uint8_t *w;
+	size_t wlen, outlen;
+	void *out;
+	bool ok;
+
+	if (!in_varint(&r->in, &len) || !in_varint(&r->in, &psize))
+		return false;
+	/* We only send patches smaller than the literal. */
+	if (len > CRCDELTA_CHUNK || psize >= len) {
+		errno = EINVAL;
+		return false;
+	}
+	if (!in_read(&r->in, r->patch, psize))
+		return false;
+
+	w = window_get(&r->win, &wlen);
+	switch (bdelta_patch(w, wlen, r->patch, psize, &out, &outlen)) {
+	case BDELTA_OK:
+		break;
+	case BDELTA_MEMORY:
+		errno = ENOMEM;
+		return false;
+	default:
+		errno = EINVAL;
+		return false;
+	}
+	if (outlen != len) {
+		free(out);
+		errno = EINVAL;
+		return false;
+	}
+	ok = emit(r, out, outlen);
+	free(out);
+	return ok;
+}
+
+bool crcdelta_patch(int oldfd, int deltafd, int newfd)
+{
+	struct receiver *r;
+	char magic[sizeof(DELTA_MAGIC) - 1];
+	uint64_t block_size, old_len;
+	uint8_t *block = NULL;
+	bool ok;
+
+	r = malloc(sizeof(*r));
+	if (!r)
+		return false;
+	r->in.fd = deltafd;
+	r->in.start = r->in.end = 0;
+	r->out.fd = newfd;
+	r->out.used = 0;
+	r->win.len = 0;
+	r->crc = 0;
+
+	ok = in_read(&r->in, magic, sizeof(magic))
+		&& in_varint(&r->in, &block_size)
+		&& in_varint(&r->in, &old_len);
+	if (ok && (memcmp(magic, DELTA_MAGIC, sizeof(magic)) != 0
+		   || block_size == 0 || block_size > MAX_BLOCK_SIZE)) {
+		errno = EINVAL;
+		ok = false;
+	}
+	if (ok) {
+		block = malloc(block_size);
+		ok = (block != NULL);
+	}
+
+	while (ok) {
+		uint8_t op;
+		leint64_t crc;
+
+		if (!in_read(&r->in, &op, 1)) {
+			ok = false;
+			break;
+		}
+		switch (op) {
+		case OP_COPY:
+			ok = apply_copy(r, oldfd, block, block_size, old_len);
+			continue;
+		case OP_LITERAL:
+			ok = apply_literal(r);
+			continue;
+		case OP_PATCH:
+			ok = apply_patch(r);
+			continue;
+		case OP_END:
+			ok = in_read(&r->in, &crc, sizeof(crc))
+				&& out_flush(&r->out);
+			if (ok && le64_to_cpu(crc) != r->crc) {
+				errno = EINVAL;
+				ok = false;
+			}
+			break;
+		default:
+			errno = EINVAL;
+			ok = false;
+			break;
+		}
+		break;
+	}
+
+	free(block);
+	free(r);
+	return ok;
+}
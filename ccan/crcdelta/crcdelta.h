@@ -0,0 +1,90 @@
+/* Licensed under LGPLv2.1+ - see LICENSE file for details */
+#ifndef CCAN_CRCDELTA_H
+#define CCAN_CRCDELTA_H
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Literal data is sent in pieces of at most this size, each one as a
+ * bdelta patch against (at most) this much of the preceding output. */
+#define CRCDELTA_CHUNK 65536
+#define CRCDELTA_WINDOW 65536
+
+/**
+ * struct crcdelta_sig - the block crcs of the old file.
+ * @block_size: the size of each block (the last may be shorter)
+ * @crcbits: the number of bits in each crc
+ * @len: the length of the old file
+ * @num_crcs: the number of blocks
+ * @crcs: the crc of each block, as crc_of_blocks() gives.
+ */
+struct crcdelta_sig {
+	size_t block_size;
+	unsigned int crcbits;
+	uint64_t len;
+	size_t num_crcs;
+	uint64_t *crcs;
+};
+
+/**
+ * crcdelta_signature - write the signature of an old file
+ * @oldfd: the file descriptor to read the old file from
+ * @block_size: the block size to use
+ * @crcbits: the number of crc bits to keep per block (<= 64)
+ * @sigfd: the file descriptor to write the signature to
+ *
+ * This reads @oldfd a block at a time, so it works on pipes.  The
+ * signature is 8 bytes per block, plus a small header.
+ *
+ * Returns false (with errno set) on failure.
+ */
+bool crcdelta_signature(int oldfd, size_t block_size, unsigned int crcbits,
+			int sigfd);
+
+/**
+ * crcdelta_sig_read - read a signature written by crcdelta_signature()
+ * @sigfd: the file descriptor to read from
+ *
+ * Returns a malloc'd signature, or NULL (with errno set); EINVAL means
+ * it wasn't a valid signature.  Free it with crcdelta_sig_free().
+ */
+struct crcdelta_sig *crcdelta_sig_read(int sigfd);
+
+/**
+ * crcdelta_sig_free - free a signature from crcdelta_sig_read()
+ * @sig: the signature, or NULL.
+ */
+void crcdelta_sig_free(struct crcdelta_sig *sig);
+
+/**
+ * crcdelta_delta - write a delta from the old file to a new one
+ * @sig: the signature of the old file
+ * @newfd: the file descriptor to read the new file from
+ * @deltafd: the file descriptor to write the delta to
+ *
+ * The new file is read sequentially, and the delta written sequentially,
+ * so either can be a pipe or a socket.  Blocks found in the old file are
+ * sent as references to it; other data is sent as a bdelta patch against
+ * the recent output when that's smaller, otherwise as is.  Memory use is
+ * bounded by the block size and CRCDELTA_CHUNK, not the file sizes.
+ *
+ * The delta ends with a crc64 of the new file, so crcdelta_patch() can
+ * detect a block whose crc matched but whose contents didn't.
+ *
+ * Returns false (with errno set) on failure.
+ */
+bool crcdelta_delta(const struct crcdelta_sig *sig, int newfd, int deltafd);
+
+/**
+ * crcdelta_patch - rebuild the new file from the old one and a delta
+ * @oldfd: the file descriptor of the old file (read with pread())
+ * @deltafd: the file descriptor to read the delta from
+ * @newfd: the file descriptor to write the new file to
+ *
+ * @deltafd is read sequentially and @newfd written sequentially.
+ * Returns false (with errno set) on failure: EINVAL means the delta is
+ * corrupt, or wasn't made against this old file.  @newfd may have been
+ * partially written.
+ */
+bool crcdelta_patch(int oldfd, int deltafd, int newfd);
+#endif /* CCAN_CRCDELTA_H */
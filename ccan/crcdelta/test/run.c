@@ -0,0 +1,157 @@
+#include <ccan/crcdelta/crcdelta.h>
+#include <ccan/crcdelta/crcdelta.c>
+#include <ccan/tap/tap.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#define BLOCK_SIZE 1024
+
+static int tmpfile_with(const void *data, size_t len)
+{
+	char name[] = "run-crcdelta.XXXXXX";
+	int fd = mkstemp(name);
+
+	unlink(name);
+	write_all(fd, data, len);
+	lseek(fd, 0, SEEK_SET);
+	return fd;
+}
+
+static char *file_contents(int fd, size_t *len)
+{
+	struct stat st;
+	char *p;
+
+	fstat(fd, &st);
+	p = malloc(st.st_size + 1);
+	*len = pread(fd, p, st.st_size, 0);
+	return p;
+}
+
+/* Signature, delta and patch: returns the delta size, or -1 on failure. */
+static ssize_t sync_ok(const void *old, size_t oldlen,
+		       const void *new, size_t newlen, unsigned int crcbits)
+{
+	int oldfd = tmpfile_with(old, oldlen), newfd = tmpfile_with(new, newlen);
+	int sigfd = tmpfile_with(NULL, 0), deltafd = tmpfile_with(NULL, 0);
+	int outfd = tmpfile_with(NULL, 0);
+	struct crcdelta_sig *sig;
+	ssize_t ret = -1;
+	size_t len;
+	char *p;
+
+	if (!crcdelta_signature(oldfd, BLOCK_SIZE, crcbits, sigfd))
+		goto out;
+	lseek(sigfd, 0, SEEK_SET);
+	sig = crcdelta_sig_read(sigfd);
+	if (!sig || sig->len != oldlen)
+		goto out;
+	if (!crcdelta_delta(sig, newfd, deltafd))
+		goto out;
+	crcdelta_sig_free(sig);
+	lseek(deltafd, 0, SEEK_SET);
+	if (!crcdelta_patch(oldfd, deltafd, outfd))
+		goto out;
+
+	p = file_contents(outfd, &len);
+	if (len == newlen && memcmp(p, new, len) == 0)
+		free(file_contents(deltafd, (size_t *)&ret));
+	free(p);
+out:
+	close(oldfd);
+	close(newfd);
+	close(sigfd);
+	close(deltafd);
+	close(outfd);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t oldlen = 300 * BLOCK_SIZE + 17, newlen;
+	char *old = malloc(oldlen), *new = malloc(oldlen * 2);
+	int oldfd, newfd, deltafd, outfd, sigfd;
+	struct crcdelta_sig *sig;
+	ssize_t dsize;
+	size_t i;
+
+	plan_tests(14);
+	for (i = 0; i < oldlen; i++)
+		old[i] = random();
+
+	/* Identical: just block references. */
+	dsize = sync_ok(old, oldlen, old, oldlen, 64);
+	ok1(dsize > 0 && dsize < 64);
+
+	/* Some insertions, a deletion, and blocks moved around. */
+	newlen = 0;
+	memcpy(new, old + 100 * BLOCK_SIZE, 50 * BLOCK_SIZE);
+	newlen += 50 * BLOCK_SIZE;
+	memcpy(new + newlen, "inserted", 8);
+	newlen += 8;
+	memcpy(new + newlen, old, 100 * BLOCK_SIZE + 3);
+	newlen += 100 * BLOCK_SIZE + 3;
+	memcpy(new + newlen, old + 160 * BLOCK_SIZE, oldlen - 160 * BLOCK_SIZE);
+	newlen += oldlen - 160 * BLOCK_SIZE;
+	dsize = sync_ok(old, oldlen, new, newlen, 64);
+	ok1(dsize > 0 && dsize < 4 * BLOCK_SIZE);
+
+	/* New data which nearly repeats the last chunk: sent as a patch. */
+	for (i = 0; i < CRCDELTA_CHUNK; i++)
+		new[i] = random();
+	memcpy(new + CRCDELTA_CHUNK, new, CRCDELTA_CHUNK);
+	new[CRCDELTA_CHUNK + 2500] ^= 1;
+	new[CRCDELTA_CHUNK + 60000] ^= 1;
+	dsize = sync_ok(old, oldlen, new, CRCDELTA_CHUNK * 2, 64);
+	ok1(dsize > 0 && dsize < CRCDELTA_CHUNK + 100);
+
+	/* Empty files, at either end. */
+	ok1(sync_ok(old, 0, new, 4000, 64) > 0);
+	ok1(sync_ok(old, oldlen, new, 0, 64) > 0);
+	ok1(sync_ok(old, 0, new, 0, 64) > 0);
+
+	/* More new data than the window and chunk sizes. */
+	for (i = 0; i < oldlen * 2; i++)
+		new[i] = random();
+	ok1(sync_ok(old, oldlen, new, oldlen * 2, 64) > (ssize_t)oldlen * 2);
+
+	/* Few crc bits means false matches: the final crc catches those. */
+	memcpy(new, old, oldlen);
+	for (i = 0; i < oldlen; i += BLOCK_SIZE)
+		new[i + 5] ^= 0x80;
+	ok1(sync_ok(old, oldlen, new, oldlen, 64) > 0);
+	ok1(sync_ok(old, oldlen, new, oldlen, 1) == -1 && errno == EINVAL);
+
+	/* Patching the wrong old file fails. */
+	oldfd = tmpfile_with(old, oldlen);
+	sigfd = tmpfile_with(NULL, 0);
+	deltafd = tmpfile_with(NULL, 0);
+	outfd = tmpfile_with(NULL, 0);
+	ok1(crcdelta_signature(oldfd, BLOCK_SIZE, 64, sigfd));
+	lseek(sigfd, 0, SEEK_SET);
+	sig = crcdelta_sig_read(sigfd);
+	newfd = tmpfile_with(old, oldlen);
+	ok1(crcdelta_delta(sig, newfd, deltafd));
+	close(newfd);
+	crcdelta_sig_free(sig);
+	close(oldfd);
+	oldfd = tmpfile_with(new, oldlen);
+	lseek(deltafd, 0, SEEK_SET);
+	ok1(!crcdelta_patch(oldfd, deltafd, outfd) && errno == EINVAL);
+
+	/* So does a truncated delta, or a bad signature. */
+	ftruncate(deltafd, 20);
+	lseek(deltafd, 0, SEEK_SET);
+	ok1(!crcdelta_patch(oldfd, deltafd, outfd) && errno == EINVAL);
+	lseek(deltafd, 0, SEEK_SET);
+	ok1(!crcdelta_sig_read(deltafd) && errno == EINVAL);
+
+	close(oldfd);
+	close(sigfd);
+	close(deltafd);
+	close(outfd);
+	free(old);
+	free(new);
+	return exit_status();
+}
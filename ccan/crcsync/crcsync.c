@@ -1,9 +1,17 @@
 /* Licensed under LGPLv2.1+ - see LICENSE file for details */
 #include "crcsync.h"
 #include <ccan/crc/crc.h>
+#include <ccan/htable/htable.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 
 /* FIXME: That 64-bit CRC takes a while to warm the lower bits.  Do
  * some quantitative tests and replace it?  Meanwhile, use upper bits. */
@@ -28,6 +36,123 @@ void crc_of_blocks(const void *data, size_t len, unsigned int block_size,
 		crc[i] = (crc64_iso(0, buf, len) & crcmask);
 }
 
+/* Below this, starting a thread costs more than it saves. */
+#define CRC_PARALLEL_MIN (1024 * 1024)
+
+struct blocks_job {
+	pthread_t thread;
+	bool threaded;
+	const void *data;
+	size_t len;
+	unsigned int block_size, crcbits;
+	uint64_t *crc;
+};
+
+static void *blocks_job_run(void *arg)
+{
+	struct blocks_job *job = arg;
+
+	crc_of_blocks(job->data, job->len, job->block_size, job->crcbits,
+		      job->crc);
+	return NULL;
+}
+
+void crc_of_blocks_parallel(const void *data, size_t len,
+			    unsigned int block_size, unsigned int crcbits,
+			    uint64_t crc[], unsigned int threads)
+{
+	struct blocks_job *jobs;
+	size_t num_blocks, per_thread;
+	unsigned int i;
+
+	if (threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? cpus : 1;
+	}
+	if (threads > len / CRC_PARALLEL_MIN)
+		threads = len / CRC_PARALLEL_MIN;
+	num_blocks = len / block_size;
+	if (threads > num_blocks)
+		threads = num_blocks;
+	if (threads <= 1
+	    || !(jobs = calloc(threads, sizeof(*jobs)))) {
+		crc_of_blocks(data, len, block_size, crcbits, crc);
+		return;
+	}
+
+	/* Whole blocks each; the last one gets any partial block. */
+	per_thread = num_blocks / threads;
+	for (i = 0; i < threads; i++) {
+		size_t first = i * per_thread;
+
+		jobs[i].data = (const uint8_t *)data + first * block_size;
+		jobs[i].len = (i == threads - 1)
+			? len - first * block_size : per_thread * block_size;
+		jobs[i].block_size = block_size;
+		jobs[i].crcbits = crcbits;
+		jobs[i].crc = crc + first;
+	}
+
+	for (i = 1; i < threads; i++)
+		jobs[i].threaded = (pthread_create(&jobs[i].thread, NULL,
+						   blocks_job_run,
+						   &jobs[i]) == 0);
+	blocks_job_run(&jobs[0]);
+	for (i = 1; i < threads; i++) {
+		if (jobs[i].threaded)
+			pthread_join(jobs[i].thread, NULL);
+		else
+			blocks_job_run(&jobs[i]);
+	}
+	free(jobs);
+}
+
+bool crc_of_file(const char *filename, unsigned int block_size,
+		 unsigned int crcbits, unsigned int threads,
+		 uint64_t **crc, size_t *len)
+{
+	struct stat st;
+	void *map;
+	int fd, saved_errno;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) != 0)
+		goto fail_close;
+
+	*len = st.st_size;
+	if (*len == 0) {
+		close(fd);
+		*crc = NULL;
+		return true;
+	}
+
+	*crc = malloc((*len / block_size + 1) * sizeof(**crc));
+	if (!*crc)
+		goto fail_close;
+
+	map = mmap(NULL, *len, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		saved_errno = errno;
+		free(*crc);
+		close(fd);
+		errno = saved_errno;
+		return false;
+	}
+	close(fd);
+
+	crc_of_blocks_parallel(map, *len, block_size, crcbits, *crc, threads);
+	munmap(map, *len);
+	return true;
+
+fail_close:
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return false;
+}
+
 struct crc_context {
 	size_t block_size;
 	uint64_t crcmask;
@@ -46,8 +171,15 @@ struct crc_context {
 	size_t tail_size;
 	uint64_t tail_crc;
 
-	/* Uncrc tab. */
+	/* Uncrc tab, and the crc64 table for adding bytes. */
 	uint64_t uncrc_tab[256];
+	const uint64_t *crc_tab;
+
+	/* The crcs, so we don't search them all for every byte: a filter
+	 * small enough to stay in cache, then a hash table. */
+	unsigned int filter_bits;
+	uint64_t *filter;
+	struct htable index;
 
 	/* This doesn't count the last CRC. */
 	unsigned int num_crcs;
@@ -55,21 +187,91 @@ struct crc_context {
 };
 
 /* Calculate the how the crc changes when we take a give char out of the
- * crc'd area. */
+ * crc'd area.  That's the crc of the char followed by wsize-1 zeroes (the
+ * zeroes themselves don't change a crc which starts at 0). */
 static void init_uncrc_tab(uint64_t uncrc_tab[], unsigned int wsize)
 {
 	unsigned int i;
-	uint64_t part_crc;
-	uint8_t buffer[wsize];
-
-	/* Calculate crc(buffer+1, wsize-1) once, since it doesn't change. */
-	memset(buffer, 0, wsize);
-	part_crc = crc64_iso(0, buffer+1, wsize-1);
 
 	for (i = 0; i < 256; i++) {
-		buffer[0] = i;
-		uncrc_tab[i] = (crc64_iso(0, buffer, wsize) ^ part_crc);
+		uint8_t c = i;
+		uncrc_tab[i] = crc64_iso_combine(crc64_iso(0, &c, 1), 0,
+						 wsize - 1);
+	}
+}
+
+/* The crcs are already well mixed, but only the top crcbits are set. */
+static size_t hash_crc(uint64_t crc)
+{
+	crc ^= crc >> 32;
+	return crc * 0x9E3779B97F4A7C15ULL >> 16;
+}
+
+static size_t rehash_crc(const void *elem, void *unused)
+{
+	return hash_crc(*(const uint64_t *)elem);
+}
+
+static bool crc_eq(const void *elem, void *crc)
+{
+	return *(const uint64_t *)elem == *(const uint64_t *)crc;
+}
+
+/* Two bits per crc, for about 1 in 20 false positives. */
+static void filter_bits(const struct crc_context *ctx, size_t h,
+			size_t *b1, size_t *b2)
+{
+	size_t mask = ((size_t)1 << ctx->filter_bits) - 1;
+
+	*b1 = h & mask;
+	*b2 = (h >> ctx->filter_bits) & mask;
+}
+
+static void filter_add(struct crc_context *ctx, size_t h)
+{
+	size_t b1, b2;
+
+	filter_bits(ctx, h, &b1, &b2);
+	ctx->filter[b1 / 64] |= (uint64_t)1 << (b1 % 64);
+	ctx->filter[b2 / 64] |= (uint64_t)1 << (b2 % 64);
+}
+
+static bool filter_test(const struct crc_context *ctx, size_t h)
+{
+	size_t b1, b2;
+
+	filter_bits(ctx, h, &b1, &b2);
+	return (ctx->filter[b1 / 64] & ((uint64_t)1 << (b1 % 64)))
+		&& (ctx->filter[b2 / 64] & ((uint64_t)1 << (b2 % 64)));
+}
+
+static bool index_crcs(struct crc_context *ctx)
+{
+	unsigned int i;
+
+	/* About 8 bits per crc, and at least one word. */
+	ctx->filter_bits = 6;
+	while (((size_t)1 << ctx->filter_bits) < (size_t)ctx->num_crcs * 8)
+		ctx->filter_bits++;
+	ctx->filter = calloc(((size_t)1 << ctx->filter_bits) / 64,
+			     sizeof(ctx->filter[0]));
+	if (!ctx->filter)
+		return false;
+
+	if (!htable_reserve(&ctx->index, ctx->num_crcs))
+		return false;
+
+	for (i = 0; i < ctx->num_crcs; i++) {
+		size_t h = hash_crc(ctx->crc[i]);
+
+		/* If there are duplicates, the first one wins. */
+		if (htable_get(&ctx->index, h, crc_eq, &ctx->crc[i]))
+			continue;
+		if (!htable_add(&ctx->index, h, &ctx->crc[i]))
+			return false;
+		filter_add(ctx, h);
 	}
+	return true;
 }
 
 struct crc_context *crc_context_new(size_t block_size, unsigned crcbits,
@@ -99,9 +301,12 @@ struct crc_context *crc_context_new(size_t block_size, unsigned crcbits,
 		ctx->total_bytes = 0;
 		ctx->have_match = -1;
 		init_uncrc_tab(ctx->uncrc_tab, block_size);
+		ctx->crc_tab = crc64_iso_table();
+		ctx->filter = NULL;
+		htable_init(&ctx->index, rehash_crc, NULL);
 		ctx->buffer = malloc(block_size);
-		if (!ctx->buffer) {
-			free(ctx);
+		if (!ctx->buffer || !ctx->crc_tab || !index_crcs(ctx)) {
+			crc_context_free(ctx);
 			ctx = NULL;
 		}
 	}
@@ -111,15 +316,21 @@ struct crc_context *crc_context_new(size_t block_size, unsigned crcbits,
 /* Return -1 or index into matching crc. */
 static int crc_matches(const struct crc_context *ctx)
 {
-	unsigned int i;
+	uint64_t crc = ctx->running_crc & ctx->crcmask;
+	const uint64_t *match;
+	size_t h;
 
 	if (ctx->literal_bytes < ctx->block_size)
 		return -1;
 
-	for (i = 0; i < ctx->num_crcs; i++)
-		if ((ctx->running_crc & ctx->crcmask) == ctx->crc[i])
-			return i;
-	return -1;
+	h = hash_crc(crc);
+	if (!filter_test(ctx, h))
+		return -1;
+
+	match = htable_get(&ctx->index, h, crc_eq, &crc);
+	if (!match)
+		return -1;
+	return match - ctx->crc;
 }
 
 static bool tail_matches(const struct crc_context *ctx)
@@ -130,9 +341,11 @@ static bool tail_matches(const struct crc_context *ctx)
 	return (ctx->running_crc & ctx->crcmask) == ctx->tail_crc;
 }
 
-static uint64_t crc_add_byte(uint64_t crc, uint8_t newbyte)
+/* Straight from the table: crc64_iso() is slow for a single byte. */
+static uint64_t crc_add_byte(uint64_t crc, uint8_t newbyte,
+			     const uint64_t crc_tab[])
 {
-	return crc64_iso(crc, &newbyte, 1);
+	return crc_tab[(crc ^ newbyte) & 0xFF] ^ (crc >> 8);
 }
 
 static uint64_t crc_remove_byte(uint64_t crc, uint8_t oldbyte,
@@ -142,9 +355,10 @@ static uint64_t crc_remove_byte(uint64_t crc, uint8_t oldbyte,
 }
 
 static uint64_t crc_roll(uint64_t crc, uint8_t oldbyte, uint8_t newbyte,
-			 const uint64_t uncrc_tab[])
+			 const uint64_t uncrc_tab[], const uint64_t crc_tab[])
 {
-	return crc_add_byte(crc_remove_byte(crc, oldbyte, uncrc_tab), newbyte);
+	return crc_add_byte(crc_remove_byte(crc, oldbyte, uncrc_tab), newbyte,
+			    crc_tab);
 }
 
 static size_t buffer_size(const struct crc_context *ctx)
@@ -185,13 +399,15 @@ size_t crc_read_block(struct crc_context *ctx, long *result,
 		if (old) {
 			ctx->running_crc = crc_roll(ctx->running_crc,
 						    *old, *p,
-						    ctx->uncrc_tab);
+						    ctx->uncrc_tab,
+						    ctx->crc_tab);
 			old++;
 			/* End of stored buffer?  Start on data they gave us. */
 			if (old == (uint8_t *)ctx->buffer + ctx->buffer_end)
 				old = buf;
 		} else {
-			ctx->running_crc = crc_add_byte(ctx->running_crc, *p);
+			ctx->running_crc = crc_add_byte(ctx->running_crc, *p,
+							ctx->crc_tab);
 			if (p == (uint8_t *)buf + ctx->block_size - 1)
 				old = buf;
 			/* We don't roll this csum, we only look for it after
@@ -289,6 +505,10 @@ long crc_read_flush(struct crc_context *ctx)
  */
 void crc_context_free(struct crc_context *ctx)
 {
+	if (!ctx)
+		return;
+	htable_clear(&ctx->index);
+	free(ctx->filter);
 	free(ctx->buffer);
 	free(ctx);
 }
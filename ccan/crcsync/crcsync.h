@@ -3,6 +3,7 @@
 #define CCAN_CRCSYNC_H
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 /**
  * crc_of_blocks - calculate the crc of the blocks.
@@ -18,6 +19,55 @@
 void crc_of_blocks(const void *data, size_t len, unsigned int blocksize,
 		   unsigned int crcbits, uint64_t crc[]);
 
+/**
+ * crc_of_blocks_parallel - calculate the crc of the blocks, using threads.
+ * @data: pointer to the buffer to CRC
+ * @len: length of the buffer
+ * @blocksize: CRC of each block (final block may be shorter)
+ * @crcbits: the number of bits of crc you want (currently 64 maximum)
+ * @crc: the crcs (array will have (len + blocksize-1)/blocksize entries).
+ * @threads: maximum number of threads to use, or 0 for one per CPU
+ *
+ * The same as crc_of_blocks(), but each thread does a run of blocks.
+ * Each thread gets at least a megabyte, so small buffers are simply done
+ * in the caller's thread; so are any runs a thread can't be created for.
+ */
+void crc_of_blocks_parallel(const void *data, size_t len,
+			    unsigned int blocksize, unsigned int crcbits,
+			    uint64_t crc[], unsigned int threads);
+
+/**
+ * crc_of_file - calculate the crc of the blocks of a file.
+ * @filename: the file to map
+ * @blocksize: CRC of each block (final block may be shorter)
+ * @crcbits: the number of bits of crc you want (currently 64 maximum)
+ * @threads: maximum number of threads to use, or 0 for one per CPU
+ * @crc: set to a malloc'd array of (*@len + blocksize-1)/blocksize crcs.
+ * @len: set to the length of the file.
+ *
+ * This maps the file, rather than reading it, and uses
+ * crc_of_blocks_parallel().  Returns false (with errno set) on failure.
+ * For an empty file, *@crc is set to NULL.
+ *
+ * Example:
+ *	static struct crc_context *context_for(const char *filename)
+ *	{
+ *		struct crc_context *ctx;
+ *		uint64_t *crcs;
+ *		size_t len;
+ *
+ *		if (!crc_of_file(filename, 4096, 64, 0, &crcs, &len) || !len)
+ *			return NULL;
+ *		ctx = crc_context_new(4096, 64, crcs, (len + 4095) / 4096,
+ *				      len % 4096);
+ *		free(crcs);
+ *		return ctx;
+ *	}
+ */
+bool crc_of_file(const char *filename, unsigned int blocksize,
+		 unsigned int crcbits, unsigned int threads,
+		 uint64_t **crc, size_t *len);
+
 /**
  * crc_context_new - allocate and initialize state for crc_find_block
  * @blocksize: the size of each block
@@ -0,0 +1,66 @@
+#include <ccan/crcsync/crcsync.h>
+#include <ccan/crcsync/crcsync.c>
+#include <ccan/tap/tap.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define BLOCK_SIZE 64
+#define NUM_BLOCKS 5000
+
+/* The new data is the old blocks backwards, with a junk byte between. */
+static bool check(unsigned int crcbits)
+{
+	static uint8_t old[BLOCK_SIZE * NUM_BLOCKS];
+	static uint8_t new[(BLOCK_SIZE + 1) * NUM_BLOCKS];
+	static uint64_t crcs[NUM_BLOCKS];
+	struct crc_context *ctx;
+	unsigned int i, blocks = 0, junk = 0;
+	size_t used;
+	long res;
+	bool ok = true;
+
+	srandom(crcbits);
+	for (i = 0; i < sizeof(old); i++)
+		old[i] = random();
+	/* Block 7 appears again later: the first one must win. */
+	memcpy(old + BLOCK_SIZE * 4000, old + BLOCK_SIZE * 7, BLOCK_SIZE);
+
+	for (i = 0; i < NUM_BLOCKS; i++) {
+		memcpy(new + i * (BLOCK_SIZE + 1),
+		       old + (NUM_BLOCKS - 1 - i) * BLOCK_SIZE, BLOCK_SIZE);
+		new[i * (BLOCK_SIZE + 1) + BLOCK_SIZE] = random();
+	}
+
+	crc_of_blocks(old, sizeof(old), BLOCK_SIZE, crcbits, crcs);
+	ctx = crc_context_new(BLOCK_SIZE, crcbits, crcs, NUM_BLOCKS, 0);
+
+	for (used = 0; used < sizeof(new); ) {
+		used += crc_read_block(ctx, &res, new + used,
+				       sizeof(new) - used);
+		if (res < 0) {
+			unsigned int want = NUM_BLOCKS - 1 - blocks;
+			if (want == 4000)
+				want = 7;
+			if (-res - 1 != want)
+				ok = false;
+			blocks++;
+		} else
+			junk += res;
+	}
+	while ((res = crc_read_flush(ctx)) != 0)
+		junk += res;
+	crc_context_free(ctx);
+
+	return ok && blocks == NUM_BLOCKS && junk == NUM_BLOCKS;
+}
+
+int main(int argc, char *argv[])
+{
+	plan_tests(3);
+	ok1(check(64));
+	ok1(check(48));
+	/* Only the top bits are set: they must still index well. */
+	ok1(check(40));
+	return exit_status();
+}
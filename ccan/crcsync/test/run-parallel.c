@@ -0,0 +1,73 @@
+#include <ccan/crcsync/crcsync.h>
+#include <ccan/crcsync/crcsync.c>
+#include <ccan/tap/tap.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Enough for several threads' worth, plus a partial block. */
+#define BUFSIZE (5 * 1024 * 1024 + 1234)
+
+static bool same_crcs(const void *buf, size_t len, unsigned int block_size,
+		      unsigned int crcbits, unsigned int threads)
+{
+	size_t num = (len + block_size - 1) / block_size;
+	uint64_t *a = malloc((num + 1) * sizeof(*a));
+	uint64_t *b = malloc((num + 1) * sizeof(*b));
+	bool ok;
+
+	/* Make sure nothing writes past the end. */
+	a[num] = b[num] = 0xDEADBEEF;
+	crc_of_blocks(buf, len, block_size, crcbits, a);
+	crc_of_blocks_parallel(buf, len, block_size, crcbits, b, threads);
+	ok = memcmp(a, b, (num + 1) * sizeof(*a)) == 0;
+	free(a);
+	free(b);
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	char filename[] = "run-parallel.XXXXXX";
+	unsigned char *buf;
+	uint64_t *crcs, *expect;
+	size_t i, len;
+	int fd;
+
+	plan_tests(12);
+	buf = malloc(BUFSIZE);
+	for (i = 0; i < BUFSIZE; i++)
+		buf[i] = random();
+
+	ok1(same_crcs(buf, BUFSIZE, 4096, 64, 0));
+	ok1(same_crcs(buf, BUFSIZE, 4096, 32, 4));
+	ok1(same_crcs(buf, BUFSIZE, 1000, 64, 3));
+	ok1(same_crcs(buf, BUFSIZE - 1234, 4096, 64, 5));
+	/* More threads than blocks, and too small to bother with threads. */
+	ok1(same_crcs(buf, BUFSIZE, 2 * 1024 * 1024, 64, 16));
+	ok1(same_crcs(buf, 5000, 512, 64, 8));
+
+	fd = mkstemp(filename);
+	ok1(fd >= 0);
+	ok1(write(fd, buf, BUFSIZE) == BUFSIZE);
+	close(fd);
+
+	expect = malloc((BUFSIZE / 4096 + 1) * sizeof(*expect));
+	crc_of_blocks(buf, BUFSIZE, 4096, 64, expect);
+	ok1(crc_of_file(filename, 4096, 64, 4, &crcs, &len));
+	ok1(len == BUFSIZE
+	    && memcmp(crcs, expect, (BUFSIZE / 4096 + 1) * sizeof(*crcs)) == 0);
+	free(crcs);
+	free(expect);
+
+	/* An empty file has no crcs; a missing one is an error. */
+	fd = open(filename, O_TRUNC|O_WRONLY);
+	close(fd);
+	ok1(crc_of_file(filename, 4096, 64, 0, &crcs, &len)
+	    && len == 0 && crcs == NULL);
+	unlink(filename);
+	ok1(!crc_of_file(filename, 4096, 64, 0, &crcs, &len)
+	    && errno == ENOENT);
+
+	free(buf);
+	return exit_status();
+}
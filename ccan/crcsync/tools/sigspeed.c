@@ -0,0 +1,64 @@
+/* Signature (crc_of_blocks) throughput as the number of threads grows. */
+#include <ccan/crcsync/crcsync.h>
+#include <ccan/crcsync/crcsync.c>
+#include <ccan/crc/crc.c>
+#include <ccan/cpuid/cpuid.c>
+#include <ccan/htable/htable.c>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+static const unsigned int thread_counts[] = { 1, 2, 4, 8, 16 };
+
+static double time_run(const void *buf, size_t len, unsigned int block_size,
+		       uint64_t *crcs, unsigned int threads, unsigned int runs)
+{
+	struct timeval start, stop, diff;
+	unsigned int i;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < runs; i++)
+		crc_of_blocks_parallel(buf, len, block_size, 64, crcs,
+				       threads);
+	gettimeofday(&stop, NULL);
+	timersub(&stop, &start, &diff);
+	return diff.tv_sec + diff.tv_usec / 1000000.0;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t i, len, runs;
+	unsigned int t, block_size;
+	unsigned char *buf;
+	uint64_t *crcs;
+	double base = 0;
+
+	len = (argv[1] ? atol(argv[1]) : 256) * 1024 * 1024;
+	block_size = argv[1] && argv[2] ? atoi(argv[2]) : 4096;
+	runs = 4;
+
+	buf = malloc(len);
+	crcs = malloc((len / block_size + 1) * sizeof(*crcs));
+	for (i = 0; i < len; i++)
+		buf[i] = random();
+
+	/* Warm up (and fault in) everything first. */
+	crc_of_blocks(buf, len, block_size, 64, crcs);
+
+	printf("%zu MB, %u byte blocks, %ld cpus\n", len / (1024 * 1024),
+	       block_size, sysconf(_SC_NPROCESSORS_ONLN));
+	printf("threads\tMB/sec\t\tspeedup\n");
+	for (t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+		double secs = time_run(buf, len, block_size, crcs,
+				       thread_counts[t], runs);
+		double mbs = len * runs / secs / (1024 * 1024);
+
+		if (t == 0)
+			base = mbs;
+		printf("%u\t%.1f\t\t%.2f\n", thread_counts[t], mbs, mbs / base);
+	}
+	free(crcs);
+	free(buf);
+	return 0;
+}
@@ -68,6 +68,7 @@ on 1 byte), but shoehorning those bytes into integers efficiently is messy.
 #endif /* old hash.c headers. */
 
 #include "hash.h"
+#include <string.h>
 
 #if HAVE_LITTLE_ENDIAN
 #define HASH_LITTLE_ENDIAN 1
@@ -711,6 +712,204 @@ uint64_t hash64_any(const void *key, size_t length, uint64_t base)
 	return ((uint64_t)b32 << 32) | lower;
 }
 
+/*
+ * hash_fast: a 64-bit multiply-mix hash, after Wang Yi's wyhash (whose
+ * constants these are).  The step multiplies two 64-bit words into 128
+ * bits and folds the halves together, which mixes the whole of both in a
+ * few cycles; longer keys run three of these side by side.
+ */
+#define HASH_FAST_P0 0xa0761d6478bd642fULL
+#define HASH_FAST_P1 0xe7037ed1a0b428dbULL
+#define HASH_FAST_P2 0x8ebc6af09c88c6e3ULL
+#define HASH_FAST_P3 0x589965cc75374cc3ULL
+
+/* Keys longer than this may use the AES version instead. */
+#define HASH_FAST_AES_MIN 64
+
+static inline void hash_fast_mul128(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 r = (unsigned __int128)*a * *b;
+
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+#else
+	uint64_t ha = *a >> 32, la = (uint32_t)*a;
+	uint64_t hb = *b >> 32, lb = (uint32_t)*b;
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	uint64_t t = rl + (rm0 << 32), lo;
+	uint64_t carry = t < rl;
+
+	lo = t + (rm1 << 32);
+	carry += lo < t;
+	*a = lo;
+	*b = rh + (rm0 >> 32) + (rm1 >> 32) + carry;
+#endif
+}
+
+static inline uint64_t hash_fast_mix(uint64_t a, uint64_t b)
+{
+	hash_fast_mul128(&a, &b);
+	return a ^ b;
+}
+
+static inline uint64_t hash_fast_r8(const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t hash_fast_r4(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t hash64_fast_mix(const void *key, size_t length, uint64_t base)
+{
+	const unsigned char *p = key;
+	uint64_t seed = base ^ hash_fast_mix(base ^ HASH_FAST_P0, HASH_FAST_P1);
+	uint64_t a, b;
+
+	if (length <= 16) {
+		if (length >= 4) {
+			/* Two overlapping pairs of words cover 4 to 16 bytes. */
+			size_t mid = (length >> 3) << 2;
+			a = (hash_fast_r4(p) << 32) | hash_fast_r4(p + mid);
+			b = (hash_fast_r4(p + length - 4) << 32)
+				| hash_fast_r4(p + length - 4 - mid);
+		} else if (length > 0) {
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8)
+				| p[length - 1];
+			b = 0;
+		} else
+			a = b = 0;
+	} else {
+		size_t i = length;
+
+		if (i > 48) {
+			uint64_t seed1 = seed, seed2 = seed;
+
+			do {
+				seed = hash_fast_mix(hash_fast_r8(p) ^ HASH_FAST_P1,
+						     hash_fast_r8(p + 8) ^ seed);
+				seed1 = hash_fast_mix(hash_fast_r8(p + 16) ^ HASH_FAST_P2,
+						      hash_fast_r8(p + 24) ^ seed1);
+				seed2 = hash_fast_mix(hash_fast_r8(p + 32) ^ HASH_FAST_P3,
+						      hash_fast_r8(p + 40) ^ seed2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= seed1 ^ seed2;
+		}
+		while (i > 16) {
+			seed = hash_fast_mix(hash_fast_r8(p) ^ HASH_FAST_P1,
+					     hash_fast_r8(p + 8) ^ seed);
+			p += 16;
+			i -= 16;
+		}
+		/* The last 16 bytes, which may overlap ones already done. */
+		a = hash_fast_r8(p + i - 16);
+		b = hash_fast_r8(p + i - 8);
+	}
+
+	a ^= HASH_FAST_P1;
+	b ^= seed;
+	hash_fast_mul128(&a, &b);
+	return hash_fast_mix(a ^ HASH_FAST_P0 ^ length, b ^ HASH_FAST_P1);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <wmmintrin.h>
+
+/*
+ * With AES-NI, long keys go through four lanes of AES rounds, each taking
+ * 16 bytes at a time as its round key: a round is a single instruction,
+ * and the four are independent, so this runs at about 16 bytes a cycle.
+ * The final partial block is done by re-reading the last 64 bytes.
+ */
+__attribute__((target("aes")))
+static uint64_t hash64_fast_aes(const void *key, size_t length, uint64_t base)
+{
+	const unsigned char *p = key, *end = p + length - 64;
+	__m128i k = _mm_set_epi64x(HASH_FAST_P0 ^ length, HASH_FAST_P1 ^ base);
+	__m128i s0 = _mm_set_epi64x(HASH_FAST_P0, base);
+	__m128i s1 = _mm_set_epi64x(HASH_FAST_P1, base ^ length);
+	__m128i s2 = _mm_set_epi64x(HASH_FAST_P2, base);
+	__m128i s3 = _mm_set_epi64x(HASH_FAST_P3, base ^ length);
+
+	for (;;) {
+		if (p > end)
+			p = end;
+		s0 = _mm_aesenc_si128(s0, _mm_loadu_si128((const __m128i *)p));
+		s1 = _mm_aesenc_si128(s1, _mm_loadu_si128((const __m128i *)(p + 16)));
+		s2 = _mm_aesenc_si128(s2, _mm_loadu_si128((const __m128i *)(p + 32)));
+		s3 = _mm_aesenc_si128(s3, _mm_loadu_si128((const __m128i *)(p + 48)));
+		if (p == end)
+			break;
+		p += 64;
+	}
+
+	/* The last blocks have only been xored in: mix them before merging. */
+	s0 = _mm_aesenc_si128(s0, k);
+	s1 = _mm_aesenc_si128(s1, k);
+	s2 = _mm_aesenc_si128(s2, k);
+	s3 = _mm_aesenc_si128(s3, k);
+	s0 = _mm_aesenc_si128(s0, s1);
+	s2 = _mm_aesenc_si128(s2, s3);
+	s0 = _mm_aesenc_si128(s0, s2);
+	s0 = _mm_aesenc_si128(s0, k);
+	s0 = _mm_aesenc_si128(s0, k);
+	return _mm_cvtsi128_si64(s0)
+		^ _mm_cvtsi128_si64(_mm_unpackhi_epi64(s0, s0));
+}
+
+static uint64_t (*hash64_fast_long_impl(void))(const void *, size_t, uint64_t)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("aes"))
+		return hash64_fast_aes;
+	return hash64_fast_mix;
+}
+#else
+static uint64_t (*hash64_fast_long_impl(void))(const void *, size_t, uint64_t)
+{
+	return hash64_fast_mix;
+}
+#endif
+
+static uint64_t hash64_fast_dispatch(const void *key, size_t length,
+				     uint64_t base);
+
+/* Chosen on first use: if two threads race here they write the same value. */
+static uint64_t (*hash64_fast_long)(const void *, size_t, uint64_t)
+	= hash64_fast_dispatch;
+
+static uint64_t hash64_fast_dispatch(const void *key, size_t length,
+				     uint64_t base)
+{
+	hash64_fast_long = hash64_fast_long_impl();
+	return hash64_fast_long(key, length, base);
+}
+
+uint64_t hash64_fast_any(const void *key, size_t length, uint64_t base)
+{
+	if (length <= HASH_FAST_AES_MIN)
+		return hash64_fast_mix(key, length, base);
+	return hash64_fast_long(key, length, base);
+}
+
+uint32_t hash_fast_any(const void *key, size_t length, uint32_t base)
+{
+	uint64_t h = hash64_fast_any(key, length, base);
+
+	return h ^ (h >> 32);
+}
+
 #ifdef SELF_TEST
 
 /* used for timings */
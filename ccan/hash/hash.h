@@ -229,6 +229,46 @@ static inline uint32_t hash_string(const char *string)
 	 : hash64_stable_8((p), (num), (base)))
 
 
+/**
+ * hash_fast - faster hash of an array for internal use
+ * @p: the array or pointer to first element
+ * @num: the number of elements to hash
+ * @base: the base number to roll into the hash (usually 0)
+ *
+ * This is like hash(), but uses 64-bit multiplies rather than lookup3's
+ * 32-bit rounds, and AES instructions for long keys where the CPU has
+ * them.  On 64-bit machines it's about as fast for 8 byte keys, twice as
+ * fast at 16 bytes, and 20 times as fast from a few hundred bytes up; see
+ * tools/hashspeed.
+ *
+ * This hash will have different results on different machines (even
+ * different CPUs of the same architecture), so is only useful for
+ * internal hashes (ie. not hashes sent across the network or saved to
+ * disk).
+ *
+ * See also: hash, hash64_fast.
+ *
+ * Example:
+ *	static size_t rehash_name(const char *name)
+ *	{
+ *		return hash_fast(name, strlen(name), 0);
+ *	}
+ */
+#define hash_fast(p, num, base) hash_fast_any((p), (num)*sizeof(*(p)), (base))
+
+/**
+ * hash64_fast - faster 64-bit hash of an array for internal use
+ * @p: the array or pointer to first element
+ * @num: the number of elements to hash
+ * @base: the 64-bit base number to roll into the hash (usually 0)
+ *
+ * This is the 64-bit version of hash_fast(); the same caveats apply.
+ *
+ * See also: hash64, hash_fast.
+ */
+#define hash64_fast(p, num, base)					\
+	hash64_fast_any((p), (num)*sizeof(*(p)), (base))
+
 /**
  * hashl - fast 32/64-bit hash of an array for internal use
  * @p: the array or pointer to first element
@@ -254,6 +294,8 @@ uint64_t hash64_stable_64(const void *key, size_t n, uint64_t base);
 uint64_t hash64_stable_32(const void *key, size_t n, uint64_t base);
 uint64_t hash64_stable_16(const void *key, size_t n, uint64_t base);
 uint64_t hash64_stable_8(const void *key, size_t n, uint64_t base);
+uint32_t hash_fast_any(const void *key, size_t length, uint32_t base);
+uint64_t hash64_fast_any(const void *key, size_t length, uint64_t base);
 
 /**
  * hash_pointer - hash a pointer for internal use
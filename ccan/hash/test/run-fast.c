@@ -0,0 +1,124 @@
+#include <ccan/hash/hash.h>
+#include <ccan/tap/tap.h>
+#include <ccan/hash/hash.c>
+#include <stdbool.h>
+#include <string.h>
+
+#define MAX_LEN 200
+
+/* The same hash wherever the key is, and different for any changed bit. */
+static bool check_key(uint64_t (*fn)(const void *, size_t, uint64_t),
+		      const unsigned char *key, size_t len)
+{
+	unsigned char copy[MAX_LEN + 8];
+	uint64_t h = fn(key, len, 0);
+	size_t i, bit;
+
+	for (i = 1; i < 8; i++) {
+		memcpy(copy + i, key, len);
+		if (fn(copy + i, len, 0) != h)
+			return false;
+	}
+	if (fn(key, len, 1) == h)
+		return false;
+
+	memcpy(copy, key, len);
+	for (i = 0; i < len; i++) {
+		for (bit = 0; bit < 8; bit++) {
+			copy[i] ^= 1 << bit;
+			if (fn(copy, len, 0) == h)
+				return false;
+			copy[i] ^= 1 << bit;
+		}
+	}
+	return true;
+}
+
+static bool check_all_lengths(uint64_t (*fn)(const void *, size_t, uint64_t),
+			      size_t min, const unsigned char *key)
+{
+	size_t len;
+
+	for (len = min; len <= MAX_LEN; len++)
+		if (!check_key(fn, key, len))
+			return false;
+	return true;
+}
+
+/* Each byte of the hash of random keys should be evenly spread. */
+static void check_distribution(size_t len)
+{
+	static unsigned int results[sizeof(uint64_t)][256];
+	unsigned char key[MAX_LEN];
+	unsigned int i, j;
+
+	memset(results, 0, sizeof(results));
+	for (j = 0; j < 256000; j++) {
+		uint64_t h;
+
+		for (i = 0; i < len; i++)
+			key[i] = random();
+		h = hash64_fast(key, len, 0);
+		for (i = 0; i < sizeof(uint64_t); i++)
+			results[i][(h >> i*8) & 0xFF]++;
+	}
+
+	for (i = 0; i < sizeof(uint64_t); i++) {
+		unsigned int lowest = -1U, highest = 0;
+
+		for (j = 0; j < 256; j++) {
+			if (results[i][j] < lowest)
+				lowest = results[i][j];
+			if (results[i][j] > highest)
+				highest = results[i][j];
+		}
+		/* Expect within 20% */
+		ok(lowest > 800 && highest < 1200,
+		   "len %zu byte %u range %u-%u", len, i, lowest, highest);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned char key[MAX_LEN];
+	uint64_t h[MAX_LEN + 1];
+	size_t i, j;
+
+	plan_tests(7 + 8 * 3);
+
+	for (i = 0; i < MAX_LEN; i++)
+		key[i] = random();
+
+	ok1(check_all_lengths(hash64_fast_any, 0, key));
+	ok1(check_all_lengths(hash64_fast_mix, 0, key));
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (__builtin_cpu_supports("aes"))
+		ok1(check_all_lengths(hash64_fast_aes, HASH_FAST_AES_MIN + 1, key));
+	else
+		pass("No AES-NI here");
+#else
+	pass("No AES-NI version here");
+#endif
+
+	/* Zero-filled keys of different lengths shouldn't collide. */
+	memset(key, 0, sizeof(key));
+	for (i = 0; i <= MAX_LEN; i++)
+		h[i] = hash64_fast(key, i, 0);
+	for (i = 0; i <= MAX_LEN; i++)
+		for (j = 0; j < i; j++)
+			if (h[i] == h[j])
+				break;
+	ok1(i == MAX_LEN + 1 && j == MAX_LEN);
+
+	/* The 32-bit one is the same thing folded. */
+	h[0] = hash64_fast(key, 10, 7);
+	ok1(hash_fast(key, 10, 7) == (uint32_t)(h[0] ^ (h[0] >> 32)));
+	ok1(hash_fast("hello", 5, 0) != hash_fast("hellp", 5, 0));
+	ok1(hash64_fast("", 0, 0) != hash64_fast("", 0, 1));
+
+	check_distribution(8);
+	check_distribution(40);
+	check_distribution(200);
+
+	return exit_status();
+}
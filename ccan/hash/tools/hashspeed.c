@@ -0,0 +1,85 @@
+/* Speed of the hash functions, for keys from 8 bytes to 64k. */
+#include <ccan/hash/hash.h>
+#include <ccan/hash/hash.c>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+static uint64_t lookup3_32(const void *key, size_t len, uint64_t base)
+{
+	return hash_any(key, len, base);
+}
+
+static uint64_t fast_32(const void *key, size_t len, uint64_t base)
+{
+	return hash_fast_any(key, len, base);
+}
+
+static const struct {
+	const char *name;
+	uint64_t (*fn)(const void *, size_t, uint64_t);
+} hashes[] = {
+	{ "hash", lookup3_32 },
+	{ "hash64", hash64_any },
+	{ "hash_fast", fast_32 },
+	{ "hash64_fast", hash64_fast_any },
+	{ "(mix only)", hash64_fast_mix },
+#if defined(__x86_64__) && defined(__GNUC__)
+	{ "(aes only)", hash64_fast_aes },
+#endif
+};
+
+static const size_t sizes[] = { 8, 16, 32, 64, 128, 256, 1024, 4096,
+				16384, 65536 };
+
+/* Whatever the size, hash this many bytes (and at least a million keys). */
+#define TOTAL_BYTES (256 * 1024 * 1024)
+
+static uint64_t sink;
+
+static double time_hash(uint64_t (*fn)(const void *, size_t, uint64_t),
+			const void *key, size_t len, size_t runs)
+{
+	struct timeval start, stop, diff;
+	uint64_t h = 0;
+	size_t i;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < runs; i++)
+		h ^= fn(key, len, i);
+	gettimeofday(&stop, NULL);
+	sink ^= h;
+	timersub(&stop, &start, &diff);
+	return (diff.tv_sec * 1000000.0 + diff.tv_usec) * 1000 / runs;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned char *key;
+	size_t i, s, h;
+
+	key = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+	for (i = 0; i < sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]; i++)
+		key[i] = random();
+
+	printf("ns per hash (GB/sec)\n%-8s", "bytes");
+	for (h = 0; h < sizeof(hashes) / sizeof(hashes[0]); h++)
+		printf("\t%-16s", hashes[h].name);
+	printf("\n");
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		size_t runs = TOTAL_BYTES / sizes[s];
+
+		if (runs < 1000000 && sizes[s] <= 64)
+			runs = 1000000;
+		printf("%-8zu", sizes[s]);
+		for (h = 0; h < sizeof(hashes) / sizeof(hashes[0]); h++) {
+			double ns = time_hash(hashes[h].fn, key, sizes[s], runs);
+			printf("\t%-8.1f(%.2f)", ns, sizes[s] / ns);
+		}
+		printf("\n");
+	}
+	free(key);
+	return sink == 0;
+}
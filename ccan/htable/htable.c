@@ -9,6 +9,19 @@
 /* We use 0x1 as deleted marker. */
 #define HTABLE_DELETED (0x1)
 
+/* In incremental mode, how many old buckets each add or del moves.
+ * We must finish before the new table needs resizing: rehash_table()
+ * leaves at least a quarter of it free for adds, so that needs 4.
+ * htable_delval() doesn't move anything, so deleting while iterating
+ * stays safe. */
+#define HTABLE_MIGRATE_BUCKETS 4
+
+#if defined(__GNUC__)
+#define htable_prefetch(p, rw) __builtin_prefetch((p), (rw))
+#else
+#define htable_prefetch(p, rw) ((void)(p))
+#endif
+
 /* We clear out the bits which are always the same, and put metadata there. */
 static inline uintptr_t get_extra_ptr_bits(const struct htable *ht,
 					   uintptr_t e)
@@ -32,14 +45,20 @@ static inline bool entry_is_valid(uintptr_t e)
 	return e > HTABLE_DELETED;
 }
 
-static inline uintptr_t get_hash_ptr_bits(const struct htable *ht,
-					  size_t hash)
+static inline uintptr_t hash_ptr_bits(const struct htable *ht,
+				      unsigned int bits, uintptr_t perfect_bit,
+				      size_t hash)
 {
 	/* Shuffling the extra bits (as specified in mask) down the
 	 * end is quite expensive.  But the lower bits are redundant, so
 	 * we fold the value first. */
-	return (hash ^ (hash >> ht->bits))
-		& ht->common_mask & ~ht->perfect_bit;
+	return (hash ^ (hash >> bits)) & ht->common_mask & ~perfect_bit;
+}
+
+static inline uintptr_t get_hash_ptr_bits(const struct htable *ht,
+					  size_t hash)
+{
+	return hash_ptr_bits(ht, ht->bits, ht->perfect_bit, hash);
 }
 
 void htable_init(struct htable *ht,
@@ -54,9 +73,13 @@ void htable_init(struct htable *ht,
 
 void htable_clear(struct htable *ht)
 {
+	bool incremental = ht->incremental;
+
 	if (ht->table != &ht->perfect_bit)
 		free((void *)ht->table);
+	free(ht->old_table);
 	htable_init(ht, ht->rehash, ht->priv);
+	ht->incremental = incremental;
 }
 
 static size_t hash_bucket(const struct htable *ht, size_t h)
@@ -64,52 +87,116 @@ static size_t hash_bucket(const struct htable *ht, size_t h)
 	return h & ((1 << ht->bits)-1);
 }
 
-static void *htable_val(const struct htable *ht,
-			struct htable_iter *i, size_t hash, uintptr_t perfect)
+static void *table_val(const struct htable *ht, const uintptr_t *table,
+		       unsigned int bits, uintptr_t perfect_bit,
+		       size_t *off, size_t hash, uintptr_t perfect)
 {
-	uintptr_t h2 = get_hash_ptr_bits(ht, hash) | perfect;
+	uintptr_t h2 = hash_ptr_bits(ht, bits, perfect_bit, hash) | perfect;
 
-	while (ht->table[i->off]) {
-		if (ht->table[i->off] != HTABLE_DELETED) {
-			if (get_extra_ptr_bits(ht, ht->table[i->off]) == h2)
-				return get_raw_ptr(ht, ht->table[i->off]);
+	while (table[*off]) {
+		if (table[*off] != HTABLE_DELETED) {
+			if (get_extra_ptr_bits(ht, table[*off]) == h2)
+				return get_raw_ptr(ht, table[*off]);
 		}
-		i->off = (i->off + 1) & ((1 << ht->bits)-1);
+		*off = (*off + 1) & ((1 << bits)-1);
 		h2 &= ~perfect;
 	}
 	return NULL;
 }
 
+static void *htable_val(const struct htable *ht,
+			struct htable_iter *i, size_t hash, uintptr_t perfect)
+{
+	return table_val(ht, ht->table, ht->bits, ht->perfect_bit,
+			 &i->off, hash, perfect);
+}
+
+/* While resizing, iterator offsets past the new table are in the old. */
+static size_t old_base(const struct htable *ht)
+{
+	return (size_t)1 << ht->bits;
+}
+
+static void *old_val(const struct htable *ht,
+		     struct htable_iter *i, size_t hash, uintptr_t perfect)
+{
+	size_t off = i->off - old_base(ht);
+	void *p;
+
+	p = table_val(ht, ht->old_table, ht->old_bits, ht->old_perfect_bit,
+		      &off, hash, perfect);
+	i->off = old_base(ht) + off;
+	return p;
+}
+
+static void *old_firstval(const struct htable *ht,
+			  struct htable_iter *i, size_t hash)
+{
+	if (!ht->old_table)
+		return NULL;
+	i->off = old_base(ht) + (hash & ((1 << ht->old_bits)-1));
+	return old_val(ht, i, hash, ht->old_perfect_bit);
+}
+
 void *htable_firstval(const struct htable *ht,
 		      struct htable_iter *i, size_t hash)
 {
+	void *p;
+
 	i->off = hash_bucket(ht, hash);
-	return htable_val(ht, i, hash, ht->perfect_bit);
+	p = htable_val(ht, i, hash, ht->perfect_bit);
+	if (!p)
+		p = old_firstval(ht, i, hash);
+	return p;
 }
 
 void *htable_nextval(const struct htable *ht,
 		     struct htable_iter *i, size_t hash)
 {
+	void *p;
+
+	if (i->off >= old_base(ht)) {
+		size_t off = i->off - old_base(ht);
+		if (!ht->old_table)
+			return NULL;
+		i->off = old_base(ht) + ((off + 1) & ((1 << ht->old_bits)-1));
+		return old_val(ht, i, hash, 0);
+	}
+
 	i->off = (i->off + 1) & ((1 << ht->bits)-1);
-	return htable_val(ht, i, hash, 0);
+	p = htable_val(ht, i, hash, 0);
+	if (!p)
+		p = old_firstval(ht, i, hash);
+	return p;
 }
 
-void *htable_first(const struct htable *ht, struct htable_iter *i)
+/* Find the next valid entry at or after i->off, in either table. */
+static void *htable_scan(const struct htable *ht, struct htable_iter *i)
 {
-	for (i->off = 0; i->off < (size_t)1 << ht->bits; i->off++) {
+	for (; i->off < old_base(ht); i->off++) {
 		if (entry_is_valid(ht->table[i->off]))
 			return get_raw_ptr(ht, ht->table[i->off]);
 	}
+	if (!ht->old_table)
+		return NULL;
+	for (; i->off < old_base(ht) + ((size_t)1 << ht->old_bits); i->off++) {
+		uintptr_t e = ht->old_table[i->off - old_base(ht)];
+		if (entry_is_valid(e))
+			return get_raw_ptr(ht, e);
+	}
 	return NULL;
 }
 
+void *htable_first(const struct htable *ht, struct htable_iter *i)
+{
+	i->off = 0;
+	return htable_scan(ht, i);
+}
+
 void *htable_next(const struct htable *ht, struct htable_iter *i)
 {
-	for (i->off++; i->off < (size_t)1 << ht->bits; i->off++) {
-		if (entry_is_valid(ht->table[i->off]))
-			return get_raw_ptr(ht, ht->table[i->off]);
-	}
-	return NULL;
+	i->off++;
+	return htable_scan(ht, i);
 }
 
 /* This does not expand the hash table, that's up to caller. */
@@ -127,19 +214,34 @@ static void ht_add(struct htable *ht, const void *new, size_t h)
 	ht->table[i] = make_hval(ht, new, get_hash_ptr_bits(ht, h)|perfect);
 }
 
-static COLD bool double_table(struct htable *ht)
+/* Move entries from the old table, up to @num buckets' worth. */
+static void migrate(struct htable *ht, size_t num)
 {
-	unsigned int i;
-	size_t oldnum = (size_t)1 << ht->bits;
-	uintptr_t *oldtable, e;
+	size_t oldnum = (size_t)1 << ht->old_bits;
 
-	oldtable = ht->table;
-	ht->table = calloc(1 << (ht->bits+1), sizeof(size_t));
-	if (!ht->table) {
-		ht->table = oldtable;
-		return false;
+	while (num-- && ht->migrated < oldnum) {
+		uintptr_t e = ht->old_table[ht->migrated];
+		if (entry_is_valid(e)) {
+			void *p = get_raw_ptr(ht, e);
+			ht_add(ht, p, ht->rehash(p, ht->priv));
+			/* Not 0: that would break later probe chains. */
+			ht->old_table[ht->migrated] = HTABLE_DELETED;
+		}
+		ht->migrated++;
 	}
-	ht->bits++;
+
+	if (ht->migrated == oldnum) {
+		free(ht->old_table);
+		ht->old_table = NULL;
+	}
+}
+
+static void set_table(struct htable *ht, uintptr_t *table, unsigned int bits)
+{
+	unsigned int i;
+
+	ht->table = table;
+	ht->bits = bits;
 	ht->max = ((size_t)3 << ht->bits) / 4;
 	ht->max_with_deleted = ((size_t)9 << ht->bits) / 10;
 
@@ -152,6 +254,51 @@ static COLD bool double_table(struct htable *ht)
 			}
 		}
 	}
+	ht->deleted = 0;
+}
+
+/* Start moving to a new table of @bits; add and del will finish it. */
+static COLD bool start_resize(struct htable *ht, unsigned int bits)
+{
+	uintptr_t *table;
+
+	/* Adds finish the last move before the new table fills. */
+	assert(!ht->old_table);
+
+	table = calloc((size_t)1 << bits, sizeof(size_t));
+	if (!table)
+		return false;
+
+	if (ht->table != &ht->perfect_bit) {
+		ht->old_table = ht->table;
+		ht->old_bits = ht->bits;
+		ht->old_perfect_bit = ht->perfect_bit;
+		ht->migrated = 0;
+	}
+	set_table(ht, table, bits);
+	return true;
+}
+
+void htable_set_incremental(struct htable *ht, bool incremental)
+{
+	if (!incremental && ht->old_table)
+		migrate(ht, (size_t)-1);
+	ht->incremental = incremental;
+}
+
+static COLD bool grow_table(struct htable *ht, unsigned int bits)
+{
+	size_t i, oldnum = (size_t)1 << ht->bits;
+	uintptr_t *oldtable, *newtable, e;
+
+	if (ht->incremental)
+		return start_resize(ht, bits);
+
+	oldtable = ht->table;
+	newtable = calloc((size_t)1 << bits, sizeof(size_t));
+	if (!newtable)
+		return false;
+	set_table(ht, newtable, bits);
 
 	if (oldtable != &ht->perfect_bit) {
 		for (i = 0; i < oldnum; i++) {
@@ -162,15 +309,42 @@ static COLD bool double_table(struct htable *ht)
 		}
 		free(oldtable);
 	}
-	ht->deleted = 0;
 	return true;
 }
 
+static COLD bool double_table(struct htable *ht)
+{
+	return grow_table(ht, ht->bits + 1);
+}
+
+bool htable_reserve(struct htable *ht, size_t num)
+{
+	unsigned int bits = ht->bits;
+
+	while (((size_t)3 << bits) / 4 < num)
+		bits++;
+	if (bits == ht->bits)
+		return true;
+	/* Can't have two old tables: finish with this one. */
+	if (ht->old_table)
+		migrate(ht, (size_t)-1);
+	return grow_table(ht, bits);
+}
+
 static COLD void rehash_table(struct htable *ht)
 {
 	size_t start, i;
 	uintptr_t e;
 
+	/* Move to a fresh table, bit by bit.  If it's half full, make
+	 * it twice the size: the move must finish before the next
+	 * resize, and only adds bring that closer.  If we can't allocate
+	 * it, fall through and do it all now. */
+	if (ht->incremental
+	    && start_resize(ht, ht->bits
+			    + (ht->elems + 1 >= ((size_t)1 << ht->bits) / 2)))
+		return;
+
 	/* Beware wrap cases: we need to start from first empty bucket. */
 	for (start = 0; ht->table[start]; start++);
 
@@ -190,11 +364,43 @@ static COLD void rehash_table(struct htable *ht)
 	ht->deleted = 0;
 }
 
+/* Stop stealing the bits in @maskdiff, putting them back in entries. */
+static COLD void strip_common(struct htable *ht, uintptr_t maskdiff)
+{
+	size_t i;
+	uintptr_t bitsdiff;
+
+	/* These are the bits which go there in existing entries. */
+	bitsdiff = ht->common_bits & maskdiff;
+
+	for (i = 0; i < (size_t)1 << ht->bits; i++) {
+		if (!entry_is_valid(ht->table[i]))
+			continue;
+		/* Clear the bits no longer in the mask, set them as
+		 * expected. */
+		ht->table[i] &= ~maskdiff;
+		ht->table[i] |= bitsdiff;
+	}
+	if (ht->old_table) {
+		for (i = 0; i < (size_t)1 << ht->old_bits; i++) {
+			if (!entry_is_valid(ht->old_table[i]))
+				continue;
+			ht->old_table[i] &= ~maskdiff;
+			ht->old_table[i] |= bitsdiff;
+		}
+		ht->old_perfect_bit &= ~maskdiff;
+	}
+
+	/* Take away those bits from our mask, bits and perfect bit. */
+	ht->common_mask &= ~maskdiff;
+	ht->common_bits &= ~maskdiff;
+	ht->perfect_bit &= ~maskdiff;
+}
+
 /* We stole some bits, now we need to put them back... */
 static COLD void update_common(struct htable *ht, const void *p)
 {
 	unsigned int i;
-	uintptr_t maskdiff, bitsdiff;
 
 	if (ht->elems == 0) {
 		/* Always reveal one bit of the pointer in the bucket,
@@ -213,28 +419,13 @@ static COLD void update_common(struct htable *ht, const void *p)
 	}
 
 	/* Find bits which are unequal to old common set. */
-	maskdiff = ht->common_bits ^ ((uintptr_t)p & ht->common_mask);
-
-	/* These are the bits which go there in existing entries. */
-	bitsdiff = ht->common_bits & maskdiff;
-
-	for (i = 0; i < (size_t)1 << ht->bits; i++) {
-		if (!entry_is_valid(ht->table[i]))
-			continue;
-		/* Clear the bits no longer in the mask, set them as
-		 * expected. */
-		ht->table[i] &= ~maskdiff;
-		ht->table[i] |= bitsdiff;
-	}
-
-	/* Take away those bits from our mask, bits and perfect bit. */
-	ht->common_mask &= ~maskdiff;
-	ht->common_bits &= ~maskdiff;
-	ht->perfect_bit &= ~maskdiff;
+	strip_common(ht, ht->common_bits ^ ((uintptr_t)p & ht->common_mask));
 }
 
 bool htable_add(struct htable *ht, size_t hash, const void *p)
 {
+	if (ht->old_table)
+		migrate(ht, HTABLE_MIGRATE_BUCKETS);
 	if (ht->elems+1 > ht->max && !double_table(ht))
 		return false;
 	if (ht->elems+1 + ht->deleted > ht->max_with_deleted)
@@ -248,6 +439,81 @@ bool htable_add(struct htable *ht, size_t hash, const void *p)
 	return true;
 }
 
+bool htable_add_many(struct htable *ht, const void *const p[], size_t num)
+{
+	size_t i, j, n, hashes[HTABLE_BATCH];
+	uintptr_t maskdiff = 0;
+
+	if (!num)
+		return true;
+	/* We're going to touch everything anyway: finish any move now,
+	 * and any we start here. */
+	if (ht->old_table)
+		migrate(ht, (size_t)-1);
+	if (!htable_reserve(ht, ht->elems + num))
+		return false;
+	if (ht->elems + num + ht->deleted > ht->max_with_deleted)
+		rehash_table(ht);
+	if (ht->old_table)
+		migrate(ht, (size_t)-1);
+
+	/* One pass over the table for everyone's uncommon bits, not one
+	 * each. */
+	if (ht->elems == 0
+	    && ((uintptr_t)p[0] & ht->common_mask) != ht->common_bits)
+		update_common(ht, p[0]);
+	for (i = 0; i < num; i++) {
+		assert(p[i]);
+		maskdiff |= ht->common_bits ^ ((uintptr_t)p[i] & ht->common_mask);
+	}
+	if (maskdiff)
+		strip_common(ht, maskdiff);
+
+	/* Hash a batch and fetch their buckets before we need them. */
+	for (i = 0; i < num; i += n) {
+		n = num - i < HTABLE_BATCH ? num - i : HTABLE_BATCH;
+		for (j = 0; j < n; j++) {
+			hashes[j] = ht->rehash(p[i+j], ht->priv);
+			htable_prefetch(&ht->table[hash_bucket(ht, hashes[j])],
+					1);
+		}
+		for (j = 0; j < n; j++)
+			ht_add(ht, p[i+j], hashes[j]);
+	}
+	ht->elems += num;
+	return true;
+}
+
+size_t htable_get_many(const struct htable *ht, size_t num,
+		       const size_t hashes[],
+		       bool (*cmp)(const void *candidate, void *ptr),
+		       const void *const ptrs[], void *results[])
+{
+	size_t i, j, n, found = 0;
+
+	for (i = 0; i < num; i += n) {
+		n = num - i < HTABLE_BATCH ? num - i : HTABLE_BATCH;
+		/* First fetch all the buckets... */
+		for (j = 0; j < n; j++)
+			htable_prefetch(&ht->table[hash_bucket(ht, hashes[i+j])],
+					0);
+		/* ...then the first candidate in each... */
+		for (j = 0; j < n; j++) {
+			uintptr_t e = ht->table[hash_bucket(ht, hashes[i+j])];
+			if (entry_is_valid(e))
+				htable_prefetch(get_raw_ptr(ht, e), 0);
+		}
+		/* ...by which time the first should be here. */
+		for (j = 0; j < n; j++) {
+			results[i+j] = htable_get(ht, hashes[i+j], cmp,
+						  ptrs[i+j]);
+			if (results[i+j])
+				found++;
+		}
+	}
+	return found;
+}
+
 bool htable_del(struct htable *ht, size_t h, const void *p)
 {
 	struct htable_iter i;
@@ -256,6 +522,9 @@ bool htable_del(struct htable *ht, size_t h, const void *p)
 	for (c = htable_firstval(ht,&i,h); c; c = htable_nextval(ht,&i,h)) {
 		if (c == p) {
 			htable_delval(ht, &i);
+			/* Otherwise the old table lives until the next add. */
+			if (ht->old_table)
+				migrate(ht, HTABLE_MIGRATE_BUCKETS);
 			return true;
 		}
 	}
@@ -264,7 +533,16 @@ bool htable_del(struct htable *ht, size_t h, const void *p)
 
 void htable_delval(struct htable *ht, struct htable_iter *i)
 {
-	assert(i->off < (size_t)1 << ht->bits);
+	if (i->off >= old_base(ht)) {
+		size_t off = i->off - old_base(ht);
+		assert(ht->old_table);
+		assert(off < (size_t)1 << ht->old_bits);
+		assert(entry_is_valid(ht->old_table[off]));
+		/* Old table is never added to, so we don't count these. */
+		ht->elems--;
+		ht->old_table[off] = HTABLE_DELETED;
+		return;
+	}
 	assert(entry_is_valid(ht->table[i->off]));
 
 	ht->elems--;
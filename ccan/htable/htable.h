@@ -21,6 +21,12 @@ struct htable {
 	uintptr_t common_mask, common_bits;
 	uintptr_t perfect_bit;
 	uintptr_t *table;
+	/* Incremental resizing: the table we're still moving entries from */
+	bool incremental;
+	unsigned int old_bits;
+	uintptr_t old_perfect_bit;
+	size_t migrated;
+	uintptr_t *old_table;
 };
 
 /**
@@ -40,7 +46,8 @@ struct htable {
  *	static struct htable ht = HTABLE_INITIALIZER(ht, rehash, NULL);
  */
 #define HTABLE_INITIALIZER(name, rehash, priv)				\
-	{ rehash, priv, 0, 0, 0, 0, 0, -1, 0, 0, &name.perfect_bit }
+	{ rehash, priv, 0, 0, 0, 0, 0, -1, 0, 0, &name.perfect_bit,	\
+	  false, 0, 0, 0, NULL }
 
 /**
  * htable_init - initialize an empty hash table.
@@ -59,6 +66,52 @@ void htable_init(struct htable *ht,
  */
 void htable_clear(struct htable *ht);
 
+/**
+ * htable_set_incremental - spread resizing over later operations.
+ * @ht: the hash table
+ * @incremental: true to resize incrementally, false to resize at once.
+ *
+ * Normally when a hash table grows, htable_add() allocates a new table
+ * and moves every entry across before returning: with millions of
+ * entries, that one call can take a long time.
+ *
+ * In incremental mode, the old table is kept alongside the new one and
+ * each htable_add() and htable_del() moves a few buckets across, until
+ * the old table is empty and can be freed.  Lookups (which can't change the table) check
+ * both tables meanwhile, so they're a little slower until the move is
+ * done, and both tables are in memory at once.  Cleaning out deleted
+ * entries is spread out the same way.
+ *
+ * Moved entries can land behind an htable_first()/htable_next() walk,
+ * so to delete while walking, use htable_delval() on the iterator: it
+ * never moves anything.  Adding while walking can still cause entries
+ * to be skipped or seen twice, as it can without incremental mode.
+ *
+ * Turning incremental mode off finishes any move in progress.
+ *
+ * Example:
+ *	static size_t rehash(const void *elem, void *unused)
+ *	{
+ *		return *(size_t *)elem;
+ *	}
+ *	static struct htable ht = HTABLE_INITIALIZER(ht, rehash, NULL);
+ *	...
+ *	// We care more about worst-case latency than throughput.
+ *	htable_set_incremental(&ht, true);
+ */
+void htable_set_incremental(struct htable *ht, bool incremental);
+
+/**
+ * htable_reserve - make room for a number of entries.
+ * @ht: the hash table
+ * @num: the total number of entries it should hold
+ *
+ * If you know how big a table will get, this grows it once instead of
+ * doubling it over and over as entries are added.  It never shrinks the
+ * table.  This can only fail due to allocation failure.
+ */
+bool htable_reserve(struct htable *ht, size_t num);
+
 /**
  * htable_rehash - use a hashtree's rehash function
  * @elem: the argument to rehash()
@@ -77,13 +130,32 @@ size_t htable_rehash(const void *elem);
  */
 bool htable_add(struct htable *ht, size_t hash, const void *p);
 
+/* How many entries htable_add_many and htable_get_many prefetch at once. */
+#define HTABLE_BATCH 16
+
+/**
+ * htable_add_many - add an array of pointers into a hash table.
+ * @ht: the htable
+ * @p: the non-NULL pointers
+ * @num: the number of pointers in @p
+ *
+ * This is the same as calling htable_add() on each, but faster: the
+ * table is grown once, and the hashes (from the rehash function) are
+ * computed a batch at a time so their buckets can be fetched in
+ * parallel.  This can only fail due to allocation failure, in which
+ * case nothing is added.
+ */
+bool htable_add_many(struct htable *ht, const void *const p[], size_t num);
+
 /**
  * htable_del - remove a pointer from a hash table
  * @ht: the htable
  * @hash: the hash value of the object
  * @p: the pointer
  *
- * Returns true if the pointer was found (and deleted).
+ * Returns true if the pointer was found (and deleted).  In incremental
+ * mode this can move entries, like htable_add(): see
+ * htable_set_incremental().
  */
 bool htable_del(struct htable *ht, size_t hash, const void *p);
 
@@ -144,6 +216,24 @@ static inline void *htable_get(const struct htable *ht,
 	return NULL;
 }
 
+/**
+ * htable_get_many - find many entries in the hash table
+ * @ht: the hashtable
+ * @num: the number of entries to find
+ * @hashes: the hash value of each entry
+ * @cmp: the comparison function
+ * @ptrs: the pointer to hand to the comparison function for each entry.
+ * @results: filled with what htable_get() would return for each entry.
+ *
+ * Looking up many keys one at a time waits for memory on each.  This
+ * prefetches a batch of buckets before probing any of them, so the
+ * memory accesses overlap.  Returns the number of entries found.
+ */
+size_t htable_get_many(const struct htable *ht, size_t num,
+		       const size_t hashes[],
+		       bool (*cmp)(const void *candidate, void *ptr),
+		       const void *const ptrs[], void *results[]);
+
 /**
  * htable_first - find an entry in the hash table
  * @ht: the hashtable
@@ -0,0 +1,190 @@
+/* Licensed under LGPLv2+ - see LICENSE file for details */
+#include <ccan/htable/htable_frozen.h>
+#include <ccan/read_write_all/read_write_all.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* We write through this, rather than a write() per field. */
+struct frozen_out {
+	int fd;
+	size_t used;
+	char buf[65536];
+};
+
+static bool out_flush(struct frozen_out *out)
+{
+	bool ok = write_all(out->fd, out->buf, out->used);
+	out->used = 0;
+	return ok;
+}
+
+static bool out_write(struct frozen_out *out, const void *data, size_t len)
+{
+	if (out->used + len > sizeof(out->buf)) {
+		if (!out_flush(out))
+			return false;
+		if (len > sizeof(out->buf))
+			return write_all(out->fd, data, len);
+	}
+	memcpy(out->buf + out->used, data, len);
+	out->used += len;
+	return true;
+}
+
+static size_t record_len(size_t keylen, size_t vallen)
+{
+	return sizeof(struct htable_frozen_record)
+		+ htable_frozen_pad(keylen) + htable_frozen_pad(vallen);
+}
+
+bool htable_freeze(const struct htable *ht, int fd,
+		   void (*describe)(const void *elem,
+				    const void **key, size_t *keylen,
+				    const void **val, size_t *vallen,
+				    void *arg),
+		   void *arg)
+{
+	static const char pad[sizeof(leint64_t)];
+	struct htable_frozen_header hdr;
+	struct htable_frozen_slot *slots;
+	struct frozen_out *out;
+	struct htable_iter i;
+	unsigned int bits = 0;
+	size_t num;
+	uint64_t off;
+	const void *e;
+	bool ok;
+
+	/* Same maximum load as htable, so there's always an empty slot. */
+	while (((size_t)3 << bits) / 4 <= ht->elems)
+		bits++;
+	num = (size_t)1 << bits;
+
+	slots = calloc(num, sizeof(*slots));
+	out = malloc(sizeof(*out));
+	if (!slots || !out) {
+		free(slots);
+		free(out);
+		return false;
+	}
+	out->fd = fd;
+	out->used = 0;
+
+	/* First pass: place everything, so we can write sequentially. */
+	off = sizeof(hdr) + num * sizeof(*slots);
+	for (e = htable_first(ht, &i); e; e = htable_next(ht, &i)) {
+		const void *key, *val;
+		size_t keylen, vallen, h, j;
+
+		describe(e, &key, &keylen, &val, &vallen, arg);
+		h = ht->rehash(e, ht->priv);
+		for (j = h & (num - 1); le64_to_cpu(slots[j].off);
+		     j = (j + 1) & (num - 1));
+		slots[j].hash = cpu_to_le64(h);
+		slots[j].off = cpu_to_le64(off);
+		off += record_len(keylen, vallen);
+	}
+
+	memcpy(hdr.magic, HTABLE_FROZEN_MAGIC, sizeof(hdr.magic));
+	hdr.bits = cpu_to_le64(bits);
+	hdr.elems = cpu_to_le64(ht->elems);
+	hdr.size = cpu_to_le64(off);
+	ok = out_write(out, &hdr, sizeof(hdr))
+		&& out_write(out, slots, num * sizeof(*slots));
+	free(slots);
+
+	/* Second pass: the records, in the same order. */
+	for (e = htable_first(ht, &i); ok && e; e = htable_next(ht, &i)) {
+		struct htable_frozen_record r;
+		const void *key, *val;
+		size_t keylen, vallen, keypad, valpad;
+
+		describe(e, &key, &keylen, &val, &vallen, arg);
+		r.keylen = cpu_to_le64(keylen);
+		r.vallen = cpu_to_le64(vallen);
+		keypad = htable_frozen_pad(keylen) - keylen;
+		valpad = htable_frozen_pad(vallen) - vallen;
+		ok = out_write(out, &r, sizeof(r))
+			&& out_write(out, key, keylen)
+			&& out_write(out, pad, keypad)
+			&& out_write(out, val, vallen)
+			&& out_write(out, pad, valpad);
+	}
+	if (ok)
+		ok = out_flush(out);
+	free(out);
+	return ok;
+}
+
+bool htable_frozen_init(struct htable_frozen *hf, const void *base,
+			size_t len)
+{
+	const struct htable_frozen_header *hdr = base;
+	size_t max_slots;
+	uint64_t bits;
+
+	if (len < sizeof(*hdr)
+	    || len % sizeof(leint64_t)
+	    || memcmp(hdr->magic, HTABLE_FROZEN_MAGIC, sizeof(hdr->magic))
+	    || le64_to_cpu(hdr->size) != len)
+		goto inval;
+
+	bits = le64_to_cpu(hdr->bits);
+	max_slots = (len - sizeof(*hdr)) / sizeof(hf->slots[0]);
+	if (bits >= sizeof(size_t) * CHAR_BIT - 5
+	    || ((size_t)1 << bits) > max_slots)
+		goto inval;
+
+	hf->base = base;
+	hf->len = len;
+	hf->mask = ((size_t)1 << bits) - 1;
+	hf->elems = le64_to_cpu(hdr->elems);
+	hf->slots = (const struct htable_frozen_slot *)(hdr + 1);
+	return true;
+
+inval:
+	errno = EINVAL;
+	return false;
+}
+
+bool htable_frozen_open(struct htable_frozen *hf, const char *filename)
+{
+	struct stat st;
+	void *base;
+	int fd, saved_errno;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) != 0) {
+		saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return false;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	saved_errno = errno;
+	close(fd);
+	if (base == MAP_FAILED) {
+		errno = saved_errno;
+		return false;
+	}
+
+	if (!htable_frozen_init(hf, base, st.st_size)) {
+		munmap(base, st.st_size);
+		errno = EINVAL;
+		return false;
+	}
+	return true;
+}
+
+void htable_frozen_close(struct htable_frozen *hf)
+{
+	munmap((void *)hf->base, hf->len);
+}
@@ -0,0 +1,190 @@
+/* Licensed under LGPLv2+ - see LICENSE file for details */
+#ifndef CCAN_HTABLE_FROZEN_H
+#define CCAN_HTABLE_FROZEN_H
+#include "config.h"
+#include <ccan/htable/htable.h>
+#include <ccan/endian/endian.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* On-disk layout, all little-endian:
+ *	struct htable_frozen_header;
+ *	struct htable_frozen_slot[1 << bits];
+ *	records: keylen, vallen, key, value, each padded to 8 bytes.
+ * Offsets are from the start of the file; 0 means an empty slot. */
+#define HTABLE_FROZEN_MAGIC "CCANHTF1"
+
+struct htable_frozen_header {
+	char magic[8];
+	leint64_t bits;
+	leint64_t elems;
+	leint64_t size;
+};
+
+struct htable_frozen_slot {
+	leint64_t hash;
+	leint64_t off;
+};
+
+struct htable_frozen_record {
+	leint64_t keylen;
+	leint64_t vallen;
+	char data[];
+};
+
+/**
+ * struct htable_frozen - a read-only hash table mapped from a file.
+ *
+ * This is built by htable_freeze() from an ordinary struct htable.  The
+ * file contains offsets rather than pointers, so it can be mapped at any
+ * address (and by many processes at once) and used immediately, without
+ * parsing anything.
+ */
+struct htable_frozen {
+	const char *base;
+	size_t len;
+	size_t mask;
+	size_t elems;
+	const struct htable_frozen_slot *slots;
+};
+
+/**
+ * htable_freeze - write a hash table out in frozen form.
+ * @ht: the hash table
+ * @fd: the file descriptor to write to (written sequentially)
+ * @describe: callback to get an element's key and value bytes
+ * @arg: argument to @describe
+ *
+ * Each element is hashed with @ht's rehash function: that must give the
+ * same answer for the key as the hash later handed to
+ * htable_frozen_get(), in every process which reads the file.
+ *
+ * Returns false (with errno set) if it can't write or allocate.
+ *
+ * Example:
+ *	struct record {
+ *		const char *name;
+ *		int val;
+ *	};
+ *
+ *	static void describe(const void *elem, const void **key,
+ *			     size_t *keylen, const void **val, size_t *vallen,
+ *			     void *unused)
+ *	{
+ *		const struct record *r = elem;
+ *
+ *		*key = r->name;
+ *		*keylen = strlen(r->name);
+ *		*val = &r->val;
+ *		*vallen = sizeof(r->val);
+ *	}
+ *	...
+ *	static bool save(const struct htable *ht, int fd)
+ *	{
+ *		return htable_freeze(ht, fd, describe, NULL);
+ *	}
+ */
+bool htable_freeze(const struct htable *ht, int fd,
+		   void (*describe)(const void *elem,
+				    const void **key, size_t *keylen,
+				    const void **val, size_t *vallen,
+				    void *arg),
+		   void *arg);
+
+/**
+ * htable_frozen_open - map a frozen hash table file.
+ * @hf: the struct htable_frozen to fill in
+ * @filename: the file written by htable_freeze()
+ *
+ * Returns false (with errno set) if it can't be opened or mapped, or
+ * isn't a valid frozen table (errno EINVAL).
+ */
+bool htable_frozen_open(struct htable_frozen *hf, const char *filename);
+
+/**
+ * htable_frozen_init - use a frozen hash table already in memory.
+ * @hf: the struct htable_frozen to fill in
+ * @base: the contents of the file written by htable_freeze()
+ * @len: the length of @base
+ *
+ * @base must be 8-byte aligned, and stay valid while @hf is used.
+ * Returns false (with errno EINVAL) if it isn't a valid frozen table
+ * (including if @len isn't a multiple of 8, as every valid one is).
+ */
+bool htable_frozen_init(struct htable_frozen *hf, const void *base,
+			size_t len);
+
+/**
+ * htable_frozen_close - unmap a frozen hash table file.
+ * @hf: the struct htable_frozen from htable_frozen_open()
+ */
+void htable_frozen_close(struct htable_frozen *hf);
+
+/* Keys and values are padded, so values can be used in place. */
+static inline uint64_t htable_frozen_pad(uint64_t len)
+{
+	return (len + sizeof(leint64_t) - 1) & ~(uint64_t)(sizeof(leint64_t) - 1);
+}
+
+/* The record at @off, if it's all inside the file, otherwise NULL. */
+static inline const struct htable_frozen_record *
+htable_frozen_record(const struct htable_frozen *hf, uint64_t off)
+{
+	const struct htable_frozen_record *r;
+	uint64_t left;
+
+	if (off > hf->len - sizeof(*r) || off % sizeof(leint64_t))
+		return NULL;
+	r = (const struct htable_frozen_record *)(hf->base + off);
+	left = hf->len - off - sizeof(*r);
+	/* Check the padded key fits before subtracting it. */
+	if (le64_to_cpu(r->keylen) > left
+	    || htable_frozen_pad(le64_to_cpu(r->keylen)) > left
+	    || le64_to_cpu(r->vallen)
+	       > left - htable_frozen_pad(le64_to_cpu(r->keylen)))
+		return NULL;
+	return r;
+}
+
+/**
+ * htable_frozen_get - find a value in a frozen hash table
+ * @hf: the frozen hashtable
+ * @h: the hash value of the key
+ * @key: the key bytes
+ * @keylen: the length of @key
+ * @vallen: set to the length of the value, if non-NULL
+ *
+ * Returns a pointer to the value inside the mapping (8-byte aligned, so
+ * a struct can be used in place), or NULL if the key isn't there.
+ */
+static inline const void *htable_frozen_get(const struct htable_frozen *hf,
+					    size_t h,
+					    const void *key, size_t keylen,
+					    size_t *vallen)
+{
+	size_t i = h & hf->mask, n;
+
+	/* Bounded, in case a bad file has no empty slots. */
+	for (n = 0; n <= hf->mask; n++, i = (i + 1) & hf->mask) {
+		const struct htable_frozen_record *r;
+		uint64_t off = le64_to_cpu(hf->slots[i].off);
+
+		if (!off)
+			return NULL;
+		if (le64_to_cpu(hf->slots[i].hash) != (uint64_t)h)
+			continue;
+		r = htable_frozen_record(hf, off);
+		if (!r)
+			return NULL;
+		if (le64_to_cpu(r->keylen) == keylen
+		    && memcmp(r->data, key, keylen) == 0) {
+			if (vallen)
+				*vallen = le64_to_cpu(r->vallen);
+			return r->data + htable_frozen_pad(keylen);
+		}
+	}
+	return NULL;
+}
+#endif /* CCAN_HTABLE_FROZEN_H */
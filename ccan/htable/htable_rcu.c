@@ -0,0 +1,252 @@
+/* Licensed under LGPLv2+ - see LICENSE file for details */
+#include <ccan/htable/htable_rcu.h>
+#include <ccan/compiler/compiler.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <sched.h>
+
+void htable_rcu_init(struct htable_rcu *ht)
+{
+	pthread_mutex_init(&ht->lock, NULL);
+	ht->table = NULL;
+	ht->retired = NULL;
+	ht->readers = NULL;
+	ht->epoch = 1;
+}
+
+static void free_retired(struct htable_rcu_table **list)
+{
+	while (*list) {
+		struct htable_rcu_table *t = *list;
+		*list = t->next;
+		free(t);
+	}
+}
+
+void htable_rcu_clear(struct htable_rcu *ht)
+{
+	free(ht->table);
+	ht->table = NULL;
+	free_retired(&ht->retired);
+}
+
+void htable_rcu_reader_register(struct htable_rcu *ht,
+				struct htable_rcu_reader *r)
+{
+	r->epoch = 0;
+	pthread_mutex_lock(&ht->lock);
+	r->next = ht->readers;
+	ht->readers = r;
+	pthread_mutex_unlock(&ht->lock);
+}
+
+void htable_rcu_reader_unregister(struct htable_rcu *ht,
+				  struct htable_rcu_reader *r)
+{
+	struct htable_rcu_reader **rp;
+
+	assert(!r->epoch);
+	pthread_mutex_lock(&ht->lock);
+	for (rp = &ht->readers; *rp != r; rp = &(*rp)->next)
+		assert(*rp);
+	*rp = r->next;
+	pthread_mutex_unlock(&ht->lock);
+}
+
+/* Oldest epoch any reader is in, or 0 if none are reading.  Called
+ * with lock held. */
+static unsigned long oldest_reader(const struct htable_rcu *ht)
+{
+	const struct htable_rcu_reader *r;
+	unsigned long oldest = 0;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (r = ht->readers; r; r = r->next) {
+		unsigned long e = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE);
+		if (e && (!oldest || e < oldest))
+			oldest = e;
+	}
+	return oldest;
+}
+
+/* Free tables no reader can still be looking at.  Called with lock held. */
+static void reclaim(struct htable_rcu *ht)
+{
+	struct htable_rcu_table **tp;
+	unsigned long oldest;
+
+	if (!ht->retired)
+		return;
+
+	oldest = oldest_reader(ht);
+	for (tp = &ht->retired; *tp;) {
+		struct htable_rcu_table *t = *tp;
+		if (!oldest || t->retired <= oldest) {
+			*tp = t->next;
+			free(t);
+		} else
+			tp = &t->next;
+	}
+}
+
+void htable_rcu_synchronize(struct htable_rcu *ht)
+{
+	unsigned long epoch;
+
+	pthread_mutex_lock(&ht->lock);
+	epoch = __atomic_add_fetch(&ht->epoch, 1, __ATOMIC_SEQ_CST);
+	for (;;) {
+		unsigned long oldest = oldest_reader(ht);
+		if (!oldest || oldest >= epoch)
+			break;
+		sched_yield();
+	}
+	reclaim(ht);
+	pthread_mutex_unlock(&ht->lock);
+}
+
+/* This does not expand the hash table, that's up to caller. */
+static void table_add(struct htable_rcu_table *t, const void *p, size_t h)
+{
+	size_t mask = ((size_t)1 << t->bits) - 1, i;
+
+	i = h & mask;
+	while (t->slots[i].p && t->slots[i].p != HTABLE_RCU_DELETED)
+		i = (i + 1) & mask;
+
+	if (t->slots[i].p == HTABLE_RCU_DELETED)
+		t->deleted--;
+	__atomic_store_n(&t->slots[i].hash, h, __ATOMIC_RELAXED);
+	/* Readers which see the pointer must see the hash. */
+	__atomic_store_n(&t->slots[i].p, p, __ATOMIC_RELEASE);
+	t->elems++;
+}
+
+static struct htable_rcu_table *new_table(unsigned int bits)
+{
+	struct htable_rcu_table *t;
+
+	t = calloc(1, sizeof(*t) + sizeof(t->slots[0]) * ((size_t)1 << bits));
+	if (!t)
+		return NULL;
+	t->bits = bits;
+	t->max = ((size_t)3 << bits) / 4;
+	return t;
+}
+
+/* Build a new copy of the table, publish it, and retire the old one. */
+static COLD bool replace_table(struct htable_rcu *ht, unsigned int bits)
+{
+	struct htable_rcu_table *old = ht->table, *t;
+	size_t i;
+
+	t = new_table(bits);
+	if (!t)
+		return false;
+
+	if (old) {
+		for (i = 0; i < (size_t)1 << old->bits; i++) {
+			const void *p = old->slots[i].p;
+			if (p && p != HTABLE_RCU_DELETED)
+				table_add(t, p, old->slots[i].hash);
+		}
+	}
+	__atomic_store_n(&ht->table, t, __ATOMIC_SEQ_CST);
+
+	if (old) {
+		/* Readers from now on can't see old. */
+		old->retired = __atomic_add_fetch(&ht->epoch, 1,
+						  __ATOMIC_SEQ_CST);
+		old->next = ht->retired;
+		ht->retired = old;
+	}
+	return true;
+}
+
+bool htable_rcu_add(struct htable_rcu *ht, size_t hash, const void *p)
+{
+	struct htable_rcu_table *t;
+	bool ret = true;
+
+	assert(p);
+	pthread_mutex_lock(&ht->lock);
+	reclaim(ht);
+	t = ht->table;
+	if (!t || t->elems + 1 + t->deleted > t->max) {
+		unsigned int bits;
+
+		if (!t)
+			bits = 4;
+		/* Mostly deleted entries?  Just clean them out. */
+		else if (t->elems + 1 <= t->max / 2)
+			bits = t->bits;
+		else
+			bits = t->bits + 1;
+		if (!replace_table(ht, bits)) {
+			ret = false;
+			goto out;
+		}
+		t = ht->table;
+	}
+	table_add(t, p, hash);
+out:
+	pthread_mutex_unlock(&ht->lock);
+	return ret;
+}
+
+bool htable_rcu_del(struct htable_rcu *ht, size_t h, const void *p)
+{
+	struct htable_rcu_table *t;
+	size_t mask, i;
+	bool ret = false;
+
+	pthread_mutex_lock(&ht->lock);
+	t = ht->table;
+	if (!t)
+		goto out;
+
+	mask = ((size_t)1 << t->bits) - 1;
+	for (i = h & mask; t->slots[i].p; i = (i + 1) & mask) {
+		if (t->slots[i].p == p && t->slots[i].hash == h) {
+			/* Not NULL: that would break later probe chains. */
+			__atomic_store_n(&t->slots[i].p, HTABLE_RCU_DELETED,
+					 __ATOMIC_RELEASE);
+			t->elems--;
+			t->deleted++;
+			ret = true;
+			break;
+		}
+	}
+out:
+	pthread_mutex_unlock(&ht->lock);
+	return ret;
+}
+
+/* Find the next valid entry at or after i->off. */
+static void *htable_rcu_scan(struct htable_rcu_iter *i)
+{
+	if (!i->t)
+		return NULL;
+	for (; i->off < (size_t)1 << i->t->bits; i->off++) {
+		const void *p = __atomic_load_n(&i->t->slots[i->off].p,
+						__ATOMIC_ACQUIRE);
+		if (p && p != HTABLE_RCU_DELETED)
+			return (void *)p;
+	}
+	return NULL;
+}
+
+void *htable_rcu_first(const struct htable_rcu *ht,
+		       struct htable_rcu_iter *i)
+{
+	i->t = __atomic_load_n(&ht->table, __ATOMIC_ACQUIRE);
+	i->off = 0;
+	return htable_rcu_scan(i);
+}
+
+void *htable_rcu_next(const struct htable_rcu *ht,
+		      struct htable_rcu_iter *i)
+{
+	i->off++;
+	return htable_rcu_scan(i);
+}
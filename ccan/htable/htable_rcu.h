@@ -0,0 +1,227 @@
+/* Licensed under LGPLv2+ - see LICENSE file for details */
+#ifndef CCAN_HTABLE_RCU_H
+#define CCAN_HTABLE_RCU_H
+#include "config.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/* We use 0x1 as deleted marker. */
+#define HTABLE_RCU_DELETED ((const void *)0x1)
+
+/* One table: readers only ever see these fully built. */
+struct htable_rcu_table {
+	unsigned int bits;
+	size_t elems, deleted, max;
+	/* Once replaced, when it was retired and what's next on the list. */
+	unsigned long retired;
+	struct htable_rcu_table *next;
+	struct htable_rcu_slot {
+		size_t hash;
+		const void *p;
+	} slots[];
+};
+
+/**
+ * struct htable_rcu_reader - a thread which reads a htable_rcu.
+ *
+ * Each thread which calls htable_rcu_get() needs one of these,
+ * registered with htable_rcu_reader_register().
+ */
+struct htable_rcu_reader {
+	struct htable_rcu_reader *next;
+	/* Epoch we entered our read section in, or 0 if not in one. */
+	unsigned long epoch;
+};
+
+/**
+ * struct htable_rcu - private definition of a concurrent htable.
+ *
+ * This is a hash table which any number of threads can read while
+ * another changes it.  Readers take no locks and write nothing shared,
+ * so lookups scale across cores; writers are serialized by a mutex.
+ *
+ * Readers can hold on to a table (or an element) after a writer has
+ * replaced (or deleted) it, so these can't be freed immediately.
+ * Readers register, and mark when they are reading; old tables are
+ * freed once no reader is still reading from before they were replaced.
+ * Call htable_rcu_synchronize() before freeing deleted elements.
+ *
+ * It's exposed here so you can put it in your structures and so we can
+ * supply inline functions.
+ */
+struct htable_rcu {
+	pthread_mutex_t lock;
+	struct htable_rcu_table *table;
+	struct htable_rcu_table *retired;
+	struct htable_rcu_reader *readers;
+	unsigned long epoch;
+};
+
+/**
+ * htable_rcu_init - initialize an empty hash table.
+ * @ht: the hash table to initialize
+ *
+ * Unlike htable, the hash values are stored in the table, so no
+ * rehash function is needed.
+ */
+void htable_rcu_init(struct htable_rcu *ht);
+
+/**
+ * htable_rcu_clear - empty a hash table.
+ * @ht: the hash table to clear
+ *
+ * No-one can be using the table while this is called.  This doesn't do
+ * anything to any pointers left in it.
+ */
+void htable_rcu_clear(struct htable_rcu *ht);
+
+/**
+ * htable_rcu_reader_register - register a reading thread.
+ * @ht: the hash table
+ * @r: the reader (usually one per thread)
+ */
+void htable_rcu_reader_register(struct htable_rcu *ht,
+				struct htable_rcu_reader *r);
+
+/**
+ * htable_rcu_reader_unregister - unregister a reading thread.
+ * @ht: the hash table
+ * @r: the reader (must not be inside htable_rcu_read_lock())
+ */
+void htable_rcu_reader_unregister(struct htable_rcu *ht,
+				  struct htable_rcu_reader *r);
+
+/**
+ * htable_rcu_read_lock - enter a read section.
+ * @ht: the hash table
+ * @r: this thread's reader
+ *
+ * This doesn't actually lock anything: it marks that @r may be using
+ * the table (and anything found in it) until htable_rcu_read_unlock().
+ * Keep read sections short; a reader which never leaves one means old
+ * tables are never freed.  Read sections don't nest.
+ */
+static inline void htable_rcu_read_lock(const struct htable_rcu *ht,
+					struct htable_rcu_reader *r)
+{
+	__atomic_store_n(&r->epoch, __atomic_load_n(&ht->epoch,
+						     __ATOMIC_SEQ_CST),
+			 __ATOMIC_SEQ_CST);
+	/* Our epoch must be visible before we look at the table. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+ * htable_rcu_read_unlock - leave a read section.
+ * @ht: the hash table
+ * @r: this thread's reader
+ *
+ * After this, pointers found in the table may be freed under you.
+ */
+static inline void htable_rcu_read_unlock(const struct htable_rcu *ht,
+					  struct htable_rcu_reader *r)
+{
+	__atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * htable_rcu_add - add a pointer into a hash table.
+ * @ht: the htable
+ * @hash: the hash value of the object
+ * @p: the non-NULL pointer
+ *
+ * This can only fail due to allocation failure.  It can be called
+ * concurrently with readers and other writers.
+ */
+bool htable_rcu_add(struct htable_rcu *ht, size_t hash, const void *p);
+
+/**
+ * htable_rcu_del - remove a pointer from a hash table
+ * @ht: the htable
+ * @hash: the hash value of the object
+ * @p: the pointer
+ *
+ * Returns true if the pointer was found (and deleted).  Readers may
+ * still be using @p: call htable_rcu_synchronize() before freeing it.
+ */
+bool htable_rcu_del(struct htable_rcu *ht, size_t hash, const void *p);
+
+/**
+ * htable_rcu_synchronize - wait for readers which might see old entries.
+ * @ht: the htable
+ *
+ * Once this returns, no reader can still be using anything deleted
+ * from the table before it was called.
+ */
+void htable_rcu_synchronize(struct htable_rcu *ht);
+
+/**
+ * htable_rcu_get - find an entry in the hash table
+ * @ht: the hashtable
+ * @h: the hash value of the entry
+ * @cmp: the comparison function
+ * @ptr: the pointer to hand to the comparison function.
+ *
+ * Must be called inside htable_rcu_read_lock() (or by the only thread
+ * using the table).  The result is valid until htable_rcu_read_unlock().
+ */
+static inline void *htable_rcu_get(const struct htable_rcu *ht,
+				   size_t h,
+				   bool (*cmp)(const void *candidate, void *ptr),
+				   const void *ptr)
+{
+	const struct htable_rcu_table *t;
+	size_t mask, i;
+
+	t = __atomic_load_n(&ht->table, __ATOMIC_ACQUIRE);
+	if (!t)
+		return NULL;
+
+	mask = ((size_t)1 << t->bits) - 1;
+	for (i = h & mask;; i = (i + 1) & mask) {
+		const void *p = __atomic_load_n(&t->slots[i].p,
+						__ATOMIC_ACQUIRE);
+		if (!p)
+			return NULL;
+		if (p != HTABLE_RCU_DELETED
+		    && __atomic_load_n(&t->slots[i].hash,
+				       __ATOMIC_RELAXED) == h
+		    && cmp(p, (void *)ptr))
+			return (void *)p;
+	}
+}
+
+/**
+ * struct htable_rcu_iter - iterator for htable_rcu_first etc.
+ *
+ * This refers to a location inside one version of the hashtable.
+ */
+struct htable_rcu_iter {
+	const struct htable_rcu_table *t;
+	size_t off;
+};
+
+/**
+ * htable_rcu_first - find an entry in the hash table
+ * @ht: the hashtable
+ * @i: the struct htable_rcu_iter to initialize
+ *
+ * Get an entry in the hashtable; NULL if empty.  As with
+ * htable_rcu_get(), use this inside a read section.  Entries added or
+ * deleted while iterating may or may not be seen.
+ */
+void *htable_rcu_first(const struct htable_rcu *ht,
+		       struct htable_rcu_iter *i);
+
+/**
+ * htable_rcu_next - find another entry in the hash table
+ * @ht: the hashtable
+ * @i: the struct htable_rcu_iter to use
+ *
+ * Get another entry in the hashtable; NULL if all done.
+ */
+void *htable_rcu_next(const struct htable_rcu *ht,
+		      struct htable_rcu_iter *i);
+#endif /* CCAN_HTABLE_RCU_H */
@@ -0,0 +1,196 @@
+/* Licensed under LGPLv2+ - see LICENSE file for details */
+#include <ccan/htable/htable_swiss.h>
+#include <ccan/compiler/compiler.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/* Smallest table: one whole group, so a group never holds a slot twice. */
+#define HTABLE_SWISS_MIN_BITS 4
+
+static inline bool ctrl_is_full(uint8_t c)
+{
+	return !(c & 0x80);
+}
+
+static size_t num_slots(const struct htable_swiss *ht)
+{
+	return (size_t)1 << ht->bits;
+}
+
+/* The first group is copied after the end, so groups never wrap. */
+static void set_ctrl(struct htable_swiss *ht, size_t slot, uint8_t c)
+{
+	ht->ctrl[slot] = c;
+	if (slot < HTABLE_SWISS_GROUP)
+		ht->ctrl[num_slots(ht) + slot] = c;
+}
+
+void htable_swiss_init(struct htable_swiss *ht,
+		       size_t (*rehash)(const void *elem, void *priv),
+		       void *priv)
+{
+	struct htable_swiss empty = HTABLE_SWISS_INITIALIZER(empty, NULL, NULL);
+	*ht = empty;
+	ht->rehash = rehash;
+	ht->priv = priv;
+}
+
+void htable_swiss_clear(struct htable_swiss *ht)
+{
+	free(ht->ctrl);
+	free(ht->slots);
+	htable_swiss_init(ht, ht->rehash, ht->priv);
+}
+
+/* This does not expand the hash table, that's up to caller. */
+static void ht_add(struct htable_swiss *ht, const void *new, size_t h)
+{
+	size_t mask = num_slots(ht) - 1, pos, slot;
+	uint64_t m;
+
+	pos = htable_swiss_pos(ht, h);
+	for (;;) {
+		const uint8_t *group = ht->ctrl + pos;
+
+		m = htable_swiss_match(group, HTABLE_SWISS_EMPTY)
+			| htable_swiss_match(group, HTABLE_SWISS_DELETED);
+		if (m)
+			break;
+		pos = (pos + HTABLE_SWISS_GROUP) & mask;
+	}
+
+	slot = (pos + htable_swiss_first_match(m)) & mask;
+	if (ht->ctrl[slot] == HTABLE_SWISS_DELETED)
+		ht->deleted--;
+	set_ctrl(ht, slot, htable_swiss_h2(ht, h));
+	ht->slots[slot] = new;
+}
+
+/* Move everything into a new table of @bits (which drops deleted ones). */
+static COLD bool resize_table(struct htable_swiss *ht, unsigned int bits)
+{
+	uint8_t *oldctrl = ht->ctrl;
+	const void **oldslots = ht->slots;
+	size_t i, oldnum = oldctrl ? num_slots(ht) : 0;
+	size_t num = (size_t)1 << bits;
+
+	ht->ctrl = malloc(num + HTABLE_SWISS_GROUP);
+	ht->slots = calloc(num, sizeof(ht->slots[0]));
+	if (!ht->ctrl || !ht->slots) {
+		free(ht->ctrl);
+		free(ht->slots);
+		ht->ctrl = oldctrl;
+		ht->slots = oldslots;
+		return false;
+	}
+	memset(ht->ctrl, HTABLE_SWISS_EMPTY, num + HTABLE_SWISS_GROUP);
+	ht->bits = bits;
+	ht->deleted = 0;
+	/* Keep at least one empty slot in every probe sequence. */
+	ht->max = num / 8 * 7;
+
+	for (i = 0; i < oldnum; i++) {
+		if (ctrl_is_full(oldctrl[i]))
+			ht_add(ht, oldslots[i], ht->rehash(oldslots[i], ht->priv));
+	}
+	free(oldctrl);
+	free(oldslots);
+	return true;
+}
+
+bool htable_swiss_add(struct htable_swiss *ht, size_t hash, const void *p)
+{
+	assert(p);
+	if (ht->elems + 1 + ht->deleted > ht->max) {
+		unsigned int bits;
+
+		if (!ht->ctrl)
+			bits = HTABLE_SWISS_MIN_BITS;
+		/* Mostly deleted entries?  Just clean them out. */
+		else if (ht->elems + 1 <= ht->max / 2)
+			bits = ht->bits;
+		else
+			bits = ht->bits + 1;
+		if (!resize_table(ht, bits))
+			return false;
+	}
+
+	ht_add(ht, p, hash);
+	ht->elems++;
+	return true;
+}
+
+static void delete_slot(struct htable_swiss *ht, size_t slot)
+{
+	assert(ctrl_is_full(ht->ctrl[slot]));
+	/* Not empty: that would break later probe sequences. */
+	set_ctrl(ht, slot, HTABLE_SWISS_DELETED);
+	ht->slots[slot] = NULL;
+	ht->elems--;
+	ht->deleted++;
+}
+
+bool htable_swiss_del(struct htable_swiss *ht, size_t h, const void *p)
+{
+	size_t mask = num_slots(ht) - 1, pos;
+	uint8_t h2;
+
+	if (!ht->elems)
+		return false;
+
+	pos = htable_swiss_pos(ht, h);
+	h2 = htable_swiss_h2(ht, h);
+	for (;;) {
+		const uint8_t *group = ht->ctrl + pos;
+		uint64_t m = htable_swiss_match(group, h2);
+
+		while (m) {
+			size_t slot;
+			slot = (pos + htable_swiss_first_match(m)) & mask;
+			if (ht->slots[slot] == p) {
+				delete_slot(ht, slot);
+				return true;
+			}
+			m &= m - 1;
+		}
+		if (htable_swiss_match(group, HTABLE_SWISS_EMPTY))
+			return false;
+		pos = (pos + HTABLE_SWISS_GROUP) & mask;
+	}
+}
+
+/* Find the next full slot at or after i->off. */
+static void *htable_swiss_scan(const struct htable_swiss *ht,
+			       struct htable_swiss_iter *i)
+{
+	if (!ht->ctrl)
+		return NULL;
+	for (; i->off < num_slots(ht); i->off++) {
+		if (ctrl_is_full(ht->ctrl[i->off]))
+			return (void *)ht->slots[i->off];
+	}
+	return NULL;
+}
+
+void *htable_swiss_first(const struct htable_swiss *ht,
+			 struct htable_swiss_iter *i)
+{
+	i->off = 0;
+	return htable_swiss_scan(ht, i);
+}
+
+void *htable_swiss_next(const struct htable_swiss *ht,
+			struct htable_swiss_iter *i)
+{
+	i->off++;
+	return htable_swiss_scan(ht, i);
+}
+
+void htable_swiss_delval(struct htable_swiss *ht,
+			 struct htable_swiss_iter *i)
+{
+	assert(ht->ctrl);
+	assert(i->off < num_slots(ht));
+	delete_slot(ht, i->off);
+}
@@ -0,0 +1,235 @@
+/* Licensed under LGPLv2+ - see LICENSE file for details */
+#ifndef CCAN_HTABLE_SWISS_H
+#define CCAN_HTABLE_SWISS_H
+#include "config.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/**
+ * struct htable_swiss - private definition of a control-byte htable.
+ *
+ * This is an alternative to struct htable with the same interface.
+ * Instead of stealing bits from the pointers, it keeps a separate
+ * array of control bytes, one per slot: either empty, deleted, or 7
+ * bits of the hash.  Lookups compare 16 control bytes at once (using
+ * SSE2 or NEON if available), and only touch the pointer (and call
+ * the comparison function) when those 7 bits match.  That means far
+ * fewer cache misses on lookups which fail.
+ *
+ * It's exposed here so you can put it in your structures and so we can
+ * supply inline functions.
+ */
+struct htable_swiss {
+	size_t (*rehash)(const void *elem, void *priv);
+	void *priv;
+	unsigned int bits;
+	size_t elems, deleted, max;
+	/* 1 << bits control bytes, plus a copy of the first group. */
+	uint8_t *ctrl;
+	const void **slots;
+};
+
+/* How many control bytes we probe at once. */
+#define HTABLE_SWISS_GROUP 16
+
+/* Control byte values: anything else is 7 bits of hash. */
+#define HTABLE_SWISS_EMPTY 0x80
+#define HTABLE_SWISS_DELETED 0xFE
+
+/**
+ * HTABLE_SWISS_INITIALIZER - static initialization for a hash table.
+ * @name: name of this htable.
+ * @rehash: hash function to use for rehashing.
+ * @priv: private argument to @rehash function.
+ *
+ * Example:
+ *	static size_t rehash(const void *elem, void *unused)
+ *	{
+ *		return *(size_t *)elem;
+ *	}
+ *	static struct htable_swiss ht
+ *		= HTABLE_SWISS_INITIALIZER(ht, rehash, NULL);
+ */
+#define HTABLE_SWISS_INITIALIZER(name, rehash, priv)		\
+	{ rehash, priv, 0, 0, 0, 0, NULL, NULL }
+
+/**
+ * htable_swiss_init - initialize an empty hash table.
+ * @ht: the hash table to initialize
+ * @rehash: hash function to use for rehashing.
+ * @priv: private argument to @rehash function.
+ */
+void htable_swiss_init(struct htable_swiss *ht,
+		       size_t (*rehash)(const void *elem, void *priv),
+		       void *priv);
+
+/**
+ * htable_swiss_clear - empty a hash table.
+ * @ht: the hash table to clear
+ *
+ * This doesn't do anything to any pointers left in it.
+ */
+void htable_swiss_clear(struct htable_swiss *ht);
+
+/**
+ * htable_swiss_add - add a pointer into a hash table.
+ * @ht: the htable
+ * @hash: the hash value of the object
+ * @p: the non-NULL pointer
+ *
+ * This can only fail due to allocation failure.
+ */
+bool htable_swiss_add(struct htable_swiss *ht, size_t hash, const void *p);
+
+/**
+ * htable_swiss_del - remove a pointer from a hash table
+ * @ht: the htable
+ * @hash: the hash value of the object
+ * @p: the pointer
+ *
+ * Returns true if the pointer was found (and deleted).
+ */
+bool htable_swiss_del(struct htable_swiss *ht, size_t hash, const void *p);
+
+/**
+ * struct htable_swiss_iter - iterator for htable_swiss_first etc.
+ *
+ * This refers to a location inside the hashtable.
+ */
+struct htable_swiss_iter {
+	size_t off;
+};
+
+/* Bitmasks of matching control bytes within a group: one bit per slot,
+ * at bit (slot << HTABLE_SWISS_SHIFT). */
+#if defined(__SSE2__)
+#define HTABLE_SWISS_SHIFT 0
+static inline uint64_t htable_swiss_match(const uint8_t *group, uint8_t c)
+{
+	__m128i g = _mm_loadu_si128((const __m128i *)group);
+
+	return (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(g,
+							 _mm_set1_epi8(c)));
+}
+#elif defined(__ARM_NEON)
+/* NEON has no movemask: narrow each byte result to a nibble instead. */
+#define HTABLE_SWISS_SHIFT 2
+static inline uint64_t htable_swiss_match(const uint8_t *group, uint8_t c)
+{
+	uint8x16_t eq = vceqq_u8(vld1q_u8(group), vdupq_n_u8(c));
+	uint8x8_t n = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+
+	return vget_lane_u64(vreinterpret_u64_u8(n), 0)
+		& 0x1111111111111111ULL;
+}
+#else
+#define HTABLE_SWISS_SHIFT 0
+static inline uint64_t htable_swiss_match(const uint8_t *group, uint8_t c)
+{
+	uint64_t mask = 0;
+	unsigned int i;
+
+	for (i = 0; i < HTABLE_SWISS_GROUP; i++)
+		mask |= (uint64_t)(group[i] == c) << i;
+	return mask;
+}
+#endif
+
+static inline unsigned int htable_swiss_first_match(uint64_t mask)
+{
+#if HAVE_BUILTIN_FFSLL
+	return (__builtin_ffsll(mask) - 1) >> HTABLE_SWISS_SHIFT;
+#else
+	unsigned int i;
+
+	for (i = 0; !(mask & 1); i++)
+		mask >>= 1;
+	return i >> HTABLE_SWISS_SHIFT;
+#endif
+}
+
+static inline size_t htable_swiss_pos(const struct htable_swiss *ht,
+				      size_t hash)
+{
+	return hash & (((size_t)1 << ht->bits) - 1);
+}
+
+/* The next 7 bits after the ones which pick the position. */
+static inline uint8_t htable_swiss_h2(const struct htable_swiss *ht,
+				      size_t hash)
+{
+	return (hash >> ht->bits) & 0x7F;
+}
+
+/**
+ * htable_swiss_get - find an entry in the hash table
+ * @ht: the hashtable
+ * @h: the hash value of the entry
+ * @cmp: the comparison function
+ * @ptr: the pointer to hand to the comparison function.
+ */
+static inline void *htable_swiss_get(const struct htable_swiss *ht,
+				     size_t h,
+				     bool (*cmp)(const void *candidate,
+						 void *ptr),
+				     const void *ptr)
+{
+	size_t mask = ((size_t)1 << ht->bits) - 1, pos;
+	uint8_t h2;
+
+	if (!ht->elems)
+		return NULL;
+
+	pos = htable_swiss_pos(ht, h);
+	h2 = htable_swiss_h2(ht, h);
+	for (;;) {
+		const uint8_t *group = ht->ctrl + pos;
+		uint64_t m = htable_swiss_match(group, h2);
+
+		while (m) {
+			size_t slot;
+			slot = (pos + htable_swiss_first_match(m)) & mask;
+			if (cmp(ht->slots[slot], (void *)ptr))
+				return (void *)ht->slots[slot];
+			m &= m - 1;
+		}
+		if (htable_swiss_match(group, HTABLE_SWISS_EMPTY))
+			return NULL;
+		pos = (pos + HTABLE_SWISS_GROUP) & mask;
+	}
+}
+
+/**
+ * htable_swiss_first - find an entry in the hash table
+ * @ht: the hashtable
+ * @i: the struct htable_swiss_iter to initialize
+ *
+ * Get an entry in the hashtable; NULL if empty.
+ */
+void *htable_swiss_first(const struct htable_swiss *ht,
+			 struct htable_swiss_iter *i);
+
+/**
+ * htable_swiss_next - find another entry in the hash table
+ * @ht: the hashtable
+ * @i: the struct htable_swiss_iter to use
+ *
+ * Get another entry in the hashtable; NULL if all done.
+ */
+void *htable_swiss_next(const struct htable_swiss *ht,
+			struct htable_swiss_iter *i);
+
+/**
+ * htable_swiss_delval - remove an iterated pointer from a hash table
+ * @ht: the htable
+ * @i: the htable_swiss_iter
+ */
+void htable_swiss_delval(struct htable_swiss *ht,
+			 struct htable_swiss_iter *i);
+#endif /* CCAN_HTABLE_SWISS_H */
@@ -2,6 +2,7 @@
 #ifndef CCAN_HTABLE_TYPE_H
 #define CCAN_HTABLE_TYPE_H
 #include <ccan/htable/htable.h>
+#include <ccan/htable/htable_swiss.h>
 #include "config.h"
 
 /**
@@ -32,6 +33,15 @@
  * Find function return the matching element, or NULL:
  *	type *<name>_get(const struct @name *ht, const <keytype> *k);
  *
+ * Bulk versions: reserve space, add an array, and look up an array of keys
+ * (setting each result to the element or NULL, and returning the number
+ * found):
+ *	bool <name>_reserve(struct <name> *ht, size_t num);
+ *	bool <name>_add_many(struct <name> *ht, type *const elems[], size_t num);
+ *	size_t <name>_get_many(const struct <name> *ht,
+ *			       const <keytype> keys[], type *results[],
+ *			       size_t num);
+ *
  * Iteration over hashtable is also supported:
  *	type *<name>_first(const struct <name> *ht, struct <name>_iter *i);
  *	type *<name>_next(const struct <name> *ht, struct <name>_iter *i);
@@ -43,27 +53,75 @@
  *	struct <name> ht = { HTABLE_INITIALIZER(ht.raw, <name>_hash, NULL) };
  */
 #define HTABLE_DEFINE_TYPE(type, keyof, hashfn, eqfn, name)		\
-	struct name { struct htable raw; };				\
-	struct name##_iter { struct htable_iter i; };			\
+	HTABLE_DEFINE_TYPE_OF(htable, type, keyof, hashfn, eqfn, name)	\
+	static inline bool name##_reserve(struct name *ht, size_t num)	\
+	{								\
+		return htable_reserve(&ht->raw, num);			\
+	}								\
+	static inline bool name##_add_many(struct name *ht,		\
+					   type *const elems[], size_t num) \
+	{								\
+		return htable_add_many(&ht->raw,			\
+				       (const void *const *)elems, num); \
+	}								\
+	static inline size_t name##_get_many(const struct name *ht,	\
+				const HTABLE_KTYPE(keyof) keys[],	\
+				type *results[], size_t num)		\
+	{								\
+		size_t i, j, n, found = 0, hashes[HTABLE_BATCH];	\
+		for (i = 0; i < num; i += n) {				\
+			n = num - i < HTABLE_BATCH ? num - i : HTABLE_BATCH; \
+			for (j = 0; j < n; j++)				\
+				hashes[j] = hashfn(keys[i+j]);		\
+			found += htable_get_many(&ht->raw, n, hashes,	\
+				(bool (*)(const void *, void *))(eqfn),	\
+				(const void *const *)keys + i,		\
+				(void **)results + i);			\
+		}							\
+		return found;						\
+	}
+
+/**
+ * HTABLE_SWISS_DEFINE_TYPE - create a set of htable_swiss ops for a type
+ * @type: a type whose pointers will be values in the hash.
+ * @keyof: a function/macro to extract a key: <keytype> @keyof(const type *elem)
+ * @hashfn: a hash function for a @key: size_t @hashfn(const <keytype> *)
+ * @eqfn: an equality function keys: bool @eqfn(const type *, const <keytype> *)
+ * @prefix: a prefix for all the functions to define (of form <name>_*)
+ *
+ * This is exactly like HTABLE_DEFINE_TYPE, but uses struct htable_swiss
+ * underneath: pick it if most of your lookups fail.  Use
+ * HTABLE_SWISS_INITIALIZER instead of HTABLE_INITIALIZER.
+ *
+ * Since it doesn't steal bits from the pointers, @hashfn should give
+ * good low bits: they pick both the position and the control byte.
+ */
+#define HTABLE_SWISS_DEFINE_TYPE(type, keyof, hashfn, eqfn, name)	\
+	HTABLE_DEFINE_TYPE_OF(htable_swiss, type, keyof, hashfn, eqfn, name)
+
+/* Both of the above: @base is the underlying table, htable or htable_swiss */
+#define HTABLE_DEFINE_TYPE_OF(base, type, keyof, hashfn, eqfn, name)	\
+	struct name { struct base raw; };				\
+	struct name##_iter { struct base##_iter i; };			\
 	static inline size_t name##_hash(const void *elem, void *priv)	\
 	{								\
 		return hashfn(keyof((const type *)elem));		\
 	}								\
 	static inline void name##_init(struct name *ht)			\
 	{								\
-		htable_init(&ht->raw, name##_hash, NULL);		\
+		base##_init(&ht->raw, name##_hash, NULL);		\
 	}								\
 	static inline void name##_clear(struct name *ht)		\
 	{								\
-		htable_clear(&ht->raw);					\
+		base##_clear(&ht->raw);					\
 	}								\
 	static inline bool name##_add(struct name *ht, const type *elem) \
 	{								\
-		return htable_add(&ht->raw, hashfn(keyof(elem)), elem);	\
+		return base##_add(&ht->raw, hashfn(keyof(elem)), elem);	\
 	}								\
 	static inline bool name##_del(struct name *ht, const type *elem) \
 	{								\
-		return htable_del(&ht->raw, hashfn(keyof(elem)), elem);	\
+		return base##_del(&ht->raw, hashfn(keyof(elem)), elem);	\
 	}								\
 	static inline type *name##_get(const struct name *ht,		\
 				       const HTABLE_KTYPE(keyof) k)	\
@@ -71,7 +129,7 @@
 		/* Typecheck for eqfn */				\
 		(void)sizeof(eqfn((const type *)NULL,			\
 				  keyof((const type *)NULL)));		\
-		return htable_get(&ht->raw,				\
+		return base##_get(&ht->raw,				\
 				  hashfn(k),				\
 				  (bool (*)(const void *, void *))(eqfn), \
 				  k);					\
@@ -87,12 +145,12 @@
 	static inline type *name##_first(const struct name *ht,		\
 					 struct name##_iter *iter)	\
 	{								\
-		return htable_first(&ht->raw, &iter->i);		\
+		return base##_first(&ht->raw, &iter->i);		\
 	}								\
 	static inline type *name##_next(const struct name *ht,		\
 					struct name##_iter *iter)	\
 	{								\
-		return htable_next(&ht->raw, &iter->i);			\
+		return base##_next(&ht->raw, &iter->i);			\
 	}
 
 #if HAVE_TYPEOF
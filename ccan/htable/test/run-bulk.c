@@ -0,0 +1,130 @@
+#include <ccan/htable/htable_type.h>
+#include <ccan/htable/htable.c>
+#include <ccan/tap/tap.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define NUM_BITS 9
+#define NUM_VALS (1 << NUM_BITS)
+
+struct obj {
+	/* Makes sure we don't try to treat and obj as a key or vice versa */
+	unsigned char unused;
+	unsigned int key;
+};
+
+static const unsigned int *objkey(const struct obj *obj)
+{
+	return &obj->key;
+}
+
+/* We use the number divided by two as the hash (for lots of
+   collisions), plus set all the higher bits so we can detect if they
+   don't get masked out. */
+static size_t objhash(const unsigned int *key)
+{
+	size_t h = *key / 2;
+	h |= -1UL << NUM_BITS;
+	return h;
+}
+
+static bool cmp(const struct obj *obj, const unsigned int *key)
+{
+	return obj->key == *key;
+}
+
+HTABLE_DEFINE_TYPE(struct obj, objkey, objhash, cmp, htable_obj);
+
+static bool find_all(const struct htable_obj *ht, struct obj val[],
+		     unsigned int num)
+{
+	const unsigned int *keys[NUM_VALS * 2];
+	struct obj *results[NUM_VALS * 2];
+	unsigned int i, misses[NUM_VALS];
+
+	/* Every key, interleaved with ones which aren't there. */
+	for (i = 0; i < num; i++) {
+		misses[i] = NUM_VALS + i;
+		keys[i*2] = &val[i].key;
+		keys[i*2+1] = &misses[i];
+	}
+	if (htable_obj_get_many(ht, keys, results, num * 2) != num)
+		return false;
+	for (i = 0; i < num; i++) {
+		if (results[i*2] != &val[i] || results[i*2+1])
+			return false;
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i;
+	struct htable_obj ht;
+	struct obj val[NUM_VALS], *ptrs[NUM_VALS];
+	struct obj *spread[NUM_VALS];
+	struct htable_obj_iter iter;
+	void *p;
+
+	plan_tests(17);
+	for (i = 0; i < NUM_VALS; i++) {
+		val[i].key = i;
+		ptrs[i] = &val[i];
+	}
+
+	/* Reserving makes the table big enough, once. */
+	htable_obj_init(&ht);
+	ok1(htable_obj_reserve(&ht, NUM_VALS));
+	ok1(ht.raw.max >= NUM_VALS);
+	ok1(ht.raw.bits == NUM_BITS + 1);
+	/* It never shrinks. */
+	ok1(htable_obj_reserve(&ht, 1));
+	ok1(ht.raw.bits == NUM_BITS + 1);
+
+	/* Adding them all at once doesn't need to grow it. */
+	ok1(htable_obj_add_many(&ht, ptrs, NUM_VALS));
+	ok1(ht.raw.bits == NUM_BITS + 1);
+	ok1(ht.raw.elems == NUM_VALS);
+	ok1(find_all(&ht, val, NUM_VALS));
+
+	i = 0;
+	for (p = htable_obj_first(&ht,&iter); p; p = htable_obj_next(&ht, &iter))
+		i++;
+	ok1(i == NUM_VALS);
+	htable_obj_clear(&ht);
+
+	/* Without reserving, and adding to existing entries.  These
+	 * pointers have different common bits from the ones already in. */
+	htable_obj_init(&ht);
+	ok1(htable_obj_add_many(&ht, ptrs, NUM_VALS / 2));
+	for (i = 0; i < NUM_VALS / 2; i++) {
+		spread[i] = malloc(sizeof(struct obj));
+		spread[i]->key = NUM_VALS / 2 + i;
+	}
+	ok1(htable_obj_add_many(&ht, spread, NUM_VALS / 2));
+	ok1(ht.raw.elems == NUM_VALS);
+	for (i = 0; i < NUM_VALS / 2; i++)
+		val[NUM_VALS / 2 + i] = *spread[i];
+	for (i = 0; i < NUM_VALS / 2; i++)
+		if (htable_obj_get(&ht, &i) != &val[i])
+			break;
+	ok1(i == NUM_VALS / 2);
+	for (i = NUM_VALS / 2; i < NUM_VALS; i++)
+		if (htable_obj_get(&ht, &i) != spread[i - NUM_VALS / 2])
+			break;
+	ok1(i == NUM_VALS);
+	for (i = 0; i < NUM_VALS / 2; i++)
+		free(spread[i]);
+	htable_obj_clear(&ht);
+
+	/* Incremental mode: bulk add finishes any move. */
+	htable_obj_init(&ht);
+	htable_set_incremental(&ht.raw, true);
+	for (i = 0; i < NUM_VALS / 2; i++)
+		htable_obj_add(&ht, &val[i]);
+	ok1(htable_obj_add_many(&ht, ptrs + NUM_VALS / 2, NUM_VALS / 2));
+	ok1(!ht.raw.old_table && find_all(&ht, val, NUM_VALS));
+	htable_obj_clear(&ht);
+
+	return exit_status();
+}
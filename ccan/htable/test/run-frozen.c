@@ -0,0 +1,141 @@
+#include <ccan/htable/htable_frozen.h>
+#include <ccan/htable/htable.c>
+#include <ccan/htable/htable_frozen.c>
+#include <ccan/read_write_all/read_write_all.c>
+#include <ccan/tap/tap.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define NUM_VALS 1000
+
+struct record {
+	char name[16];
+	unsigned int val;
+};
+
+/* FNV-1a: the same in every process. */
+static size_t hash_name(const char *name)
+{
+	size_t h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619U;
+	return h;
+}
+
+static size_t rehash(const void *elem, void *unused)
+{
+	return hash_name(((const struct record *)elem)->name);
+}
+
+static void describe(const void *elem, const void **key, size_t *keylen,
+		     const void **val, size_t *vallen, void *unused)
+{
+	const struct record *r = elem;
+
+	*key = r->name;
+	*keylen = strlen(r->name);
+	*val = &r->val;
+	*vallen = sizeof(r->val);
+}
+
+static bool find_all(const struct htable_frozen *hf,
+		     const struct record recs[])
+{
+	unsigned int i;
+
+	for (i = 0; i < NUM_VALS; i++) {
+		const unsigned int *v;
+		size_t vallen;
+
+		v = htable_frozen_get(hf, hash_name(recs[i].name),
+				      recs[i].name, strlen(recs[i].name),
+				      &vallen);
+		if (!v || vallen != sizeof(*v) || *v != recs[i].val)
+			return false;
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct record recs[NUM_VALS];
+	char filename[] = "run-frozen.XXXXXX";
+	struct htable_frozen hf;
+	struct htable ht;
+	unsigned int i;
+	uint64_t *copy, *bad, last;
+	struct htable_frozen_record *r;
+	struct stat st;
+	int fd;
+
+	plan_tests(16);
+	htable_init(&ht, rehash, NULL);
+	for (i = 0; i < NUM_VALS; i++) {
+		sprintf(recs[i].name, "name%u", i);
+		recs[i].val = i * 7;
+		htable_add(&ht, hash_name(recs[i].name), &recs[i]);
+	}
+
+	fd = mkstemp(filename);
+	ok1(fd >= 0);
+	ok1(htable_freeze(&ht, fd, describe, NULL));
+	ok1(fstat(fd, &st) == 0);
+	close(fd);
+
+	ok1(htable_frozen_open(&hf, filename));
+	ok1(hf.elems == NUM_VALS);
+	ok1(find_all(&hf, recs));
+	ok1(!htable_frozen_get(&hf, hash_name("name1000"), "name1000", 8, NULL));
+	/* Same hash, different key (a prefix). */
+	ok1(!htable_frozen_get(&hf, hash_name("name1"), "name", 4, NULL));
+
+	/* It works from anywhere in memory. */
+	copy = malloc(st.st_size);
+	memcpy(copy, hf.base, st.st_size);
+	htable_frozen_close(&hf);
+	ok1(htable_frozen_init(&hf, copy, st.st_size));
+	ok1(find_all(&hf, recs));
+
+	/* But not if it's truncated, or isn't one at all. */
+	ok1(!htable_frozen_init(&hf, copy, st.st_size - 8) && errno == EINVAL);
+
+	/* A length which isn't a multiple of 8 can't be valid... */
+	bad = calloc(st.st_size + 8, 1);
+	memcpy(bad, copy, st.st_size);
+	((struct htable_frozen_header *)bad)->size = cpu_to_le64(st.st_size + 4);
+	ok1(!htable_frozen_init(&hf, bad, st.st_size + 4) && errno == EINVAL);
+
+	/* ...and even if it got through, a key running into the padding
+	 * of the last record mustn't let a value run off the end. */
+	ok1(htable_frozen_init(&hf, copy, st.st_size));
+	for (i = 0, last = 0; i <= hf.mask; i++) {
+		if (le64_to_cpu(hf.slots[i].off) > last)
+			last = le64_to_cpu(hf.slots[i].off);
+	}
+	hf.base = (const char *)bad;
+	hf.len = st.st_size + 4;
+	r = (struct htable_frozen_record *)((char *)bad + last);
+	r->keylen = cpu_to_le64(hf.len - last - sizeof(*r));
+	r->vallen = cpu_to_le64(1 << 20);
+	ok1(!htable_frozen_record(&hf, last));
+	free(bad);
+
+	memset(copy, 0, 8);
+	ok1(!htable_frozen_init(&hf, copy, st.st_size) && errno == EINVAL);
+	free(copy);
+	unlink(filename);
+
+	/* An empty table is fine too. */
+	htable_clear(&ht);
+	fd = open(filename, O_RDWR|O_CREAT|O_EXCL, 0600);
+	htable_freeze(&ht, fd, describe, NULL);
+	close(fd);
+	ok1(htable_frozen_open(&hf, filename)
+	    && !htable_frozen_get(&hf, hash_name("name0"), "name0", 5, NULL));
+	htable_frozen_close(&hf);
+	unlink(filename);
+
+	return exit_status();
+}
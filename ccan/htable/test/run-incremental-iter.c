@@ -0,0 +1,69 @@
+#include <ccan/htable/htable.h>
+#include <ccan/htable/htable.c>
+#include <ccan/tap/tap.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define NUM_VALS 3100
+
+/* Scattered, so moved entries land behind the iterator too. */
+static size_t hash(const void *elem, void *unused)
+{
+	return *(uint64_t *)elem * 0x9E3779B97F4A7C15ULL;
+}
+
+static bool objcmp(const void *htelem, void *cmpdata)
+{
+	return *(uint64_t *)htelem == *(uint64_t *)cmpdata;
+}
+
+int main(int argc, char *argv[])
+{
+	static uint64_t val[NUM_VALS];
+	static bool seen[NUM_VALS];
+	struct htable_iter iter;
+	unsigned int i, n = 0, dups = 0;
+	bool found = true;
+	uint64_t *p;
+	struct htable ht;
+
+	plan_tests(6);
+	for (i = 0; i < NUM_VALS; i++)
+		val[i] = i;
+
+	htable_init(&ht, hash, NULL);
+	htable_set_incremental(&ht, true);
+	for (i = 0; i < NUM_VALS; i++)
+		htable_add(&ht, hash(&val[i], NULL), &val[i]);
+	/* We want to catch it mid-move. */
+	ok1(ht.old_table);
+
+	/* Delete the odd ones as we go: we must still see everything.
+	 * htable_delval() never moves entries behind us. */
+	for (p = htable_first(&ht, &iter); p; p = htable_next(&ht, &iter)) {
+		if (seen[*p])
+			dups++;
+		seen[*p] = true;
+		n++;
+		if (*p % 2)
+			htable_delval(&ht, &iter);
+	}
+	ok1(n == NUM_VALS);
+	ok1(dups == 0);
+	ok1(ht.elems == NUM_VALS / 2);
+
+	for (i = 0; i < NUM_VALS; i++) {
+		p = htable_get(&ht, hash(&val[i], NULL), objcmp, &val[i]);
+		if ((p != NULL) != (i % 2 == 0))
+			found = false;
+	}
+	ok1(found);
+
+	/* Adding finishes the move as usual. */
+	for (i = 1; i < NUM_VALS; i += 2)
+		htable_add(&ht, hash(&val[i], NULL), &val[i]);
+	ok1(!ht.old_table);
+	htable_clear(&ht);
+
+	return exit_status();
+}
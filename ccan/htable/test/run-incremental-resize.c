@@ -0,0 +1,99 @@
+#include <ccan/htable/htable.h>
+#include <ccan/htable/htable.c>
+#include <ccan/tap/tap.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define NUM_LIVE 3000
+#define NUM_CHURN 100000
+
+static unsigned int rehashes;
+
+static size_t hash(const void *elem, void *unused)
+{
+	return *(uint64_t *)elem * 0x9E3779B97F4A7C15ULL;
+}
+
+static size_t counting_rehash(const void *elem, void *unused)
+{
+	rehashes++;
+	return hash(elem, unused);
+}
+
+static bool objcmp(const void *htelem, void *cmpdata)
+{
+	return *(uint64_t *)htelem == *(uint64_t *)cmpdata;
+}
+
+static unsigned int count_all(const struct htable *ht)
+{
+	struct htable_iter iter;
+	unsigned int n = 0;
+	void *p;
+
+	for (p = htable_first(ht, &iter); p; p = htable_next(ht, &iter))
+		n++;
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	static uint64_t val[NUM_LIVE + NUM_CHURN];
+	unsigned int i, lo, resizes = 0, max_rehashes = 0;
+	bool found = true, was_moving;
+	struct htable ht;
+
+	plan_tests(7);
+	for (i = 0; i < NUM_LIVE + NUM_CHURN; i++)
+		val[i] = i;
+
+	htable_init(&ht, counting_rehash, NULL);
+	htable_set_incremental(&ht, true);
+	for (i = 0; i < NUM_LIVE; i++)
+		htable_add(&ht, hash(&val[i], NULL), &val[i]);
+
+	/* Nearly full, and every delete leaves a tombstone in the new
+	 * table: resizes come often.  Each must find the last move
+	 * finished, not finish it itself. */
+	for (lo = 0; lo < NUM_CHURN; lo++) {
+		uint64_t *v = &val[NUM_LIVE + lo];
+
+		was_moving = (ht.old_table != NULL);
+		rehashes = 0;
+		htable_add(&ht, hash(v, NULL), v);
+		if (rehashes > max_rehashes)
+			max_rehashes = rehashes;
+		if (!was_moving && ht.old_table)
+			resizes++;
+
+		rehashes = 0;
+		htable_del(&ht, hash(v, NULL), v);
+		if (rehashes > max_rehashes)
+			max_rehashes = rehashes;
+	}
+	ok1(resizes > 2);
+	ok1(max_rehashes <= HTABLE_MIGRATE_BUCKETS);
+	ok1(ht.elems == NUM_LIVE);
+	ok1(count_all(&ht) == NUM_LIVE);
+	for (i = 0; i < NUM_LIVE + NUM_CHURN; i++) {
+		void *p = htable_get(&ht, hash(&val[i], NULL), objcmp, &val[i]);
+		if ((p != NULL) != (i < NUM_LIVE))
+			found = false;
+	}
+	ok1(found);
+
+	/* Deleting alone finishes a move, too. */
+	htable_clear(&ht);
+	htable_set_incremental(&ht, true);
+	for (i = 0; !ht.old_table; i++)
+		htable_add(&ht, hash(&val[i], NULL), &val[i]);
+	while (ht.old_table && i > 0) {
+		i--;
+		htable_del(&ht, hash(&val[i], NULL), &val[i]);
+	}
+	ok1(!ht.old_table);
+	ok1(ht.elems == i);
+	htable_clear(&ht);
+
+	return exit_status();
+}
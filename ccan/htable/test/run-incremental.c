@@ -0,0 +1,140 @@
+#include <ccan/htable/htable.h>
+#include <ccan/htable/htable.c>
+#include <ccan/tap/tap.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define NUM_VALS 10000
+
+static unsigned int rehashes;
+
+/* Lots of collisions, as in run.c. */
+static size_t hash(const void *elem, void *unused)
+{
+	return *(uint64_t *)elem / 2;
+}
+
+static size_t counting_rehash(const void *elem, void *unused)
+{
+	rehashes++;
+	return hash(elem, unused);
+}
+
+static bool objcmp(const void *htelem, void *cmpdata)
+{
+	return *(uint64_t *)htelem == *(uint64_t *)cmpdata;
+}
+
+static bool find_all(const struct htable *ht, uint64_t val[],
+		     unsigned int start, unsigned int end)
+{
+	unsigned int i;
+
+	for (i = start; i < end; i++) {
+		if (htable_get(ht, hash(&val[i], NULL), objcmp, &val[i])
+		    != &val[i])
+			return false;
+	}
+	return true;
+}
+
+static unsigned int count_all(const struct htable *ht)
+{
+	struct htable_iter iter;
+	unsigned int n = 0;
+	void *p;
+
+	for (p = htable_first(ht, &iter); p; p = htable_next(ht, &iter))
+		n++;
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	static uint64_t val[NUM_VALS];
+	unsigned int i, max_rehashes = 0;
+	bool found = true, counted = true, seen_old = false;
+	struct htable ht;
+	uintptr_t perfect_bit;
+
+	plan_tests(14);
+	for (i = 0; i < NUM_VALS; i++)
+		val[i] = i;
+
+	htable_init(&ht, counting_rehash, NULL);
+	htable_set_incremental(&ht, true);
+
+	for (i = 0; i < NUM_VALS; i++) {
+		rehashes = 0;
+		htable_add(&ht, hash(&val[i], NULL), &val[i]);
+		if (rehashes > max_rehashes)
+			max_rehashes = rehashes;
+		if (ht.old_table) {
+			seen_old = true;
+			/* Everything must be findable mid-move. */
+			if (i % 97 == 0) {
+				if (!find_all(&ht, val, 0, i + 1))
+					found = false;
+				if (count_all(&ht) != i + 1)
+					counted = false;
+			}
+		}
+	}
+	ok1(seen_old);
+	ok1(found);
+	ok1(counted);
+	/* No add ever moved more than a few entries. */
+	ok1(max_rehashes <= HTABLE_MIGRATE_BUCKETS);
+	ok1(find_all(&ht, val, 0, NUM_VALS));
+
+	/* Deleting can delete from the old table. */
+	found = true;
+	for (i = 0; i < NUM_VALS; i += 2) {
+		if (!htable_del(&ht, hash(&val[i], NULL), &val[i]))
+			found = false;
+	}
+	ok1(found);
+	ok1(ht.elems == NUM_VALS / 2);
+	ok1(count_all(&ht) == NUM_VALS / 2);
+	found = true;
+	for (i = 0; i < NUM_VALS; i++) {
+		void *p = htable_get(&ht, hash(&val[i], NULL), objcmp, &val[i]);
+		if ((p != NULL) != (i % 2 == 1))
+			found = false;
+	}
+	ok1(found);
+
+	/* Churn: tombstones get cleaned incrementally too. */
+	max_rehashes = 0;
+	for (i = 0; i < NUM_VALS * 4; i++) {
+		unsigned int n = (i * 2) % NUM_VALS;
+		rehashes = 0;
+		if (i / (NUM_VALS / 2) % 2 == 0)
+			htable_add(&ht, hash(&val[n], NULL), &val[n]);
+		else
+			htable_del(&ht, hash(&val[n], NULL), &val[n]);
+		if (rehashes > max_rehashes)
+			max_rehashes = rehashes;
+	}
+	ok1(max_rehashes <= HTABLE_MIGRATE_BUCKETS);
+	ok1(count_all(&ht) == ht.elems);
+
+	/* Turning it off finishes the move. */
+	htable_set_incremental(&ht, false);
+	ok1(!ht.old_table);
+
+	/* Perfect bit corner case from run.c, while moving. */
+	htable_clear(&ht);
+	htable_set_incremental(&ht, true);
+	htable_add(&ht, hash(&val[NUM_VALS-1], NULL), &val[NUM_VALS-1]);
+	perfect_bit = ht.perfect_bit;
+	htable_add(&ht, 0, (void *)((uintptr_t)&val[NUM_VALS-1] | perfect_bit));
+	htable_del(&ht, 0, (void *)((uintptr_t)&val[NUM_VALS-1] | perfect_bit));
+	for (i = 0; i < NUM_VALS-1; i++)
+		htable_add(&ht, hash(&val[i], NULL), &val[i]);
+	ok1(ht.perfect_bit != 0);
+	ok1(find_all(&ht, val, 0, NUM_VALS));
+	htable_clear(&ht);
+
+	return exit_status();
+}
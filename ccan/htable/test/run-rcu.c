@@ -0,0 +1,126 @@
+#include <ccan/htable/htable_rcu.h>
+#include <ccan/htable/htable_rcu.c>
+#include <ccan/tap/tap.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define NUM_VALS 4096
+#define NUM_READERS 4
+
+static struct htable_rcu ht;
+static uint64_t val[NUM_VALS];
+static bool done;
+
+/* Lots of collisions, as in run.c. */
+static size_t hash(uint64_t v)
+{
+	return v / 2;
+}
+
+static bool objcmp(const void *htelem, void *cmpdata)
+{
+	return *(uint64_t *)htelem == *(uint64_t *)cmpdata;
+}
+
+/* Readers keep looking for the first half, which never changes. */
+static void *reader(void *arg)
+{
+	struct htable_rcu_reader r;
+	unsigned long missing = 0;
+	unsigned int i;
+
+	htable_rcu_reader_register(&ht, &r);
+	while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+		for (i = 0; i < NUM_VALS / 2; i++) {
+			uint64_t *p;
+			htable_rcu_read_lock(&ht, &r);
+			p = htable_rcu_get(&ht, hash(val[i]), objcmp, &val[i]);
+			if (p != &val[i])
+				missing++;
+			htable_rcu_read_unlock(&ht, &r);
+		}
+	}
+	htable_rcu_reader_unregister(&ht, &r);
+	return (void *)missing;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i, j;
+	uint64_t dne = NUM_VALS;
+	struct htable_rcu_iter iter;
+	pthread_t readers[NUM_READERS];
+	struct htable_rcu_reader r;
+	bool all_found = true;
+	void *p;
+
+	plan_tests(13);
+	for (i = 0; i < NUM_VALS; i++)
+		val[i] = i;
+
+	htable_rcu_init(&ht);
+	ok1(!htable_rcu_get(&ht, hash(dne), objcmp, &dne));
+	ok1(!htable_rcu_del(&ht, hash(dne), &dne));
+
+	for (i = 0; i < NUM_VALS; i++)
+		htable_rcu_add(&ht, hash(val[i]), &val[i]);
+	ok1(ht.table->elems == NUM_VALS);
+	for (i = 0; i < NUM_VALS; i++)
+		if (htable_rcu_get(&ht, hash(val[i]), objcmp, &val[i])
+		    != &val[i])
+			all_found = false;
+	ok1(all_found);
+	ok1(!htable_rcu_get(&ht, hash(dne), objcmp, &dne));
+
+	/* Walk once, should get them all. */
+	i = 0;
+	for (p = htable_rcu_first(&ht, &iter); p; p = htable_rcu_next(&ht, &iter))
+		i++;
+	ok1(i == NUM_VALS);
+
+	/* Nobody's reading, so no old tables are left. */
+	ok1(!ht.retired);
+
+	/* A reader holds old tables until it's done. */
+	htable_rcu_reader_register(&ht, &r);
+	htable_rcu_read_lock(&ht, &r);
+	for (i = 0; i < NUM_VALS; i++)
+		htable_rcu_add(&ht, hash(val[i]), &val[i]);
+	ok1(ht.retired);
+	for (i = 0; i < NUM_VALS; i++)
+		htable_rcu_del(&ht, hash(val[i]), &val[i]);
+	htable_rcu_read_unlock(&ht, &r);
+	htable_rcu_reader_unregister(&ht, &r);
+	htable_rcu_synchronize(&ht);
+	ok1(!ht.retired);
+
+	/* Delete the second half. */
+	for (i = NUM_VALS / 2; i < NUM_VALS; i++)
+		if (!htable_rcu_del(&ht, hash(val[i]), &val[i]))
+			all_found = false;
+	ok1(all_found);
+	ok1(ht.table->elems == NUM_VALS / 2);
+
+	/* Now churn the second half while readers look up the first. */
+	for (i = 0; i < NUM_READERS; i++)
+		pthread_create(&readers[i], NULL, reader, NULL);
+	for (j = 0; j < 50; j++) {
+		for (i = NUM_VALS / 2; i < NUM_VALS; i++)
+			htable_rcu_add(&ht, hash(val[i]), &val[i]);
+		for (i = NUM_VALS / 2; i < NUM_VALS; i++)
+			htable_rcu_del(&ht, hash(val[i]), &val[i]);
+		htable_rcu_synchronize(&ht);
+	}
+	__atomic_store_n(&done, true, __ATOMIC_RELEASE);
+	for (i = 0; i < NUM_READERS; i++) {
+		void *missing;
+		pthread_join(readers[i], &missing);
+		if (missing)
+			all_found = false;
+	}
+	ok1(all_found);
+	ok1(!ht.readers);
+	htable_rcu_clear(&ht);
+
+	return exit_status();
+}
@@ -0,0 +1,159 @@
+#include <ccan/htable/htable_type.h>
+#include <ccan/htable/htable_swiss.c>
+#include <ccan/tap/tap.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define NUM_BITS 7
+#define NUM_VALS (1 << NUM_BITS)
+
+struct obj {
+	/* Makes sure we don't try to treat and obj as a key or vice versa */
+	unsigned char unused;
+	unsigned int key;
+};
+
+static const unsigned int *objkey(const struct obj *obj)
+{
+	return &obj->key;
+}
+
+/* We use the number divided by two as the hash, for lots of collisions. */
+static size_t objhash(const unsigned int *key)
+{
+	return *key / 2;
+}
+
+static bool cmp(const struct obj *obj, const unsigned int *key)
+{
+	return obj->key == *key;
+}
+
+HTABLE_SWISS_DEFINE_TYPE(struct obj, objkey, objhash, cmp, htable_obj);
+
+static void add_vals(struct htable_obj *ht,
+		     struct obj val[], unsigned int num)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; i++) {
+		if (htable_obj_get(ht, &i)) {
+			fail("%u already in hash", i);
+			return;
+		}
+		htable_obj_add(ht, &val[i]);
+		if (htable_obj_get(ht, &i) != &val[i]) {
+			fail("%u not added to hash", i);
+			return;
+		}
+	}
+	pass("Added %u numbers to hash", i);
+}
+
+static void find_vals(const struct htable_obj *ht,
+		      const struct obj val[], unsigned int num)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; i++) {
+		if (htable_obj_get(ht, &i) != &val[i]) {
+			fail("%u not found in hash", i);
+			return;
+		}
+	}
+	pass("Found %u numbers in hash", i);
+}
+
+static void del_vals_bykey(struct htable_obj *ht, unsigned int num)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; i++) {
+		if (!htable_obj_delkey(ht, &i)) {
+			fail("%u not deleted by key from hash", i);
+			return;
+		}
+	}
+	pass("Deleted %u numbers by key from hash", i);
+}
+
+static bool ctrl_consistent(const struct htable_swiss *ht)
+{
+	size_t i;
+
+	/* The copy of the first group must match. */
+	for (i = 0; i < HTABLE_SWISS_GROUP; i++)
+		if (ht->ctrl[i] != ht->ctrl[((size_t)1 << ht->bits) + i])
+			return false;
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i, j;
+	struct htable_obj ht;
+	struct obj val[NUM_VALS];
+	unsigned int dne;
+	void *p;
+	struct htable_obj_iter iter;
+
+	plan_tests(22);
+	for (i = 0; i < NUM_VALS; i++)
+		val[i].key = i;
+	dne = i;
+
+	htable_obj_init(&ht);
+	ok1(ht.raw.max == 0);
+	ok1(ht.raw.bits == 0);
+
+	/* We cannot find an entry which doesn't exist. */
+	ok1(!htable_obj_get(&ht, &dne));
+	ok1(!htable_obj_delkey(&ht, &dne));
+
+	/* Fill it, it should increase in size. */
+	add_vals(&ht, val, NUM_VALS);
+	ok1(ht.raw.bits == NUM_BITS + 1);
+	ok1(ht.raw.max < (1 << ht.raw.bits));
+	ok1(ht.raw.elems == NUM_VALS);
+	ok1(ctrl_consistent(&ht.raw));
+
+	/* Find all. */
+	find_vals(&ht, val, NUM_VALS);
+	ok1(!htable_obj_get(&ht, &dne));
+
+	/* Walk once, should get them all. */
+	i = 0;
+	for (p = htable_obj_first(&ht,&iter); p; p = htable_obj_next(&ht, &iter))
+		i++;
+	ok1(i == NUM_VALS);
+
+	/* Delete all. */
+	del_vals_bykey(&ht, NUM_VALS);
+	ok1(!htable_obj_get(&ht, &val[0].key));
+	ok1(ht.raw.elems == 0);
+
+	/* Churn: deleted slots must get cleaned out, not grow the table. */
+	for (j = 0; j < 100; j++) {
+		for (i = 0; i < NUM_VALS; i++)
+			htable_obj_add(&ht, &val[i]);
+		for (i = 0; i < NUM_VALS; i++)
+			htable_obj_del(&ht, &val[i]);
+	}
+	ok1(ht.raw.bits == NUM_BITS + 1);
+	ok1(ht.raw.elems == 0);
+	ok1(ht.raw.elems + ht.raw.deleted <= ht.raw.max);
+	ok1(ctrl_consistent(&ht.raw));
+
+	/* Add them back, then delete them while iterating. */
+	add_vals(&ht, val, NUM_VALS);
+	find_vals(&ht, val, NUM_VALS);
+	i = 0;
+	for (p = htable_obj_first(&ht,&iter); p; p = htable_obj_next(&ht, &iter)) {
+		htable_swiss_delval(&ht.raw, &iter.i);
+		i++;
+	}
+	ok1(i == NUM_VALS && ht.raw.elems == 0);
+	htable_obj_clear(&ht);
+
+	return exit_status();
+}
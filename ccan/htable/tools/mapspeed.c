@@ -0,0 +1,476 @@
+/* Compare htable against other maps, on identical keys and workloads.
+ *
+ * Usage: mapspeed [--sizes=N,N...] [--hit=PERCENT] [--maps=name,name...]
+ *
+ * For each size, each map gets the same random keys, and we time:
+ *	insert:	adding every key to an empty map.
+ *	hit:	looking up every key, in a random order.
+ *	mixed:	lookups where only PERCENT% of the keys are present.
+ *	miss:	looking up keys which aren't there.
+ *	churn:	deleting one key and adding another, over and over.
+ *
+ * Times are ns/op.  We also report how much heap each map uses per entry
+ * after inserting, and (on Linux, if perf counters are allowed) cache
+ * misses per op.  jmap needs libJudy: build with "make HAVE_JUDY=1".
+ */
+#include <ccan/htable/htable_type.h>
+#include <ccan/htable/htable_swiss.h>
+#include <ccan/strmap/strmap.h>
+#include <ccan/stringmap/stringmap.h>
+#include <ccan/avl/avl.h>
+#include <ccan/hash/hash.h>
+#include <ccan/time/time.h>
+#if HAVE_JUDY
+#include <ccan/jmap/jmap.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+/* Every map gets the same keys: the string and number are one key. */
+struct key {
+	unsigned long num;
+	char str[24];
+};
+
+static const char *keystr(const struct key *k)
+{
+	return k->str;
+}
+
+static size_t hash_str(const char *str)
+{
+	return hash(str, strlen(str), 0);
+}
+
+static bool streq(const struct key *k, const char *str)
+{
+	return strcmp(k->str, str) == 0;
+}
+
+HTABLE_DEFINE_TYPE(struct key, keystr, hash_str, streq, htable_key);
+HTABLE_SWISS_DEFINE_TYPE(struct key, keystr, hash_str, streq, swiss_key);
+
+struct strmap_key {
+	STRMAP_MEMBERS(struct key *);
+};
+
+typedef stringmap(struct key *) stringmap_key;
+
+#if HAVE_JUDY
+struct jmap_key {
+	JMAP_MEMBERS(unsigned long, struct key *);
+};
+#endif
+
+/* Each map under test.  del is NULL if the map can't delete. */
+struct map_ops {
+	const char *name;
+	void *(*new)(void);
+	bool (*add)(void *map, struct key *k);
+	bool (*get)(void *map, struct key *k);
+	bool (*del)(void *map, struct key *k);
+	void (*free)(void *map);
+};
+
+static void *htable_new(void)
+{
+	struct htable_key *ht = malloc(sizeof(*ht));
+	htable_key_init(ht);
+	return ht;
+}
+
+static bool htable_add_key(void *map, struct key *k)
+{
+	return htable_key_add(map, k);
+}
+
+static bool htable_get_key(void *map, struct key *k)
+{
+	return htable_key_get(map, k->str) != NULL;
+}
+
+static bool htable_del_key(void *map, struct key *k)
+{
+	return htable_key_delkey(map, k->str);
+}
+
+static void htable_free(void *map)
+{
+	htable_key_clear(map);
+	free(map);
+}
+
+static void *swiss_new(void)
+{
+	struct swiss_key *ht = malloc(sizeof(*ht));
+	swiss_key_init(ht);
+	return ht;
+}
+
+static bool swiss_add_key(void *map, struct key *k)
+{
+	return swiss_key_add(map, k);
+}
+
+static bool swiss_get_key(void *map, struct key *k)
+{
+	return swiss_key_get(map, k->str) != NULL;
+}
+
+static bool swiss_del_key(void *map, struct key *k)
+{
+	return swiss_key_delkey(map, k->str);
+}
+
+static void swiss_free(void *map)
+{
+	swiss_key_clear(map);
+	free(map);
+}
+
+static void *strmap_new(void)
+{
+	struct strmap_key *map = malloc(sizeof(*map));
+	strmap_init(map);
+	return map;
+}
+
+static bool strmap_add_key(void *map, struct key *k)
+{
+	return strmap_add((struct strmap_key *)map, k->str, k);
+}
+
+static bool strmap_get_key(void *map, struct key *k)
+{
+	return strmap_get((struct strmap_key *)map, k->str) != NULL;
+}
+
+static bool strmap_del_key(void *map, struct key *k)
+{
+	return strmap_del((struct strmap_key *)map, k->str, NULL) != NULL;
+}
+
+static void strmap_free(void *map)
+{
+	strmap_clear((struct strmap_key *)map);
+	free(map);
+}
+
+static void *stringmap_new_map(void)
+{
+	stringmap_key *map = malloc(sizeof(*map));
+	stringmap_init(*map, NULL);
+	return map;
+}
+
+static bool stringmap_add_key(void *map, struct key *k)
+{
+	struct key **v = stringmap_enter(*(stringmap_key *)map, k->str);
+	if (!v)
+		return false;
+	*v = k;
+	return true;
+}
+
+static bool stringmap_get_key(void *map, struct key *k)
+{
+	return stringmap_lookup(*(stringmap_key *)map, k->str) != NULL;
+}
+
+static void stringmap_free_map(void *map)
+{
+	stringmap_free(*(stringmap_key *)map);
+	free(map);
+}
+
+static int avl_strcmp(const void *a, const void *b)
+{
+	return strcmp(a, b);
+}
+
+static void *avl_new_map(void)
+{
+	return avl_new(avl_strcmp);
+}
+
+static bool avl_add_key(void *map, struct key *k)
+{
+	return avl_insert(map, k->str, k);
+}
+
+static bool avl_get_key(void *map, struct key *k)
+{
+	return avl_lookup(map, k->str) != NULL;
+}
+
+static bool avl_del_key(void *map, struct key *k)
+{
+	return avl_remove(map, k->str);
+}
+
+static void avl_free_map(void *map)
+{
+	avl_free(map);
+}
+
+#if HAVE_JUDY
+/* Judy maps integers, so it gets the numeric form of each key. */
+static void *jmap_new_map(void)
+{
+	return jmap_new(struct jmap_key);
+}
+
+static bool jmap_add_key(void *map, struct key *k)
+{
+	return jmap_add((struct jmap_key *)map, k->num, k);
+}
+
+static bool jmap_get_key(void *map, struct key *k)
+{
+	return jmap_get((struct jmap_key *)map, k->num) != NULL;
+}
+
+static bool jmap_del_key(void *map, struct key *k)
+{
+	return jmap_del((struct jmap_key *)map, k->num);
+}
+
+static void jmap_free_map(void *map)
+{
+	jmap_free((struct jmap_key *)map);
+}
+#endif
+
+static const struct map_ops maps[] = {
+	{ "htable", htable_new, htable_add_key, htable_get_key,
+	  htable_del_key, htable_free },
+	{ "htable_swiss", swiss_new, swiss_add_key, swiss_get_key,
+	  swiss_del_key, swiss_free },
+	{ "strmap", strmap_new, strmap_add_key, strmap_get_key,
+	  strmap_del_key, strmap_free },
+	{ "stringmap", stringmap_new_map, stringmap_add_key,
+	  stringmap_get_key, NULL, stringmap_free_map },
+	{ "avl", avl_new_map, avl_add_key, avl_get_key,
+	  avl_del_key, avl_free_map },
+#if HAVE_JUDY
+	{ "jmap", jmap_new_map, jmap_add_key, jmap_get_key,
+	  jmap_del_key, jmap_free_map },
+#endif
+};
+
+/* Bytes currently allocated from the heap. */
+static size_t heap_used(void)
+{
+	/* Big allocations are mmapped, and counted separately. */
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	struct mallinfo2 mi = mallinfo2();
+	return mi.uordblks + mi.hblkhd;
+#elif defined(__GLIBC__)
+	struct mallinfo mi = mallinfo();
+	return (unsigned int)mi.uordblks + (unsigned int)mi.hblkhd;
+#else
+	return 0;
+#endif
+}
+
+static int cache_fd = -1;
+
+static void open_cache_counter(void)
+{
+#ifdef __linux__
+	struct perf_event_attr pe;
+
+	memset(&pe, 0, sizeof(pe));
+	pe.type = PERF_TYPE_HARDWARE;
+	pe.size = sizeof(pe);
+	pe.config = PERF_COUNT_HW_CACHE_MISSES;
+	pe.exclude_kernel = 1;
+	pe.exclude_hv = 1;
+	cache_fd = syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+#endif
+}
+
+static unsigned long long cache_misses(void)
+{
+	unsigned long long count = 0;
+
+	if (cache_fd >= 0 && read(cache_fd, &count, sizeof(count))
+	    != sizeof(count))
+		count = 0;
+	return count;
+}
+
+struct result {
+	double ns, misses;
+};
+
+/* What result we expect from each op. */
+enum expect { EXPECT_TRUE, EXPECT_FALSE, EXPECT_EITHER };
+
+/* Run @fn on each of @keys in @order, and time it. */
+static struct result run(const struct map_ops *m, void *map,
+			 bool (*fn)(void *, struct key *),
+			 struct key *keys, const size_t *order, size_t num,
+			 enum expect expect)
+{
+	struct timespec start;
+	unsigned long long misses;
+	struct result r;
+	size_t i;
+
+	misses = cache_misses();
+	start = time_now();
+	for (i = 0; i < num; i++) {
+		bool ret = fn(map, &keys[order[i]]);
+		if (expect != EXPECT_EITHER && ret != (expect == EXPECT_TRUE)) {
+			fprintf(stderr, "%s: unexpected result for %s\n",
+				m->name, keys[order[i]].str);
+			exit(1);
+		}
+	}
+	r.ns = (double)time_to_nsec(time_sub(time_now(), start)) / num;
+	r.misses = (double)(cache_misses() - misses) / num;
+	return r;
+}
+
+static void print_result(struct result r)
+{
+	if (cache_fd >= 0)
+		printf("\t%.1f (%.2f)", r.ns, r.misses);
+	else
+		printf("\t%.1f", r.ns);
+}
+
+/* Random but distinct: multiplying by an odd number is a bijection. */
+static void make_keys(struct key *keys, size_t start, size_t num)
+{
+	size_t i;
+
+	for (i = 0; i < num; i++) {
+		keys[i].num = (unsigned long)(start + i) * 0x9E3779B97F4A7C15UL;
+		sprintf(keys[i].str, "%lx", keys[i].num);
+	}
+}
+
+static void shuffle(size_t *order, size_t num)
+{
+	size_t i;
+
+	for (i = 0; i < num; i++)
+		order[i] = i;
+	for (i = num - 1; i > 0; i--) {
+		size_t j = random() % (i + 1), tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+}
+
+static bool wanted(const char *list, const char *name)
+{
+	size_t len = strlen(name);
+	const char *p;
+
+	if (!list)
+		return true;
+	for (p = list; (p = strstr(p, name)) != NULL; p += len) {
+		if ((p == list || p[-1] == ',') && (!p[len] || p[len] == ','))
+			return true;
+	}
+	return false;
+}
+
+static void bench(const struct map_ops *m, size_t num, unsigned int hit)
+{
+	struct key *keys, *misses, *mixed;
+	size_t *order, i, heap;
+	struct timespec start;
+	unsigned long long c;
+	struct result r;
+	void *map;
+
+	/* keys[] are in the map, misses[] aren't (until churn). */
+	keys = malloc(num * sizeof(*keys));
+	misses = malloc(num * sizeof(*misses));
+	mixed = malloc(num * sizeof(*mixed));
+	order = malloc(num * sizeof(*order));
+	make_keys(keys, 0, num);
+	make_keys(misses, num, num);
+	for (i = 0; i < num; i++)
+		mixed[i] = (random() % 100 < hit) ? keys[i] : misses[i];
+
+	printf("%s\t%zu", m->name, num);
+	heap = heap_used();
+	map = m->new();
+	shuffle(order, num);
+	print_result(run(m, map, m->add, keys, order, num, EXPECT_TRUE));
+	printf("\t%.1f", (double)(heap_used() - heap) / num);
+
+	shuffle(order, num);
+	print_result(run(m, map, m->get, keys, order, num, EXPECT_TRUE));
+	print_result(run(m, map, m->get, mixed, order, num, EXPECT_EITHER));
+	print_result(run(m, map, m->get, misses, order, num, EXPECT_FALSE));
+
+	/* Churn: replace each key in turn with one not in the map. */
+	if (m->del) {
+		c = cache_misses();
+		start = time_now();
+		for (i = 0; i < num; i++) {
+			if (!m->del(map, &keys[order[i]])
+			    || !m->add(map, &misses[order[i]]))
+				abort();
+		}
+		r.ns = (double)time_to_nsec(time_sub(time_now(), start))
+			/ (num * 2);
+		r.misses = (double)(cache_misses() - c) / (num * 2);
+		print_result(r);
+	} else
+		printf("\t-");
+	printf("\n");
+
+	m->free(map);
+	free(keys);
+	free(misses);
+	free(mixed);
+	free(order);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *sizes = "1000,10000,100000,1000000", *only = NULL, *p;
+	unsigned int hit = 50, i;
+
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--sizes=", 8) == 0)
+			sizes = argv[i] + 8;
+		else if (strncmp(argv[i], "--hit=", 6) == 0)
+			hit = atoi(argv[i] + 6);
+		else if (strncmp(argv[i], "--maps=", 7) == 0)
+			only = argv[i] + 7;
+		else {
+			fprintf(stderr, "Usage: %s [--sizes=N,N...]"
+				" [--hit=PERCENT] [--maps=name,name...]\n",
+				argv[0]);
+			exit(1);
+		}
+	}
+
+	open_cache_counter();
+	printf("# ns/op%s; mixed lookups hit %u%%\n",
+	       cache_fd >= 0 ? " (cache misses/op)" : "", hit);
+	printf("map\tsize\tinsert\tbytes/entry\thit\tmixed\tmiss\tchurn\n");
+	for (p = sizes; p; p = strchr(p, ',') ? strchr(p, ',') + 1 : NULL) {
+		size_t num = strtoul(p, NULL, 0);
+
+		for (i = 0; i < sizeof(maps) / sizeof(maps[0]); i++)
+			if (wanted(only, maps[i].name))
+				bench(&maps[i], num, hit);
+	}
+	return 0;
+}
@@ -0,0 +1,179 @@
+/* Read scaling for htable_rcu against a mutex-wrapped htable. */
+#include <ccan/htable/htable.h>
+#include <ccan/htable/htable.c>
+#include <ccan/htable/htable_rcu.h>
+#include <ccan/htable/htable_rcu.c>
+#include <ccan/hash/hash.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+struct object {
+	/* The key. */
+	unsigned int key;
+
+	/* Some contents. Doubles as consistency check. */
+	struct object *self;
+};
+
+static struct object *objs;
+static size_t num, lookups;
+
+static struct htable locked;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct htable_rcu rcu;
+
+/* Set to stop the writer thread. */
+static bool stop_writer;
+
+static size_t hash_key(unsigned int key)
+{
+	return hashl(&key, 1, 0);
+}
+
+static size_t rehash(const void *elem, void *unused)
+{
+	return hash_key(((const struct object *)elem)->key);
+}
+
+static bool cmp(const void *candidate, void *key)
+{
+	return ((const struct object *)candidate)->key == *(unsigned int *)key;
+}
+
+/* Each reader starts at a different place, then strides randomly. */
+static void *read_locked(void *arg)
+{
+	size_t i, j = (size_t)arg % num;
+
+	for (i = 0; i < lookups; i++, j = (j + 10007) % num) {
+		unsigned int key = j;
+		struct object *o;
+
+		pthread_mutex_lock(&lock);
+		o = htable_get(&locked, hash_key(key), cmp, &key);
+		if (o->self != &objs[j])
+			abort();
+		pthread_mutex_unlock(&lock);
+	}
+	return NULL;
+}
+
+static void *read_rcu(void *arg)
+{
+	struct htable_rcu_reader r;
+	size_t i, j = (size_t)arg % num;
+
+	htable_rcu_reader_register(&rcu, &r);
+	for (i = 0; i < lookups; i++, j = (j + 10007) % num) {
+		unsigned int key = j;
+		struct object *o;
+
+		htable_rcu_read_lock(&rcu, &r);
+		o = htable_rcu_get(&rcu, hash_key(key), cmp, &key);
+		if (o->self != &objs[j])
+			abort();
+		htable_rcu_read_unlock(&rcu, &r);
+	}
+	htable_rcu_reader_unregister(&rcu, &r);
+	return NULL;
+}
+
+/* Optional background writer: delete and re-add objects forever. */
+static void *write_locked(void *arg)
+{
+	size_t j;
+
+	for (j = 0; !__atomic_load_n(&stop_writer, __ATOMIC_ACQUIRE);
+	     j = (j + 1) % num) {
+		pthread_mutex_lock(&lock);
+		htable_del(&locked, rehash(&objs[j], NULL), &objs[j]);
+		htable_add(&locked, rehash(&objs[j], NULL), &objs[j]);
+		pthread_mutex_unlock(&lock);
+	}
+	return NULL;
+}
+
+/* Without the lock, readers would see the object briefly missing: so
+ * add a second copy first, then delete one. */
+static void *write_rcu(void *arg)
+{
+	size_t j;
+
+	for (j = 0; !__atomic_load_n(&stop_writer, __ATOMIC_ACQUIRE);
+	     j = (j + 1) % num) {
+		htable_rcu_add(&rcu, rehash(&objs[j], NULL), &objs[j]);
+		htable_rcu_del(&rcu, rehash(&objs[j], NULL), &objs[j]);
+	}
+	return NULL;
+}
+
+/* Nanoseconds per lookup, across all threads. */
+static double run(void *(*reader)(void *), void *(*writer)(void *),
+		  unsigned int threads)
+{
+	pthread_t *tids = calloc(threads, sizeof(tids[0])), wtid;
+	struct timeval start, stop, diff;
+	unsigned int i;
+
+	stop_writer = false;
+	if (writer)
+		pthread_create(&wtid, NULL, writer, NULL);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < threads; i++)
+		pthread_create(&tids[i], NULL, reader,
+			       (void *)(size_t)(i * (num / threads)));
+	for (i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	gettimeofday(&stop, NULL);
+
+	if (writer) {
+		__atomic_store_n(&stop_writer, true, __ATOMIC_RELEASE);
+		pthread_join(wtid, NULL);
+	}
+	free(tids);
+
+	timersub(&stop, &start, &diff);
+	return (diff.tv_sec * 1000000.0 + diff.tv_usec) * 1000
+		/ ((double)lookups * threads);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int threads, max_threads;
+	bool with_writer = false;
+	size_t i;
+
+	if (argv[1] && strcmp(argv[1], "--writer") == 0) {
+		argv++;
+		with_writer = true;
+	}
+	num = argv[1] ? atoi(argv[1]) : 1000000;
+	max_threads = argv[1] && argv[2] ? atoi(argv[2]) : 16;
+	lookups = num;
+
+	objs = calloc(num, sizeof(objs[0]));
+	htable_init(&locked, rehash, NULL);
+	htable_rcu_init(&rcu);
+	for (i = 0; i < num; i++) {
+		objs[i].key = i;
+		objs[i].self = &objs[i];
+		htable_add(&locked, rehash(&objs[i], NULL), &objs[i]);
+		htable_rcu_add(&rcu, rehash(&objs[i], NULL), &objs[i]);
+	}
+
+	printf("%zu entries, %zu lookups per thread%s\n", num, lookups,
+	       with_writer ? ", with a writer" : "");
+	printf("threads\tmutex ns/op\trcu ns/op\trcu Mops/sec\n");
+	for (threads = 1; threads <= max_threads; threads *= 2) {
+		double m, r;
+
+		m = run(read_locked, with_writer ? write_locked : NULL, threads);
+		r = run(read_rcu, with_writer ? write_rcu : NULL, threads);
+		printf("%u\t%.1f\t\t%.1f\t\t%.1f\n", threads, m, r, 1000 / r);
+	}
+	return 0;
+}
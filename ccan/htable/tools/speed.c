@@ -133,7 +133,8 @@ static size_t worst_run(struct htable *ht, size_t *deleted)
 
 int main(int argc, char *argv[])
 {
-	struct object *objs;
+	struct object *objs, **ptrs;
+	const unsigned int **keys;
 	size_t i, j, num, deleted;
 	struct timeval start, stop;
 	struct htable_obj ht;
@@ -145,6 +146,8 @@ int main(int argc, char *argv[])
 	}
 	num = argv[1] ? atoi(argv[1]) : 1000000;
 	objs = calloc(num, sizeof(objs[0]));
+	ptrs = calloc(num, sizeof(ptrs[0]));
+	keys = calloc(num, sizeof(keys[0]));
 
 	for (i = 0; i < num; i++) {
 		objs[i].key = i;
@@ -174,9 +177,11 @@ int main(int argc, char *argv[])
 	printf("Initial lookup (match): ");
 	fflush(stdout);
 	gettimeofday(&start, NULL);
-	for (i = 0; i < num; i++)
-		if (htable_obj_get(&ht, &i)->self != objs[i].self)
+	for (i = 0; i < num; i++) {
+		unsigned int n = i;
+		if (htable_obj_get(&ht, &n)->self != objs[i].self)
 			abort();
+	}
 	gettimeofday(&stop, NULL);
 	printf(" %zu ns\n", normalize(&start, &stop, num));
 
@@ -195,9 +200,11 @@ int main(int argc, char *argv[])
 	printf("Initial lookup (random): ");
 	fflush(stdout);
 	gettimeofday(&start, NULL);
-	for (i = 0, j = 0; i < num; i++, j = (j + 10007) % num)
-		if (htable_obj_get(&ht, &j)->self != &objs[j])
+	for (i = 0, j = 0; i < num; i++, j = (j + 10007) % num) {
+		unsigned int n = j;
+		if (htable_obj_get(&ht, &n)->self != &objs[j])
 			abort();
+	}
 	gettimeofday(&stop, NULL);
 	printf(" %zu ns\n", normalize(&start, &stop, num));
 
@@ -251,9 +258,11 @@ int main(int argc, char *argv[])
 	printf("Lookup after half-change (match): ");
 	fflush(stdout);
 	gettimeofday(&start, NULL);
-	for (i = 1; i < num; i+=2)
-		if (htable_obj_get(&ht, &i)->self != objs[i].self)
+	for (i = 1; i < num; i+=2) {
+		unsigned int n = i;
+		if (htable_obj_get(&ht, &n)->self != objs[i].self)
 			abort();
+	}
 	for (i = 0; i < num; i+=2) {
 		unsigned int n = i + num;
 		if (htable_obj_get(&ht, &n)->self != objs[i].self)
@@ -372,5 +381,29 @@ int main(int argc, char *argv[])
 	printf("Details: delete markers %zu, perfect %.0f%%\n",
 	       count_deleted(&ht.raw), perfect(&ht.raw) * 100.0 / ht.raw.elems);
 
+	/* Now the same again, in bulk. */
+	htable_obj_clear(&ht);
+	for (i = 0; i < num; i++) {
+		objs[i].key = i;
+		ptrs[i] = objs[i].self;
+	}
+
+	printf("Bulk insert: ");
+	fflush(stdout);
+	gettimeofday(&start, NULL);
+	htable_obj_add_many(&ht, ptrs, num);
+	gettimeofday(&stop, NULL);
+	printf(" %zu ns\n", normalize(&start, &stop, num));
+
+	printf("Bulk lookup (random): ");
+	fflush(stdout);
+	for (i = 0, j = 0; i < num; i++, j = (j + 10007) % num)
+		keys[i] = &objs[j].key;
+	gettimeofday(&start, NULL);
+	if (htable_obj_get_many(&ht, keys, ptrs, num) != num)
+		abort();
+	gettimeofday(&stop, NULL);
+	printf(" %zu ns\n", normalize(&start, &stop, num));
+
 	return 0;
 }
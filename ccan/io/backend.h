@@ -1,8 +1,22 @@
 /* Licensed under LGPLv2.1+ - see LICENSE file for details */
 #ifndef CCAN_IO_BACKEND_H
 #define CCAN_IO_BACKEND_H
+#include "config.h"
 #include <stdbool.h>
 #include <ccan/timer/timer.h>
+#include "io.h"
+
+/* Each thread has its own loop, if the compiler can do that.  If not,
+ * check_loop_thread() makes sure only one thread ever runs a loop. */
+#if HAVE_THREAD_LOCAL
+#define IO_PER_THREAD __thread
+static inline void check_loop_thread(void)
+{
+}
+#else
+#define IO_PER_THREAD
+void check_loop_thread(void);
+#endif
 
 struct io_alloc {
 	void *(*alloc)(size_t size);
@@ -28,10 +42,17 @@ struct io_listener {
 
 struct io_timeout {
 	struct timer timer;
+	/* NULL unless active. */
 	struct io_conn *conn;
 
 	struct io_plan (*next)(struct io_conn *, void *arg);
 	void *next_arg;
+
+	/* When it's due, and whether timer is in the timers. */
+	struct timespec deadline;
+	bool queued;
+	/* Coarse mode: when timer expires (may be before deadline). */
+	struct timespec armed;
 };
 
 /* One connection per client. */
@@ -43,16 +64,49 @@ struct io_conn {
 
 	struct io_conn *duplex;
 	struct io_timeout *timeout;
+	/* Set by io_set_wbuf(): queued writes are flushed on yield. */
+	struct io_wbuf *wbuf;
+	struct io_conn_stats stats;
+	/* This thread's queue, for io_wake_from_thread(). */
+	struct io_wakeq *wakeq;
+	struct io_conn *wake_next;
+	struct io_plan wake_plan;
+	/* epoll backend: where this is in its closing[] and ready_now[]. */
+	size_t closing_idx, ready_idx;
 
 	struct io_plan plan;
 };
 
+/* Other threads push connections to wake; the loop thread drains it. */
+struct io_wakeq {
+	/* Reads the eventfd (or pipe); NULL until io_wake_from_thread_init */
+	struct io_conn *conn;
+	/* Where other threads write to wake the loop. */
+	int fd;
+	/* Connections to wake, newest first, chained by wake_next. */
+	struct io_conn *head;
+	char buf[64];
+	size_t len;
+};
+
 static inline bool timeout_active(const struct io_conn *conn)
 {
 	return conn->timeout && conn->timeout->conn;
 }
 
-extern void *io_loop_return;
+/* Can this plan make progress without waiting for the fd? */
+static inline bool plan_ready_now(const struct io_plan *plan)
+{
+	return plan->next && plan->io && !plan->pollflag;
+}
+
+extern IO_PER_THREAD void *io_loop_return;
+/* NULL unless io_set_stats() enabled it. */
+extern IO_PER_THREAD struct io_loop_stats *io_stats;
+void stats_waited(struct timespec start, int ready);
+/* Frees, or keeps for reuse if io_set_pool_size() allows. */
+void pool_free_conn(struct io_conn *conn);
+void pool_free_listener(struct io_listener *l);
 
 #ifdef DEBUG
 extern struct io_conn *current;
@@ -68,6 +122,9 @@ static inline bool doing_debug(void)
 {
 	return io_debug_conn;
 }
+void io_loop_enter(void);
+void io_loop_exit(void);
+void free_conn(struct io_conn *conn);
 #else
 static inline void set_current(struct io_conn *conn)
 {
@@ -80,17 +137,31 @@ static inline bool doing_debug(void)
 {
 	return false;
 }
+static inline void io_loop_enter(void)
+{
+}
+static inline void io_loop_exit(void)
+{
+}
+static inline void free_conn(struct io_conn *conn)
+{
+	pool_free_conn(conn);
+}
 #endif
 
 bool add_listener(struct io_listener *l);
 bool add_conn(struct io_conn *c);
 bool add_duplex(struct io_conn *c);
+/* Closes the fd, and frees @l once nothing refers to it. */
 void del_listener(struct io_listener *l);
 void backend_plan_changed(struct io_conn *conn);
-void backend_add_timeout(struct io_conn *conn, struct timespec ts);
-void backend_del_timeout(struct io_conn *conn);
+bool expire_timeouts(int *ms);
+void del_timeout(struct io_conn *conn);
+void free_timeout(struct io_conn *conn);
 void backend_del_conn(struct io_conn *conn);
 
 void io_ready(struct io_conn *conn);
+/* Our own connections, which don't keep io_loop() running. */
+unsigned int num_internal_conns(void);
 void *do_io_loop(struct io_conn **ready);
 #endif /* CCAN_IO_BACKEND_H */
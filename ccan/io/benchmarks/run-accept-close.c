@@ -0,0 +1,110 @@
+/* Accept short connections as fast as we can: each client connects,
+ * sends one byte and waits for us to close.  Compare pool sizes with
+ * "run-accept-close 0" and "run-accept-close 1000". */
+#include <ccan/io/io.h>
+#include <ccan/time/time.h>
+#include <ccan/err/err.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#define NUM_CONNS 10000 /* per child */
+#define NUM_CHILDREN 4
+
+static unsigned int completed, total;
+static char byte;
+
+static void finish(struct io_conn *conn, void *unused)
+{
+	if (++completed == total)
+		io_break(&completed, io_idle());
+}
+
+static void init_conn(int fd, void *unused)
+{
+	struct io_conn *conn;
+
+	conn = io_new_conn(fd, io_read(&byte, 1, io_close_cb, NULL));
+	if (!conn)
+		err(1, "Creating connection");
+	io_set_finish(conn, finish, NULL);
+}
+
+/* This runs in the child. */
+static void create_clients(struct sockaddr_un *addr, unsigned int num)
+{
+	unsigned int i;
+	char c = 0;
+
+	for (i = 0; i < num; i++) {
+		int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (sock < 0)
+			err(1, "creating socket");
+		if (connect(sock, (void *)addr, sizeof(*addr)) != 0)
+			err(1, "connecting socket");
+		if (write(sock, &c, 1) != 1)
+			err(1, "writing socket");
+		/* Wait for them to close. */
+		if (read(sock, &c, 1) != 0)
+			errx(1, "reading socket?");
+		close(sock);
+	}
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i, pool = 0, num = NUM_CONNS;
+	struct sockaddr_un addr;
+	struct timespec start, end;
+	int fd;
+
+	if (argc > 3)
+		errx(1, "Usage: %s [<pool-size> [<conns-per-child>]]", argv[0]);
+	if (argc > 1)
+		pool = atoi(argv[1]);
+	if (argc > 2)
+		num = atoi(argv[2]);
+	total = num * NUM_CHILDREN;
+
+	addr.sun_family = AF_UNIX;
+	sprintf(addr.sun_path, "/tmp/run-accept-close.sock.%u", getpid());
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		err(1, "Creating socket");
+	if (bind(fd, (void *)&addr, sizeof(addr)) != 0)
+		err(1, "Binding to %s", addr.sun_path);
+	if (listen(fd, 128) != 0)
+		err(1, "Listening on %s", addr.sun_path);
+
+	io_set_pool_size(pool);
+	if (!io_new_listener(fd, init_conn, NULL))
+		err(1, "Creating listener");
+
+	start = time_now();
+	for (i = 0; i < NUM_CHILDREN; i++) {
+		switch (fork()) {
+		case -1:
+			err(1, "forking");
+		case 0:
+			create_clients(&addr, num);
+		}
+	}
+
+	if (io_loop() != &completed)
+		errx(1, "io_loop?");
+	end = time_now();
+	for (i = 0; i < NUM_CHILDREN; i++)
+		wait(NULL);
+	unlink(addr.sun_path);
+
+	printf("run-accept-close: pool %u: %u connections: %u ns per conn\n",
+	       pool, completed,
+	       (int)time_to_nsec(time_divide(time_sub(end, start), completed)));
+	return 0;
+}
@@ -0,0 +1,298 @@
+/* Request/reply throughput and latency benchmark.
+ *
+ * Each client is a separate process with one connection, sending a
+ * request and waiting for the reply, over and over.  The server echoes
+ * a reply of the same size.  Clients record each request's round-trip
+ * time in shared memory, and we report requests per second and
+ * latency percentiles.  Build as run-bench (poll) and run-bench-epoll.
+ *
+ * Use -j for a single line of JSON, to compare runs with a script. */
+#include <ccan/io/io.h>
+#include <ccan/time/time.h>
+#include <ccan/err/err.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#ifdef IO_USE_EPOLL
+#define BACKEND "epoll"
+#else
+#define BACKEND "poll"
+#endif
+
+#define DEFAULT_CLIENTS 8
+#define DEFAULT_REQUESTS 10000 /* per client */
+#define DEFAULT_SIZE 64
+
+struct server_conn {
+	size_t size;
+	char *buf;
+};
+
+static unsigned int completed;
+
+static struct io_plan read_request(struct io_conn *conn, struct server_conn *s);
+
+static struct io_plan write_reply(struct io_conn *conn, struct server_conn *s)
+{
+	return io_write(s->buf, s->size, read_request, s);
+}
+
+static struct io_plan read_request(struct io_conn *conn, struct server_conn *s)
+{
+	/* The first call is from main, before any request. */
+	if (conn)
+		completed++;
+	return io_read(s->buf, s->size, write_reply, s);
+}
+
+static void free_server_conn(struct io_conn *conn, struct server_conn *s)
+{
+	free(s->buf);
+	free(s);
+}
+
+static void new_server_conn(int fd, size_t size)
+{
+	struct server_conn *s = malloc(sizeof(*s));
+	struct io_conn *conn;
+
+	if (!s || !(s->buf = malloc(size)))
+		err(1, "Allocating server buffer");
+	s->size = size;
+	conn = io_new_conn(fd, read_request(NULL, s));
+	if (!conn)
+		err(1, "Creating connection");
+	io_set_finish(conn, free_server_conn, s);
+}
+
+static bool read_all(int fd, char *buf, size_t len)
+{
+	while (len) {
+		ssize_t r = read(fd, buf, len);
+		if (r <= 0)
+			return false;
+		buf += r;
+		len -= r;
+	}
+	return true;
+}
+
+/* This runs in the child: one request at a time. */
+static void run_client(int fd, int waitfd, size_t size,
+		       unsigned int num, uint64_t *nsec)
+{
+	char *buf = calloc(1, size);
+	unsigned int i;
+	char c;
+
+	if (!buf)
+		err(1, "Allocating client buffer");
+
+	/* Wait until everyone's ready. */
+	if (read(waitfd, &c, 1) != 0)
+		errx(1, "Wait pipe?");
+
+	for (i = 0; i < num; i++) {
+		struct timespec start = time_now();
+
+		if (write(fd, buf, size) != size)
+			err(1, "Writing request");
+		if (!read_all(fd, buf, size))
+			err(1, "Reading reply");
+		nsec[i] = time_to_nsec(time_sub(time_now(), start));
+	}
+	close(fd);
+	exit(0);
+}
+
+static int tcp_listener(struct sockaddr_in *addr)
+{
+	socklen_t len = sizeof(*addr);
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (fd < 0)
+		err(1, "Creating socket");
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	/* Port 0: kernel picks one, which we read back. */
+	if (bind(fd, (void *)addr, sizeof(*addr)) != 0)
+		err(1, "Binding to loopback");
+	if (getsockname(fd, (void *)addr, &len) != 0)
+		err(1, "Getting socket name");
+	if (listen(fd, 128) != 0)
+		err(1, "Listening");
+	return fd;
+}
+
+static int tcp_connect(const struct sockaddr_in *addr)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0), on = 1;
+
+	if (fd < 0)
+		err(1, "Creating socket");
+	if (connect(fd, (void *)addr, sizeof(*addr)) != 0)
+		err(1, "Connecting to loopback");
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	return fd;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	const uint64_t *x = a, *y = b;
+
+	return *x < *y ? -1 : *x > *y;
+}
+
+static double percentile_usec(const uint64_t *sorted, size_t num, double p)
+{
+	size_t i = num * p;
+
+	if (i >= num)
+		i = num - 1;
+	return sorted[i] / 1000.0;
+}
+
+static void usage(const char *argv0)
+{
+	errx(1, "Usage: %s [-c clients] [-n requests-per-client]"
+	     " [-s size] [-t socketpair|tcp] [-j]", argv0);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i, clients = DEFAULT_CLIENTS, num = DEFAULT_REQUESTS;
+	size_t size = DEFAULT_SIZE, total;
+	bool tcp = false, json = false;
+	struct sockaddr_in addr;
+	struct timespec start, end;
+	uint64_t *nsec;
+	double secs;
+	int opt, lfd = -1, wake[2];
+
+	while ((opt = getopt(argc, argv, "c:n:s:t:j")) != -1) {
+		switch (opt) {
+		case 'c':
+			clients = atoi(optarg);
+			break;
+		case 'n':
+			num = atoi(optarg);
+			break;
+		case 's':
+			size = atol(optarg);
+			break;
+		case 't':
+			if (strcmp(optarg, "tcp") == 0)
+				tcp = true;
+			else if (strcmp(optarg, "socketpair") != 0)
+				usage(argv[0]);
+			break;
+		case 'j':
+			json = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || !clients || !num || !size)
+		usage(argv[0]);
+
+	total = (size_t)clients * num;
+	/* Children write their timings straight into here. */
+	nsec = mmap(NULL, total * sizeof(*nsec), PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (nsec == MAP_FAILED)
+		err(1, "Mapping %zu timings", total);
+
+	if (pipe(wake) != 0)
+		err(1, "Creating pipe");
+	if (tcp)
+		lfd = tcp_listener(&addr);
+
+	for (i = 0; i < clients; i++) {
+		int fds[2];
+
+		if (tcp) {
+			int on = 1;
+
+			fds[1] = tcp_connect(&addr);
+			fds[0] = accept(lfd, NULL, NULL);
+			if (fds[0] < 0)
+				err(1, "Accepting");
+			setsockopt(fds[0], IPPROTO_TCP, TCP_NODELAY,
+				   &on, sizeof(on));
+		} else if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+			err(1, "Creating socketpair");
+
+		switch (fork()) {
+		case -1:
+			err(1, "Forking");
+		case 0:
+			close(wake[1]);
+			close(fds[0]);
+			run_client(fds[1], wake[0], size, num, nsec + i * num);
+		}
+		close(fds[1]);
+		new_server_conn(fds[0], size);
+	}
+	if (tcp)
+		close(lfd);
+
+	/* Closing the pipe starts them all at once. */
+	close(wake[0]);
+	start = time_now();
+	close(wake[1]);
+	/* Returns when all the clients have closed. */
+	if (io_loop() != NULL)
+		errx(1, "io_loop?");
+	end = time_now();
+
+	for (i = 0; i < clients; i++) {
+		int status;
+		if (wait(&status) < 0 || !WIFEXITED(status)
+		    || WEXITSTATUS(status) != 0)
+			errx(1, "Client failed");
+	}
+	if (completed != total)
+		errx(1, "Only %u of %zu requests completed", completed, total);
+
+	secs = time_to_nsec(time_sub(end, start)) / 1000000000.0;
+	qsort(nsec, total, sizeof(*nsec), cmp_u64);
+
+	if (json)
+		printf("{\"benchmark\":\"run-bench\",\"backend\":\"%s\","
+		       "\"transport\":\"%s\",\"clients\":%u,"
+		       "\"requests\":%zu,\"size\":%zu,\"seconds\":%.6f,"
+		       "\"requests_per_sec\":%.1f,\"p50_usec\":%.3f,"
+		       "\"p99_usec\":%.3f,\"p999_usec\":%.3f,"
+		       "\"max_usec\":%.3f}\n",
+		       BACKEND, tcp ? "tcp" : "socketpair", clients,
+		       total, size, secs, total / secs,
+		       percentile_usec(nsec, total, 0.50),
+		       percentile_usec(nsec, total, 0.99),
+		       percentile_usec(nsec, total, 0.999),
+		       nsec[total - 1] / 1000.0);
+	else
+		printf("run-bench (%s, %s): %u clients, %zu requests of %zu"
+		       " bytes in %.3f sec\n"
+		       "  %.1f requests/sec\n"
+		       "  latency usec: p50 %.1f, p99 %.1f, p999 %.1f,"
+		       " max %.1f\n",
+		       BACKEND, tcp ? "tcp" : "socketpair", clients,
+		       total, size, secs, total / secs,
+		       percentile_usec(nsec, total, 0.50),
+		       percentile_usec(nsec, total, 0.99),
+		       percentile_usec(nsec, total, 0.999),
+		       nsec[total - 1] / 1000.0);
+	return 0;
+}
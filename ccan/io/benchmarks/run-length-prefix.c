@@ -23,19 +23,23 @@ static unsigned int completed;
 struct client {
 	unsigned int len;
 	char *request_buffer;
+	/* Header and (small) body usually arrive in one read. */
+	struct io_rbuf rbuf;
+	char rbuf_mem[4096];
 };
 
 static struct io_plan write_reply(struct io_conn *conn, struct client *client);
 static struct io_plan read_body(struct io_conn *conn, struct client *client)
 {
 	assert(client->len <= REQUEST_MAX);
-	return io_read(client->request_buffer, client->len,
-		       write_reply, client);
+	return io_read_buffered(&client->rbuf, client->request_buffer,
+				client->len, write_reply, client);
 }
 
 static struct io_plan io_read_header(struct client *client)
 {
-	return io_read(&client->len, sizeof(client->len), read_body, client);
+	return io_read_buffered(&client->rbuf, &client->len,
+				sizeof(client->len), read_body, client);
 }
 
 /* once we're done, loop again. */
@@ -157,6 +161,8 @@ int main(int argc, char *argv[])
 				err(1, "Accepting fd");
 			/* For efficiency, we share buffer */
 			client->request_buffer = buffer;
+			io_rbuf_init(&client->rbuf, client->rbuf_mem,
+				     sizeof(client->rbuf_mem));
 			io_new_conn(ret, io_read_header(client));
 		}
 	}
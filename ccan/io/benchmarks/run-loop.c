@@ -1,12 +1,15 @@
 #include <ccan/io/io.h>
 #include <ccan/time/time.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <err.h>
 #include <signal.h>
 
+/* Build as run-loop (poll) and run-loop-epoll to compare backends. */
 #define NUM 500
 #define NUM_ITERS 10000
 
@@ -47,32 +50,88 @@ static struct io_plan poke_reader(struct io_conn *conn, struct buffer *buf)
 	return io_idle();
 }
 
-int main(void)
+/* Idle connections wait for input which never comes, until we're done. */
+static struct io_plan never(struct io_conn *conn, void *unused)
 {
-	unsigned int i;
+	abort();
+}
+
+static unsigned int num_active;
+
+static void active_done(struct io_conn *conn, void *unused)
+{
+	/* Idle ones will never finish, so stop once the ring is done. */
+	if (--num_active == 0)
+		io_break(&num_active, io_idle());
+}
+
+static struct io_conn *active_conn(struct io_conn *conn)
+{
+	if (conn) {
+		io_set_finish(conn, active_done, NULL);
+		num_active++;
+	}
+	return conn;
+}
+
+static void raise_fd_limit(unsigned int num)
+{
+	struct rlimit lim;
+
+	if (getrlimit(RLIMIT_NOFILE, &lim) != 0)
+		err(1, "getrlimit");
+	if (lim.rlim_cur >= num)
+		return;
+	if (lim.rlim_max != RLIM_INFINITY && lim.rlim_max < num)
+		errx(1, "Need %u fds, limit is %llu",
+		     num, (long long)lim.rlim_max);
+	lim.rlim_cur = num;
+	if (setrlimit(RLIMIT_NOFILE, &lim) != 0)
+		err(1, "setrlimit");
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i, num = NUM, num_idle = 0;
 	int fds[2], last_read, last_write;
 	struct timespec start, end;
-	struct buffer buf[NUM];
+	struct buffer *buf;
+
+	if (argc > 3)
+		errx(1, "Usage: %s [<num-active> [<num-idle>]]", argv[0]);
+	if (argc > 1)
+		num = atoi(argv[1]);
+	if (argc > 2)
+		num_idle = atoi(argv[2]);
+	if (num < 2)
+		errx(1, "Need at least 2 active connections");
+
+	/* Two fds per pipe, one per idle connection, plus slack. */
+	raise_fd_limit(num * 2 + num_idle + 16);
+
+	buf = calloc(num, sizeof(*buf));
+	if (!buf)
+		err(1, "Allocating %u buffers", num);
 
 	if (pipe(fds) != 0)
 		err(1, "pipe");
 	last_read = fds[0];
 	last_write = fds[1];
 
-	for (i = 1; i < NUM; i++) {
+	for (i = 1; i < num; i++) {
 		buf[i].iters = 0;
 		if (pipe(fds) < 0)
 			err(1, "pipe");
 		memset(buf[i].buf, i, sizeof(buf[i].buf));
 		sprintf(buf[i].buf, "%i-%i", i, i);
 
-		buf[i].reader = io_new_conn(last_read, io_idle());
+		buf[i].reader = active_conn(io_new_conn(last_read, io_idle()));
 		if (!buf[i].reader)
 			err(1, "Creating reader %i", i);
-		buf[i].writer = io_new_conn(fds[1],
+		buf[i].writer = active_conn(io_new_conn(fds[1],
 					    io_write(&buf[i].buf,
 						     sizeof(buf[i].buf),
-						     poke_reader, &buf[i]));
+						     poke_reader, &buf[i])));
 		if (!buf[i].writer)
 			err(1, "Creating writer %i", i);
 		last_read = fds[0];
@@ -82,31 +141,46 @@ int main(void)
 	i = 0;
 	buf[i].iters = 0;
 	sprintf(buf[i].buf, "%i-%i", i, i);
-	buf[i].reader = io_new_conn(last_read, io_idle());
+	buf[i].reader = active_conn(io_new_conn(last_read, io_idle()));
 	if (!buf[i].reader)
 		err(1, "Creating reader %i", i);
-	buf[i].writer = io_new_conn(last_write, io_write(&buf[i].buf,
+	buf[i].writer = active_conn(io_new_conn(last_write,
+						io_write(&buf[i].buf,
 							 sizeof(buf[i].buf),
-							 poke_reader, &buf[i]));
+							 poke_reader,
+							 &buf[i])));
 	if (!buf[i].writer)
 		err(1, "Creating writer %i", i);
 
+	/* Lots of connections doing nothing: the backend shouldn't care.
+	 * They all read from one pipe (via dup) which never gets data. */
+	if (num_idle && pipe(fds) < 0)
+		err(1, "pipe for idle");
+	for (i = 0; i < num_idle; i++) {
+		int fd = dup(fds[0]);
+		if (fd < 0)
+			err(1, "dup for idle %i", i);
+		if (!io_new_conn(fd, io_read(buf, 1, never, NULL)))
+			err(1, "Creating idle %i", i);
+	}
+
 	/* They should eventually exit */
 	start = time_now();
-	if (io_loop() != NULL)
+	if (io_loop() != &num_active)
 		errx(1, "io_loop?");
 	end = time_now();
 
-	for (i = 0; i < NUM; i++) {
+	for (i = 0; i < num; i++) {
 		char b[sizeof(buf[0].buf)];
 		memset(b, i, sizeof(b));
 		sprintf(b, "%i-%i", i, i);
-		if (memcmp(b, buf[(i + NUM_ITERS) % NUM].buf, sizeof(b)) != 0)
+		if (memcmp(b, buf[(i + NUM_ITERS) % num].buf, sizeof(b)) != 0)
 			errx(1, "Buffer for %i was '%s' not '%s'",
-			     i, buf[(i + NUM_ITERS) % NUM].buf, b);
+			     i, buf[(i + NUM_ITERS) % num].buf, b);
 	}
 
-	printf("run-many: %u %u iterations: %llu usec\n",
-	       NUM, NUM_ITERS, (long long)time_to_usec(time_sub(end, start)));
+	printf("run-many: %u %u iterations, %u idle: %llu usec\n",
+	       num, NUM_ITERS, num_idle,
+	       (long long)time_to_usec(time_sub(end, start)));
 	return 0;
 }
@@ -0,0 +1,615 @@
+/* Licensed under LGPLv2.1+ - see LICENSE file for details */
+/* epoll(7) backend: define IO_USE_EPOLL to use this instead of poll.c. */
+#ifdef IO_USE_EPOLL
+#include "io.h"
+#include "backend.h"
+#include <assert.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <limits.h>
+#include <errno.h>
+
+/* Maximum number of ready fds we handle per epoll_wait(). */
+#define EPOLL_BATCH 256
+
+static IO_PER_THREAD int epfd = -1;
+/* A fork()ed child shares epfd with us: it mustn't unregister our fds. */
+static IO_PER_THREAD pid_t epfd_pid;
+static IO_PER_THREAD size_t num_fds = 0, num_conns = 0, num_waiting = 0;
+/* Connections which need finish_conns(); no need to scan them all. */
+static IO_PER_THREAD size_t num_closing = 0, max_closing = 0;
+static IO_PER_THREAD struct io_conn **closing = NULL;
+/* Connections whose plans don't need to wait (same size as closing). */
+static IO_PER_THREAD size_t num_ready_now = 0;
+static IO_PER_THREAD struct io_conn **ready_now = NULL;
+/* epoll refuses regular files (and /dev/null): poll says they're ready. */
+static IO_PER_THREAD size_t num_always = 0, max_always = 0;
+static IO_PER_THREAD struct fd **always = NULL;
+/* Listeners closed while we handle a batch of events, which may still
+ * be in it: we free them once it's done.  Chained via arg. */
+static IO_PER_THREAD unsigned int handling_events = 0;
+static IO_PER_THREAD struct io_listener *dead_listeners = NULL;
+
+/* conn->closing_idx and conn->ready_idx when not on the list. */
+#define NOT_LISTED ((size_t)-1)
+
+/*
+ * fd->backend_info is -1 once deleted, otherwise it holds the events
+ * the plan wants, the events currently registered with epoll, and
+ * whether this fd is on always[].  Both halves of a duplex share one
+ * registration, so we keep their backend_info in sync.
+ *
+ * We don't unregister when a connection stops waiting (eg. goes idle),
+ * as it will usually want the same thing again soon: if it gets events
+ * it doesn't want two epoll_wait()s in a row, we fix up the
+ * registration then (UNWANTED marks the first time).
+ *
+ * EPOLLIN and EPOLLOUT are the same as POLLIN and POLLOUT, so we
+ * use plan.pollflag directly.
+ */
+#define WANT_MASK	((size_t)0xFFFF)
+#define EPOLL_SHIFT	16
+#define UNWANTED	((size_t)1 << 30)
+#define ALWAYS_READY	((size_t)1 << 31)
+
+static int wanted(const struct fd *fd)
+{
+	return fd->backend_info & WANT_MASK;
+}
+
+static int registered(const struct fd *fd)
+{
+	return (fd->backend_info >> EPOLL_SHIFT) & WANT_MASK;
+}
+
+static bool add_always(struct fd *fd)
+{
+	if (num_always + 1 > max_always) {
+		struct fd **newalways;
+		size_t num = max_always ? max_always * 2 : 8;
+
+		newalways = io_alloc.realloc(always, sizeof(*always) * num);
+		if (!newalways)
+			return false;
+		always = newalways;
+		max_always = num;
+	}
+	always[num_always++] = fd;
+	fd->backend_info |= ALWAYS_READY;
+	return true;
+}
+
+static void del_always(struct fd *fd)
+{
+	size_t i;
+
+	for (i = 0; i < num_always; i++) {
+		if (always[i] == fd) {
+			always[i] = always[--num_always];
+			break;
+		}
+	}
+	if (num_always == 0) {
+		io_alloc.free(always);
+		always = NULL;
+		max_always = 0;
+	}
+}
+
+/* Tell epoll about @events (which may be 0), pointing it at @fd. */
+static bool set_registered(struct fd *fd, int events)
+{
+	struct epoll_event ev;
+	int op, old = registered(fd);
+
+	if (fd->backend_info & ALWAYS_READY)
+		return true;
+
+	ev.events = events;
+	ev.data.ptr = fd;
+	if (!events)
+		op = EPOLL_CTL_DEL;
+	else if (!old)
+		op = EPOLL_CTL_ADD;
+	else
+		op = EPOLL_CTL_MOD;
+
+	if (epoll_ctl(epfd, op, fd->fd, &ev) != 0) {
+		if (errno != EPERM || op != EPOLL_CTL_ADD)
+			return false;
+		return add_always(fd);
+	}
+
+	fd->backend_info &= ~(WANT_MASK << EPOLL_SHIFT);
+	fd->backend_info |= (size_t)events << EPOLL_SHIFT;
+	return true;
+}
+
+static bool set_wanted(struct fd *fd, int events)
+{
+	int old = wanted(fd);
+
+	/* Only register if we want something it doesn't have. */
+	if (events && events != registered(fd)) {
+		if (!set_registered(fd, events))
+			return false;
+	}
+
+	if (old)
+		num_waiting--;
+	if (events)
+		num_waiting++;
+	fd->backend_info &= ~(WANT_MASK|UNWANTED);
+	fd->backend_info |= events;
+	return true;
+}
+
+static bool add_fd(struct fd *fd, int events)
+{
+	if (epfd < 0) {
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd < 0)
+			return false;
+		epfd_pid = getpid();
+	}
+
+	fd->backend_info = 0;
+	if (!set_wanted(fd, events))
+		return false;
+	num_fds++;
+	return true;
+}
+
+static void del_fd(struct fd *fd)
+{
+	assert(fd->backend_info != -1);
+	set_wanted(fd, 0);
+	/* We need to unregister, as other dup()s may keep it open; but
+	 * that would also unregister it for the process we forked from. */
+	if (registered(fd) && getpid() == epfd_pid)
+		set_registered(fd, 0);
+	if (fd->backend_info & ALWAYS_READY)
+		del_always(fd);
+	if (--num_fds == 0) {
+		/* Free everything when no more fds. */
+		assert(num_conns == 0);
+		close(epfd);
+		epfd = -1;
+		io_alloc.free(closing);
+		io_alloc.free(ready_now);
+		closing = NULL;
+		ready_now = NULL;
+		max_closing = 0;
+	}
+	fd->backend_info = -1;
+	close(fd->fd);
+}
+
+/* We keep room for every conn to close (or be ready now), so
+ * add_closing() and add_ready_now() can't fail. */
+static bool add_conn_space(void)
+{
+	if (num_conns + 1 > max_closing) {
+		struct io_conn **newclosing, **newready;
+		size_t num = max_closing ? max_closing * 2 : 8;
+
+		newclosing = io_alloc.realloc(closing, sizeof(*closing) * num);
+		if (!newclosing)
+			return false;
+		closing = newclosing;
+		newready = io_alloc.realloc(ready_now, sizeof(*ready_now)*num);
+		if (!newready)
+			return false;
+		ready_now = newready;
+		max_closing = num;
+	}
+	num_conns++;
+	return true;
+}
+
+static void add_closing(struct io_conn *conn)
+{
+	/* Timeouts can close a connection twice before we finish it. */
+	if (conn->closing_idx != NOT_LISTED)
+		return;
+
+	assert(num_closing < num_conns);
+	conn->closing_idx = num_closing;
+	closing[num_closing++] = conn;
+}
+
+static void del_closing(struct io_conn *conn)
+{
+	size_t i = conn->closing_idx;
+
+	if (i == NOT_LISTED)
+		abort();
+	closing[i] = closing[--num_closing];
+	closing[i]->closing_idx = i;
+	conn->closing_idx = NOT_LISTED;
+}
+
+static void add_ready_now(struct io_conn *conn)
+{
+	if (conn->ready_idx != NOT_LISTED)
+		return;
+
+	assert(num_ready_now < num_conns);
+	conn->ready_idx = num_ready_now;
+	ready_now[num_ready_now++] = conn;
+}
+
+static void del_ready_now(struct io_conn *conn)
+{
+	size_t i = conn->ready_idx;
+
+	if (i == NOT_LISTED)
+		return;
+	ready_now[i] = ready_now[--num_ready_now];
+	ready_now[i]->ready_idx = i;
+	conn->ready_idx = NOT_LISTED;
+}
+
+bool add_listener(struct io_listener *l)
+{
+	if (!add_fd(&l->fd, POLLIN))
+		return false;
+	return true;
+}
+
+static bool update_events(struct io_conn *conn)
+{
+	int events = conn->plan.pollflag;
+
+	if (conn->duplex) {
+		int mask = conn->duplex->plan.pollflag;
+		/* You can't *both* read/write. */
+		assert(!mask || events != mask);
+		events |= mask;
+	}
+
+	if (!set_wanted(&conn->fd, events))
+		return false;
+	if (conn->duplex)
+		conn->duplex->fd.backend_info = conn->fd.backend_info;
+	return true;
+}
+
+void backend_plan_changed(struct io_conn *conn)
+{
+	/* This can happen with debugging and delayed free... */
+	if (conn->fd.backend_info == -1)
+		return;
+
+	/* Out of epoll watches (or memory): fail the plan. */
+	if (!update_events(conn)) {
+		conn->plan = io_close_();
+		update_events(conn);
+	}
+
+	if (!conn->plan.next)
+		add_closing(conn);
+	else if (plan_ready_now(&conn->plan))
+		add_ready_now(conn);
+}
+
+bool add_conn(struct io_conn *c)
+{
+	c->closing_idx = c->ready_idx = NOT_LISTED;
+	if (!add_conn_space())
+		return false;
+	if (!add_fd(&c->fd, c->plan.pollflag)) {
+		num_conns--;
+		return false;
+	}
+	/* Immediate close is allowed. */
+	if (!c->plan.next)
+		add_closing(c);
+	else if (plan_ready_now(&c->plan))
+		add_ready_now(c);
+	return true;
+}
+
+bool add_duplex(struct io_conn *c)
+{
+	c->closing_idx = c->ready_idx = NOT_LISTED;
+	if (!add_conn_space())
+		return false;
+	c->fd.backend_info = c->duplex->fd.backend_info;
+	backend_plan_changed(c);
+	return true;
+}
+
+void backend_del_conn(struct io_conn *conn)
+{
+	if (conn->finish) {
+		/* Saved by io_close */
+		errno = conn->plan.u1.s;
+		conn->finish(conn, conn->finish_arg);
+	}
+	free_timeout(conn);
+	del_closing(conn);
+	del_ready_now(conn);
+	num_conns--;
+	if (conn->duplex) {
+		struct io_conn *other = conn->duplex;
+		size_t i;
+
+		other->duplex = NULL;
+		other->fd.backend_info = conn->fd.backend_info;
+		/* In case epoll (or always[]) pointed to us. */
+		if (registered(&other->fd)
+		    && !set_registered(&other->fd, registered(&other->fd)))
+			set_registered(&other->fd, 0);
+		for (i = 0; i < num_always; i++)
+			if (always[i] == &conn->fd)
+				always[i] = &other->fd;
+		conn->fd.backend_info = -1;
+	} else
+		del_fd(&conn->fd);
+	free_conn(conn);
+}
+
+void del_listener(struct io_listener *l)
+{
+	del_fd(&l->fd);
+	if (handling_events) {
+		l->arg = dead_listeners;
+		dead_listeners = l;
+	} else
+		pool_free_listener(l);
+}
+
+/* Done with a batch: nothing can refer to closed listeners now. */
+static void end_events(void)
+{
+	if (--handling_events)
+		return;
+	while (dead_listeners) {
+		struct io_listener *l = dead_listeners;
+		dead_listeners = l->arg;
+		pool_free_listener(l);
+	}
+}
+
+static void set_plan(struct io_conn *conn, struct io_plan plan)
+{
+	conn->plan = plan;
+	backend_plan_changed(conn);
+}
+
+static void accept_conn(struct io_listener *l)
+{
+	int fd = accept(l->fd.fd, NULL, NULL);
+
+	/* FIXME: What to do here? */
+	if (fd < 0)
+		return;
+	l->init(fd, l->arg);
+}
+
+/* It's OK to miss some, as long as we make progress. */
+static bool finish_conns(struct io_conn **ready)
+{
+	while (num_closing && !io_loop_return) {
+		struct io_conn *c = closing[num_closing - 1];
+
+		/* Debugging can replace a plan after io_close(). */
+		if (c->plan.next) {
+			del_closing(c);
+			continue;
+		}
+		if (doing_debug_on(c) && ready) {
+			*ready = c;
+			return true;
+		}
+		backend_del_conn(c);
+	}
+	return false;
+}
+
+/* Run plans which don't need to wait for their fd. */
+static bool run_ready_now(struct io_conn **ready)
+{
+	while (num_ready_now && !io_loop_return) {
+		struct io_conn *c = ready_now[--num_ready_now];
+
+		c->ready_idx = NOT_LISTED;
+		/* It may have changed its mind since. */
+		if (!plan_ready_now(&c->plan))
+			continue;
+		if (doing_debug_on(c) && ready) {
+			*ready = c;
+			return true;
+		}
+		io_ready(c);
+		/* debug can recurse; anything can change. */
+		if (doing_debug())
+			break;
+	}
+	return false;
+}
+
+/* Returns false if debugging means we have to stop processing events. */
+static bool handle_events(struct io_conn *c, int events,
+			  struct io_conn **ready)
+{
+	if (c->fd.listener) {
+		if (events & POLLIN)
+			accept_conn((void *)c);
+	} else if (events & (POLLIN|POLLOUT)) {
+		if (c->duplex) {
+			int mask = c->duplex->plan.pollflag;
+			if (events & mask) {
+				if (doing_debug_on(c->duplex) && ready) {
+					*ready = c->duplex;
+					return false;
+				}
+				io_ready(c->duplex);
+				events &= ~mask;
+				/* debug can recurse; anything can change. */
+				if (doing_debug())
+					return false;
+				if (!(events & (POLLIN|POLLOUT)))
+					return true;
+			}
+		}
+		if (doing_debug_on(c) && ready) {
+			*ready = c;
+			return false;
+		}
+		io_ready(c);
+		/* debug can recurse; anything can change. */
+		if (doing_debug())
+			return false;
+	} else if (events & (POLLHUP|POLLNVAL|POLLERR)) {
+		set_current(c);
+		errno = EBADF;
+		set_plan(c, io_close());
+		if (c->duplex) {
+			set_current(c->duplex);
+			set_plan(c->duplex, io_close());
+		}
+	}
+	return true;
+}
+
+/* Filter out events this fd no longer wants, fixing registration. */
+static int wanted_events(struct fd *fd, int events)
+{
+	int want = wanted(fd);
+
+	/* Like poll(), we don't report hangups on idle fds. */
+	if ((events & ~want & (POLLIN|POLLOUT))
+	    || (!want && (events & (POLLHUP|POLLERR)))) {
+		/* If set_registered fails, we'll just keep ignoring it. */
+		if (!(fd->backend_info & UNWANTED))
+			fd->backend_info |= UNWANTED;
+		else if (set_registered(fd, want))
+			fd->backend_info &= ~UNWANTED;
+		if (!fd->listener && ((struct io_conn *)fd)->duplex)
+			((struct io_conn *)fd)->duplex->fd.backend_info
+				= fd->backend_info;
+	}
+	if (!want)
+		return 0;
+	return events & (want|POLLHUP|POLLERR);
+}
+
+/* Do any of the fds epoll won't take want to do something? */
+static bool always_waiting(void)
+{
+	size_t i;
+
+	for (i = 0; i < num_always; i++)
+		if (wanted(always[i]))
+			return true;
+	return false;
+}
+
+/* This is the main loop. */
+void *do_io_loop(struct io_conn **ready)
+{
+	void *ret;
+
+	check_loop_thread();
+	io_loop_enter();
+
+	while (!io_loop_return) {
+		int i, r, timeout = INT_MAX;
+		struct timespec start;
+		struct epoll_event events[EPOLL_BATCH];
+		bool some_timeouts;
+		size_t n;
+
+		/* Call functions for expired timers. */
+		some_timeouts = expire_timeouts(&timeout);
+
+		if (num_closing) {
+			/* If this finishes a debugging con, return now. */
+			if (finish_conns(ready))
+				return NULL;
+			/* Could have started/finished more. */
+			continue;
+		}
+
+		if (num_ready_now) {
+			/* If this is a debugging con, return now. */
+			if (run_ready_now(ready))
+				return NULL;
+			continue;
+		}
+
+		/* debug can recurse on io_loop; anything can change. */
+		if (doing_debug() && some_timeouts)
+			continue;
+
+		if (num_fds == num_internal_conns())
+			break;
+
+		/* You can't tell them all to go to sleep! */
+		assert(num_waiting);
+
+		if (always_waiting())
+			timeout = 0;
+
+		if (io_stats)
+			start = time_now();
+		r = epoll_wait(epfd, events, EPOLL_BATCH, timeout);
+		if (io_stats)
+			stats_waited(start, r);
+		if (r < 0)
+			break;
+
+		handling_events++;
+		for (i = 0; i < r && !io_loop_return; i++) {
+			struct fd *fd = events[i].data.ptr;
+			int events_i;
+
+			/* Closed by a callback earlier in this batch? */
+			if (fd->backend_info == -1)
+				continue;
+			events_i = wanted_events(fd, events[i].events);
+			if (events_i
+			    && !handle_events((struct io_conn *)fd, events_i,
+					      ready))
+				break;
+		}
+
+		/* These are always ready for whatever they're waiting for. */
+		for (n = 0; i == r && n < num_always && !io_loop_return; n++) {
+			struct fd *fd = always[n];
+
+			if (wanted(fd)
+			    && !handle_events((struct io_conn *)fd, wanted(fd),
+					      ready))
+				break;
+		}
+		end_events();
+
+		/* We stopped because debug wants to run this one. */
+		if (ready && *ready)
+			return NULL;
+	}
+
+	while (num_closing && !io_loop_return) {
+		if (finish_conns(ready))
+			return NULL;
+	}
+
+	ret = io_loop_return;
+	io_loop_return = NULL;
+
+	io_loop_exit();
+	return ret;
+}
+
+void *io_loop(void)
+{
+	return do_io_loop(NULL);
+}
+#endif /* IO_USE_EPOLL */
@@ -11,13 +11,189 @@
 #include <poll.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <ccan/tally/tally.h>
+#if HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+#if HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+#if !HAVE_THREAD_LOCAL
+#include <pthread.h>
+#endif
+
+IO_PER_THREAD void *io_loop_return;
+
+static IO_PER_THREAD struct timers timeouts;
+/* Zero unless io_set_timeout_granularity() makes timeouts coarse. */
+static IO_PER_THREAD struct timespec granularity;
+static IO_PER_THREAD struct io_timeout_stats timeout_stats;
+/* Counts for this loop iteration, so far. */
+static IO_PER_THREAD unsigned int iter_fired, iter_cancelled;
+
+IO_PER_THREAD struct io_loop_stats *io_stats;
+static IO_PER_THREAD struct io_wakeq wakeq;
+/* I/O done by the current plan, which io_ready() adds to the conn. */
+static IO_PER_THREAD struct io_conn_stats io_counts;
+
+static void count_read(ssize_t ret)
+{
+	io_counts.syscalls++;
+	if (ret > 0)
+		io_counts.bytes_read += ret;
+}
+
+static void count_write(ssize_t ret)
+{
+	io_counts.syscalls++;
+	if (ret > 0)
+		io_counts.bytes_written += ret;
+}
+
+static void claim_counts(struct io_conn *conn)
+{
+	conn->stats.bytes_read += io_counts.bytes_read;
+	conn->stats.bytes_written += io_counts.bytes_written;
+	conn->stats.syscalls += io_counts.syscalls;
+	memset(&io_counts, 0, sizeof(io_counts));
+}
+
+/* Callbacks are timed if stats are enabled. */
+static struct timespec callback_start(void)
+{
+	struct timespec start = { 0, 0 };
+
+	if (io_stats)
+		start = time_now();
+	return start;
+}
+
+static void callback_done(struct timespec start)
+{
+	struct timespec t;
 
-void *io_loop_return;
+	if (!io_stats)
+		return;
+	t = time_sub(time_now(), start);
+	io_stats->callback_time = time_add(io_stats->callback_time, t);
+	tally_add(io_stats->callback_usec, time_to_usec(t));
+}
+
+void stats_waited(struct timespec start, int ready)
+{
+	io_stats->wait_time = time_add(io_stats->wait_time,
+				       time_sub(time_now(), start));
+	if (ready > 0) {
+		io_stats->wakeups++;
+		io_stats->fds_ready += ready;
+		if (ready > io_stats->max_fds_ready)
+			io_stats->max_fds_ready = ready;
+	}
+}
+
+bool io_set_stats(bool enable)
+{
+	if (!enable) {
+		if (io_stats) {
+			free(io_stats->callback_usec);
+			io_alloc.free(io_stats);
+			io_stats = NULL;
+		}
+		return true;
+	}
+
+	if (io_stats)
+		return true;
+	io_stats = io_alloc.alloc(sizeof(*io_stats));
+	if (!io_stats)
+		return false;
+	memset(io_stats, 0, sizeof(*io_stats));
+	io_stats->callback_usec = tally_new(IO_STATS_BUCKETS);
+	if (!io_stats->callback_usec) {
+		io_alloc.free(io_stats);
+		io_stats = NULL;
+		return false;
+	}
+	return true;
+}
+
+const struct io_loop_stats *io_get_loop_stats(void)
+{
+	return io_stats;
+}
+
+void io_get_conn_stats(const struct io_conn *conn,
+		       struct io_conn_stats *stats)
+{
+	*stats = conn->stats;
+}
 
 struct io_alloc io_alloc = {
 	malloc, realloc, free
 };
 
+/* Freed objects kept for reuse, chained through their first word. */
+struct io_pool {
+	void *head;
+	unsigned int num;
+};
+static IO_PER_THREAD struct io_pool conn_pool, listener_pool, timeout_pool;
+static IO_PER_THREAD unsigned int pool_max;
+
+static void *pool_alloc(struct io_pool *pool, size_t size)
+{
+	void *p = pool->head;
+
+	if (!p)
+		return io_alloc.alloc(size);
+	pool->head = *(void **)p;
+	pool->num--;
+	return p;
+}
+
+static void pool_free(struct io_pool *pool, void *p)
+{
+	if (pool->num >= pool_max) {
+		io_alloc.free(p);
+		return;
+	}
+	*(void **)p = pool->head;
+	pool->head = p;
+	pool->num++;
+}
+
+static void pool_trim(struct io_pool *pool)
+{
+	while (pool->num > pool_max) {
+		void *p = pool->head;
+		pool->head = *(void **)p;
+		pool->num--;
+		io_alloc.free(p);
+	}
+}
+
+void pool_free_conn(struct io_conn *conn)
+{
+	pool_free(&conn_pool, conn);
+}
+
+void pool_free_listener(struct io_listener *l)
+{
+	pool_free(&listener_pool, l);
+}
+
+void io_set_pool_size(unsigned int max)
+{
+	pool_max = max;
+	pool_trim(&conn_pool);
+	pool_trim(&listener_pool);
+	pool_trim(&timeout_pool);
+}
+
+static struct io_plan flush_before(struct io_conn *conn, struct io_plan plan);
+
 #ifdef DEBUG
 /* Set to skip the next plan. */
 bool io_plan_nodebug;
@@ -27,6 +203,41 @@ struct io_conn *current;
 bool (*io_debug_conn)(struct io_conn *conn);
 /* Set when we wake up an connection we are debugging. */
 bool io_debug_wakeup;
+/* How deeply we've recursed into do_io_loop(). */
+static unsigned int io_loop_level;
+/* Connections freed while recursing, chained via finish_arg. */
+static struct io_conn *free_later;
+
+void io_loop_enter(void)
+{
+	io_loop_level++;
+}
+
+void io_loop_exit(void)
+{
+	io_loop_level--;
+	if (io_loop_level == 0) {
+		/* Delayed free. */
+		while (free_later) {
+			struct io_conn *c = free_later;
+			free_later = c->finish_arg;
+			pool_free_conn(c);
+		}
+	}
+}
+
+void free_conn(struct io_conn *conn)
+{
+	/* Only free on final exit: chain via finish. */
+	if (io_loop_level > 1) {
+		struct io_conn *c;
+		for (c = free_later; c; c = c->finish_arg)
+			assert(c != conn);
+		conn->finish_arg = free_later;
+		free_later = conn;
+	} else
+		pool_free_conn(conn);
+}
 
 struct io_plan io_debug(struct io_plan plan)
 {
@@ -43,7 +254,7 @@ struct io_plan io_debug(struct io_plan plan)
 	}
 
 	io_debug_wakeup = false;
-	current->plan = plan;
+	current->plan = flush_before(current, plan);
 	backend_plan_changed(current);
 
 	/* Call back into the loop immediately. */
@@ -80,6 +291,7 @@ int io_debug_io(int ret)
 
 	if (!doing_debug_on(conn))
 		return ret;
+	claim_counts(conn);
 
 	/* These will all go linearly through the io_debug() path above. */
 	switch (ret) {
@@ -93,7 +305,7 @@ int io_debug_io(int ret)
 		break;
 	case 1: /* Done: get next plan. */
 		if (timeout_active(conn))
-			backend_del_timeout(conn);
+			del_timeout(conn);
 		conn->plan.next(conn, conn->plan.next_arg);
 		break;
 	default:
@@ -129,7 +341,7 @@ struct io_listener *io_new_listener_(int fd,
 				     void (*init)(int fd, void *arg),
 				     void *arg)
 {
-	struct io_listener *l = io_alloc.alloc(sizeof(*l));
+	struct io_listener *l = pool_alloc(&listener_pool, sizeof(*l));
 
 	if (!l)
 		return NULL;
@@ -139,7 +351,7 @@ struct io_listener *io_new_listener_(int fd,
 	l->init = init;
 	l->arg = arg;
 	if (!add_listener(l)) {
-		io_alloc.free(l);
+		pool_free(&listener_pool, l);
 		return NULL;
 	}
 	return l;
@@ -147,14 +359,13 @@ struct io_listener *io_new_listener_(int fd,
 
 void io_close_listener(struct io_listener *l)
 {
-	close(l->fd.fd);
+	/* This closes the fd, once it's out of the backend. */
 	del_listener(l);
-	io_alloc.free(l);
 }
 
 struct io_conn *io_new_conn_(int fd, struct io_plan plan)
 {
-	struct io_conn *conn = io_alloc.alloc(sizeof(*conn));
+	struct io_conn *conn = pool_alloc(&conn_pool, sizeof(*conn));
 
 	io_plan_debug_again();
 
@@ -168,8 +379,11 @@ struct io_conn *io_new_conn_(int fd, struct io_plan plan)
 	conn->finish_arg = NULL;
 	conn->duplex = NULL;
 	conn->timeout = NULL;
+	conn->wbuf = NULL;
+	memset(&conn->stats, 0, sizeof(conn->stats));
+	conn->wakeq = &wakeq;
 	if (!add_conn(conn)) {
-		io_alloc.free(conn);
+		pool_free_conn(conn);
 		return NULL;
 	}
 	return conn;
@@ -191,7 +405,7 @@ struct io_conn *io_duplex_(struct io_conn *old, struct io_plan plan)
 
 	assert(!old->duplex);
 
-	conn = io_alloc.alloc(sizeof(*conn));
+	conn = pool_alloc(&conn_pool, sizeof(*conn));
 	if (!conn)
 		return NULL;
 
@@ -202,36 +416,203 @@ struct io_conn *io_duplex_(struct io_conn *old, struct io_plan plan)
 	conn->finish = NULL;
 	conn->finish_arg = NULL;
 	conn->timeout = NULL;
+	conn->wbuf = NULL;
+	memset(&conn->stats, 0, sizeof(conn->stats));
+	conn->wakeq = &wakeq;
 	if (!add_duplex(conn)) {
-		io_alloc.free(conn);
+		pool_free_conn(conn);
 		return NULL;
 	}
 	old->duplex = conn;
 	return conn;
 }
 
+#if !HAVE_THREAD_LOCAL
+/* Without per-thread loops, only one thread can ever run one. */
+static pthread_once_t loop_once = PTHREAD_ONCE_INIT;
+static pthread_t loop_thread;
+
+static void set_loop_thread(void)
+{
+	loop_thread = pthread_self();
+}
+
+void check_loop_thread(void)
+{
+	pthread_once(&loop_once, set_loop_thread);
+	assert(pthread_equal(loop_thread, pthread_self()));
+}
+#endif
+
+static bool coarse_timeouts(void)
+{
+	return granularity.tv_sec || granularity.tv_nsec;
+}
+
+/* Round up to a multiple of granularity, so nearby timers share a slot. */
+static struct timespec round_up(struct timespec t)
+{
+	uint64_t g = time_to_nsec(granularity), n = time_to_nsec(t);
+
+	/* Re-armed after switching to exact timeouts? */
+	if (!g)
+		return t;
+	return time_from_nsec((n + g - 1) / g * g);
+}
+
+static void arm_timeout(struct io_timeout *t, struct timespec when)
+{
+	if (!timeouts.base)
+		timers_init(&timeouts, time_now());
+	timer_add(&timeouts, &t->timer, when);
+	t->armed = when;
+	t->queued = true;
+}
+
+static void add_timeout(struct io_conn *conn, struct timespec duration)
+{
+	struct io_timeout *t = conn->timeout;
+
+	t->deadline = time_add(time_now(), duration);
+	t->conn = conn;
+	timeout_stats.added++;
+
+	if (!coarse_timeouts()) {
+		/* Left queued from before granularity was set to 0? */
+		if (t->queued)
+			timer_del(&timeouts, &t->timer);
+		arm_timeout(t, t->deadline);
+		return;
+	}
+
+	/* Still queued from last time, and not too late?  Leave it: if it
+	 * expires before the deadline, expire_timeouts() re-arms it. */
+	if (t->queued) {
+		if (!time_greater(t->armed, time_add(t->deadline, granularity)))
+			return;
+		timer_del(&timeouts, &t->timer);
+		t->queued = false;
+	}
+	arm_timeout(t, round_up(t->deadline));
+}
+
+void del_timeout(struct io_conn *conn)
+{
+	struct io_timeout *t = conn->timeout;
+
+	assert(t->conn == conn);
+	t->conn = NULL;
+	timeout_stats.cancelled++;
+	iter_cancelled++;
+
+	/* Coarse timers are left queued: it's likely to be re-added. */
+	if (!coarse_timeouts()) {
+		timer_del(&timeouts, &t->timer);
+		t->queued = false;
+	}
+}
+
+void free_timeout(struct io_conn *conn)
+{
+	if (!conn->timeout)
+		return;
+	if (timeout_active(conn))
+		del_timeout(conn);
+	if (conn->timeout->queued)
+		timer_del(&timeouts, &conn->timeout->timer);
+	pool_free(&timeout_pool, conn->timeout);
+}
+
+/* Called once per loop iteration. */
+bool expire_timeouts(int *ms)
+{
+	struct timespec now, first, start;
+	struct list_head expired;
+	struct io_timeout *t;
+	bool some_timeouts = false;
+
+	timeout_stats.iter_fired = iter_fired;
+	timeout_stats.iter_cancelled = iter_cancelled;
+	iter_fired = iter_cancelled = 0;
+	if (io_stats)
+		io_stats->iterations++;
+
+	if (!timeouts.base)
+		return false;
+
+	now = time_now();
+	timers_expire(&timeouts, now, &expired);
+	while ((t = list_pop(&expired, struct io_timeout, timer.list))) {
+		struct io_conn *conn = t->conn;
+
+		t->queued = false;
+		/* Cancelled (coarse mode), and not re-added since. */
+		if (!conn)
+			continue;
+		/* Re-added (coarse mode) with a later deadline. */
+		if (time_greater(t->deadline, t->armed)) {
+			arm_timeout(t, round_up(t->deadline));
+			timeout_stats.rearmed++;
+			continue;
+		}
+
+		/* Clear, in case timer re-adds */
+		t->conn = NULL;
+		timeout_stats.fired++;
+		iter_fired++;
+		set_current(conn);
+		start = callback_start();
+		conn->plan = t->next(conn, t->next_arg);
+		callback_done(start);
+		backend_plan_changed(conn);
+		some_timeouts = true;
+	}
+
+	/* Now figure out how long to wait for the next one. */
+	if (timer_earliest(&timeouts, &first)) {
+		uint64_t f = time_to_msec(time_sub(first, now));
+		if (f < *ms)
+			*ms = f;
+	}
+	return some_timeouts;
+}
+
 bool io_timeout_(struct io_conn *conn, struct timespec ts,
 		 struct io_plan (*cb)(struct io_conn *, void *), void *arg)
 {
 	assert(cb);
 
 	if (!conn->timeout) {
-		conn->timeout = io_alloc.alloc(sizeof(*conn->timeout));
+		conn->timeout = pool_alloc(&timeout_pool,
+					   sizeof(*conn->timeout));
 		if (!conn->timeout)
 			return false;
+		conn->timeout->conn = NULL;
+		conn->timeout->queued = false;
 	} else
 		assert(!timeout_active(conn));
 
 	conn->timeout->next = cb;
 	conn->timeout->next_arg = arg;
-	backend_add_timeout(conn, ts);
+	add_timeout(conn, ts);
 	return true;
 }
 
+void io_set_timeout_granularity(struct timespec gran)
+{
+	granularity = gran;
+}
+
+void io_get_timeout_stats(struct io_timeout_stats *stats)
+{
+	*stats = timeout_stats;
+}
+
 /* Returns true if we're finished. */
 static int do_write(int fd, struct io_plan *plan)
 {
 	ssize_t ret = write(fd, plan->u1.cp, plan->u2.s);
+	count_write(ret);
 	if (ret < 0)
 		return io_debug_io(-1);
 
@@ -261,6 +642,7 @@ struct io_plan io_write_(const void *data, size_t len,
 static int do_read(int fd, struct io_plan *plan)
 {
 	ssize_t ret = read(fd, plan->u1.cp, plan->u2.s);
+	count_read(ret);
 	if (ret <= 0)
 		return io_debug_io(-1);
 
@@ -290,6 +672,7 @@ struct io_plan io_read_(void *data, size_t len,
 static int do_read_partial(int fd, struct io_plan *plan)
 {
 	ssize_t ret = read(fd, plan->u1.cp, *(size_t *)plan->u2.vp);
+	count_read(ret);
 	if (ret <= 0)
 		return io_debug_io(-1);
 
@@ -318,6 +701,7 @@ struct io_plan io_read_partial_(void *data, size_t *len,
 static int do_write_partial(int fd, struct io_plan *plan)
 {
 	ssize_t ret = write(fd, plan->u1.cp, *(size_t *)plan->u2.vp);
+	count_write(ret);
 	if (ret < 0)
 		return io_debug_io(-1);
 
@@ -343,6 +727,381 @@ struct io_plan io_write_partial_(const void *data, size_t *len,
 	return plan;
 }
 
+static int do_writev(int fd, struct io_plan *plan)
+{
+	struct iovec *iov = plan->u1.vp;
+	size_t cnt = plan->u2.s;
+	ssize_t ret;
+
+#ifdef IOV_MAX
+	if (cnt > IOV_MAX)
+		cnt = IOV_MAX;
+#endif
+	ret = writev(fd, iov, cnt);
+	count_write(ret);
+	if (ret < 0)
+		return io_debug_io(-1);
+
+	/* Skip over what we wrote, trimming any partially-written one. */
+	while (plan->u2.s && ret >= (ssize_t)iov->iov_len) {
+		ret -= iov->iov_len;
+		iov++;
+		plan->u2.s--;
+	}
+	if (plan->u2.s) {
+		iov->iov_base = (char *)iov->iov_base + ret;
+		iov->iov_len -= ret;
+	}
+	plan->u1.vp = iov;
+	return io_debug_io(plan->u2.s == 0);
+}
+
+/* Queue an array of buffers to be written. */
+struct io_plan io_writev_(struct iovec *iov, size_t iovcnt,
+			  struct io_plan (*cb)(struct io_conn *, void *),
+			  void *arg)
+{
+	struct io_plan plan;
+
+	assert(cb);
+	plan.u1.vp = iov;
+	plan.u2.s = iovcnt;
+	plan.io = do_writev;
+	plan.next = cb;
+	plan.next_arg = arg;
+	plan.pollflag = POLLOUT;
+
+	return plan;
+}
+
+/* Copy via a bounce buffer, for when the kernel won't do it for us. */
+static ssize_t copy_from_file(int fd, int in_fd, size_t len)
+{
+	char buf[16384];
+	off_t off = lseek(in_fd, 0, SEEK_CUR);
+	ssize_t ret;
+
+	if (off < 0)
+		return -1;
+	if (len > sizeof(buf))
+		len = sizeof(buf);
+	ret = pread(in_fd, buf, len, off);
+	if (ret <= 0)
+		return ret;
+	ret = write(fd, buf, ret);
+	if (ret > 0 && lseek(in_fd, off + ret, SEEK_SET) < 0)
+		return -1;
+	return ret;
+}
+
+static int do_sendfile(int fd, struct io_plan *plan)
+{
+	int in_fd = plan->u1.s;
+	ssize_t ret;
+
+#if HAVE_SENDFILE
+	ret = sendfile(fd, in_fd, NULL, plan->u2.s);
+	if (ret < 0 && (errno == EINVAL || errno == ENOSYS))
+		ret = copy_from_file(fd, in_fd, plan->u2.s);
+#else
+	ret = copy_from_file(fd, in_fd, plan->u2.s);
+#endif
+	count_write(ret);
+	/* Hitting end of file early is an error, too. */
+	if (ret <= 0)
+		return io_debug_io(-1);
+
+	plan->u2.s -= ret;
+	return io_debug_io(plan->u2.s == 0);
+}
+
+/* Queue part of a file to be written. */
+struct io_plan io_sendfile_(int in_fd, size_t len,
+			    struct io_plan (*cb)(struct io_conn *, void *),
+			    void *arg)
+{
+	struct io_plan plan;
+
+	assert(cb);
+	plan.u1.s = in_fd;
+	plan.u2.s = len;
+	plan.io = do_sendfile;
+	plan.next = cb;
+	plan.next_arg = arg;
+	plan.pollflag = POLLOUT;
+
+	return plan;
+}
+
+void io_rbuf_init(struct io_rbuf *rbuf, char *buf, size_t size)
+{
+	rbuf->buf = buf;
+	rbuf->size = size;
+	rbuf->start = rbuf->len = rbuf->consume = 0;
+}
+
+static void rbuf_consume(struct io_rbuf *rbuf, size_t len)
+{
+	rbuf->start += len;
+	rbuf->len -= len;
+	if (!rbuf->len)
+		rbuf->start = 0;
+}
+
+/* Read as much as will fit at the end of the buffer. */
+static ssize_t rbuf_fill(int fd, struct io_rbuf *rbuf)
+{
+	ssize_t ret;
+
+	if (rbuf->start + rbuf->len == rbuf->size) {
+		memmove(rbuf->buf, rbuf->buf + rbuf->start, rbuf->len);
+		rbuf->start = 0;
+	}
+	ret = read(fd, rbuf->buf + rbuf->start + rbuf->len,
+		   rbuf->size - rbuf->start - rbuf->len);
+	count_read(ret);
+	if (ret > 0)
+		rbuf->len += ret;
+	return ret;
+}
+
+/* Give them what we have. */
+static void rbuf_copy(struct io_rbuf *rbuf)
+{
+	size_t n = rbuf->want < rbuf->len ? rbuf->want : rbuf->len;
+
+	memcpy(rbuf->data, rbuf->buf + rbuf->start, n);
+	rbuf->data += n;
+	rbuf->want -= n;
+	rbuf_consume(rbuf, n);
+}
+
+static int do_read_buffered(int fd, struct io_plan *plan)
+{
+	struct io_rbuf *rbuf = plan->u1.vp;
+	struct iovec iov[2];
+	ssize_t ret;
+
+	rbuf_copy(rbuf);
+	if (rbuf->want == 0)
+		return io_debug_io(1);
+
+	/* Buffer is now empty: read straight into data, excess to buffer. */
+	iov[0].iov_base = rbuf->data;
+	iov[0].iov_len = rbuf->want;
+	iov[1].iov_base = rbuf->buf;
+	iov[1].iov_len = rbuf->size;
+	ret = readv(fd, iov, 2);
+	count_read(ret);
+	if (ret <= 0)
+		return io_debug_io(-1);
+
+	if (ret > rbuf->want) {
+		rbuf->len = ret - rbuf->want;
+		ret = rbuf->want;
+	}
+	rbuf->data += ret;
+	rbuf->want -= ret;
+	return io_debug_io(rbuf->want == 0);
+}
+
+/* Queue a request to read into a buffer, via the read buffer. */
+struct io_plan io_read_buffered_(struct io_rbuf *rbuf, void *data, size_t len,
+				 struct io_plan (*cb)(struct io_conn *, void *),
+				 void *arg)
+{
+	struct io_plan plan;
+
+	assert(cb);
+	rbuf_consume(rbuf, rbuf->consume);
+	rbuf->consume = 0;
+	rbuf->data = data;
+	rbuf->want = len;
+
+	plan.u1.vp = rbuf;
+	plan.io = do_read_buffered;
+	plan.next = cb;
+	plan.next_arg = arg;
+	/* No need to wait if we already have it all. */
+	plan.pollflag = rbuf->len >= len ? 0 : POLLIN;
+
+	return plan;
+}
+
+/* Have we got a whole record yet? */
+static bool rbuf_find_delim(struct io_rbuf *rbuf)
+{
+	const char *start = rbuf->buf + rbuf->start, *p;
+
+	p = memchr(start + rbuf->scanned, rbuf->delim,
+		   rbuf->len - rbuf->scanned);
+	if (!p) {
+		rbuf->scanned = rbuf->len;
+		return false;
+	}
+	*rbuf->line = rbuf->buf + rbuf->start;
+	*rbuf->linelen = rbuf->consume = p + 1 - start;
+	return true;
+}
+
+static int do_read_until(int fd, struct io_plan *plan)
+{
+	struct io_rbuf *rbuf = plan->u1.vp;
+
+	if (rbuf_find_delim(rbuf))
+		return io_debug_io(1);
+
+	if (rbuf->len == rbuf->size) {
+		errno = ENOBUFS;
+		return io_debug_io(-1);
+	}
+	if (rbuf_fill(fd, rbuf) <= 0)
+		return io_debug_io(-1);
+	return io_debug_io(rbuf_find_delim(rbuf));
+}
+
+/* Queue a request to read a delimited record, via the read buffer. */
+struct io_plan io_read_until_(struct io_rbuf *rbuf, char delim,
+			      char **line, size_t *linelen,
+			      struct io_plan (*cb)(struct io_conn *, void *),
+			      void *arg)
+{
+	struct io_plan plan;
+
+	assert(cb);
+	rbuf_consume(rbuf, rbuf->consume);
+	rbuf->consume = 0;
+	rbuf->delim = delim;
+	rbuf->scanned = 0;
+	rbuf->line = line;
+	rbuf->linelen = linelen;
+
+	plan.u1.vp = rbuf;
+	plan.io = do_read_until;
+	plan.next = cb;
+	plan.next_arg = arg;
+	/* No need to wait if we already have it all. */
+	if (memchr(rbuf->buf + rbuf->start, delim, rbuf->len))
+		plan.pollflag = 0;
+	else {
+		plan.pollflag = POLLIN;
+		rbuf->scanned = rbuf->len;
+	}
+
+	return plan;
+}
+
+void io_wbuf_init(struct io_wbuf *wbuf, char *buf, size_t size)
+{
+	wbuf->buf = buf;
+	wbuf->size = size;
+	wbuf->len = wbuf->datalen = wbuf->done = 0;
+	wbuf->data = NULL;
+}
+
+void io_set_wbuf(struct io_conn *conn, struct io_wbuf *wbuf)
+{
+	assert(!conn->wbuf || !conn->wbuf->len);
+	conn->wbuf = wbuf;
+}
+
+static int do_queued(int fd, struct io_plan *plan)
+{
+	return io_debug_io(1);
+}
+
+/* Write queued data, then any unbuffered data. */
+static int do_write_buffered(int fd, struct io_plan *plan)
+{
+	struct io_wbuf *wbuf = plan->u1.vp;
+	struct iovec iov[2];
+	size_t n = 0, off = 0;
+	ssize_t ret;
+
+	if (wbuf->done < wbuf->len) {
+		iov[n].iov_base = wbuf->buf + wbuf->done;
+		iov[n].iov_len = wbuf->len - wbuf->done;
+		n++;
+	} else
+		off = wbuf->done - wbuf->len;
+	if (off < wbuf->datalen) {
+		iov[n].iov_base = (char *)wbuf->data + off;
+		iov[n].iov_len = wbuf->datalen - off;
+		n++;
+	}
+
+	ret = writev(fd, iov, n);
+	count_write(ret);
+	if (ret < 0)
+		return io_debug_io(-1);
+
+	wbuf->done += ret;
+	if (wbuf->done < wbuf->len + wbuf->datalen)
+		return io_debug_io(0);
+
+	wbuf->len = wbuf->datalen = wbuf->done = 0;
+	wbuf->data = NULL;
+	return io_debug_io(1);
+}
+
+/* Queue some data to be written, via the write buffer. */
+struct io_plan io_write_buffered_(struct io_wbuf *wbuf,
+				  const void *data, size_t len,
+				  struct io_plan (*cb)(struct io_conn *, void *),
+				  void *arg)
+{
+	struct io_plan plan;
+
+	assert(cb);
+	plan.u1.vp = wbuf;
+	plan.next = cb;
+	plan.next_arg = arg;
+
+	if (len <= wbuf->size - wbuf->len) {
+		memcpy(wbuf->buf + wbuf->len, data, len);
+		wbuf->len += len;
+		plan.io = do_queued;
+		plan.pollflag = 0;
+	} else {
+		wbuf->data = data;
+		wbuf->datalen = len;
+		plan.io = do_write_buffered;
+		plan.pollflag = POLLOUT;
+	}
+
+	return plan;
+}
+
+static struct io_plan wbuf_flushed(struct io_conn *conn, void *wbuf)
+{
+	return io_debug(((struct io_wbuf *)wbuf)->saved);
+}
+
+static bool flushing(const struct io_conn *conn)
+{
+	return conn->plan.next == wbuf_flushed;
+}
+
+/* If we're about to wait, flush queued writes first. */
+static struct io_plan flush_before(struct io_conn *conn, struct io_plan plan)
+{
+	struct io_plan flush;
+
+	if (!conn->wbuf || !conn->wbuf->len || plan_ready_now(&plan))
+		return plan;
+	/* This flushes anyway. */
+	if (plan.io == do_write_buffered)
+		return plan;
+
+	conn->wbuf->saved = plan;
+	flush.u1.vp = conn->wbuf;
+	flush.io = do_write_buffered;
+	flush.next = wbuf_flushed;
+	flush.next_arg = conn->wbuf;
+	flush.pollflag = POLLOUT;
+	return flush;
+}
+
 static int already_connected(int fd, struct io_plan *plan)
 {
 	return io_debug_io(1);
@@ -416,6 +1175,12 @@ void io_wake_(struct io_conn *conn, struct io_plan plan)
 	/* It might be closing, but we haven't called its finish() yet. */
 	if (!conn->plan.next)
 		return;
+	/* It went idle, but is still flushing: wake after that. */
+	if (flushing(conn)) {
+		assert(!conn->wbuf->saved.io);
+		conn->wbuf->saved = plan;
+		return;
+	}
 	/* It was idle, right? */
 	assert(!conn->plan.io);
 	conn->plan = plan;
@@ -424,22 +1189,127 @@ void io_wake_(struct io_conn *conn, struct io_plan plan)
 	debug_io_wake(conn);
 }
 
+unsigned int num_internal_conns(void)
+{
+	return wakeq.conn ? 1 : 0;
+}
+
+static struct io_plan read_wakeups(struct io_conn *conn, struct io_wakeq *wq);
+
+static struct io_plan got_wakeups(struct io_conn *conn, struct io_wakeq *wq)
+{
+	struct io_conn *c, *next, *list = NULL;
+
+	/* Take them all at once, and reverse them to wake in order. */
+	c = __sync_lock_test_and_set(&wq->head, NULL);
+	for (; c; c = next) {
+		next = c->wake_next;
+		c->wake_next = list;
+		list = c;
+	}
+
+	for (c = list; c; c = next) {
+		next = c->wake_next;
+		io_wake_(c, c->wake_plan);
+	}
+	return read_wakeups(conn, wq);
+}
+
+static struct io_plan read_wakeups(struct io_conn *conn, struct io_wakeq *wq)
+{
+	/* An eventfd read gives (and resets) the counter: any size >= 8. */
+	wq->len = sizeof(wq->buf);
+	return io_read_partial(wq->buf, &wq->len, got_wakeups, wq);
+}
+
+static void wakeq_closed(struct io_conn *conn, struct io_wakeq *wq)
+{
+	if (wq->fd != conn->fd.fd)
+		close(wq->fd);
+	wq->conn = NULL;
+}
+
+bool io_wake_from_thread_init(void)
+{
+	int fds[2];
+
+	if (wakeq.conn)
+		return true;
+
+#if HAVE_EVENTFD
+	fds[0] = fds[1] = eventfd(0, EFD_CLOEXEC);
+	if (fds[0] < 0)
+		return false;
+#else
+	if (pipe(fds) != 0)
+		return false;
+	/* If the pipe is full, the loop is awake anyway: don't block. */
+	fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+#endif
+	wakeq.fd = fds[1];
+	wakeq.conn = io_new_conn(fds[0], read_wakeups(NULL, &wakeq));
+	if (!wakeq.conn) {
+		int saved_errno = errno;
+		close(fds[0]);
+		if (fds[1] != fds[0])
+			close(fds[1]);
+		errno = saved_errno;
+		return false;
+	}
+	io_set_finish(wakeq.conn, wakeq_closed, &wakeq);
+	return true;
+}
+
+void io_wake_from_thread_(struct io_conn *conn, struct io_plan plan)
+{
+	struct io_wakeq *wq = conn->wakeq;
+	struct io_conn *head;
+	uint64_t one = 1;
+
+	/* Its loop thread needs to have called io_wake_from_thread_init() */
+	assert(wq->conn);
+
+	conn->wake_plan = plan;
+	do {
+		head = wq->head;
+		conn->wake_next = head;
+	} while (!__sync_bool_compare_and_swap(&wq->head, head, conn));
+
+	/* If the queue was empty, the loop may be asleep.  A failed write
+	 * means the pipe is full, so it's awake anyway. */
+	if (!head && write(wq->fd, &one, sizeof(one)) != sizeof(one))
+		assert(errno == EAGAIN);
+}
+
 void io_ready(struct io_conn *conn)
 {
+	struct timespec start;
+	int ret;
+
 	set_current(conn);
-	switch (conn->plan.io(conn->fd.fd, &conn->plan)) {
-	case -1: /* Failure means a new plan: close up. */
-		conn->plan = io_close();
-		backend_plan_changed(conn);
-		break;
-	case 0: /* Keep going with plan. */
-		break;
-	case 1: /* Done: get next plan. */
-		if (timeout_active(conn))
-			backend_del_timeout(conn);
-		conn->plan = conn->plan.next(conn, conn->plan.next_arg);
-		backend_plan_changed(conn);
-	}
+	do {
+		ret = conn->plan.io(conn->fd.fd, &conn->plan);
+		claim_counts(conn);
+		switch (ret) {
+		case -1: /* Failure means a new plan: close up. */
+			conn->plan = io_close();
+			backend_plan_changed(conn);
+			break;
+		case 0: /* Keep going with plan. */
+			break;
+		case 1: /* Done: get next plan. */
+			/* A flush isn't their plan: timeout is for the next. */
+			if (timeout_active(conn) && !flushing(conn))
+				del_timeout(conn);
+			start = callback_start();
+			conn->plan = conn->plan.next(conn, conn->plan.next_arg);
+			callback_done(start);
+			conn->plan = flush_before(conn, conn->plan);
+			backend_plan_changed(conn);
+		}
+	/* No point going back to the loop if it needn't wait. */
+	} while (plan_ready_now(&conn->plan)
+		 && !io_loop_return && !doing_debug());
 	set_current(NULL);
 }
 
@@ -476,6 +1346,12 @@ void io_set_alloc(void *(*allocfn)(size_t size),
 		  void *(*reallocfn)(void *ptr, size_t size),
 		  void (*freefn)(void *ptr))
 {
+	unsigned int max = pool_max;
+
+	/* Pooled objects must go back to the allocator they came from. */
+	io_set_pool_size(0);
+	pool_max = max;
+
 	io_alloc.alloc = allocfn;
 	io_alloc.realloc = reallocfn;
 	io_alloc.free = freefn;
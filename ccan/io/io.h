@@ -290,6 +290,341 @@ struct io_plan io_write_partial_(const void *data, size_t *len,
 				 struct io_plan (*cb)(struct io_conn *, void*),
 				 void *arg);
 
+/**
+ * io_writev - plan to write out an array of buffers.
+ * @iov: the array of buffers.
+ * @iovcnt: the number of entries in @iov.
+ * @cb: function to call once it's done.
+ * @arg: @cb argument
+ *
+ * This creates a plan to write out all the buffers in @iov, in order,
+ * using as few writev() calls as possible.  Once it's all written,
+ * the @cb function will be called: on an error, the finish function
+ * is called instead.
+ *
+ * @iov is used to track progress, so its contents are altered and it
+ * must remain valid until @cb is called.
+ *
+ * Note that the I/O may actually be done immediately.
+ *
+ * Example:
+ * #include <sys/uio.h>
+ *
+ * struct reply {
+ *	char hdr[10];
+ *	const char *body;
+ *	struct iovec iov[2];
+ * };
+ *
+ * // Send header and body without copying them together.
+ * static struct io_plan send_reply(struct io_conn *conn, struct reply *r)
+ * {
+ *	r->iov[0].iov_base = r->hdr;
+ *	r->iov[0].iov_len = sprintf(r->hdr, "%zu\n", strlen(r->body));
+ *	r->iov[1].iov_base = (char *)r->body;
+ *	r->iov[1].iov_len = strlen(r->body);
+ *	return io_writev(r->iov, 2, io_close_cb, NULL);
+ * }
+ */
+struct iovec;
+#define io_writev(iov, iovcnt, cb, arg)					\
+	io_debug(io_writev_((iov), (iovcnt),				\
+			    typesafe_cb_preargs(struct io_plan, void *,	\
+						(cb), (arg),		\
+						struct io_conn *),	\
+			    (arg)))
+struct io_plan io_writev_(struct iovec *iov, size_t iovcnt,
+			  struct io_plan (*cb)(struct io_conn *, void *),
+			  void *arg);
+
+/**
+ * io_sendfile - plan to write data from a file.
+ * @in_fd: the file to write from.
+ * @len: the number of bytes to write.
+ * @cb: function to call once it's done.
+ * @arg: @cb argument
+ *
+ * This creates a plan to write @len bytes from @in_fd, starting at its
+ * current file offset (which is advanced as the data is written).
+ * Where possible the kernel copies the data directly using sendfile(),
+ * so it never passes through userspace.  Once it's all written, the
+ * @cb function will be called: on an error (including @in_fd ending
+ * early), the finish function is called instead.
+ *
+ * @in_fd must be a seekable file, and since the file offset is used,
+ * two connections should not io_sendfile() from the same open file at
+ * once.  @in_fd is not closed.
+ *
+ * Note that the I/O may actually be done immediately.
+ *
+ * Example:
+ * #include <fcntl.h>
+ * #include <sys/stat.h>
+ *
+ * static struct io_plan close_file(struct io_conn *conn, int *in_fd)
+ * {
+ *	close(*in_fd);
+ *	return io_close();
+ * }
+ *
+ * // Serve a file, then close.
+ * static void serve_file(int fd, int *in_fd)
+ * {
+ *	struct stat st;
+ *
+ *	fstat(*in_fd, &st);
+ *	io_new_conn(fd, io_sendfile(*in_fd, st.st_size, close_file, in_fd));
+ * }
+ */
+#define io_sendfile(in_fd, len, cb, arg)				\
+	io_debug(io_sendfile_((in_fd), (len),				\
+			      typesafe_cb_preargs(struct io_plan, void *, \
+						  (cb), (arg),		\
+						  struct io_conn *),	\
+			      (arg)))
+struct io_plan io_sendfile_(int in_fd, size_t len,
+			    struct io_plan (*cb)(struct io_conn *, void *),
+			    void *arg);
+
+/**
+ * struct io_rbuf - a read buffer for a connection.
+ *
+ * Rather than one read() per plan, buffered plans read as much as
+ * the buffer will hold and satisfy later plans from what's left over;
+ * such plans don't wait for the fd at all.  Set it up with
+ * io_rbuf_init(), and only use it with one connection.  The members
+ * are private.
+ */
+struct io_rbuf {
+	/* The buffer memory, and its size. */
+	char *buf;
+	size_t size;
+	/* The unconsumed data is at buf + start, for len bytes. */
+	size_t start, len;
+	/* Consumed at the start of the next plan (from io_read_until). */
+	size_t consume;
+
+	/* The current plan: io_read_buffered() or io_read_until(). */
+	char *data;
+	size_t want;
+	char delim;
+	size_t scanned;
+	char **line;
+	size_t *linelen;
+};
+
+/**
+ * io_rbuf_init - set up a read buffer.
+ * @rbuf: the struct io_rbuf.
+ * @buf: the memory to use.
+ * @size: the size of @buf.
+ *
+ * @buf must remain valid as long as @rbuf is in use.  A good @size is
+ * a few times the typical request size.
+ *
+ * Example:
+ * struct client {
+ *	struct io_rbuf rbuf;
+ *	char buf[4096];
+ * };
+ *
+ * static void init_client(struct client *c)
+ * {
+ *	io_rbuf_init(&c->rbuf, c->buf, sizeof(c->buf));
+ * }
+ */
+void io_rbuf_init(struct io_rbuf *rbuf, char *buf, size_t size);
+
+/**
+ * io_read_buffered - plan to read data, via a read buffer.
+ * @rbuf: the read buffer for this connection.
+ * @data: the data buffer.
+ * @len: the length to read.
+ * @cb: function to call once it's done.
+ * @arg: @cb argument
+ *
+ * This is like io_read(), but data comes from @rbuf where possible.
+ * Otherwise it reads directly into @data, with any excess (up to the
+ * size of @rbuf) saved in @rbuf for next time.
+ *
+ * Note that the I/O may actually be done immediately.
+ *
+ * Example:
+ * struct msg {
+ *	struct io_rbuf rbuf;
+ *	char buf[4096];
+ *	unsigned int len;
+ *	char *body;
+ * };
+ *
+ * static struct io_plan read_body(struct io_conn *conn, struct msg *m)
+ * {
+ *	m->body = malloc(m->len);
+ *	return io_read_buffered(&m->rbuf, m->body, m->len, io_close_cb, m);
+ * }
+ *
+ * static void start_read_msg(int fd, struct msg *m)
+ * {
+ *	io_rbuf_init(&m->rbuf, m->buf, sizeof(m->buf));
+ *	// Both header and body usually come from a single read().
+ *	io_new_conn(fd, io_read_buffered(&m->rbuf, &m->len, sizeof(m->len),
+ *					 read_body, m));
+ * }
+ */
+#define io_read_buffered(rbuf, data, len, cb, arg)			\
+	io_debug(io_read_buffered_((rbuf), (data), (len),		\
+				   typesafe_cb_preargs(struct io_plan, void *, \
+						       (cb), (arg),	\
+						       struct io_conn *), \
+				   (arg)))
+struct io_plan io_read_buffered_(struct io_rbuf *rbuf, void *data, size_t len,
+				 struct io_plan (*cb)(struct io_conn *, void *),
+				 void *arg);
+
+/**
+ * io_read_until - plan to read up to a delimiter, via a read buffer.
+ * @rbuf: the read buffer for this connection.
+ * @delim: the character which ends the record (eg. '\n').
+ * @line: set to the start of the record.
+ * @linelen: set to the length of the record, including @delim.
+ * @cb: function to call once it's done.
+ * @arg: @cb argument
+ *
+ * This creates a plan to read until @delim is seen.  @line points
+ * into @rbuf, and is only valid until the next plan using @rbuf.  A
+ * record which doesn't fit in @rbuf is an error (ENOBUFS), as is the
+ * connection closing before @delim.
+ *
+ * Note that the I/O may actually be done immediately.
+ *
+ * Example:
+ * struct lines {
+ *	struct io_rbuf rbuf;
+ *	char buf[4096];
+ *	char *line;
+ *	size_t len;
+ * };
+ *
+ * static struct io_plan print_line(struct io_conn *conn, struct lines *l)
+ * {
+ *	printf("%.*s", (int)l->len, l->line);
+ *	return io_read_until(&l->rbuf, '\n', &l->line, &l->len,
+ *			     print_line, l);
+ * }
+ */
+#define io_read_until(rbuf, delim, line, linelen, cb, arg)		\
+	io_debug(io_read_until_((rbuf), (delim), (line), (linelen),	\
+				typesafe_cb_preargs(struct io_plan, void *, \
+						    (cb), (arg),	\
+						    struct io_conn *),	\
+				(arg)))
+struct io_plan io_read_until_(struct io_rbuf *rbuf, char delim,
+			      char **line, size_t *linelen,
+			      struct io_plan (*cb)(struct io_conn *, void *),
+			      void *arg);
+
+/**
+ * struct io_wbuf - a write buffer for a connection.
+ *
+ * Small writes are copied into the buffer and complete immediately,
+ * so a callback chain building a reply from many pieces doesn't need
+ * a write() for each.  Everything is sent with as few writev() calls
+ * as possible once the buffer fills, or when the connection next has
+ * to wait for something else (eg. io_read(), io_idle() or io_close()).
+ * Set it up with io_wbuf_init(), attach it using io_set_wbuf(), and
+ * only use it with one connection.  The members are private.
+ */
+struct io_wbuf {
+	/* The buffer memory, its size, and how much is queued. */
+	char *buf;
+	size_t size, len;
+	/* Unbuffered data to send after the queued data. */
+	const char *data;
+	size_t datalen;
+	/* How much of the queued data (then data) we've written. */
+	size_t done;
+	/* The plan to resume after flushing. */
+	struct io_plan saved;
+};
+
+/**
+ * io_wbuf_init - set up a write buffer.
+ * @wbuf: the struct io_wbuf.
+ * @buf: the memory to use.
+ * @size: the size of @buf.
+ *
+ * @buf must remain valid as long as @wbuf is in use.  @size is also
+ * the most that will be queued before writing.
+ */
+void io_wbuf_init(struct io_wbuf *wbuf, char *buf, size_t size);
+
+/**
+ * io_set_wbuf - attach a write buffer to a connection.
+ * @conn: the connection.
+ * @wbuf: the write buffer (or NULL to detach, if it's empty).
+ *
+ * Connections need this to flush the write buffer before waiting for
+ * anything else.  Don't use one on a connection which reads while its
+ * io_duplex() partner writes, since the flush writes on @conn.
+ *
+ * Example:
+ * struct client {
+ *	struct io_wbuf wbuf;
+ *	char buf[1024];
+ * };
+ *
+ * static void attach_client(struct io_conn *conn, struct client *c)
+ * {
+ *	io_wbuf_init(&c->wbuf, c->buf, sizeof(c->buf));
+ *	io_set_wbuf(conn, &c->wbuf);
+ * }
+ */
+void io_set_wbuf(struct io_conn *conn, struct io_wbuf *wbuf);
+
+/**
+ * io_write_buffered - plan to write data, via a write buffer.
+ * @wbuf: the write buffer for this connection (see io_set_wbuf()).
+ * @data: the data buffer.
+ * @len: the length to write.
+ * @cb: function to call once it's done.
+ * @arg: @cb argument
+ *
+ * This is like io_write(), but if @data fits in @wbuf it is copied
+ * there and @cb is called without waiting.  Otherwise the buffered data
+ * and @data are written together, without copying @data.
+ *
+ * Note that the I/O may actually be done immediately.
+ *
+ * Example:
+ * struct reply {
+ *	struct io_wbuf wbuf;
+ *	char buf[1024];
+ *	const char *body;
+ * };
+ *
+ * static struct io_plan write_body(struct io_conn *conn, struct reply *r)
+ * {
+ *	// Both pieces will go out in one write, then we close.
+ *	return io_write_buffered(&r->wbuf, r->body, strlen(r->body),
+ *				 io_close_cb, NULL);
+ * }
+ *
+ * static struct io_plan write_header(struct io_conn *conn, struct reply *r)
+ * {
+ *	return io_write_buffered(&r->wbuf, "200 OK\n", 7, write_body, r);
+ * }
+ */
+#define io_write_buffered(wbuf, data, len, cb, arg)			\
+	io_debug(io_write_buffered_((wbuf), (data), (len),		\
+				    typesafe_cb_preargs(struct io_plan, void *, \
+							(cb), (arg),	\
+							struct io_conn *), \
+				    (arg)))
+struct io_plan io_write_buffered_(struct io_wbuf *wbuf,
+				  const void *data, size_t len,
+				  struct io_plan (*cb)(struct io_conn *, void *),
+				  void *arg);
+
 /**
  * io_connect - plan to connect to a listening socket.
  * @fd: file descriptor.
@@ -384,6 +719,145 @@ struct io_plan io_idle_(void);
 bool io_timeout_(struct io_conn *conn, struct timespec ts,
 		 struct io_plan (*fn)(struct io_conn *, void *), void *arg);
 
+/**
+ * io_set_timeout_granularity - trade timeout accuracy for speed.
+ * @gran: how late a timeout may be called (0 for exact, the default).
+ *
+ * With many connections each setting a timeout per request, adding and
+ * removing timers becomes expensive.  With a granularity, a timeout
+ * which is removed (because the next callback was called) is left
+ * queued, and if the connection sets a new timeout it simply reuses
+ * it: the timer only needs to be re-armed if it expires before the new
+ * deadline.  Timeouts are also rounded up to a multiple of @gran, so
+ * they may be called up to @gran late.
+ *
+ * 1 to 100 milliseconds is typical.  This only affects the io_loop() of
+ * the calling thread.  It can be changed at any time, but timeouts
+ * already set may still be up to the old granularity late.
+ *
+ * Example:
+ *	io_set_timeout_granularity(time_from_msec(10));
+ */
+void io_set_timeout_granularity(struct timespec gran);
+
+/**
+ * struct io_timeout_stats - counters for io_timeout().
+ * @added: number of io_timeout() calls.
+ * @fired: number of timeouts which were called.
+ * @cancelled: number removed before being called (eg. the plan finished).
+ * @rearmed: coarse timers which expired early and were re-armed.
+ * @iter_fired: @fired during the last io_loop() iteration.
+ * @iter_cancelled: @cancelled during the last io_loop() iteration.
+ */
+struct io_timeout_stats {
+	uint64_t added, fired, cancelled, rearmed;
+	unsigned int iter_fired, iter_cancelled;
+};
+
+/**
+ * io_get_timeout_stats - get the timeout counters for this thread.
+ * @stats: the struct io_timeout_stats to fill in.
+ *
+ * Example:
+ *	struct io_timeout_stats stats;
+ *
+ *	io_get_timeout_stats(&stats);
+ *	printf("%llu timeouts fired\n", (unsigned long long)stats.fired);
+ */
+void io_get_timeout_stats(struct io_timeout_stats *stats);
+
+/**
+ * struct io_conn_stats - I/O counters for a connection.
+ * @bytes_read: total bytes read by the connection's plans.
+ * @bytes_written: total bytes written by the connection's plans.
+ * @syscalls: number of read/write calls made (including failures).
+ *
+ * Only the io_read/io_write family of plans (and their buffered
+ * variants) are counted: custom plans do their own I/O.
+ */
+struct io_conn_stats {
+	uint64_t bytes_read, bytes_written, syscalls;
+};
+
+/**
+ * io_get_conn_stats - get the I/O counters for a connection.
+ * @conn: the connection.
+ * @stats: the struct io_conn_stats to fill in.
+ *
+ * These are always kept, whether io_set_stats() is enabled or not.
+ * Each half of an io_duplex() connection has its own counters.
+ *
+ * Example:
+ *	static void log_finish(struct io_conn *conn, void *unused)
+ *	{
+ *		struct io_conn_stats stats;
+ *
+ *		io_get_conn_stats(conn, &stats);
+ *		printf("%llu bytes in, %llu out\n",
+ *		       (unsigned long long)stats.bytes_read,
+ *		       (unsigned long long)stats.bytes_written);
+ *	}
+ */
+void io_get_conn_stats(const struct io_conn *conn,
+		       struct io_conn_stats *stats);
+
+struct tally;
+
+/* How many buckets io_set_stats() uses for the callback latency tally. */
+#define IO_STATS_BUCKETS 100
+
+/**
+ * struct io_loop_stats - statistics for this thread's io_loop().
+ * @iterations: times around the loop.
+ * @wakeups: times poll/epoll_wait returned with fds ready.
+ * @fds_ready: total fds ready, over all @wakeups.
+ * @max_fds_ready: most fds ready at once.
+ * @wait_time: total time spent waiting in poll/epoll_wait.
+ * @callback_time: total time spent in callbacks (including timeouts).
+ * @callback_usec: tally of each callback's duration in microseconds.
+ *
+ * Use ccan/tally to query @callback_usec, eg. tally_histogram().
+ */
+struct io_loop_stats {
+	uint64_t iterations, wakeups, fds_ready;
+	unsigned int max_fds_ready;
+	struct timespec wait_time, callback_time;
+	struct tally *callback_usec;
+};
+
+/**
+ * io_set_stats - turn io_loop() statistics on or off.
+ * @enable: true to start gathering, false to stop (and free them).
+ *
+ * Gathering statistics costs two time_now() calls per callback and
+ * per wait, so it is off by default.  Enabling it when already enabled
+ * does nothing; disabling frees the statistics.  This only affects the
+ * calling thread.
+ *
+ * Returns false if allocation fails.
+ *
+ * Example:
+ *	if (!io_set_stats(true))
+ *		err(1, "Enabling io stats");
+ */
+bool io_set_stats(bool enable);
+
+/**
+ * io_get_loop_stats - get this thread's io_loop() statistics.
+ *
+ * Returns NULL unless io_set_stats(true) has been called.  The result
+ * is live: it can be examined inside a callback, while io_loop() runs.
+ *
+ * Example:
+ *	const struct io_loop_stats *s = io_get_loop_stats();
+ *
+ *	if (s)
+ *		printf("%llu iterations, %llu fds ready\n",
+ *		       (unsigned long long)s->iterations,
+ *		       (unsigned long long)s->fds_ready);
+ */
+const struct io_loop_stats *io_get_loop_stats(void);
+
 /**
  * io_duplex - split an fd into two connections.
  * @conn: a connection.
@@ -431,6 +905,53 @@ struct io_conn *io_duplex_(struct io_conn *conn, struct io_plan plan);
 #define io_wake(conn, plan) (io_plan_no_debug(), io_wake_((conn), (plan)))
 void io_wake_(struct io_conn *conn, struct io_plan plan);
 
+/**
+ * io_wake_from_thread_init - allow other threads to wake connections.
+ *
+ * This must be called by the thread which will run io_loop(), before
+ * any other thread calls io_wake_from_thread() on one of its
+ * connections.  It creates an eventfd (or a pipe) which io_loop()
+ * watches; this doesn't stop io_loop() returning once all the other
+ * connections are closed.  Calling it again does nothing.
+ *
+ * Returns false on error (and sets errno).
+ *
+ * Example:
+ *	if (!io_wake_from_thread_init())
+ *		err(1, "io_wake_from_thread_init");
+ */
+bool io_wake_from_thread_init(void);
+
+/**
+ * io_wake_from_thread - wake up an idle connection from another thread.
+ * @conn: an idle connection.
+ * @plan: the next I/O plan for @conn.
+ *
+ * Like io_wake(), but safe to call from any thread: @conn is queued
+ * (without locking) and its io_loop() thread is woken to run @plan.
+ * This lets a callback hand work to a thread pool and return
+ * io_idle(); the worker then calls this with the result.
+ *
+ * @conn must stay idle until it's woken, and must only be woken once:
+ * it cannot be closed or woken by its own thread meanwhile.  Any
+ * buffers @plan uses must not be touched by the worker afterwards.
+ *
+ * Example:
+ *	// Runs in a worker thread.
+ *	static void *work(void *arg)
+ *	{
+ *		struct io_conn *conn = arg;
+ *		static char reply[] = "done";
+ *
+ *		io_wake_from_thread(conn, io_write(reply, sizeof(reply),
+ *						   io_close_cb, NULL));
+ *		return NULL;
+ *	}
+ */
+#define io_wake_from_thread(conn, plan)					\
+	(io_plan_no_debug(), io_wake_from_thread_((conn), (plan)))
+void io_wake_from_thread_(struct io_conn *conn, struct io_plan plan);
+
 /**
  * io_break - return from io_loop()
  * @ret: non-NULL value to return from io_loop().
@@ -486,6 +1007,23 @@ struct io_plan io_close_cb(struct io_conn *, void *unused);
  * This is the core loop; it exits with the io_break() arg, or NULL if
  * all connections and listeners are closed.
  *
+ * If the compiler supports thread-local storage (HAVE_THREAD_LOCAL),
+ * each thread has its own loop: connections and listeners belong to
+ * the thread which created them, and io_loop() only services those.
+ * Never hand an io_conn to another thread, nor io_wake() one there:
+ * use io_wake_from_thread() to wake a connection from another thread.
+ * To spread a server across cores, run one io_loop() per thread, each
+ * with its own io_new_listener(): either on separate sockets bound with
+ * SO_REUSEPORT (the kernel then balances connections), or all on one
+ * shared O_NONBLOCK listening socket (whichever thread wins the accept()
+ * gets the connection).  In the shared case, give each thread its own
+ * dup() of the fd: io_close_listener() closes the fd it was given, and
+ * other threads' listeners must not lose theirs.  DEBUG mode is
+ * single-threaded only.
+ *
+ * Without HAVE_THREAD_LOCAL, there is only one loop, and io_loop()
+ * asserts that it's always called from the same thread.
+ *
  * Example:
  *	io_loop();
  */
@@ -498,9 +1036,29 @@ void *io_loop(void);
  * @freefn: free function
  *
  * By default io uses malloc/realloc/free, and returns NULL if they fail.
- * You can set your own variants here.
+ * You can set your own variants here.  Anything in this thread's pool
+ * (see io_set_pool_size()) is freed first, using the old @freefn.
  */
 void io_set_alloc(void *(*allocfn)(size_t size),
 		  void *(*reallocfn)(void *ptr, size_t size),
 		  void (*freefn)(void *ptr));
+
+/**
+ * io_set_pool_size - reuse freed connections instead of freeing them.
+ * @max: how many connections (and listeners, and timeouts) to keep.
+ *
+ * A server which accepts many short-lived connections spends a good
+ * deal of time allocating and freeing them.  With a pool, up to @max
+ * closed connections are kept for reuse by io_new_conn(), io_duplex()
+ * and the listeners; similarly for listeners themselves and the
+ * structures io_timeout() allocates.
+ *
+ * The default is 0 (no pool).  Reducing it frees any excess.  Each
+ * thread has its own pool: this only affects the calling thread.
+ *
+ * Example:
+ *	// Keep enough for the expected number of concurrent connections.
+ *	io_set_pool_size(1000);
+ */
+void io_set_pool_size(unsigned int max);
 #endif /* CCAN_IO_H */
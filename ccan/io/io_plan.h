@@ -17,6 +17,10 @@ struct io_conn;
  * is saved).  If it returns 1, @next is called, otherwise @io is
  * called again when @pollflag is available.
  *
+ * If @pollflag is 0 but @io is set, @io is called without waiting for
+ * the fd at all: this is useful if the plan can be satisfied from data
+ * already buffered.
+ *
  * You can use this to write your own io_plan functions.
  */
 struct io_plan {
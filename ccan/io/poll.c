@@ -1,4 +1,6 @@
 /* Licensed under LGPLv2.1+ - see LICENSE file for details */
+/* poll(2) backend: the default unless IO_USE_EPOLL is defined. */
+#ifndef IO_USE_EPOLL
 #include "io.h"
 #include "backend.h"
 #include <assert.h>
@@ -9,54 +11,11 @@
 #include <limits.h>
 #include <errno.h>
 
-static size_t num_fds = 0, max_fds = 0, num_closing = 0, num_waiting = 0;
-static struct pollfd *pollfds = NULL;
-static struct fd **fds = NULL;
-static struct timers timeouts;
-#ifdef DEBUG
-static unsigned int io_loop_level;
-static struct io_conn *free_later;
-static void io_loop_enter(void)
-{
-	io_loop_level++;
-}
-static void io_loop_exit(void)
-{
-	io_loop_level--;
-	if (io_loop_level == 0) {
-		/* Delayed free. */
-		while (free_later) {
-			struct io_conn *c = free_later;
-			free_later = c->finish_arg;
-			io_alloc.free(c);
-		}
-	}
-}
-static void free_conn(struct io_conn *conn)
-{
-	/* Only free on final exit: chain via finish. */
-	if (io_loop_level > 1) {
-		struct io_conn *c;
-		for (c = free_later; c; c = c->finish_arg)
-			assert(c != conn);
-		conn->finish_arg = free_later;
-		free_later = conn;
-	} else
-		io_alloc.free(conn);
-}
-#else
-static void io_loop_enter(void)
-{
-}
-static void io_loop_exit(void)
-{
-}
-static void free_conn(struct io_conn *conn)
-{
-	io_alloc.free(conn);
-}
-#endif
-
+static IO_PER_THREAD size_t num_fds = 0, max_fds = 0, num_closing = 0, num_waiting = 0;
+static IO_PER_THREAD struct pollfd *pollfds = NULL;
+static IO_PER_THREAD struct fd **fds = NULL;
+/* Set when a plan may not need to wait: see run_ready_now(). */
+static IO_PER_THREAD bool some_ready_now;
 static bool add_fd(struct fd *fd, short events)
 {
 	if (num_fds + 1 > max_fds) {
@@ -153,6 +112,8 @@ void backend_plan_changed(struct io_conn *conn)
 
 	if (!conn->plan.next)
 		num_closing++;
+	else if (plan_ready_now(&conn->plan))
+		some_ready_now = true;
 }
 
 bool add_conn(struct io_conn *c)
@@ -162,6 +123,8 @@ bool add_conn(struct io_conn *c)
 	/* Immediate close is allowed. */
 	if (!c->plan.next)
 		num_closing++;
+	else if (plan_ready_now(&c->plan))
+		some_ready_now = true;
 	return true;
 }
 
@@ -179,9 +142,7 @@ void backend_del_conn(struct io_conn *conn)
 		errno = conn->plan.u1.s;
 		conn->finish(conn, conn->finish_arg);
 	}
-	if (timeout_active(conn))
-		backend_del_timeout(conn);
-	io_alloc.free(conn->timeout);
+	free_timeout(conn);
 	if (conn->duplex) {
 		/* In case fds[] pointed to the other one. */
 		fds[conn->fd.backend_info] = &conn->duplex->fd;
@@ -196,6 +157,7 @@ void backend_del_conn(struct io_conn *conn)
 void del_listener(struct io_listener *l)
 {
 	del_fd(&l->fd);
+	pool_free_listener(l);
 }
 
 static void set_plan(struct io_conn *conn, struct io_plan plan)
@@ -242,20 +204,35 @@ static bool finish_conns(struct io_conn **ready)
 	return false;
 }
 
-void backend_add_timeout(struct io_conn *conn, struct timespec duration)
+/* Run plans which don't need to wait for their fd. */
+static bool run_ready_now(struct io_conn **ready)
 {
-	if (!timeouts.base)
-		timers_init(&timeouts, time_now());
-	timer_add(&timeouts, &conn->timeout->timer,
-		  time_add(time_now(), duration));
-	conn->timeout->conn = conn;
-}
+	unsigned int i;
 
-void backend_del_timeout(struct io_conn *conn)
-{
-	assert(conn->timeout->conn == conn);
-	timer_del(&timeouts, &conn->timeout->timer);
-	conn->timeout->conn = NULL;
+	some_ready_now = false;
+	for (i = 0; !io_loop_return && i < num_fds; i++) {
+		struct io_conn *c, *duplex;
+
+		if (fds[i]->listener)
+			continue;
+		c = (void *)fds[i];
+		for (duplex = c->duplex; c; c = duplex, duplex = NULL) {
+			if (!plan_ready_now(&c->plan))
+				continue;
+			/* debug can recurse; anything can change. */
+			if (doing_debug()) {
+				some_ready_now = true;
+				if (doing_debug_on(c) && ready) {
+					*ready = c;
+					return true;
+				}
+				io_ready(c);
+				return false;
+			}
+			io_ready(c);
+		}
+	}
+	return false;
 }
 
 /* This is the main loop. */
@@ -263,38 +240,16 @@ void *do_io_loop(struct io_conn **ready)
 {
 	void *ret;
 
+	check_loop_thread();
 	io_loop_enter();
 
 	while (!io_loop_return) {
 		int i, r, timeout = INT_MAX;
-		struct timespec now;
-		bool some_timeouts = false;
-
-		if (timeouts.base) {
-			struct timespec first;
-			struct list_head expired;
-			struct io_timeout *t;
-
-			now = time_now();
-
-			/* Call functions for expired timers. */
-			timers_expire(&timeouts, now, &expired);
-			while ((t = list_pop(&expired, struct io_timeout, timer.list))) {
-				struct io_conn *conn = t->conn;
-				/* Clear, in case timer re-adds */
-				t->conn = NULL;
-				set_current(conn);
-				set_plan(conn, t->next(conn, t->next_arg));
-				some_timeouts = true;
-			}
+		struct timespec start;
+		bool some_timeouts;
 
-			/* Now figure out how long to wait for the next one. */
-			if (timer_earliest(&timeouts, &first)) {
-				uint64_t f = time_to_msec(time_sub(first, now));
-				if (f < INT_MAX)
-					timeout = f;
-			}
-		}
+		/* Call functions for expired timers. */
+		some_timeouts = expire_timeouts(&timeout);
 
 		if (num_closing) {
 			/* If this finishes a debugging con, return now. */
@@ -304,17 +259,28 @@ void *do_io_loop(struct io_conn **ready)
 			continue;
 		}
 
+		if (some_ready_now) {
+			/* If this is a debugging con, return now. */
+			if (run_ready_now(ready))
+				return NULL;
+			continue;
+		}
+
 		/* debug can recurse on io_loop; anything can change. */
 		if (doing_debug() && some_timeouts)
 			continue;
 
-		if (num_fds == 0)
+		if (num_fds == num_internal_conns())
 			break;
 
 		/* You can't tell them all to go to sleep! */
 		assert(num_waiting);
 
+		if (io_stats)
+			start = time_now();
 		r = poll(pollfds, num_fds, timeout);
+		if (io_stats)
+			stats_waited(start, r);
 		if (r < 0)
 			break;
 
@@ -387,3 +353,4 @@ void *io_loop(void)
 {
 	return do_io_loop(NULL);
 }
+#endif /* !IO_USE_EPOLL */
@@ -0,0 +1,3 @@
+#define IO_USE_EPOLL
+#define PORT "63001"
+#include "run-01-start-finish.c"
@@ -0,0 +1,3 @@
+#define IO_USE_EPOLL
+#define PORT "63002"
+#include "run-02-read.c"
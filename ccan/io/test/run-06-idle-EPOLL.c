@@ -0,0 +1,3 @@
+#define IO_USE_EPOLL
+#define PORT "63006"
+#include "run-06-idle.c"
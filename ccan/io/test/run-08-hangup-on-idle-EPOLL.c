@@ -0,0 +1,2 @@
+#define IO_USE_EPOLL
+#include "run-08-hangup-on-idle.c"
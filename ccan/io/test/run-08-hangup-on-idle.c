@@ -1,6 +1,7 @@
 #include <ccan/io/io.h>
 /* Include the C files directly. */
 #include <ccan/io/poll.c>
+#include <ccan/io/epoll.c>
 #include <ccan/io/io.c>
 #include <ccan/tap/tap.h>
 #include <sys/wait.h>
@@ -0,0 +1,3 @@
+#define IO_USE_EPOLL
+#define PORT "63012"
+#include "run-12-bidir.c"
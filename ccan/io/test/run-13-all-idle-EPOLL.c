@@ -0,0 +1,2 @@
+#define IO_USE_EPOLL
+#include "run-13-all-idle.c"
@@ -0,0 +1,3 @@
+#define IO_USE_EPOLL
+#define PORT "63015"
+#include "run-15-timeout.c"
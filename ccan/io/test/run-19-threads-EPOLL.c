@@ -0,0 +1,3 @@
+#define IO_USE_EPOLL
+#define PORT "64019"
+#include "run-19-threads.c"
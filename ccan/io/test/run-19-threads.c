@@ -0,0 +1,180 @@
+#include <ccan/io/io.h>
+/* Include the C files directly. */
+#include <ccan/io/poll.c>
+#include <ccan/io/epoll.c>
+#include <ccan/io/io.c>
+#include <ccan/tap/tap.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#ifndef PORT
+#define PORT "65019"
+#endif
+
+#define NUM_THREADS 4
+#define NUM_CONNS 200
+
+/* Only the main thread calls ok1(): tap isn't thread-safe. */
+struct thread {
+	pthread_t id;
+	struct io_listener *l;
+	int listen_fd, quit[2];
+	unsigned int conns;
+	void *ret;
+	char c, q;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static unsigned int num_ready;
+
+static struct io_plan echo(struct io_conn *conn, struct thread *t)
+{
+	return io_write(&t->c, 1, io_close_cb, NULL);
+}
+
+static void init_conn(int fd, struct thread *t)
+{
+	t->conns++;
+	io_new_conn(fd, io_read(&t->c, 1, echo, t));
+}
+
+/* One byte on the quit pipe: stop listening, so io_loop() can finish. */
+static struct io_plan quit(struct io_conn *conn, struct thread *t)
+{
+	io_close_listener(t->l);
+	return io_close();
+}
+
+static void *loop_thread(void *arg)
+{
+	struct thread *t = arg;
+	int fd = t->listen_fd;
+
+	t->l = io_new_listener(fd, init_conn, t);
+	if (t->l)
+		io_new_conn(t->quit[0], io_read(&t->q, 1, quit, t));
+
+	pthread_mutex_lock(&lock);
+	num_ready++;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+
+	t->ret = io_loop();
+	return NULL;
+}
+
+static int make_listen_fd(const char *port, struct addrinfo **info)
+{
+	int fd, on = 1;
+	struct addrinfo *addrinfo, hints;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	hints.ai_protocol = 0;
+
+	if (getaddrinfo(NULL, port, &hints, &addrinfo) != 0)
+		return -1;
+
+	fd = socket(addrinfo->ai_family, addrinfo->ai_socktype,
+		    addrinfo->ai_protocol);
+	if (fd < 0)
+		return -1;
+
+	/* Each thread gets its own socket; kernel spreads the load. */
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+	if (bind(fd, addrinfo->ai_addr, addrinfo->ai_addrlen) != 0) {
+		close(fd);
+		return -1;
+	}
+	if (listen(fd, NUM_CONNS) != 0) {
+		close(fd);
+		return -1;
+	}
+	*info = addrinfo;
+	return fd;
+}
+
+/* Each connection sends a byte and waits for it to come back. */
+static void talk_to_servers(const struct addrinfo *addrinfo)
+{
+	int fd, i;
+	char c;
+
+	for (i = 0; i < NUM_CONNS; i++) {
+		fd = socket(addrinfo->ai_family, addrinfo->ai_socktype,
+			    addrinfo->ai_protocol);
+		if (fd < 0)
+			exit(1);
+		if (connect(fd, addrinfo->ai_addr, addrinfo->ai_addrlen) != 0)
+			exit(2);
+		c = i;
+		if (write(fd, &c, 1) != 1)
+			exit(3);
+		if (read(fd, &c, 1) != 1 || c != (char)i)
+			exit(4);
+		close(fd);
+	}
+}
+
+int main(void)
+{
+	struct thread t[NUM_THREADS];
+	struct addrinfo *addrinfo = NULL;
+	unsigned int i, total = 0, used = 0;
+	int status;
+
+	/* This is how many tests you plan to run */
+	plan_tests(NUM_THREADS * 4 + 5);
+
+	for (i = 0; i < NUM_THREADS; i++) {
+		if (addrinfo)
+			freeaddrinfo(addrinfo);
+		t[i].listen_fd = make_listen_fd(PORT, &addrinfo);
+		ok1(t[i].listen_fd >= 0);
+		ok1(pipe(t[i].quit) == 0);
+		t[i].conns = 0;
+		t[i].l = NULL;
+		t[i].ret = &t[i];
+		ok1(pthread_create(&t[i].id, NULL, loop_thread, &t[i]) == 0);
+	}
+
+	/* Wait until they're all listening. */
+	pthread_mutex_lock(&lock);
+	while (num_ready != NUM_THREADS)
+		pthread_cond_wait(&cond, &lock);
+	pthread_mutex_unlock(&lock);
+
+	fflush(stdout);
+	if (!fork()) {
+		talk_to_servers(addrinfo);
+		freeaddrinfo(addrinfo);
+		exit(0);
+	}
+	ok1(wait(&status));
+	ok1(WIFEXITED(status));
+	ok1(WEXITSTATUS(status) == 0);
+
+	for (i = 0; i < NUM_THREADS; i++) {
+		if (write(t[i].quit[1], "q", 1) != 1)
+			break;
+		pthread_join(t[i].id, NULL);
+		/* Every loop finished on its own, with nothing left. */
+		ok1(t[i].ret == NULL);
+		total += t[i].conns;
+		if (t[i].conns)
+			used++;
+	}
+	ok1(total == NUM_CONNS);
+	/* Not a strict guarantee, but with 200 connections... */
+	ok1(used > 1);
+
+	freeaddrinfo(addrinfo);
+
+	/* This exits depending on whether all tests passed */
+	return exit_status();
+}
@@ -0,0 +1,102 @@
+#include <ccan/io/io.h>
+/* Include the C files directly. */
+#include <ccan/io/poll.c>
+#include <ccan/io/io.c>
+#include <ccan/tap/tap.h>
+#include <sys/wait.h>
+#include <stdio.h>
+
+/* More than IOV_MAX, and more than a pipe holds. */
+#define NUM_IOV 2000
+
+struct data {
+	int state;
+	size_t len;
+	char *buf;
+	struct iovec iov[NUM_IOV];
+};
+
+static void finish_ok(struct io_conn *conn, struct data *d)
+{
+	ok1(d->state == 1);
+	d->state++;
+	io_break(d, io_idle());
+}
+
+static struct io_plan write_done(struct io_conn *conn, struct data *d)
+{
+	ok1(d->state == 0);
+	d->state++;
+	return io_close();
+}
+
+static void read_from_pipe(int fd, const char *expect, size_t len)
+{
+	char buf[1000];
+	size_t done;
+	ssize_t r;
+
+	for (done = 0; done < len; done += r) {
+		r = read(fd, buf, sizeof(buf));
+		if (r <= 0)
+			exit(1);
+		if (done + r > len || memcmp(buf, expect + done, r) != 0)
+			exit(2);
+	}
+	/* Nothing else. */
+	if (read(fd, buf, 1) != 0)
+		exit(3);
+}
+
+int main(void)
+{
+	struct data *d = malloc(sizeof(*d));
+	struct io_conn *conn;
+	size_t i, off;
+	int fds[2], status;
+
+	/* This is how many tests you plan to run */
+	plan_tests(11);
+	d->state = 0;
+
+	/* Mix of sizes, including empty ones. */
+	for (i = 0, d->len = 0; i < NUM_IOV; i++)
+		d->len += (i * 37) % 200;
+	d->buf = malloc(d->len);
+	for (i = 0; i < d->len; i++)
+		d->buf[i] = i * 7;
+	for (i = 0, off = 0; i < NUM_IOV; i++) {
+		d->iov[i].iov_base = d->buf + off;
+		d->iov[i].iov_len = (i * 37) % 200;
+		off += d->iov[i].iov_len;
+	}
+	ok1(off == d->len);
+	ok1(d->len > 65536);
+
+	ok1(pipe(fds) == 0);
+	fflush(stdout);
+	if (!fork()) {
+		close(fds[1]);
+		read_from_pipe(fds[0], d->buf, d->len);
+		free(d->buf);
+		free(d);
+		exit(0);
+	}
+	close(fds[0]);
+	conn = io_new_conn(fds[1], io_writev(d->iov, NUM_IOV, write_done, d));
+	ok1(conn);
+	io_set_finish(conn, finish_ok, d);
+
+	ok1(io_loop() == d);
+	ok1(d->state == 2);
+
+	ok1(wait(&status));
+	ok1(WIFEXITED(status));
+	ok1(WEXITSTATUS(status) == 0);
+
+	free(d->buf);
+	free(d);
+
+	/* This exits depending on whether all tests passed */
+	return exit_status();
+}
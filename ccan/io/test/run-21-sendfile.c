@@ -0,0 +1,101 @@
+#include <ccan/io/io.h>
+/* Include the C files directly. */
+#include <ccan/io/poll.c>
+#include <ccan/io/io.c>
+#include <ccan/tap/tap.h>
+#include <sys/wait.h>
+#include <stdio.h>
+
+#define FILE_LEN (1024*1024)
+#define SKIP 1000
+
+struct data {
+	int state;
+	int file_fd;
+	char *buf;
+};
+
+static void finish_ok(struct io_conn *conn, struct data *d)
+{
+	ok1(d->state == 1);
+	d->state++;
+	io_break(d, io_idle());
+}
+
+static struct io_plan write_done(struct io_conn *conn, struct data *d)
+{
+	ok1(d->state == 0);
+	d->state++;
+	return io_close();
+}
+
+static void read_from_pipe(int fd, const char *expect, size_t len)
+{
+	char buf[1000];
+	size_t done;
+	ssize_t r;
+
+	for (done = 0; done < len; done += r) {
+		r = read(fd, buf, sizeof(buf));
+		if (r <= 0)
+			exit(1);
+		if (done + r > len || memcmp(buf, expect + done, r) != 0)
+			exit(2);
+	}
+	/* Nothing else. */
+	if (read(fd, buf, 1) != 0)
+		exit(3);
+}
+
+int main(void)
+{
+	struct data *d = malloc(sizeof(*d));
+	char filename[] = "run-21-sendfile.XXXXXX";
+	struct io_conn *conn;
+	int fds[2], status, i;
+
+	/* This is how many tests you plan to run */
+	plan_tests(13);
+	d->state = 0;
+	d->buf = malloc(FILE_LEN);
+	for (i = 0; i < FILE_LEN; i++)
+		d->buf[i] = i * 7;
+
+	d->file_fd = mkstemp(filename);
+	ok1(d->file_fd >= 0);
+	unlink(filename);
+	ok1(write(d->file_fd, d->buf, FILE_LEN) == FILE_LEN);
+	/* We start from the current offset. */
+	ok1(lseek(d->file_fd, SKIP, SEEK_SET) == SKIP);
+
+	ok1(pipe(fds) == 0);
+	fflush(stdout);
+	if (!fork()) {
+		close(fds[1]);
+		read_from_pipe(fds[0], d->buf + SKIP, FILE_LEN - SKIP);
+		free(d->buf);
+		free(d);
+		exit(0);
+	}
+	close(fds[0]);
+	conn = io_new_conn(fds[1], io_sendfile(d->file_fd, FILE_LEN - SKIP,
+					       write_done, d));
+	ok1(conn);
+	io_set_finish(conn, finish_ok, d);
+
+	ok1(io_loop() == d);
+	ok1(d->state == 2);
+	/* File offset is advanced to the end. */
+	ok1(lseek(d->file_fd, 0, SEEK_CUR) == FILE_LEN);
+
+	ok1(wait(&status));
+	ok1(WIFEXITED(status));
+	ok1(WEXITSTATUS(status) == 0);
+	close(d->file_fd);
+
+	free(d->buf);
+	free(d);
+
+	/* This exits depending on whether all tests passed */
+	return exit_status();
+}
@@ -0,0 +1,175 @@
+#include <ccan/io/io.h>
+/* Include the C files directly. */
+#include <ccan/io/poll.c>
+#include <ccan/io/epoll.c>
+#include <ccan/io/io.c>
+#include <ccan/tap/tap.h>
+#include <sys/wait.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define NUM_LINES 100
+/* Lines are 8 bytes, so this holds 8 of them. */
+#define BUF_SIZE 64
+
+static const uint32_t msglens[] = { 1, 10, 63, 64, 200, 300 };
+#define NUM_MSGS (sizeof(msglens) / sizeof(msglens[0]))
+
+struct data {
+	struct io_rbuf rbuf;
+	char buf[BUF_SIZE];
+	int state;
+	unsigned int lines, msgs;
+	char *line;
+	size_t len;
+	uint32_t msglen;
+	char body[300];
+	bool lines_ok, msgs_ok, woke_ready;
+};
+
+static void finish_ok(struct io_conn *conn, struct data *d)
+{
+	ok1(errno == ENOBUFS);
+	d->state++;
+	io_break(d, io_idle());
+}
+
+/* Too long for buffer: fails. */
+static struct io_plan read_toolong(struct io_conn *conn, struct data *d)
+{
+	return io_read_until(&d->rbuf, '\n', &d->line, &d->len, io_close_cb, d);
+}
+
+static struct io_plan read_msglen(struct io_conn *conn, struct data *d);
+
+static struct io_plan check_body(struct io_conn *conn, struct data *d)
+{
+	uint32_t i;
+
+	if (d->msglen != msglens[d->msgs])
+		d->msgs_ok = false;
+	for (i = 0; i < d->msglen; i++)
+		if (d->body[i] != (char)(d->msgs + i))
+			d->msgs_ok = false;
+	d->msgs++;
+	return read_msglen(conn, d);
+}
+
+static struct io_plan read_body(struct io_conn *conn, struct data *d)
+{
+	if (d->msglen > sizeof(d->body))
+		return io_close();
+	return io_read_buffered(&d->rbuf, d->body, d->msglen, check_body, d);
+}
+
+static struct io_plan read_msglen(struct io_conn *conn, struct data *d)
+{
+	if (d->msgs == NUM_MSGS)
+		return read_toolong(conn, d);
+	return io_read_buffered(&d->rbuf, &d->msglen, sizeof(d->msglen),
+				read_body, d);
+}
+
+static struct io_plan got_line(struct io_conn *conn, struct data *d);
+
+/* The next line is already buffered, so this needn't wait. */
+static struct io_plan wake_up(struct io_conn *conn, struct data *d)
+{
+	struct io_plan plan;
+
+	plan = io_read_until(&d->rbuf, '\n', &d->line, &d->len, got_line, d);
+	d->woke_ready = (plan.pollflag == 0);
+	return plan;
+}
+
+static struct io_plan got_line(struct io_conn *conn, struct data *d)
+{
+	char expect[9];
+
+	sprintf(expect, "line %02u\n", d->lines);
+	if (d->len != 8 || memcmp(d->line, expect, 8) != 0)
+		d->lines_ok = false;
+	d->lines++;
+
+	/* Pause halfway: we should continue from the buffer. */
+	if (d->lines == NUM_LINES / 2) {
+		io_timeout(conn, time_from_usec(1), wake_up, d);
+		return io_idle();
+	}
+	if (d->lines == NUM_LINES)
+		return read_msglen(conn, d);
+	return io_read_until(&d->rbuf, '\n', &d->line, &d->len, got_line, d);
+}
+
+static void write_all(int fd, const void *p, size_t len)
+{
+	if (write(fd, p, len) != len)
+		exit(1);
+}
+
+static void write_to_pipe(int fd)
+{
+	char lines[NUM_LINES * 8 + 1], msgs[1000], toolong[BUF_SIZE * 2];
+	size_t i, j, off;
+
+	for (i = 0; i < NUM_LINES; i++)
+		sprintf(lines + i * 8, "line %02u\n", (unsigned)i);
+	write_all(fd, lines, NUM_LINES * 8);
+
+	for (i = off = 0; i < NUM_MSGS; i++) {
+		memcpy(msgs + off, &msglens[i], sizeof(msglens[i]));
+		off += sizeof(msglens[i]);
+		for (j = 0; j < msglens[i]; j++)
+			msgs[off++] = i + j;
+	}
+	write_all(fd, msgs, off);
+
+	memset(toolong, 'x', sizeof(toolong));
+	write_all(fd, toolong, sizeof(toolong));
+}
+
+int main(void)
+{
+	struct data *d = malloc(sizeof(*d));
+	struct io_conn *conn;
+	int fds[2], status;
+
+	/* This is how many tests you plan to run */
+	plan_tests(12);
+	d->state = 0;
+	d->lines = d->msgs = 0;
+	d->lines_ok = d->msgs_ok = true;
+	io_rbuf_init(&d->rbuf, d->buf, sizeof(d->buf));
+
+	ok1(pipe(fds) == 0);
+	fflush(stdout);
+	if (!fork()) {
+		close(fds[0]);
+		write_to_pipe(fds[1]);
+		free(d);
+		exit(0);
+	}
+	close(fds[1]);
+
+	conn = io_new_conn(fds[0], io_read_until(&d->rbuf, '\n',
+						 &d->line, &d->len,
+						 got_line, d));
+	ok1(conn);
+	io_set_finish(conn, finish_ok, d);
+
+	ok1(io_loop() == d);
+	ok1(d->woke_ready);
+	ok1(d->state == 1);
+	ok1(d->lines == NUM_LINES);
+	ok1(d->lines_ok);
+	ok1(d->msgs == NUM_MSGS);
+	ok1(d->msgs_ok);
+
+	ok1(wait(&status));
+	ok1(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	free(d);
+
+	/* This exits depending on whether all tests passed */
+	return exit_status();
+}
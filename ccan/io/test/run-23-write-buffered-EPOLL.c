@@ -0,0 +1,2 @@
+#define IO_USE_EPOLL
+#include "run-23-write-buffered.c"
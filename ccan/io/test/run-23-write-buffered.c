@@ -0,0 +1,149 @@
+#include <sys/uio.h>
+#include <ccan/io/io.h>
+
+/* Count the writev calls. */
+static int num_writev;
+static ssize_t counting_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	num_writev++;
+	return writev(fd, iov, iovcnt);
+}
+#define writev counting_writev
+
+/* Include the C files directly. */
+#include <ccan/io/poll.c>
+#include <ccan/io/epoll.c>
+#include <ccan/io/io.c>
+#include <ccan/tap/tap.h>
+#include <sys/wait.h>
+#include <stdio.h>
+
+#define NUM_FRAGS 100
+#define FRAG_LEN 8
+#define BIG_LEN 1000
+
+struct data {
+	struct io_wbuf wbuf;
+	char buf[256];
+	int state;
+	unsigned int frags;
+	char frag[FRAG_LEN + 1];
+	char ack;
+	char big[BIG_LEN];
+	int writevs_before_ack;
+};
+
+static void finish_ok(struct io_conn *conn, struct data *d)
+{
+	ok1(d->state == 1);
+	d->state++;
+	io_break(d, io_idle());
+}
+
+static struct io_plan write_bye(struct io_conn *conn, struct data *d)
+{
+	/* This is queued, then flushed before we close. */
+	return io_write_buffered(&d->wbuf, "bye\n", 4, io_close_cb, d);
+}
+
+static struct io_plan write_big(struct io_conn *conn, struct data *d)
+{
+	/* This is too big to queue: gets written along with "hdr". */
+	return io_write_buffered(&d->wbuf, d->big, BIG_LEN, write_bye, d);
+}
+
+static struct io_plan write_hdr(struct io_conn *conn, struct data *d)
+{
+	ok1(d->ack == 'A');
+	d->state++;
+	return io_write_buffered(&d->wbuf, "hdr", 3, write_big, d);
+}
+
+static struct io_plan write_frag(struct io_conn *conn, struct data *d)
+{
+	if (d->frags == NUM_FRAGS) {
+		d->writevs_before_ack = num_writev;
+		/* Queue gets flushed before we wait for this. */
+		return io_read(&d->ack, 1, write_hdr, d);
+	}
+	sprintf(d->frag, "frag %02u\n", d->frags++);
+	return io_write_buffered(&d->wbuf, d->frag, FRAG_LEN, write_frag, d);
+}
+
+static void read_all(int fd, const char *expect, size_t len)
+{
+	char buf[1000];
+	size_t done;
+	ssize_t r;
+
+	for (done = 0; done < len; done += r) {
+		r = read(fd, buf, len - done < sizeof(buf)
+			 ? len - done : sizeof(buf));
+		if (r <= 0)
+			exit(1);
+		if (memcmp(buf, expect + done, r) != 0)
+			exit(2);
+	}
+}
+
+static void talk_to_parent(int fd, const struct data *d)
+{
+	char frags[NUM_FRAGS * FRAG_LEN + 1], c;
+	unsigned int i;
+
+	for (i = 0; i < NUM_FRAGS; i++)
+		sprintf(frags + i * FRAG_LEN, "frag %02u\n", i);
+	read_all(fd, frags, NUM_FRAGS * FRAG_LEN);
+	if (write(fd, "A", 1) != 1)
+		exit(3);
+	read_all(fd, "hdr", 3);
+	read_all(fd, d->big, BIG_LEN);
+	read_all(fd, "bye\n", 4);
+	if (read(fd, &c, 1) != 0)
+		exit(4);
+}
+
+int main(void)
+{
+	struct data *d = malloc(sizeof(*d));
+	struct io_conn *conn;
+	int fds[2], status;
+
+	/* This is how many tests you plan to run */
+	plan_tests(10);
+	d->state = 0;
+	d->frags = 0;
+	memset(d->big, 'b', sizeof(d->big));
+	io_wbuf_init(&d->wbuf, d->buf, sizeof(d->buf));
+
+	ok1(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	fflush(stdout);
+	if (!fork()) {
+		close(fds[0]);
+		talk_to_parent(fds[1], d);
+		free(d);
+		exit(0);
+	}
+	close(fds[1]);
+
+	conn = io_new_conn(fds[0], io_idle());
+	ok1(conn);
+	io_set_wbuf(conn, &d->wbuf);
+	io_set_finish(conn, finish_ok, d);
+	io_wake(conn, write_frag(conn, d));
+
+	ok1(io_loop() == d);
+	ok1(d->state == 2);
+	/* 800 bytes through a 256 byte buffer: 3 full, then flush. */
+	ok1(d->writevs_before_ack == 3);
+	/* Then hdr + big, then bye. */
+	ok1(num_writev == 3 + 1 + 1 + 1);
+
+	ok1(wait(&status));
+	ok1(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	free(d);
+
+	/* This exits depending on whether all tests passed */
+	return exit_status();
+}
@@ -0,0 +1,163 @@
+#include <ccan/io/io.h>
+/* Include the C files directly. */
+#include <ccan/io/poll.c>
+#include <ccan/io/epoll.c>
+#include <ccan/io/io.c>
+#include <ccan/tap/tap.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define NUM_BYTES 20
+#define TIMEOUT_MSEC 50
+
+struct data {
+	int state;
+	unsigned int bytes;
+	struct timespec last;
+	char c;
+};
+
+static struct io_plan got_byte(struct io_conn *conn, struct data *d);
+
+static struct io_plan timeout(struct io_conn *conn, struct data *d)
+{
+	struct timespec now = time_now();
+
+	ok1(d->state == 0);
+	d->state++;
+	/* Never early; up to granularity late (plus scheduling slack). */
+	ok1(time_to_msec(time_sub(now, d->last)) >= TIMEOUT_MSEC);
+	ok1(time_to_msec(time_sub(now, d->last)) < TIMEOUT_MSEC + 500);
+	return io_close();
+}
+
+static struct io_plan read_byte(struct io_conn *conn, struct data *d)
+{
+	d->last = time_now();
+	io_timeout(conn, time_from_msec(TIMEOUT_MSEC), timeout, d);
+	return io_read(&d->c, 1, got_byte, d);
+}
+
+static struct io_plan got_byte(struct io_conn *conn, struct data *d)
+{
+	d->bytes++;
+	return read_byte(conn, d);
+}
+
+static void finish_ok(struct io_conn *conn, struct data *d)
+{
+	ok1(d->state == 1);
+	d->state++;
+	io_break(d, io_idle());
+}
+
+/* After switching to exact timeouts: not late, and only called once. */
+static struct io_plan timeout_exact(struct io_conn *conn, struct data *d)
+{
+	struct timespec now = time_now();
+
+	d->state++;
+	ok1(time_to_msec(time_sub(now, d->last)) >= TIMEOUT_MSEC);
+	ok1(time_to_msec(time_sub(now, d->last)) < TIMEOUT_MSEC + 500);
+	return io_close();
+}
+
+static struct io_plan never(struct io_conn *conn, struct data *d)
+{
+	abort();
+}
+
+static void finish_exact(struct io_conn *conn, struct data *d)
+{
+	if (--d->bytes == 0)
+		io_break(d, io_idle());
+}
+
+int main(void)
+{
+	struct data *d = malloc(sizeof(*d));
+	struct io_timeout_stats stats;
+	struct io_conn *conn, *other;
+	int fds[2], fds2[2], status, i;
+	pid_t child;
+
+	/* This is how many tests you plan to run */
+	plan_tests(27);
+	d->state = 0;
+	d->bytes = 0;
+
+	io_set_timeout_granularity(time_from_msec(10));
+
+	ok1(pipe(fds) == 0);
+	fflush(stdout);
+	child = fork();
+	if (!child) {
+		close(fds[0]);
+		/* Keep refreshing the timeout, then stop, holding pipe open. */
+		for (i = 0; i < NUM_BYTES; i++) {
+			if (write(fds[1], "x", 1) != 1)
+				exit(1);
+			usleep(2000);
+		}
+		sleep(5);
+		free(d);
+		exit(0);
+	}
+	close(fds[1]);
+
+	conn = io_new_conn(fds[0], io_idle());
+	ok1(conn);
+	io_set_finish(conn, finish_ok, d);
+	io_wake(conn, read_byte(conn, d));
+
+	ok1(io_loop() == d);
+	ok1(d->state == 2);
+	ok1(d->bytes == NUM_BYTES);
+
+	io_get_timeout_stats(&stats);
+	ok1(stats.added == NUM_BYTES + 1);
+	ok1(stats.cancelled == NUM_BYTES);
+	ok1(stats.fired == 1);
+	/* First timer (at least) expired early and got re-armed. */
+	ok1(stats.rearmed >= 1);
+	ok1(stats.rearmed <= 2);
+
+	kill(child, SIGTERM);
+	ok1(wait(&status) == child);
+
+	/* Coarse timers left queued must survive a switch to exact. */
+	d->state = 0;
+	d->bytes = 2;
+	d->last = time_now();
+	ok1(pipe(fds) == 0);
+	ok1(pipe(fds2) == 0);
+
+	/* This one is re-added once exact, while still queued. */
+	conn = io_new_conn(fds[0], io_read(&d->c, 1, never, d));
+	io_set_finish(conn, finish_exact, d);
+	io_timeout(conn, time_from_msec(10000), timeout_exact, d);
+	/* As when its io completes: it stays queued. */
+	del_timeout(conn);
+	ok1(conn->timeout->queued);
+
+	/* This one is queued before its (later) deadline, to be re-armed. */
+	other = io_new_conn(fds2[0], io_read(&d->c, 1, never, d));
+	io_set_finish(other, finish_exact, d);
+	io_timeout(other, time_from_msec(1), timeout_exact, d);
+	del_timeout(other);
+	io_timeout(other, time_from_msec(TIMEOUT_MSEC), timeout_exact, d);
+	ok1(time_greater(other->timeout->deadline, other->timeout->armed));
+
+	io_set_timeout_granularity(time_from_nsec(0));
+	io_timeout(conn, time_from_msec(TIMEOUT_MSEC), timeout_exact, d);
+	ok1(timers_check(&timeouts, NULL));
+
+	ok1(io_loop() == d);
+	ok1(d->state == 2);
+	ok1(!timer_earliest(&timeouts, &d->last));
+	free(d);
+
+	/* This exits depending on whether all tests passed */
+	return exit_status();
+}
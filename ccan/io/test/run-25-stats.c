@@ -0,0 +1,82 @@
+#include <ccan/io/io.h>
+/* Include the C files directly. */
+#include <ccan/io/poll.c>
+#include <ccan/io/epoll.c>
+#include <ccan/io/io.c>
+#include <ccan/tally/tally.h>
+#include <ccan/tap/tap.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define NUM_BYTES 1000
+
+struct data {
+	char in[NUM_BYTES], out[NUM_BYTES];
+	struct io_conn_stats rstats, wstats;
+	bool live_stats;
+};
+
+static struct io_plan read_done(struct io_conn *conn, struct data *d)
+{
+	/* Stats are queryable while the loop is running. */
+	d->live_stats = (io_get_loop_stats() != NULL
+			 && io_get_loop_stats()->iterations > 0);
+	return io_close();
+}
+
+static void reader_finish(struct io_conn *conn, struct data *d)
+{
+	io_get_conn_stats(conn, &d->rstats);
+}
+
+static void writer_finish(struct io_conn *conn, struct data *d)
+{
+	io_get_conn_stats(conn, &d->wstats);
+}
+
+int main(void)
+{
+	struct data *d = malloc(sizeof(*d));
+	const struct io_loop_stats *s;
+	struct io_conn *conn;
+	int fds[2];
+
+	/* This is how many tests you plan to run */
+	plan_tests(16);
+
+	ok1(io_get_loop_stats() == NULL);
+	ok1(io_set_stats(true));
+	s = io_get_loop_stats();
+	ok1(s != NULL);
+
+	memset(d->out, 'x', sizeof(d->out));
+	d->live_stats = false;
+	ok1(pipe(fds) == 0);
+	conn = io_new_conn(fds[0], io_read(d->in, sizeof(d->in), read_done, d));
+	io_set_finish(conn, reader_finish, d);
+	conn = io_new_conn(fds[1], io_write(d->out, sizeof(d->out),
+					    io_close_cb, NULL));
+	io_set_finish(conn, writer_finish, d);
+
+	ok1(io_loop() == NULL);
+	ok1(memcmp(d->in, d->out, sizeof(d->in)) == 0);
+
+	ok1(d->rstats.bytes_read == NUM_BYTES);
+	ok1(d->rstats.bytes_written == 0);
+	ok1(d->rstats.syscalls >= 1);
+	ok1(d->wstats.bytes_read == 0);
+	ok1(d->wstats.bytes_written == NUM_BYTES);
+
+	ok1(d->live_stats);
+	ok1(s->iterations > 0);
+	ok1(s->wakeups > 0 && s->fds_ready >= s->wakeups);
+	/* read_done and io_close_cb, at least. */
+	ok1(tally_num(s->callback_usec) >= 2);
+
+	ok1(io_set_stats(false) && io_get_loop_stats() == NULL);
+
+	free(d);
+
+	/* This exits depending on whether all tests passed */
+	return exit_status();
+}
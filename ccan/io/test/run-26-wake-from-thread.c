@@ -0,0 +1,96 @@
+#include <ccan/io/io.h>
+/* Include the C files directly. */
+#include <ccan/io/poll.c>
+#include <ccan/io/epoll.c>
+#include <ccan/io/io.c>
+#include <ccan/tap/tap.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define NUM_CONNS 20
+
+struct request {
+	struct io_conn *conn;
+	pthread_t worker;
+	char c, reply;
+	int other;
+	bool started;
+};
+
+/* The "heavy" work, done off the loop thread. */
+static void *work(void *arg)
+{
+	struct request *r = arg;
+
+	usleep(1000 * (r->c % 5));
+	r->reply = r->c + 1;
+	io_wake_from_thread(r->conn, io_write(&r->reply, 1, io_close_cb, NULL));
+	return NULL;
+}
+
+static struct io_plan hand_off(struct io_conn *conn, struct request *r)
+{
+	r->started = (pthread_create(&r->worker, NULL, work, r) == 0);
+	return io_idle();
+}
+
+int main(void)
+{
+	struct request r[NUM_CONNS];
+	int i, fds[2];
+	bool ok = true;
+
+	/* This is how many tests you plan to run */
+	plan_tests(7);
+
+	ok1(io_wake_from_thread_init());
+	/* Calling it twice is harmless. */
+	ok1(io_wake_from_thread_init());
+
+	for (i = 0; i < NUM_CONNS; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+			break;
+		r[i].c = i;
+		r[i].other = fds[1];
+		r[i].started = false;
+		r[i].conn = io_new_conn(fds[0],
+					io_read(&r[i].c, 1, hand_off, &r[i]));
+		if (!r[i].conn)
+			break;
+		if (write(fds[1], &r[i].c, 1) != 1)
+			break;
+	}
+	ok1(i == NUM_CONNS);
+
+	/* Returns once they're all closed, despite the eventfd. */
+	ok1(io_loop() == NULL);
+
+	for (i = 0; i < NUM_CONNS; i++) {
+		char c;
+
+		if (!r[i].started) {
+			ok = false;
+			continue;
+		}
+		pthread_join(r[i].worker, NULL);
+		if (read(r[i].other, &c, 1) != 1 || c != i + 1)
+			ok = false;
+		close(r[i].other);
+	}
+	ok1(ok);
+
+	/* It can be reused on the next loop. */
+	ok1(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	r[0].c = 7;
+	r[0].other = fds[1];
+	r[0].conn = io_new_conn(fds[0], io_idle());
+	pthread_create(&r[0].worker, NULL, work, &r[0]);
+	io_loop();
+	pthread_join(r[0].worker, NULL);
+	ok1(read(fds[1], &r[0].c, 1) == 1 && r[0].c == 8);
+
+	/* This exits depending on whether all tests passed */
+	return exit_status();
+}
@@ -0,0 +1,78 @@
+#include <ccan/io/io.h>
+/* Include the C files directly. */
+#include <ccan/io/poll.c>
+#include <ccan/io/epoll.c>
+#include <ccan/io/io.c>
+#include <ccan/tap/tap.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define NUM_CONNS 4
+#define POOL_SIZE 2
+
+/* We only count connections, not the backend's arrays. */
+static unsigned int conn_allocs;
+
+static void *allocfn(size_t size)
+{
+	if (size == sizeof(struct io_conn))
+		conn_allocs++;
+	return malloc(size);
+}
+
+static bool was_freed(struct io_conn *conn, struct io_conn **old)
+{
+	unsigned int i;
+
+	for (i = 0; i < NUM_CONNS; i++)
+		if (conn == old[i])
+			return true;
+	return false;
+}
+
+static struct io_conn *new_conns(struct io_conn **conns, unsigned int num)
+{
+	unsigned int i;
+	int fds[2];
+
+	for (i = 0; i < num; i++) {
+		if (pipe(fds) != 0)
+			return NULL;
+		close(fds[1]);
+		conns[i] = io_new_conn(fds[0], io_close());
+		if (!conns[i])
+			return NULL;
+	}
+	return conns[0];
+}
+
+int main(void)
+{
+	struct io_conn *conns[NUM_CONNS], *first[NUM_CONNS];
+
+	/* This is how many tests you plan to run */
+	plan_tests(10);
+
+	io_set_alloc(allocfn, realloc, free);
+	io_set_pool_size(POOL_SIZE);
+
+	ok1(new_conns(first, NUM_CONNS));
+	ok1(conn_allocs == NUM_CONNS);
+	ok1(io_loop() == NULL);
+	/* The pool keeps up to POOL_SIZE; the rest are freed. */
+	ok1(conn_pool.num == POOL_SIZE);
+
+	/* Now those get reused. */
+	ok1(new_conns(conns, POOL_SIZE));
+	ok1(conn_allocs == NUM_CONNS);
+	ok1(conn_pool.num == 0);
+	ok1(was_freed(conns[0], first) && was_freed(conns[1], first));
+	ok1(io_loop() == NULL);
+
+	/* Shrinking frees them. */
+	io_set_pool_size(0);
+	ok1(conn_pool.num == 0 && conn_pool.head == NULL);
+
+	/* This exits depending on whether all tests passed */
+	return exit_status();
+}
@@ -0,0 +1,111 @@
+#include <ccan/io/io.h>
+/* Include the C files directly. */
+#include <ccan/io/poll.c>
+#include <ccan/io/epoll.c>
+#include <ccan/io/io.c>
+#include <ccan/tap/tap.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+
+static struct io_listener *l1, *l2;
+static unsigned int l1_conns, l2_conns;
+static bool l2_freed, l2_freed_in_cb;
+
+static void freefn(void *p)
+{
+	if (p == l2)
+		l2_freed = true;
+	free(p);
+}
+
+/* Both listeners are ready: close the other from this one's callback. */
+static void init_l1(int fd, void *unused)
+{
+	l1_conns++;
+	io_close_listener(l2);
+	l2_freed_in_cb = l2_freed;
+	io_close_listener(l1);
+	io_new_conn(fd, io_close());
+}
+
+static void init_l2(int fd, void *unused)
+{
+	l2_conns++;
+	io_new_conn(fd, io_close());
+}
+
+/* Listen on an ephemeral loopback port. */
+static int make_listen_fd(struct sockaddr_in *addr)
+{
+	socklen_t len = sizeof(*addr);
+	int fd;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (bind(fd, (struct sockaddr *)addr, sizeof(*addr)) != 0
+	    || listen(fd, 1) != 0
+	    || getsockname(fd, (struct sockaddr *)addr, &len) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int connect_to(const struct sockaddr_in *addr)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (fd >= 0
+	    && connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int main(void)
+{
+	struct sockaddr_in addr1, addr2;
+	int fd1, fd2, c1, c2;
+
+	/* This is how many tests you plan to run */
+	plan_tests(9);
+
+	io_set_alloc(malloc, realloc, freefn);
+	fd1 = make_listen_fd(&addr1);
+	fd2 = make_listen_fd(&addr2);
+	ok1(fd1 >= 0 && fd2 >= 0);
+	l1 = io_new_listener(fd1, init_l1, NULL);
+	l2 = io_new_listener(fd2, init_l2, NULL);
+	ok1(l1 && l2);
+
+	/* Connect to l1 first, so its event comes first. */
+	c1 = connect_to(&addr1);
+	c2 = connect_to(&addr2);
+	ok1(c1 >= 0 && c2 >= 0);
+
+	ok1(io_loop() == NULL);
+	ok1(l1_conns == 1);
+	ok1(l2_conns == 0);
+#ifdef IO_USE_EPOLL
+	/* epoll_wait() may have told us about l2 already: it has to stay
+	 * around until we've looked at that. */
+	ok1(!l2_freed_in_cb);
+#else
+	ok1(l2_freed_in_cb);
+#endif
+	ok1(l2_freed);
+	/* The connection l2 never accepted is gone. */
+	ok1(read(c2, &addr2, 1) <= 0);
+	close(c1);
+	close(c2);
+
+	/* This exits depending on whether all tests passed */
+	return exit_status();
+}
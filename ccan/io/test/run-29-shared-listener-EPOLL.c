@@ -0,0 +1,2 @@
+#define IO_USE_EPOLL
+#include "run-29-shared-listener.c"
@@ -0,0 +1,166 @@
+#include <ccan/io/io.h>
+/* Include the C files directly. */
+#include <ccan/io/poll.c>
+#include <ccan/io/epoll.c>
+#include <ccan/io/io.c>
+#include <ccan/tap/tap.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#define NUM_THREADS 2
+#define NUM_CONNS 50
+
+/* Only the main thread calls ok1(): tap isn't thread-safe. */
+struct thread {
+	pthread_t id;
+	struct io_listener *l;
+	int listen_fd, quit[2];
+	unsigned int conns;
+	void *ret;
+	char c, q;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static unsigned int num_ready;
+
+static struct io_plan echo(struct io_conn *conn, struct thread *t)
+{
+	return io_write(&t->c, 1, io_close_cb, NULL);
+}
+
+static void init_conn(int fd, struct thread *t)
+{
+	t->conns++;
+	io_new_conn(fd, io_read(&t->c, 1, echo, t));
+}
+
+/* One byte on the quit pipe: stop listening, so io_loop() can finish. */
+static struct io_plan quit(struct io_conn *conn, struct thread *t)
+{
+	io_close_listener(t->l);
+	return io_close();
+}
+
+static void *loop_thread(void *arg)
+{
+	struct thread *t = arg;
+	int fd = t->listen_fd;
+
+	t->l = io_new_listener(fd, init_conn, t);
+	if (t->l)
+		io_new_conn(t->quit[0], io_read(&t->q, 1, quit, t));
+
+	pthread_mutex_lock(&lock);
+	num_ready++;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+
+	t->ret = io_loop();
+	return NULL;
+}
+
+/* One non-blocking listening socket, on an ephemeral loopback port. */
+static int make_listen_fd(struct sockaddr_in *addr)
+{
+	socklen_t len = sizeof(*addr);
+	int fd;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (bind(fd, (struct sockaddr *)addr, sizeof(*addr)) != 0
+	    || listen(fd, NUM_CONNS) != 0
+	    || getsockname(fd, (struct sockaddr *)addr, &len) != 0
+	    || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Each connection sends a byte and waits for it to come back. */
+static bool talk_to_servers(const struct sockaddr_in *addr)
+{
+	int status, fd, i;
+	char c;
+
+	fflush(stdout);
+	if (!fork()) {
+		for (i = 0; i < NUM_CONNS; i++) {
+			fd = socket(AF_INET, SOCK_STREAM, 0);
+			if (fd < 0)
+				exit(1);
+			if (connect(fd, (const struct sockaddr *)addr,
+				    sizeof(*addr)) != 0)
+				exit(2);
+			c = i;
+			if (write(fd, &c, 1) != 1)
+				exit(3);
+			if (read(fd, &c, 1) != 1 || c != (char)i)
+				exit(4);
+			close(fd);
+		}
+		exit(0);
+	}
+	return wait(&status) > 0 && WIFEXITED(status)
+		&& WEXITSTATUS(status) == 0;
+}
+
+int main(void)
+{
+	struct thread t[NUM_THREADS];
+	struct sockaddr_in addr;
+	unsigned int i, before;
+	int fd;
+
+	/* This is how many tests you plan to run */
+	plan_tests(NUM_THREADS * 3 + 8);
+
+	fd = make_listen_fd(&addr);
+	ok1(fd >= 0);
+	for (i = 0; i < NUM_THREADS; i++) {
+		/* Each listener closes its own fd, so give each a dup(). */
+		t[i].listen_fd = dup(fd);
+		ok1(t[i].listen_fd >= 0);
+		ok1(pipe(t[i].quit) == 0);
+		t[i].conns = 0;
+		t[i].l = NULL;
+		t[i].ret = &t[i];
+		ok1(pthread_create(&t[i].id, NULL, loop_thread, &t[i]) == 0);
+	}
+
+	/* Wait until they're all listening. */
+	pthread_mutex_lock(&lock);
+	while (num_ready != NUM_THREADS)
+		pthread_cond_wait(&cond, &lock);
+	pthread_mutex_unlock(&lock);
+
+	ok1(talk_to_servers(&addr));
+
+	/* The first thread stops listening... */
+	ok1(write(t[0].quit[1], "q", 1) == 1);
+	pthread_join(t[0].id, NULL);
+	ok1(t[0].ret == NULL);
+
+	/* ...but the other carries on accepting on the same socket. */
+	before = t[1].conns;
+	ok1(talk_to_servers(&addr));
+	ok1(t[1].conns == before + NUM_CONNS);
+
+	ok1(write(t[1].quit[1], "q", 1) == 1);
+	pthread_join(t[1].id, NULL);
+	ok1(t[1].ret == NULL);
+	close(fd);
+
+	/* This exits depending on whether all tests passed */
+	return exit_status();
+}
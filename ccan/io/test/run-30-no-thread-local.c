@@ -0,0 +1,47 @@
+/* Pretend the compiler can't do thread-local storage. */
+#include "config.h"
+#undef HAVE_THREAD_LOCAL
+#define HAVE_THREAD_LOCAL 0
+#include <ccan/io/io.h>
+/* Include the C files directly. */
+#include <ccan/io/poll.c>
+#include <ccan/io/epoll.c>
+#include <ccan/io/io.c>
+#include <ccan/tap/tap.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <signal.h>
+
+static void *run_loop(void *unused)
+{
+	io_loop();
+	return NULL;
+}
+
+int main(void)
+{
+	pthread_t thread;
+	int status;
+
+	plan_tests(5);
+
+	/* With nothing to do, it returns at once. */
+	ok1(io_loop() == NULL);
+	ok1(io_loop() == NULL);
+
+	fflush(stdout);
+	if (fork() == 0) {
+		/* Another thread would share our loop: that must abort. */
+		if (pthread_create(&thread, NULL, run_loop, NULL) == 0)
+			pthread_join(thread, NULL);
+		exit(0);
+	}
+
+	ok1(wait(&status) != -1);
+	ok1(WIFSIGNALED(status));
+	ok1(WTERMSIG(status) == SIGABRT);
+
+	/* This exits depending on whether all tests passed */
+	return exit_status();
+}
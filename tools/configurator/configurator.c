@@ -167,6 +167,11 @@ static struct test tests[] = {
 	  "	if (arg == 4)\n"
 	  "		warnx(\"warn %u\", arg);\n"
 	  "}\n" },
+	{ "HAVE_EVENTFD", DEFINES_FUNC, NULL, NULL,
+	  "#include <sys/eventfd.h>\n"
+	  "static int func(void) {\n"
+	  "	return eventfd(0, EFD_NONBLOCK);\n"
+	  "}\n" },
 	{ "HAVE_FILE_OFFSET_BITS", DEFINES_EVERYTHING|EXECUTE,
 	  "HAVE_32BIT_OFF_T", NULL,
 	  "#define _FILE_OFFSET_BITS 64\n"
@@ -235,6 +240,12 @@ static struct test tests[] = {
 	  "	extern void *__start_mysec[], *__stop_mysec[];\n"
 	  "	return __stop_mysec - __start_mysec;\n"
 	  "}\n" },
+	{ "HAVE_SENDFILE", DEFINES_FUNC, NULL, NULL,
+	  "#include <sys/sendfile.h>\n"
+	  "#include <stddef.h>\n"
+	  "static ssize_t func(int out, int in) {\n"
+	  "	return sendfile(out, in, NULL, 1);\n"
+	  "}\n" },
 	{ "HAVE_STACK_GROWS_UPWARDS", DEFINES_EVERYTHING|EXECUTE, NULL, NULL,
 	  "static long nest(const void *base, unsigned int i)\n"
 	  "{\n"
@@ -249,6 +260,9 @@ static struct test tests[] = {
 	  "return ({ int x = argc; x == argc ? 0 : 1; });" },
 	{ "HAVE_SYS_FILIO_H", OUTSIDE_MAIN, NULL, NULL, /* Solaris needs this for FIONREAD */
 	  "#include <sys/filio.h>\n" },
+	{ "HAVE_THREAD_LOCAL", DEFINES_FUNC, NULL, NULL,
+	  "static __thread int x;\n"
+	  "static int func(int y) { x = y; return x; }" },
 	{ "HAVE_TYPEOF", INSIDE_MAIN, NULL, NULL,
 	  "__typeof__(argc) i; i = argc; return i == argc ? 0 : 1;" },
 	{ "HAVE_UTIME", DEFINES_FUNC, NULL, NULL,